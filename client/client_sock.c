@@ -3,14 +3,28 @@
  * @brief Client-side socket program for receiving and dumping images.
  *
  * This program establishes a TCP connection with a server, receives image data
- * on the socket, and dumps the images to PPM files. It includes a signal handler
- * to gracefully exit on signals like SIGINT and SIGTERM.
+ * on the socket, and dumps the images to PPM files (PGM for grayscale, raw
+ * planes for the other compact formats). Receiving and writing are
+ * decoupled: the main thread only drains the socket into preallocated
+ * buffers, and a pool of writer threads saves them, so a slow disk does not
+ * stall the connection. It includes a signal handler to gracefully exit on
+ * signals like SIGINT and SIGTERM. In stream mode the frames are instead
+ * passed on to stdout or a named pipe, for an encoder to read. Given a
+ * comma separated list of servers, it receives from all of them in one
+ * process and saves each camera's frames in a directory of its own.
+ * Delta frames, which carry only the tiles that changed, are rebuilt into
+ * whole images as they arrive, so everything saved is a complete frame.
+ * Frames can carry a CRC32C; one that fails it is reported and not saved.
+ * With io_uring, each header and payload is one receive and frames are
+ * saved by chains submitted along with it instead of by writer threads; the
+ * system calls and context switches per frame are reported either way.
  * Reference : https://beej.us/guide/bgnet/html/#what-is-a-socket and Prof Lectures/notes on sockets
  *
  * @author Rishikesh Goud Sundaragiri
  * @date 5th Dec 2023
  */
 
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <string.h>
@@ -25,6 +39,19 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include "../common/frame_protocol.h"
+#include "../common/frame_delta.h"
+#include "../common/frame_crc.h"
+#include "../common/trace.h"
+#include "writer_pool.h"
+#include "frame_container.h"
+#include "stream_out.h"
+#include "multi_client.h"
+#include "uring_io.h"
 
 #define SUCCESS_FLAG 0
 #define SIGINT_FAIL 1
@@ -33,12 +60,25 @@
 #define INET_API_FAIL 4
 #define CONNECT_API_FAIL 5
 #define RECEIVE_ERROR 6
-#define PORT 9000
-#define HRES_STR "640"
-#define VRES_STR "480"
+#define PROTOCOL_ERROR 7
+#define USAGE_ERROR 8
+#define POOL_ERROR 9
+#define CONTAINER_ERROR 10
+#define STREAM_ERROR 11
+#define PORT FRAME_PORT
 #define STARTUP_FRAMES 20
+#define DEFAULT_WRITERS 2
+#define DEFAULT_BUFFERS 8
+#define MULTI_ERROR 12
+#define TRACE_DEFAULT_PATH "/tmp/client_trace.json"
 int client_fd;
 static int current_frame = 0;
+static int use_container = 0;
+static int roi_count = 0;
+static struct frame_delta_refs delta_refs;
+static int use_uring = 0;
+static atomic_ulong io_syscalls;   /* recv, open, write and close of the receive loop and writers */
+static atomic_ulong container_failures;   /* frames that could not be added to the container */
 
 void signal_handler(int sig)
 {
@@ -60,40 +100,658 @@ void signal_handler(int sig)
 	exit(SUCCESS_FLAG);  
 }
 
-void dump_ppm(const unsigned char *p, int size, int frame_number)
+/*
+ * Names the file a frame is dumped to and makes its PPM header, empty for
+ * raw YUV and RGB565 planes
+ */
+void frame_file(const char *dir, const char *name, int frame_number, int width, int height, int format,
+                char *path, size_t path_size, char *header, size_t header_size)
+{
+    const char *extension = FRAME_FMT_RGB24 == format ? "ppm" : FRAME_FMT_GRAY == format ? "pgm" : frame_format_name(format);
+
+    snprintf(path, path_size, "%s/%s%d.%s", dir ? dir : "frames", name, frame_number, extension);
+    if (FRAME_FMT_RGB24 == format || FRAME_FMT_GRAY == format)
+        snprintf(header, header_size, "P%c\n#Frame %d\n%d %d\n255\n", FRAME_FMT_GRAY == format ? '5' : '6',
+                 frame_number, width, height);
+    else
+        header[0] = '\0';
+}
+
+/* The same for a frame saved through io_uring, returns the header length */
+size_t describe_frame(const struct frame_buffer *frame, char *path, size_t path_size, char *header, size_t header_size)
+{
+    frame_file(frame->dir, frame->name, frame->number, frame->header.width, frame->header.height,
+               frame->header.format, path, path_size, header, header_size);
+    return strlen(header);
+}
+
+void dump_ppm(const char *dir, const char *name, const unsigned char *p, int size, int frame_number, int width, int height,
+              int format)
 {
     int written, total, dumpfd;
     char ppm_header[100]; 
-    char ppm_dumpname[30]; 
+    char ppm_dumpname[160]; 
 
-    snprintf(ppm_dumpname, sizeof(ppm_dumpname), "frames/frame%d.ppm", frame_number);
-    dumpfd = open(ppm_dumpname, O_WRONLY | O_NONBLOCK | O_CREAT, 00666);
-
-    /* PPM header construction */ 
-    snprintf(ppm_header, sizeof(ppm_header), "P6\n#Frame %d\n%s %s\n255\n", frame_number, HRES_STR, VRES_STR);
+    frame_file(dir, name, frame_number, width, height, format, ppm_dumpname, sizeof(ppm_dumpname),
+               ppm_header, sizeof(ppm_header));
+    dumpfd = open(ppm_dumpname, O_WRONLY | O_NONBLOCK | O_CREAT | O_TRUNC, 00666);
+    atomic_fetch_add(&io_syscalls, 1);
+    if (dumpfd < 0)
+    {
+        syslog(LOG_ERR, "Cannot create %s", ppm_dumpname);
+        return;
+    }
 
     /* Write header to file */
     written = write(dumpfd, ppm_header, strlen(ppm_header));
+    atomic_fetch_add(&io_syscalls, 1);
+    if (written != (int)strlen(ppm_header))
+    {
+        syslog(LOG_ERR, "Failed to write the header of %s", ppm_dumpname);
+        written = -1;
+    }
 
     total = 0;
-    /* Write frame data to file */
-    do
+    /* Write frame data to file, continuing after short writes */
+    while (written >= 0 && total < size)
     {
-        written = write(dumpfd, p, size);
+        written = write(dumpfd, p + total, size - total);
+        atomic_fetch_add(&io_syscalls, 1);
+        if (written < 0 && EINTR == errno)
+        {
+            written = 0;
+            continue;
+        }
+        if (written <= 0)
+        {
+            syslog(LOG_ERR, "Failed to write %s", ppm_dumpname);
+            break;
+        }
         total += written;
-    } while (total < size);
+    }
     close(dumpfd);
+    atomic_fetch_add(&io_syscalls, 1);
+}
+
+/* Runs on a writer thread for every frame the receive loop queued */
+void write_frame(const struct frame_buffer *frame)
+{
+    uint64_t span = trace_begin();
+
+    if (use_container)
+    {
+        if (-1 == container_append(&frame->header, frame->data))
+        {
+            atomic_fetch_add(&container_failures, 1);
+        }
+    }
+    else
+    {
+        dump_ppm(frame->dir, frame->name, frame->data, frame->header.payload_size, frame->number,
+                 frame->header.width, frame->header.height, frame->header.format);
+    }
+    trace_end("write", span, frame->header.sequence);
+}
+
+/* Takes a buffer to receive a frame into, from the ring or the writer pool */
+struct frame_buffer *frame_get(void)
+{
+    return use_uring ? uring_io_get() : writer_pool_get();
+}
+
+/* Hands a received frame over to be saved */
+void frame_save(struct frame_buffer *frame)
+{
+    if (use_uring)
+        uring_io_submit(frame);
+    else
+        writer_pool_submit(frame);
+}
+
+/* Gives back a buffer whose frame is not saved */
+void frame_put(struct frame_buffer *frame)
+{
+    if (use_uring)
+        uring_io_put(frame);
+    else
+        writer_pool_put(frame);
+}
+
+/* Receives exactly len bytes, returns 0 on success and -1 on error or EOF */
+int recv_all(int fd, unsigned char *buf, size_t len)
+{
+    size_t total = 0;
+
+    if (use_uring)
+        return uring_io_recv(fd, buf, len);
+    while (total < len)
+    {
+        ssize_t bytes_received = recv(fd, buf + total, len - total, 0);
+
+        atomic_fetch_add(&io_syscalls, 1);
+        if (bytes_received < 0 && EINTR == errno)
+            continue;
+        if (bytes_received <= 0)
+            return -1;
+        total += (size_t)bytes_received;
+    }
+    return 0;
+}
+
+/* Asks the server to replay the given number of seconds of history */
+void request_history(int fd, double seconds)
+{
+    struct command cmd;
+    unsigned char wire[COMMAND_SIZE];
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.magic = COMMAND_MAGIC;
+    cmd.type = COMMAND_HISTORY;
+    cmd.flags = COMMAND_FLAG_RELATIVE;
+    cmd.arg0 = (uint64_t)(seconds * 1e6);
+    command_pack(&cmd, wire);
+    if (send(fd, wire, sizeof(wire), MSG_NOSIGNAL) != sizeof(wire))
+    {
+        syslog(LOG_ERR, "Failed to request history");
+    }
+}
+
+/* Asks the server to send frames in another enum frame_format */
+void request_format(int fd, int format)
+{
+    struct command cmd;
+    unsigned char wire[COMMAND_SIZE];
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.magic = COMMAND_MAGIC;
+    cmd.type = COMMAND_FORMAT;
+    cmd.arg0 = (uint64_t)format;
+    command_pack(&cmd, wire);
+    if (send(fd, wire, sizeof(wire), MSG_NOSIGNAL) != sizeof(wire))
+    {
+        syslog(LOG_ERR, "Failed to request format %s", frame_format_name(format));
+    }
+}
+
+/* Asks the server for the whole frame at another simulcast level */
+void request_level(int fd, int level)
+{
+    struct command cmd;
+    unsigned char wire[COMMAND_SIZE];
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.magic = COMMAND_MAGIC;
+    cmd.type = COMMAND_LEVEL;
+    cmd.arg0 = (uint64_t)level;
+    command_pack(&cmd, wire);
+    if (send(fd, wire, sizeof(wire), MSG_NOSIGNAL) != sizeof(wire))
+    {
+        syslog(LOG_ERR, "Failed to request level %d", level);
+    }
+}
+
+/* Asks the server for delta frames, or whole frames again with an interval of 0 */
+void request_delta(int fd, int interval, int threshold)
+{
+    struct command cmd;
+    unsigned char wire[COMMAND_SIZE];
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.magic = COMMAND_MAGIC;
+    cmd.type = COMMAND_DELTA;
+    cmd.arg0 = (uint64_t)interval;
+    cmd.arg1 = (uint64_t)threshold;
+    command_pack(&cmd, wire);
+    if (send(fd, wire, sizeof(wire), MSG_NOSIGNAL) != sizeof(wire))
+    {
+        syslog(LOG_ERR, "Failed to request delta frames");
+    }
+}
+
+/* Asks the server to end every frame with a CRC32C */
+void request_crc(int fd)
+{
+    struct command cmd;
+    unsigned char wire[COMMAND_SIZE];
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.magic = COMMAND_MAGIC;
+    cmd.type = COMMAND_CRC;
+    cmd.arg0 = 1;
+    command_pack(&cmd, wire);
+    if (send(fd, wire, sizeof(wire), MSG_NOSIGNAL) != sizeof(wire))
+    {
+        syslog(LOG_ERR, "Failed to request frame checksums");
+    }
+}
+
+/* Asks the server for a whole frame, once until one arrives */
+void request_keyframe(int fd, struct frame_delta_refs *refs)
+{
+    struct command cmd;
+    unsigned char wire[COMMAND_SIZE];
+
+    if (refs->keyframe_requested)
+        return;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.magic = COMMAND_MAGIC;
+    cmd.type = COMMAND_KEYFRAME;
+    command_pack(&cmd, wire);
+    if (send(fd, wire, sizeof(wire), MSG_NOSIGNAL) != sizeof(wire))
+    {
+        syslog(LOG_ERR, "Failed to request a keyframe");
+        return;
+    }
+    refs->keyframe_requested = 1;
+}
+
+/* Asks the server to crop, scale, rotate or mirror the frames it sends */
+void request_transform(int fd, const struct frame_transform *t)
+{
+    struct command cmd;
+    unsigned char wire[COMMAND_SIZE];
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.magic = COMMAND_MAGIC;
+    cmd.type = COMMAND_TRANSFORM;
+    frame_transform_pack(t, &cmd);
+    command_pack(&cmd, wire);
+    if (send(fd, wire, sizeof(wire), MSG_NOSIGNAL) != sizeof(wire))
+    {
+        syslog(LOG_ERR, "Failed to request a transform");
+    }
+}
+
+/* Asks the server for regions of interest instead of whole frames */
+void request_rois(int fd, const struct frame_roi *rois, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        struct command cmd;
+        unsigned char wire[COMMAND_SIZE];
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.magic = COMMAND_MAGIC;
+        cmd.type = COMMAND_ROI;
+        frame_roi_pack(&rois[i], &cmd);
+        command_pack(&cmd, wire);
+        if (send(fd, wire, sizeof(wire), MSG_NOSIGNAL) != sizeof(wire))
+        {
+            syslog(LOG_ERR, "Failed to request region %d", i);
+        }
+    }
+}
+
+/* Parses -R WxH+X+Y[/scale] into region number index */
+int parse_roi(const char *spec, int index, struct frame_roi *roi)
+{
+    unsigned int w, h, x, y, scale = 1;
+    int fields = sscanf(spec, "%ux%u+%u+%u/%u", &w, &h, &x, &y, &scale);
+
+    if (fields < 4 || !w || !h || !scale || w > UINT16_MAX || h > UINT16_MAX || x > UINT16_MAX ||
+        y > UINT16_MAX || scale > UINT8_MAX)
+        return -1;
+    roi->width = (uint16_t)w;
+    roi->height = (uint16_t)h;
+    roi->x = (uint16_t)x;
+    roi->y = (uint16_t)y;
+    roi->index = (uint8_t)index;
+    roi->scale = (uint8_t)scale;
+    return 0;
+}
+
+/* File name prefix of a frame: frame, history, or roiN_ before either */
+const char *frame_file_name(const struct frame_header *header, int live)
+{
+    static const char *const names[2][FRAME_MAX_ROIS] = {
+        { "roi0_history", "roi1_history", "roi2_history", "roi3_history" },
+        { "roi0_frame", "roi1_frame", "roi2_frame", "roi3_frame" },
+    };
+
+    if (!(header->flags & FRAME_FLAG_ROI) || FRAME_ROI_INDEX(header->flags) >= FRAME_MAX_ROIS)
+        return live ? "frame" : "history";
+    return names[live ? 1 : 0][FRAME_ROI_INDEX(header->flags)];
+}
+
+/*
+ * Returns 1 if the frame is the last one the server sends for a capture:
+ * every frame without regions of interest, or the last of the regions
+ */
+int frame_completes_capture(const struct frame_header *header, int rois)
+{
+    return !(header->flags & FRAME_FLAG_ROI) || (int)FRAME_ROI_INDEX(header->flags) >= rois - 1;
+}
+
+/*
+ * Parses -g crop=WxH+X+Y,size=WxH,rotate=DEG,mirror into a transform,
+ * returns 0 on success and -1 if any part is not understood
+ */
+int parse_geometry(char *spec, struct frame_transform *t)
+{
+    char *const keys[] = { "crop", "size", "rotate", "mirror", NULL };
+    char *value;
+    unsigned int a, b, c, d, degrees;
+
+    memset(t, 0, sizeof(*t));
+    while ('\0' != *spec)
+    {
+        switch (getsubopt(&spec, keys, &value))
+        {
+        case 0:
+            if (!value || 4 != sscanf(value, "%ux%u+%u+%u", &a, &b, &c, &d) || !a || !b ||
+                a > UINT16_MAX || b > UINT16_MAX || c > UINT16_MAX || d > UINT16_MAX)
+                return -1;
+            t->crop_width = (uint16_t)a;
+            t->crop_height = (uint16_t)b;
+            t->crop_x = (uint16_t)c;
+            t->crop_y = (uint16_t)d;
+            break;
+        case 1:
+            if (!value || 2 != sscanf(value, "%ux%u", &a, &b) || !a || !b || a > UINT16_MAX || b > UINT16_MAX)
+                return -1;
+            t->width = (uint16_t)a;
+            t->height = (uint16_t)b;
+            break;
+        case 2:
+            if (!value || 1 != sscanf(value, "%u", &degrees) || degrees % 90 || degrees >= 360)
+                return -1;
+            t->rotation = (uint8_t)(degrees / 90);
+            break;
+        case 3:
+            t->mirror = 1;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns 1 if the payload size is what the header's format and size need,
+ * or for a delta, at least its tile bitmap and less than the whole image;
+ * plus the CRC if the frame has one. The end of a history replay is empty.
+ */
+int frame_payload_valid(const struct frame_header *header)
+{
+    uint32_t expected = frame_format_bytes(header->format, header->width, header->height);
+    uint32_t size = header->payload_size;
+
+    if (header->flags & FRAME_FLAG_CRC)
+    {
+        if (size < FRAME_CRC_SIZE)
+            return 0;
+        size -= FRAME_CRC_SIZE;
+    }
+    if (header->flags & FRAME_FLAG_HISTORY_END)
+        return 0 == size;
+    if (header->flags & FRAME_FLAG_DELTA)
+        return size >= frame_delta_bitmap_bytes(header->width, header->height) && size < expected;
+    return expected && size == expected;
+}
+
+/* Receives and validates one frame header */
+void receive_header(struct frame_header *header, size_t max_payload)
+{
+    unsigned char header_bytes[FRAME_HEADER_SIZE];
+
+    if (-1 == recv_all(client_fd, header_bytes, sizeof(header_bytes)))
+    {
+        syslog(LOG_ERR, "Receive error");
+        exit(RECEIVE_ERROR);
+    }
+    if (-1 == frame_header_unpack(header_bytes, header) ||
+        header->payload_size > max_payload || !frame_payload_valid(header))
+    {
+        syslog(LOG_ERR, "Malformed frame header");
+        exit(PROTOCOL_ERROR);
+    }
+}
+
+/*
+ * Passes frame payloads on to the stream output, history first, until the
+ * requested number of live frames (or, for 0, the connection) ends.
+ */
+void stream_frames(int requested_frames)
+{
+    int streamed = 0;
+
+    fprintf(stderr, "Streaming frames%s\n", stream_out_spliced() ? " with splice" : "");
+    while (requested_frames <= 0 || streamed < requested_frames)
+    {
+        struct frame_header header;
+        uint64_t span;
+        int live, startup;
+
+        trace_service();
+        span = trace_begin();
+        receive_header(&header, FRAME_MAX_PAYLOAD);
+        if (header.flags & FRAME_FLAG_HISTORY_END)
+        {
+            continue;
+        }
+        live = !(header.flags & FRAME_FLAG_HISTORY);
+        startup = live && current_frame < STARTUP_FRAMES;
+        current_frame += live && frame_completes_capture(&header, roi_count);
+        if (startup)
+        {
+            if (-1 == stream_out_discard(client_fd, header.payload_size))
+            {
+                exit(RECEIVE_ERROR);
+            }
+            continue;
+        }
+        if (-1 == stream_out_payload(client_fd, header.payload_size))
+        {
+            if (EPIPE == errno)
+            {
+                syslog(LOG_INFO, "Stream reader went away");
+                return;
+            }
+            syslog(LOG_ERR, "Stream error: %s", strerror(errno));
+            exit(STREAM_ERROR);
+        }
+        trace_end("stream", span, header.sequence);
+        streamed += live && frame_completes_capture(&header, roi_count);
+    }
 }
 
-int main(int argc, char const* argv[])
+/* Receives from every server in a comma separated list, then exits */
+void run_multi(char *list, int requested_frames, double history_seconds, int format, int level,
+               const struct frame_transform *transform, const struct frame_roi *rois, int keyframe_interval,
+               int delta_threshold, int crc, int writers, int buffers, bool single_output)
+{
+    struct multi_config config;
+    char *servers[256];
+    int count = 0;
+    int status;
+
+    if (single_output)
+    {
+        fprintf(stderr, "Container and stream output take a single server\n");
+        exit(USAGE_ERROR);
+    }
+    for (char *s = strtok(list, ","); s && count < 256; s = strtok(NULL, ","))
+    {
+        servers[count++] = s;
+    }
+    if (-1 == writer_pool_start(writers, buffers, FRAME_MAX_PAYLOAD + FRAME_CRC_SIZE, write_frame))
+    {
+        printf("Failed to start the writer pool\n");
+        exit(POOL_ERROR);
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.requested_frames = requested_frames;
+    config.startup_frames = STARTUP_FRAMES;
+    config.history_seconds = history_seconds;
+    config.format = format;
+    config.level = level;
+    config.transform = transform;
+    config.rois = rois;
+    config.roi_count = roi_count;
+    config.keyframe_interval = keyframe_interval;
+    config.delta_threshold = delta_threshold;
+    config.crc = crc;
+    status = multi_client_run(servers, count, &config);
+    writer_pool_stop();
+    exit(-1 == status ? MULTI_ERROR : SUCCESS_FLAG);
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-H seconds] [-F format] [-L level] [-g geometry] [-R region]... [-D frames[/threshold]] [-C] [-w writers] [-b buffers] [-U] [-o container | -s output] <server_ip[:port][,ip[:port]...]> <frames>\n"
+                    "  -H seconds   first fetch this much pre-connect history from the server\n"
+                    "  -F format    rgb24 (default), rgb565, nv12, i420 or gray\n"
+                    "  -L level     whole frame at full size (0, default), 1/2 (1) or 1/4 (2);\n"
+                    "               -g and -R still work on the full frame\n"
+                    "  -g geometry  crop=WxH+X+Y,size=WxH,rotate=90|180|270,mirror, any of them;\n"
+                    "               the server crops, scales, mirrors and then rotates\n"
+                    "  -R WxH+X+Y[/scale]  receive only this region, scaled down; up to %d of them,\n"
+                    "               saved as roiN_frameM\n"
+                    "  -D frames[/threshold]  receive only the 16x16 tiles that changed by more than\n"
+                    "               threshold per sample (default 0), with a whole frame every frames;\n"
+                    "               saved frames are rebuilt whole, not with -s\n"
+                    "  -C           have every frame checksummed, report and skip corrupted ones;\n"
+                    "               not with -s\n"
+                    "  -w writers   threads writing frames to disk (default %d)\n"
+                    "  -b buffers   frames that may be waiting for the disk (default %d)\n"
+                    "  -U           receive and save frames through io_uring instead of recv() and\n"
+                    "               writer threads; one server, not with -o or -s\n"
+                    "  -o file      append all frames to one container file instead of PPMs\n"
+                    "  -s output    write raw frames to a named pipe, or - for stdout;\n"
+                    "               frames 0 streams until the server disconnects\n"
+                    "  -t file      trace receiving and writing from the start, written to file at exit\n"
+                    "               (SIGUSR1 toggles tracing, SIGUSR2 dumps it, default file %s)\n"
+                    "frames is the number of live frames to save, at least 1.\n"
+                    "With several servers, frames from each go to frames/<server>/.\n",
+            prog, FRAME_MAX_ROIS, DEFAULT_WRITERS, DEFAULT_BUFFERS, TRACE_DEFAULT_PATH);
+}
+
+int main(int argc, char *argv[])
 {
     printf("Entered main\n");
     struct sockaddr_in my_addr;
+    char *port_sep;
+    char *end;
     int status;
+    int opt;
     int num_frame = 1;
+    int history_frame = 1;
     int requested_frames = 0;
-    requested_frames = atoi(argv[2]);
+    double history_seconds = 0;
+    int writers = DEFAULT_WRITERS;
+    int buffers = DEFAULT_BUFFERS;
+    const char *container_path = NULL;
+    const char *stream_path = NULL;
+    const char *trace_path = NULL;
+    int format = FRAME_FMT_RGB24;
+    struct frame_transform transform;
+    int transformed = 0;
+    struct frame_roi rois[FRAME_MAX_ROIS];
+    int level = 0;
+    int keyframe_interval = 0;
+    int delta_threshold = 0;
+    int crc = 0;
+    unsigned long crc_errors = 0;
+    int frames_received = 0;
+    struct rusage resources;
+
+    while (-1 != (opt = getopt(argc, argv, "H:F:L:g:R:D:Cw:b:Uo:s:t:")))
+    {
+        switch (opt)
+        {
+        case 'H':
+            history_seconds = atof(optarg);
+            break;
+        case 'F':
+            for (format = 0; format < FRAME_FMT_COUNT; format++)
+            {
+                if (0 == strcmp(optarg, frame_format_name(format)))
+                    break;
+            }
+            if (FRAME_FMT_COUNT == format)
+            {
+                usage(argv[0]);
+                exit(USAGE_ERROR);
+            }
+            break;
+        case 'L':
+            level = atoi(optarg);
+            if (level < 0 || level >= FRAME_PYRAMID_LEVELS)
+            {
+                usage(argv[0]);
+                exit(USAGE_ERROR);
+            }
+            break;
+        case 'g':
+            if (-1 == parse_geometry(optarg, &transform))
+            {
+                usage(argv[0]);
+                exit(USAGE_ERROR);
+            }
+            transformed = 1;
+            break;
+        case 'R':
+            if (roi_count == FRAME_MAX_ROIS || -1 == parse_roi(optarg, roi_count, &rois[roi_count]))
+            {
+                usage(argv[0]);
+                exit(USAGE_ERROR);
+            }
+            roi_count++;
+            break;
+        case 'D':
+            if (sscanf(optarg, "%d/%d", &keyframe_interval, &delta_threshold) < 1 || keyframe_interval < 1 ||
+                delta_threshold < 0 || delta_threshold > UINT8_MAX)
+            {
+                usage(argv[0]);
+                exit(USAGE_ERROR);
+            }
+            break;
+        case 'C':
+            crc = 1;
+            break;
+        case 'w':
+            writers = atoi(optarg);
+            break;
+        case 'b':
+            buffers = atoi(optarg);
+            break;
+        case 'U':
+            use_uring = 1;
+            break;
+        case 'o':
+            container_path = optarg;
+            break;
+        case 's':
+            stream_path = optarg;
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            exit(USAGE_ERROR);
+        }
+    }
+    if (argc - optind != 2 || writers < 1 || buffers <= writers || (container_path && stream_path) ||
+        ((keyframe_interval || crc) && stream_path) || (use_uring && (container_path || stream_path || strchr(argv[optind], ','))))
+    {
+        usage(argv[0]);
+        exit(USAGE_ERROR);
+    }
+    /* Only streaming runs until the server disconnects, saving needs a count */
+    requested_frames = (int)strtol(argv[optind + 1], &end, 10);
+    if (end == argv[optind + 1] || *end || requested_frames < 0 || (!requested_frames && !stream_path))
+    {
+        usage(argv[0]);
+        exit(USAGE_ERROR);
+    }
     openlog(NULL,LOG_PID, LOG_USER);
+    if (-1 == trace_setup(trace_path ? trace_path : TRACE_DEFAULT_PATH, NULL != trace_path))
+    {
+        syslog(LOG_ERR, "Tracing signals could not be installed: %s", strerror(errno));
+    }
     if(SIG_ERR == signal(SIGINT,signal_handler))
 	{
 		syslog(LOG_ERR,"SIGINT failed");
@@ -105,6 +763,13 @@ int main(int argc, char const* argv[])
 		exit(SIGTERM_FAIL);
 	}
 
+    if (strchr(argv[optind], ','))
+    {
+        run_multi(argv[optind], requested_frames, history_seconds, format, level,
+                  transformed ? &transform : NULL, rois, keyframe_interval, delta_threshold, crc, writers, buffers,
+                  container_path || stream_path);
+    }
+
     if((client_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) 
 	{
 		syslog(LOG_ERR,"Socket creation error");
@@ -114,14 +779,61 @@ int main(int argc, char const* argv[])
     my_addr.sin_family = AF_INET;
     my_addr.sin_port = htons(PORT);
 
+    /* A single server may be given as ip:port too, like each one of a list */
+    port_sep = strrchr(argv[optind], ':');
+    if (port_sep)
+    {
+        int port = atoi(port_sep + 1);
+
+        if (port <= 0 || port > 65535)
+        {
+            printf("Invalid port %s\n", port_sep + 1);
+            exit(INET_API_FAIL);
+        }
+        my_addr.sin_port = htons((uint16_t)port);
+        *port_sep = '\0';
+    }
+
     /* Convert IPv4 and IPv6 addresses from text to binary */
-	if (inet_pton(AF_INET, argv[1], &my_addr.sin_addr)<= 0) 
+	if (inet_pton(AF_INET, argv[optind], &my_addr.sin_addr)<= 0) 
 	{
 		syslog(LOG_ERR,"Invalid address: Address not supported");
         printf("Invalid address: Address not supported");
 		exit(INET_API_FAIL);
 	}
     printf("inet_pton done\n");
+    if (stream_path)
+    {
+        /* An encoder that exits should end the client, not kill it */
+        signal(SIGPIPE, SIG_IGN);
+        if (-1 == stream_out_open(stream_path))
+        {
+            fprintf(stderr, "Cannot open %s for streaming\n", stream_path);
+            exit(STREAM_ERROR);
+        }
+    }
+    if (container_path)
+    {
+        if (-1 == container_open(container_path))
+        {
+            printf("Cannot create %s\n", container_path);
+            exit(CONTAINER_ERROR);
+        }
+        /* Records must land in receive order */
+        use_container = 1;
+        writers = 1;
+    }
+    if (use_uring && -1 == uring_io_start(buffers, FRAME_MAX_PAYLOAD + FRAME_CRC_SIZE, describe_frame))
+    {
+        fprintf(stderr, "io_uring is not available, receiving with recv() and writer threads\n");
+        use_uring = 0;
+    }
+    if (!stream_path && !use_uring &&
+        -1 == writer_pool_start(writers, buffers, FRAME_MAX_PAYLOAD + FRAME_CRC_SIZE, write_frame))
+    {
+        printf("Failed to start the writer pool\n");
+        exit(POOL_ERROR);
+    }
 	if ((status=connect(client_fd, (struct sockaddr*)&my_addr,sizeof(my_addr)))< 0) 
 	{
 		syslog(LOG_ERR,"Connection Failed");
@@ -129,33 +841,133 @@ int main(int argc, char const* argv[])
 		exit(CONNECT_API_FAIL);
 	}
     printf("connected\n");
+    if (FRAME_FMT_RGB24 != format)
+    {
+        request_format(client_fd, format);
+    }
+    if (level)
+    {
+        request_level(client_fd, level);
+    }
+    if (transformed)
+    {
+        request_transform(client_fd, &transform);
+    }
+    if (roi_count)
+    {
+        request_rois(client_fd, rois, roi_count);
+    }
+    if (keyframe_interval)
+    {
+        request_delta(client_fd, keyframe_interval, delta_threshold);
+    }
+    if (crc)
+    {
+        request_crc(client_fd);
+    }
+    if (history_seconds > 0)
+    {
+        request_history(client_fd, history_seconds);
+    }
     printf("%d is the requested frames\n",requested_frames);
+    if (stream_path)
+    {
+        stream_frames(requested_frames);
+        close(client_fd);
+        return SUCCESS_FLAG;
+    }
     while (num_frame  <= requested_frames)
     {
-        unsigned char buffer[((614400 * 6) / 4)];
-        int bytes_received;
-        int total_bytes_received = 0;
+        struct frame_buffer *frame = frame_get();
+        struct frame_header *header = &frame->header;
+        uint64_t span;
 
-        while (total_bytes_received < sizeof(buffer))
+        trace_service();
+        span = trace_begin();
+        receive_header(header, frame->capacity);
+        if (-1 == recv_all(client_fd, frame->data, header->payload_size))
         {
-            bytes_received = recv(client_fd, buffer + total_bytes_received, sizeof(buffer) - total_bytes_received, 0);
-
-            if (bytes_received < 0)
-            {
-                syslog(LOG_ERR, "Receive error");
-                exit(RECEIVE_ERROR);
-            }
-
-            total_bytes_received += bytes_received;
-            current_frame++;
+            syslog(LOG_ERR, "Receive error");
+            exit(RECEIVE_ERROR);
+        }
+        trace_end("recv", span, header->sequence);
+        frames_received++;
+        if (-1 == frame_crc_check(header, frame->data))
+        {
+            crc_errors++;
+            syslog(LOG_ERR, "Frame %u failed its checksum", header->sequence);
+            fprintf(stderr, "Frame %u failed its checksum, not saved\n", header->sequence);
+            /* A delta against what this frame should have been cannot apply */
+            frame_delta_lost(&delta_refs, header);
+            frame_put(frame);
+            continue;
+        }
+        if (keyframe_interval && !(header->flags & FRAME_FLAG_HISTORY_END) &&
+            -1 == frame_delta_rebuild(&delta_refs, header, frame->data, frame->capacity))
+        {
+            /* Nothing to apply this delta to until the next keyframe */
+            request_keyframe(client_fd, &delta_refs);
+            frame_put(frame);
+            continue;
+        }
+        if (header->flags & FRAME_FLAG_HISTORY_END)
+        {
+            printf("History replay done, %d frames\n", history_frame - 1);
+            frame_put(frame);
+            continue;
+        }
+        if (header->flags & FRAME_FLAG_HISTORY)
+        {
+            frame->name = frame_file_name(header, 0);
+            frame->number = history_frame;
+            history_frame += frame_completes_capture(header, roi_count);
+            frame_save(frame);
+            continue;
         }
 
-        // Now 'buffer' contains the entire image data
-        if(current_frame > STARTUP_FRAMES)
+        // Now the buffer contains the entire image data
+        if(current_frame >= STARTUP_FRAMES)
         {
-            dump_ppm(buffer, ((614400 * 6) / 4), num_frame);
-            num_frame++;
+            frame->name = frame_file_name(header, 1);
+            frame->number = num_frame;
+            num_frame += frame_completes_capture(header, roi_count);
+            frame_save(frame);
         }
+        else
+        {
+            frame_put(frame);
+        }
+        current_frame += frame_completes_capture(header, roi_count);
     }
 
-}
\ No newline at end of file
+    /* Let the writers finish whatever is still queued */
+    if (use_uring)
+    {
+        io_syscalls += uring_io_stop();
+    }
+    else
+    {
+        writer_pool_stop();
+    }
+    getrusage(RUSAGE_SELF, &resources);
+    if (frames_received)
+    {
+        printf("%d frames received, %.1f I/O system calls and %.1f context switches per frame\n", frames_received,
+               (double)io_syscalls / frames_received,
+               (double)(resources.ru_nvcsw + resources.ru_nivcsw) / frames_received);
+    }
+    if (crc)
+    {
+        printf("%lu frames failed their checksum\n", crc_errors);
+    }
+    if (use_container && -1 == container_close())
+    {
+        printf("Failed to finish %s\n", container_path);
+        exit(CONTAINER_ERROR);
+    }
+    if (container_failures)
+    {
+        printf("%lu frames could not be added to %s\n", (unsigned long)container_failures, container_path);
+        exit(CONTAINER_ERROR);
+    }
+}
@@ -0,0 +1,319 @@
+/**
+ * @file frame_container.c
+ * @brief Single-file container for received frames with a trailing index.
+ *
+ * Writing one file per frame spends most of its time on file creation and
+ * metadata updates. The container instead appends every frame to a single
+ * file, reserving space ahead of the writes with fallocate() so the file
+ * system can hand out large contiguous extents, and writes each record's
+ * header and payload together with one writev(). The index is kept in
+ * memory and written once when the container is closed.
+ *
+ * Only one thread may append at a time; the client runs a single writer
+ * in container mode so records stay in receive order.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "frame_container.h"
+
+/* Space reserved ahead of the write position */
+#define CONTAINER_EXTENT (64u * 1024 * 1024)
+
+static int fd = -1;
+static uint64_t write_pos;
+static uint64_t reserved;
+static struct container_entry *index_entries;
+static size_t index_count, index_cap;
+
+static int write_fully(const unsigned char *p, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Cuts a record that failed part way back off the file, so the next one
+ * starts where the index expects. If the file cannot be cut, the bytes
+ * that did get out stay and the next record goes after them.
+ */
+static void drop_partial(size_t done)
+{
+    if (!done)
+        return;
+    if (0 == ftruncate(fd, (off_t)write_pos) && (off_t)-1 != lseek(fd, (off_t)write_pos, SEEK_SET))
+    {
+        reserved = write_pos;
+        return;
+    }
+    syslog(LOG_ERR, "Cannot cut a failed record off the container: %s", strerror(errno));
+    write_pos += done;
+}
+
+/**
+ * @brief   Create a container file, replacing any existing one.
+ *
+ * @param   path    File to create.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int container_open(const char *path)
+{
+    unsigned char header[CONTAINER_HEADER_SIZE];
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "Cannot create container %s: %s", path, strerror(errno));
+        return -1;
+    }
+    put_be32(header, CONTAINER_MAGIC);
+    put_be32(header + 4, CONTAINER_VERSION);
+    if (-1 == write_fully(header, sizeof(header)))
+    {
+        syslog(LOG_ERR, "Cannot write container header: %s", strerror(errno));
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+    write_pos = sizeof(header);
+    reserved = 0;
+    index_count = 0;
+    return 0;
+}
+
+/**
+ * @brief   Append a frame to the container.
+ *
+ * @param   header  Frame header, written as on the wire.
+ * @param   payload header->payload_size bytes of image data.
+ *
+ * @return  0 on success, -1 on a write error, in which case the frame is
+ *          not in the container and later frames are still indexed right.
+ */
+int container_append(const struct frame_header *header, const unsigned char *payload)
+{
+    unsigned char header_bytes[FRAME_HEADER_SIZE];
+    struct iovec iov[2];
+    size_t len = FRAME_HEADER_SIZE + header->payload_size;
+    size_t done = 0;
+
+    if (fd < 0)
+        return -1;
+
+    if (write_pos + len > reserved)
+    {
+        /* KEEP_SIZE so a killed writer leaves no zero-filled tail to walk */
+        if (0 == fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t)write_pos, CONTAINER_EXTENT))
+            reserved = write_pos + CONTAINER_EXTENT;
+        else
+            reserved = write_pos + len;  /* not supported here, write anyway */
+    }
+
+    if (index_count == index_cap)
+    {
+        size_t cap = index_cap ? index_cap * 2 : 1024;
+        struct container_entry *grown = realloc(index_entries, cap * sizeof(*grown));
+        if (!grown)
+        {
+            syslog(LOG_ERR, "Out of memory for the container index");
+            return -1;
+        }
+        index_entries = grown;
+        index_cap = cap;
+    }
+
+    frame_header_pack(header, header_bytes);
+    iov[0].iov_base = header_bytes;
+    iov[0].iov_len = FRAME_HEADER_SIZE;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = header->payload_size;
+    while (done < len)
+    {
+        ssize_t n = writev(fd, iov, 2);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+        {
+            syslog(LOG_ERR, "Container write failed: %s", strerror(errno));
+            drop_partial(done);
+            return -1;
+        }
+        done += (size_t)n;
+        /* Skip past whatever a short write did get out */
+        for (int i = 0; i < 2; i++)
+        {
+            size_t skip = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+            iov[i].iov_base = (unsigned char *)iov[i].iov_base + skip;
+            iov[i].iov_len -= skip;
+            n -= (ssize_t)skip;
+        }
+    }
+
+    index_entries[index_count].offset = write_pos;
+    index_entries[index_count].timestamp_us = header->timestamp_us;
+    index_entries[index_count].sequence = header->sequence;
+    index_entries[index_count].flags = header->flags;
+    index_count++;
+    write_pos += len;
+    return 0;
+}
+
+/**
+ * @brief   Write the index and trailer, release unused reserved space and
+ *          close the container.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int container_close(void)
+{
+    unsigned char entry[CONTAINER_INDEX_ENTRY_SIZE];
+    unsigned char trailer[CONTAINER_TRAILER_SIZE];
+    uint64_t index_offset = write_pos;
+    int status = 0;
+
+    if (fd < 0)
+        return -1;
+
+    for (size_t i = 0; i < index_count && 0 == status; i++)
+    {
+        put_be64(entry, index_entries[i].offset);
+        put_be64(entry + 8, index_entries[i].timestamp_us);
+        put_be32(entry + 16, index_entries[i].sequence);
+        put_be32(entry + 20, index_entries[i].flags);
+        status = write_fully(entry, sizeof(entry));
+    }
+    put_be32(trailer, CONTAINER_INDEX_MAGIC);
+    put_be32(trailer + 4, (uint32_t)index_count);
+    put_be64(trailer + 8, index_offset);
+    if (0 == status)
+        status = write_fully(trailer, sizeof(trailer));
+    if (-1 == status)
+        syslog(LOG_ERR, "Container index write failed: %s", strerror(errno));
+
+    /* Give back the reservation beyond the end of the data */
+    if (-1 == ftruncate(fd, (off_t)(index_offset + index_count * CONTAINER_INDEX_ENTRY_SIZE +
+                                    CONTAINER_TRAILER_SIZE)))
+        status = -1;
+    if (-1 == close(fd))
+        status = -1;
+    fd = -1;
+    free(index_entries);
+    index_entries = NULL;
+    index_count = index_cap = 0;
+    return status;
+}
+
+/* Recovers the index of a container that was never closed */
+static int scan_records(int in, uint64_t file_size, struct container_entry **entries, size_t *count)
+{
+    unsigned char header_bytes[FRAME_HEADER_SIZE];
+    struct frame_header header;
+    uint64_t pos = CONTAINER_HEADER_SIZE;
+    size_t cap = 0;
+
+    *entries = NULL;
+    *count = 0;
+    while (FRAME_HEADER_SIZE == pread(in, header_bytes, FRAME_HEADER_SIZE, (off_t)pos) &&
+           0 == frame_header_unpack(header_bytes, &header) &&
+           pos + FRAME_HEADER_SIZE + header.payload_size <= file_size)
+    {
+        if (*count == cap)
+        {
+            struct container_entry *grown;
+            cap = cap ? cap * 2 : 1024;
+            grown = realloc(*entries, cap * sizeof(*grown));
+            if (!grown)
+            {
+                free(*entries);
+                return -1;
+            }
+            *entries = grown;
+        }
+        (*entries)[*count].offset = pos;
+        (*entries)[*count].timestamp_us = header.timestamp_us;
+        (*entries)[*count].sequence = header.sequence;
+        (*entries)[*count].flags = header.flags;
+        (*count)++;
+        pos += FRAME_HEADER_SIZE + (uint64_t)header.payload_size;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Load the index of a container.
+ *
+ * Falls back to walking the records when the container has no trailer,
+ * which is the case when its writer did not shut down cleanly.
+ *
+ * @param   in      Container opened for reading.
+ * @param   entries Receives a malloc()ed array of entries.
+ * @param   count   Receives the number of entries.
+ *
+ * @return  0 on success, -1 if the file is not a container or cannot be read.
+ */
+int container_read_index(int in, struct container_entry **entries, size_t *count)
+{
+    unsigned char header[CONTAINER_HEADER_SIZE];
+    unsigned char trailer[CONTAINER_TRAILER_SIZE];
+    unsigned char *raw;
+    struct stat st;
+    uint64_t index_offset;
+    uint32_t n;
+
+    if (CONTAINER_HEADER_SIZE != pread(in, header, sizeof(header), 0) ||
+        CONTAINER_MAGIC != get_be32(header) || -1 == fstat(in, &st))
+        return -1;
+
+    if (st.st_size < CONTAINER_HEADER_SIZE + CONTAINER_TRAILER_SIZE ||
+        CONTAINER_TRAILER_SIZE != pread(in, trailer, sizeof(trailer), st.st_size - CONTAINER_TRAILER_SIZE) ||
+        CONTAINER_INDEX_MAGIC != get_be32(trailer))
+        return scan_records(in, (uint64_t)st.st_size, entries, count);
+
+    n = get_be32(trailer + 4);
+    index_offset = get_be64(trailer + 8);
+    if (index_offset + (uint64_t)n * CONTAINER_INDEX_ENTRY_SIZE + CONTAINER_TRAILER_SIZE != (uint64_t)st.st_size)
+        return scan_records(in, (uint64_t)st.st_size, entries, count);
+
+    raw = malloc((size_t)n * CONTAINER_INDEX_ENTRY_SIZE + 1);
+    *entries = malloc((size_t)n * sizeof(**entries) + 1);
+    if (!raw || !*entries ||
+        (ssize_t)((size_t)n * CONTAINER_INDEX_ENTRY_SIZE) !=
+            pread(in, raw, (size_t)n * CONTAINER_INDEX_ENTRY_SIZE, (off_t)index_offset))
+    {
+        free(raw);
+        free(*entries);
+        return -1;
+    }
+    for (uint32_t i = 0; i < n; i++)
+    {
+        const unsigned char *e = raw + (size_t)i * CONTAINER_INDEX_ENTRY_SIZE;
+        (*entries)[i].offset = get_be64(e);
+        (*entries)[i].timestamp_us = get_be64(e + 8);
+        (*entries)[i].sequence = get_be32(e + 16);
+        (*entries)[i].flags = get_be32(e + 20);
+    }
+    free(raw);
+    *count = n;
+    return 0;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file frame_container.h
+ * @brief Single-file container for received frames with a trailing index.
+ *
+ * Layout, all integers big-endian:
+ *
+ *   file header   "FCN1" magic, u32 version
+ *   records       frame header exactly as on the wire, then its payload
+ *   index         one entry per record
+ *   trailer       "FCIX" magic, u32 entry count, u64 index offset
+ *
+ * A container whose writer was killed has no index or trailer; its records
+ * can still be recovered by walking the frame headers from the start.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __FRAME_CONTAINER_H__
+#define __FRAME_CONTAINER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../common/frame_protocol.h"
+
+#define CONTAINER_MAGIC 0x46434E31u       /* "FCN1" */
+#define CONTAINER_INDEX_MAGIC 0x46434958u /* "FCIX" */
+#define CONTAINER_VERSION 1
+#define CONTAINER_HEADER_SIZE 8
+#define CONTAINER_INDEX_ENTRY_SIZE 24
+#define CONTAINER_TRAILER_SIZE 16
+
+struct container_entry
+{
+    uint64_t offset;            /* position of the record's frame header */
+    uint64_t timestamp_us;
+    uint32_t sequence;
+    uint32_t flags;             /* frame flags, tells history from live frames */
+};
+
+int container_open(const char *path);
+int container_append(const struct frame_header *header, const unsigned char *payload);
+int container_close(void);
+
+int container_read_index(int fd, struct container_entry **entries, size_t *count);
+
+#endif /* __FRAME_CONTAINER_H__ */
@@ -0,0 +1,175 @@
+/**
+ * @file frame_extract.c
+ * @brief Turns a client frame container back into individual images.
+ *
+ * Usage: frame_extract [-j quality] [-f first] [-n count] <container> <out_dir>
+ *
+ * Live frames are written as frameN and replayed history frames as
+ * historyN, numbered in container order like the client's own PPM output.
+ * With -j the images are JPEG files of the given quality instead of PPM.
+ * Grayscale records become PGM (or grayscale JPEG) files, and records in the
+ * other compact formats are written out as their raw planes, named after
+ * the format.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <jpeglib.h>
+#include "frame_container.h"
+
+static int write_ppm(const char *path, int number, const struct frame_header *h, const unsigned char *rgb)
+{
+    FILE *out = fopen(path, "wb");
+
+    if (!out)
+        return -1;
+    if (FRAME_FMT_RGB24 == h->format || FRAME_FMT_GRAY == h->format)
+        fprintf(out, "P%c\n#Frame %d\n%u %u\n255\n", FRAME_FMT_GRAY == h->format ? '5' : '6', number,
+                (unsigned)h->width, (unsigned)h->height);
+    if (h->payload_size != fwrite(rgb, 1, h->payload_size, out))
+    {
+        fclose(out);
+        return -1;
+    }
+    return fclose(out);
+}
+
+static int write_jpeg(const char *path, const struct frame_header *h, const unsigned char *rgb, int quality)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    int components = FRAME_FMT_GRAY == h->format ? 1 : 3;
+    FILE *out = fopen(path, "wb");
+
+    if (!out)
+        return -1;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, out);
+    cinfo.image_width = h->width;
+    cinfo.image_height = h->height;
+    cinfo.input_components = components;
+    cinfo.in_color_space = 1 == components ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW row = (JSAMPROW)(rgb + (size_t)cinfo.next_scanline * h->width * components);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return fclose(out);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-j quality] [-f first] [-n count] <container> <out_dir>\n"
+                    "  -j quality   write JPEG of this quality (1-100) instead of PPM\n"
+                    "  -f first     start at this record, counting from 0\n"
+                    "  -n count     extract at most this many records\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct container_entry *entries;
+    size_t count, first = 0, limit = (size_t)-1;
+    unsigned char header_bytes[FRAME_HEADER_SIZE];
+    unsigned char *payload;
+    int quality = 0;
+    int live = 0, history = 0;
+    int opt, fd;
+
+    while (-1 != (opt = getopt(argc, argv, "j:f:n:")))
+    {
+        switch (opt)
+        {
+        case 'j':
+            quality = atoi(optarg);
+            break;
+        case 'f':
+            first = (size_t)strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            limit = (size_t)strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2 || quality < 0 || quality > 100)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || -1 == container_read_index(fd, &entries, &count))
+    {
+        fprintf(stderr, "%s is not a readable frame container\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    payload = malloc(FRAME_MAX_PAYLOAD);
+    if (!payload)
+        return EXIT_FAILURE;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        struct frame_header h;
+        char path[512];
+        const char *extension;
+        int jpeg;
+        int is_history = 0 != (entries[i].flags & FRAME_FLAG_HISTORY);
+        int number = is_history ? ++history : ++live;
+
+        if (i < first)
+            continue;
+        if (i - first >= limit)
+            break;
+        if (FRAME_HEADER_SIZE != pread(fd, header_bytes, FRAME_HEADER_SIZE, (off_t)entries[i].offset) ||
+            -1 == frame_header_unpack(header_bytes, &h) ||
+            h.payload_size > FRAME_MAX_PAYLOAD ||
+            !frame_format_bytes(h.format, h.width, h.height) ||
+            h.payload_size != frame_format_bytes(h.format, h.width, h.height) ||
+            (ssize_t)h.payload_size != pread(fd, payload, h.payload_size,
+                                             (off_t)entries[i].offset + FRAME_HEADER_SIZE))
+        {
+            fprintf(stderr, "Corrupt record %zu at offset %llu\n", i, (unsigned long long)entries[i].offset);
+            return EXIT_FAILURE;
+        }
+
+        /* JPEG only for what libjpeg takes as is */
+        jpeg = quality && (FRAME_FMT_RGB24 == h.format || FRAME_FMT_GRAY == h.format);
+        if (jpeg)
+            extension = "jpg";
+        else if (FRAME_FMT_RGB24 == h.format)
+            extension = "ppm";
+        else if (FRAME_FMT_GRAY == h.format)
+            extension = "pgm";
+        else
+            extension = frame_format_name(h.format);
+        snprintf(path, sizeof(path), "%s/%s%d.%s", argv[optind + 1], is_history ? "history" : "frame",
+                 number, extension);
+        if (-1 == (jpeg ? write_jpeg(path, &h, payload, quality) : write_ppm(path, number, &h, payload)))
+        {
+            fprintf(stderr, "Cannot write %s\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+    printf("Container holds %zu frames\n", count);
+    free(payload);
+    free(entries);
+    close(fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,415 @@
+/**
+ * @file multi_client.c
+ * @brief Receives from several camera servers in one epoll loop.
+ *
+ * Every camera gets a non-blocking connection and a small receive state;
+ * frame payloads go straight into buffers from the writer pool that all
+ * cameras share, so the memory cost of a camera is independent of the
+ * frame size. When the disk is so far behind that no buffer is free, the
+ * frame is read and dropped rather than stalling the other cameras, and
+ * the drop is counted against the camera. With delta frames each camera
+ * keeps its own reference images; a camera whose reference went stale
+ * with a dropped frame asks for a keyframe and skips deltas until it comes.
+ * Frames that fail their checksum are counted per camera and not saved.
+ *
+ * Frames are saved under frames/<host>/ with the usual names, and
+ * per-camera throughput and drop counts are printed periodically.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "multi_client.h"
+#include "writer_pool.h"
+#include "../common/frame_protocol.h"
+#include "../common/frame_crc.h"
+#include "../common/clock_utils.h"
+
+#define DISCARD_CHUNK 65536
+
+struct camera
+{
+    char host[64];
+    char dir[96];
+    int port;
+    int fd;
+    int connected;
+    int done;
+
+    unsigned char header_bytes[FRAME_HEADER_SIZE];
+    size_t header_len;
+    struct frame_header header;
+    struct frame_buffer *frame;     /* NULL while discarding a payload */
+    size_t payload_off;
+
+    struct frame_delta_refs refs;
+
+    int live_seen;
+    int live_number;
+    int history_number;
+
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t dropped;
+    uint64_t corrupted;         /* frames that failed their checksum */
+    uint64_t report_bytes;
+};
+
+static unsigned char discard_buf[DISCARD_CHUNK];
+
+/* Splits "host[:port]" and prepares the camera's output directory */
+static int camera_setup(struct camera *cam, const char *spec)
+{
+    const char *colon = strrchr(spec, ':');
+    size_t host_len = colon ? (size_t)(colon - spec) : strlen(spec);
+
+    memset(cam, 0, sizeof(*cam));
+    cam->fd = -1;
+    if (host_len == 0 || host_len >= sizeof(cam->host))
+        return -1;
+    memcpy(cam->host, spec, host_len);
+    cam->port = colon ? atoi(colon + 1) : FRAME_PORT;
+
+    if (colon)
+        snprintf(cam->dir, sizeof(cam->dir), "frames/%s_%d", cam->host, cam->port);
+    else
+        snprintf(cam->dir, sizeof(cam->dir), "frames/%s", cam->host);
+    if (-1 == mkdir(cam->dir, 0777) && EEXIST != errno)
+    {
+        syslog(LOG_ERR, "Cannot create %s: %s", cam->dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int camera_connect(struct camera *cam, int epfd)
+{
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)cam->port);
+    if (inet_pton(AF_INET, cam->host, &addr.sin_addr) <= 0)
+    {
+        syslog(LOG_ERR, "Invalid address %s", cam->host);
+        return -1;
+    }
+
+    cam->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (cam->fd < 0)
+        return -1;
+    if (-1 == connect(cam->fd, (struct sockaddr *)&addr, sizeof(addr)) && EINPROGRESS != errno)
+    {
+        syslog(LOG_ERR, "Connection to %s:%d failed: %s", cam->host, cam->port, strerror(errno));
+        return -1;
+    }
+
+    /* Writable once the connection is established */
+    ev.events = EPOLLOUT;
+    ev.data.ptr = cam;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, cam->fd, &ev);
+}
+
+static void camera_close(struct camera *cam, int epfd)
+{
+    if (cam->fd >= 0)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, cam->fd, NULL);
+        close(cam->fd);
+        cam->fd = -1;
+    }
+    if (cam->frame)
+    {
+        writer_pool_put(cam->frame);
+        cam->frame = NULL;
+    }
+    frame_delta_free(&cam->refs);
+    cam->done = 1;
+}
+
+/* Finishes the connect and switches the camera over to receiving */
+static int camera_connected(struct camera *cam, int epfd, const struct multi_config *config)
+{
+    struct epoll_event ev;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (-1 == getsockopt(cam->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err)
+    {
+        syslog(LOG_ERR, "Connection to %s:%d failed: %s", cam->host, cam->port, strerror(err));
+        return -1;
+    }
+    cam->connected = 1;
+    printf("%s:%d connected\n", cam->host, cam->port);
+    if (FRAME_FMT_RGB24 != config->format)
+        request_format(cam->fd, config->format);
+    if (config->level)
+        request_level(cam->fd, config->level);
+    if (config->transform)
+        request_transform(cam->fd, config->transform);
+    if (config->roi_count)
+        request_rois(cam->fd, config->rois, config->roi_count);
+    if (config->keyframe_interval)
+        request_delta(cam->fd, config->keyframe_interval, config->delta_threshold);
+    if (config->crc)
+        request_crc(cam->fd);
+    if (config->history_seconds > 0)
+        request_history(cam->fd, config->history_seconds);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = cam;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, cam->fd, &ev);
+}
+
+/* Picks where the payload of the header just received goes */
+static void start_payload(struct camera *cam, const struct multi_config *config)
+{
+    int live = !(cam->header.flags & (FRAME_FLAG_HISTORY | FRAME_FLAG_HISTORY_END));
+    int number;
+
+    cam->payload_off = 0;
+    cam->frame = NULL;
+    if (cam->header.flags & FRAME_FLAG_HISTORY_END)
+        return;
+    if (live)
+    {
+        int startup = cam->live_seen < config->startup_frames;
+
+        if (frame_completes_capture(&cam->header, config->roi_count))
+            cam->live_seen++;
+        if (startup)
+        {
+            frame_delta_lost(&cam->refs, &cam->header);
+            return;
+        }
+        if (!frame_delta_usable(&cam->refs, &cam->header))
+        {
+            request_keyframe(cam->fd, &cam->refs);
+            return;
+        }
+    }
+
+    /* The regions of one capture share its number */
+    number = (live ? cam->live_number : cam->history_number) + 1;
+    if (frame_completes_capture(&cam->header, config->roi_count))
+    {
+        if (live)
+            cam->live_number++;
+        else
+            cam->history_number++;
+    }
+
+    cam->frame = writer_pool_try_get();
+    if (!cam->frame)
+    {
+        frame_delta_lost(&cam->refs, &cam->header);
+        cam->dropped++;
+        return;
+    }
+    cam->frame->header = cam->header;
+    cam->frame->dir = cam->dir;
+    cam->frame->name = frame_file_name(&cam->header, live);
+    cam->frame->number = number;
+}
+
+/*
+ * Hands a completely received payload to the writers, rebuilt into a whole
+ * image first if it is a delta. Returns -1 if the delta does not apply.
+ */
+static int finish_payload(struct camera *cam, const struct multi_config *config, int epfd)
+{
+    cam->header_len = 0;
+    if (!cam->frame)
+        return 0;
+    if (-1 == frame_crc_check(&cam->frame->header, cam->frame->data))
+    {
+        syslog(LOG_ERR, "Frame %u from %s:%d failed its checksum", cam->header.sequence, cam->host, cam->port);
+        frame_delta_lost(&cam->refs, &cam->frame->header);
+        writer_pool_put(cam->frame);
+        cam->frame = NULL;
+        cam->corrupted++;
+        return 0;
+    }
+    if (config->keyframe_interval &&
+        -1 == frame_delta_rebuild(&cam->refs, &cam->frame->header, cam->frame->data, cam->frame->capacity))
+    {
+        syslog(LOG_ERR, "Malformed delta frame from %s:%d", cam->host, cam->port);
+        return -1;
+    }
+    writer_pool_submit(cam->frame);
+    cam->frame = NULL;
+    cam->frames++;
+    if (!(cam->header.flags & FRAME_FLAG_HISTORY) && cam->live_number >= config->requested_frames &&
+        frame_completes_capture(&cam->header, config->roi_count))
+    {
+        printf("%s:%d done\n", cam->host, cam->port);
+        camera_close(cam, epfd);
+    }
+    return 0;
+}
+
+/*
+ * Reads whatever the socket has, possibly across several frames.
+ * Returns -1 if the connection failed or sent garbage.
+ */
+static int camera_receive(struct camera *cam, int epfd, const struct multi_config *config)
+{
+    while (!cam->done)
+    {
+        ssize_t n;
+
+        if (cam->header_len < FRAME_HEADER_SIZE)
+        {
+            n = recv(cam->fd, cam->header_bytes + cam->header_len, FRAME_HEADER_SIZE - cam->header_len, 0);
+        }
+        else if (cam->frame)
+        {
+            n = recv(cam->fd, cam->frame->data + cam->payload_off,
+                     cam->header.payload_size - cam->payload_off, 0);
+        }
+        else
+        {
+            size_t left = cam->header.payload_size - cam->payload_off;
+            n = recv(cam->fd, discard_buf, left < sizeof(discard_buf) ? left : sizeof(discard_buf), 0);
+        }
+
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+            return 0;
+        if (n <= 0)
+        {
+            syslog(LOG_ERR, "%s:%d closed the connection", cam->host, cam->port);
+            return -1;
+        }
+        cam->bytes += (uint64_t)n;
+
+        if (cam->header_len < FRAME_HEADER_SIZE)
+        {
+            cam->header_len += (size_t)n;
+            if (cam->header_len < FRAME_HEADER_SIZE)
+                continue;
+            if (-1 == frame_header_unpack(cam->header_bytes, &cam->header) ||
+                cam->header.payload_size > FRAME_MAX_PAYLOAD + FRAME_CRC_SIZE || !frame_payload_valid(&cam->header))
+            {
+                syslog(LOG_ERR, "Malformed frame header from %s:%d", cam->host, cam->port);
+                return -1;
+            }
+            start_payload(cam, config);
+        }
+        else
+        {
+            cam->payload_off += (size_t)n;
+        }
+        if (cam->header_len == FRAME_HEADER_SIZE && cam->payload_off == cam->header.payload_size &&
+            -1 == finish_payload(cam, config, epfd))
+            return -1;
+    }
+    return 0;
+}
+
+static void print_stats(struct camera *cams, int count, double seconds)
+{
+    for (int i = 0; i < count; i++)
+    {
+        printf("%s:%d frames %llu, %.1f MB/s, dropped %llu, corrupted %llu%s\n", cams[i].host, cams[i].port,
+               (unsigned long long)cams[i].frames,
+               seconds > 0 ? (double)(cams[i].bytes - cams[i].report_bytes) / seconds / 1e6 : 0.0,
+               (unsigned long long)cams[i].dropped, (unsigned long long)cams[i].corrupted,
+               cams[i].done ? " (done)" : "");
+        cams[i].report_bytes = cams[i].bytes;
+    }
+}
+
+/**
+ * @brief   Receive from all given servers until each has delivered the
+ *          requested number of frames or failed.
+ *
+ * @param   servers List of "host[:port]" strings.
+ * @param   count   Number of servers.
+ * @param   config  What to fetch from each server.
+ *
+ * @return  0 if every camera delivered its frames, -1 otherwise.
+ */
+int multi_client_run(char **servers, int count, const struct multi_config *config)
+{
+    struct camera *cams = calloc((size_t)count, sizeof(*cams));
+    struct epoll_event events[64];
+    uint64_t last_report = monotonic_us();
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int active = 0, failed = 0;
+
+    if (!cams || epfd < 0)
+        return -1;
+    mkdir("frames", 0777);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (-1 == camera_setup(&cams[i], servers[i]) || -1 == camera_connect(&cams[i], epfd))
+        {
+            fprintf(stderr, "Cannot connect to %s\n", servers[i]);
+            camera_close(&cams[i], epfd);
+            failed++;
+            continue;
+        }
+        active++;
+    }
+
+    while (active)
+    {
+        int n = epoll_wait(epfd, events, 64, MULTI_STATS_INTERVAL_MS);
+        uint64_t now;
+
+        if (-1 == n && EINTR != errno)
+        {
+            syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            struct camera *cam = events[i].data.ptr;
+            int status;
+
+            if (cam->done)
+                continue;
+            if (!cam->connected)
+                status = camera_connected(cam, epfd, config);
+            else
+                status = camera_receive(cam, epfd, config);
+            if (-1 == status)
+            {
+                camera_close(cam, epfd);
+                failed++;
+            }
+            if (cam->done)
+                active--;
+        }
+
+        now = monotonic_us();
+        if (now - last_report >= (uint64_t)MULTI_STATS_INTERVAL_MS * 1000)
+        {
+            print_stats(cams, count, (double)(now - last_report) / 1e6);
+            last_report = now;
+        }
+    }
+
+    print_stats(cams, count, (double)(monotonic_us() - last_report) / 1e6);
+    close(epfd);
+    free(cams);
+    return failed ? -1 : 0;
+}
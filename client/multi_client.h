@@ -0,0 +1,47 @@
+/**
+ * @file multi_client.h
+ * @brief Receives from several camera servers in one epoll loop.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __MULTI_CLIENT_H__
+#define __MULTI_CLIENT_H__
+
+#include "../common/frame_protocol.h"
+#include "../common/frame_delta.h"
+
+#define MULTI_STATS_INTERVAL_MS 5000
+
+struct multi_config
+{
+    int requested_frames;       /* live frames to save per camera */
+    int startup_frames;         /* live frames to skip first on each camera */
+    double history_seconds;     /* history to request on connect, 0 for none */
+    int format;                 /* enum frame_format to ask for, RGB24 needs no request */
+    int level;                  /* simulcast level to ask for, 0 needs no request */
+    const struct frame_transform *transform;    /* geometry to ask for, NULL for none */
+    const struct frame_roi *rois;               /* regions to ask for */
+    int roi_count;
+    int keyframe_interval;      /* delta frames with a keyframe this often, 0 for whole frames */
+    int delta_threshold;
+    int crc;                    /* ask for frame checksums */
+};
+
+int multi_client_run(char **servers, int count, const struct multi_config *config);
+
+/* Provided by client_sock.c */
+void request_history(int fd, double seconds);
+void request_format(int fd, int format);
+void request_level(int fd, int level);
+void request_delta(int fd, int interval, int threshold);
+void request_keyframe(int fd, struct frame_delta_refs *refs);
+void request_crc(int fd);
+void request_transform(int fd, const struct frame_transform *t);
+void request_rois(int fd, const struct frame_roi *rois, int count);
+const char *frame_file_name(const struct frame_header *header, int live);
+int frame_completes_capture(const struct frame_header *header, int roi_count);
+int frame_payload_valid(const struct frame_header *header);
+
+#endif /* __MULTI_CLIENT_H__ */
@@ -0,0 +1,175 @@
+/**
+ * @file shm_reader.c
+ * @brief Reference consumer of the server's shared-memory frame ring.
+ *
+ * Usage: shm_reader [-s socket] [-n frames] [-d dir]
+ *
+ * Connects to the server's Unix socket, maps the frame ring read-only and
+ * waits on the eventfd for new frames. Each frame is used in place: the
+ * reader computes its mean brightness, and with -d saves it as a PPM, then
+ * checks that the server did not overwrite the slot in the meantime. This
+ * is the pattern a local analytics process should follow.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "../common/frame_protocol.h"
+#include "../common/shm_protocol.h"
+
+/* Receives the ring memfd and the notification eventfd */
+static int receive_fds(int sock, int *ring_fd, int *event_fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union
+    {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    uint32_t magic;
+    int fds[2];
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &magic;
+    iov.iov_len = sizeof(magic);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if ((ssize_t)sizeof(magic) != recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) || SHM_MAGIC != magic)
+        return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || SCM_RIGHTS != cmsg->cmsg_type || CMSG_LEN(sizeof(fds)) != cmsg->cmsg_len)
+        return -1;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    *ring_fd = fds[0];
+    *event_fd = fds[1];
+    return 0;
+}
+
+static void save_ppm(const char *dir, uint64_t sequence, const struct shm_slot_header *slot,
+                     const unsigned char *rgb)
+{
+    char path[512];
+    FILE *out;
+
+    snprintf(path, sizeof(path), "%s/shm%llu.ppm", dir, (unsigned long long)sequence);
+    out = fopen(path, "wb");
+    if (!out)
+        return;
+    fprintf(out, "P6\n#Frame %llu\n%u %u\n255\n", (unsigned long long)sequence, slot->width, slot->height);
+    fwrite(rgb, 1, slot->payload_size, out);
+    fclose(out);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = SHM_DEFAULT_PATH;
+    const char *dir = NULL;
+    long frames = 100;
+    struct sockaddr_un addr;
+    struct stat st;
+    const struct shm_ring_header *ring;
+    unsigned char *base;
+    uint64_t last = 0, used = 0, torn = 0, missed = 0;
+    int sock, ring_fd, event_fd, opt;
+
+    while (-1 != (opt = getopt(argc, argv, "s:n:d:")))
+    {
+        switch (opt)
+        {
+        case 's':
+            path = optarg;
+            break;
+        case 'n':
+            frames = atol(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s socket] [-n frames] [-d dir]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || -1 == connect(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+        -1 == receive_fds(sock, &ring_fd, &event_fd) || -1 == fstat(ring_fd, &st))
+    {
+        fprintf(stderr, "Cannot attach to %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, ring_fd, 0);
+    if (MAP_FAILED == base)
+    {
+        fprintf(stderr, "Cannot map the frame ring: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    ring = (const struct shm_ring_header *)base;
+    if (SHM_MAGIC != ring->magic || SHM_VERSION != ring->version)
+    {
+        fprintf(stderr, "Unexpected frame ring layout\n");
+        return EXIT_FAILURE;
+    }
+
+    while (used < (uint64_t)frames)
+    {
+        const struct shm_slot_header *slot;
+        const unsigned char *rgb;
+        uint64_t count, latest, sequence, sum = 0;
+
+        if ((ssize_t)sizeof(count) != read(event_fd, &count, sizeof(count)))
+            break;
+        latest = atomic_load_explicit((_Atomic uint64_t *)&ring->latest, memory_order_acquire);
+        if (last && latest > last + 1)
+            missed += latest - last - 1;
+        last = latest;
+
+        slot = (const struct shm_slot_header *)(base + SHM_HEADER_SIZE +
+                                                (latest % ring->slot_count) * ring->slot_size);
+        sequence = atomic_load_explicit((_Atomic uint64_t *)&slot->sequence, memory_order_acquire);
+        if (sequence != latest)
+        {
+            torn++;
+            continue;
+        }
+
+        /* Work on the frame where it is */
+        rgb = (const unsigned char *)slot + SHM_PAYLOAD_OFFSET;
+        for (uint32_t i = 0; i < slot->payload_size; i += 3)
+            sum += rgb[i] + rgb[i + 1] + rgb[i + 2];
+        if (dir)
+            save_ppm(dir, sequence, slot, rgb);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (sequence != atomic_load_explicit((_Atomic uint64_t *)&slot->sequence, memory_order_relaxed))
+        {
+            torn++;
+            continue;
+        }
+        used++;
+        if (0 == used % 30)
+            printf("frame %llu mean %.1f\n", (unsigned long long)sequence,
+                   (double)sum / (slot->payload_size ? slot->payload_size : 1));
+    }
+    printf("Used %llu frames, skipped %llu, overwritten while in use %llu\n", (unsigned long long)used,
+           (unsigned long long)missed, (unsigned long long)torn);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,164 @@
+/**
+ * @file stream_out.c
+ * @brief Passes received frame payloads straight to stdout or a named pipe.
+ *
+ * Frames are written back to back with no headers, which is what encoders
+ * reading raw video expect. When the output is a pipe, each payload is
+ * moved from the socket into the pipe with splice() and never passes
+ * through user space. Any other output, such as a regular file, falls
+ * back to receiving into a buffer and writing it out.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "stream_out.h"
+#include "../common/frame_protocol.h"
+
+/* Room for a whole RGB24 frame, so a frame rarely waits on the reader */
+#define STREAM_PIPE_SIZE (1024 * 1024)
+
+static int out_fd = -1;
+static int use_splice;
+static unsigned char *copy_buf;
+
+/**
+ * @brief   Select where the frame stream goes.
+ *
+ * Stdout keeps its original descriptor for the stream; descriptor 1 is then
+ * pointed at stderr so status messages cannot mix with frame data. A named
+ * pipe that does not exist yet is created, and opening it waits for a
+ * reader.
+ *
+ * @param   path    "-" for stdout, otherwise the pipe or file to write.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int stream_out_open(const char *path)
+{
+    struct stat st;
+
+    if (0 == strcmp(path, "-"))
+    {
+        /* Messages still in the stdio buffer get flushed to stderr later */
+        out_fd = dup(STDOUT_FILENO);
+        if (out_fd >= 0)
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    else
+    {
+        if (-1 == mkfifo(path, 0666) && EEXIST != errno)
+        {
+            syslog(LOG_ERR, "Cannot create pipe %s: %s", path, strerror(errno));
+            return -1;
+        }
+        out_fd = open(path, O_WRONLY | O_CLOEXEC);
+    }
+    if (out_fd < 0 || -1 == fstat(out_fd, &st))
+    {
+        syslog(LOG_ERR, "Cannot open stream output %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    use_splice = S_ISFIFO(st.st_mode);
+    if (use_splice)
+    {
+        /* Not fatal, the default pipe size just means more wakeups */
+        fcntl(out_fd, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+        return 0;
+    }
+    copy_buf = malloc(FRAME_MAX_PAYLOAD);
+    return copy_buf ? 0 : -1;
+}
+
+/**
+ * @brief   Tells whether payloads bypass user space.
+ *
+ * @return  Non-zero if splice() is used.
+ */
+int stream_out_spliced(void)
+{
+    return use_splice;
+}
+
+/* Copies len bytes from the socket to the output through copy_buf */
+static int copy_payload(int sock_fd, size_t len, int discard)
+{
+    while (len)
+    {
+        size_t chunk = len < FRAME_MAX_PAYLOAD ? len : FRAME_MAX_PAYLOAD;
+        size_t got = 0;
+
+        while (got < chunk)
+        {
+            ssize_t n = recv(sock_fd, copy_buf + got, chunk - got, 0);
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n <= 0)
+                return -1;
+            got += (size_t)n;
+        }
+        for (size_t done = 0; !discard && done < chunk;)
+        {
+            ssize_t n = write(out_fd, copy_buf + done, chunk - done);
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n <= 0)
+                return -1;
+            done += (size_t)n;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Move one frame payload from the socket to the output.
+ *
+ * @param   sock_fd Connected socket positioned at the start of a payload.
+ * @param   len     Payload size in bytes.
+ *
+ * @return  0 on success, -1 if the socket or the output failed. A reader
+ *          closing the pipe shows up as EPIPE.
+ */
+int stream_out_payload(int sock_fd, size_t len)
+{
+    if (!use_splice)
+        return copy_payload(sock_fd, len, 0);
+
+    while (len)
+    {
+        ssize_t n = splice(sock_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return -1;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Read and drop a payload that should not reach the output.
+ *
+ * @param   sock_fd Connected socket positioned at the start of a payload.
+ * @param   len     Payload size in bytes.
+ *
+ * @return  0 on success, -1 if the socket failed.
+ */
+int stream_out_discard(int sock_fd, size_t len)
+{
+    if (!copy_buf && !(copy_buf = malloc(FRAME_MAX_PAYLOAD)))
+        return -1;
+    return copy_payload(sock_fd, len, 1);
+}
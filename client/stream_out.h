@@ -0,0 +1,19 @@
+/**
+ * @file stream_out.h
+ * @brief Passes received frame payloads straight to stdout or a named pipe.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __STREAM_OUT_H__
+#define __STREAM_OUT_H__
+
+#include <stddef.h>
+
+int stream_out_open(const char *path);
+int stream_out_payload(int sock_fd, size_t len);
+int stream_out_discard(int sock_fd, size_t len);
+int stream_out_spliced(void);
+
+#endif /* __STREAM_OUT_H__ */
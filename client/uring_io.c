@@ -0,0 +1,309 @@
+/**
+ * @file uring_io.c
+ * @brief Receiving frames and writing them to disk through one io_uring,
+ *        in place of recv() loops and writer threads.
+ *
+ * Each header and each payload is received with a single RECV and
+ * MSG_WAITALL, so the kernel fills the whole buffer before the client
+ * hears back, however many segments it arrives in. A received frame is
+ * saved by a linked chain on the same ring: open straight into a slot of
+ * the registered file table, write, close. Buffers keep room in front of
+ * the frame for its PPM header, so header and frame go out in one write
+ * from the registered buffer. The chain is not submitted on its own; it
+ * goes to the kernel with the next receive, in the same io_uring_enter(),
+ * and runs while the next frame arrives. Only the close posts a
+ * completion, or whichever entry failed and cancelled the rest, so a saved
+ * frame wakes the receive loop at most once. Its buffer comes back then,
+ * so as with the writer threads receiving only waits when every buffer is
+ * still being written.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include "uring_io.h"
+#include "../common/uring.h"
+
+#define PATH_SIZE 160
+#define HEADER_SIZE 100             /* room for the file header in front of a frame */
+#define CHAIN_LENGTH 3              /* open, write, close */
+
+enum uring_io_op
+{
+    OP_RECV,
+    OP_OPEN,
+    OP_WRITE,
+    OP_CLOSE
+};
+
+/* A frame buffer and what its chain needs to stay valid until it completes */
+struct save_slot
+{
+    struct frame_buffer frame;  /* first, so a frame_buffer pointer is its slot */
+    unsigned char *base;        /* the buffer, HEADER_SIZE bytes before frame.data */
+    char path[PATH_SIZE];
+    int saving;                 /* its chain has not finished */
+    uint8_t generation;         /* tells its chain's completions from an earlier one's */
+};
+
+static struct uring ring;
+static struct save_slot *slots;
+static int *free_list;
+static int slot_count, free_count;
+static int fixed_buffers;       /* data is written with WRITE_FIXED */
+static frame_file_fn describe_frame;
+static int recv_done, recv_result;
+
+/**
+ * @brief   Set up the ring, the frame buffers and the file table.
+ *
+ * @param   buffers     Number of frame buffers, one being received and the
+ *                      rest being written.
+ * @param   buffer_size Size of each buffer in bytes.
+ * @param   describe    Names the file of each frame saved.
+ *
+ * @return  0 on success, -1 if io_uring or what it needs is not available,
+ *          in which case nothing is left allocated.
+ */
+int uring_io_start(int buffers, size_t buffer_size, frame_file_fn describe)
+{
+    struct iovec *iov;
+    int *files;
+
+    /* Only this thread uses the ring, so completions can wait until it asks for them (6.1) */
+    if (buffers < 2 || -1 == uring_init(&ring, (unsigned int)buffers * CHAIN_LENGTH + 2,
+                                        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN))
+        return -1;
+    if (!(ring.features & IORING_FEAT_CQE_SKIP))
+    {
+        syslog(LOG_ERR, "io_uring cannot skip completions before Linux 5.17");
+        uring_exit(&ring);
+        return -1;
+    }
+    slots = calloc((size_t)buffers, sizeof(*slots));
+    free_list = calloc((size_t)buffers, sizeof(*free_list));
+    iov = calloc((size_t)buffers, sizeof(*iov));
+    files = malloc((size_t)buffers * sizeof(*files));
+    if (!slots || !free_list || !iov || !files)
+    {
+        syslog(LOG_ERR, "Out of memory for io_uring frame buffers");
+        goto fail;
+    }
+    for (slot_count = 0; slot_count < buffers; slot_count++)
+    {
+        struct save_slot *s = &slots[slot_count];
+
+        if (!(s->base = malloc(HEADER_SIZE + buffer_size)))
+        {
+            syslog(LOG_ERR, "Out of memory for frame buffer %d", slot_count);
+            goto fail;
+        }
+        s->frame.data = s->base + HEADER_SIZE;
+        s->frame.capacity = buffer_size;
+        iov[slot_count].iov_base = s->base;
+        iov[slot_count].iov_len = HEADER_SIZE + buffer_size;
+        files[slot_count] = -1;
+        free_list[free_count++] = slot_count;
+    }
+    /* Files are opened into the table, so a chain can name one before it exists (5.15) */
+    if (-1 == uring_register_files(&ring, files, (unsigned int)buffers))
+    {
+        syslog(LOG_ERR, "io_uring file table could not be registered: %s", strerror(errno));
+        goto fail;
+    }
+    fixed_buffers = 0 == uring_register_buffers(&ring, iov, (unsigned int)buffers);
+    if (!fixed_buffers)
+        syslog(LOG_INFO, "Frames are written from unregistered buffers: %s", strerror(errno));
+    describe_frame = describe;
+    free(iov);
+    free(files);
+    return 0;
+
+fail:
+    for (int i = 0; slots && i < slot_count; i++)
+        free(slots[i].base);
+    free(slots);
+    free(free_list);
+    free(iov);
+    free(files);
+    slots = NULL;
+    free_list = NULL;
+    slot_count = free_count = 0;
+    uring_exit(&ring);
+    return -1;
+}
+
+/* Acts on every completion posted so far */
+static void reap(void)
+{
+    struct io_uring_cqe cqe;
+
+    while (0 == uring_peek(&ring, &cqe))
+    {
+        unsigned int op = (unsigned int)(cqe.user_data & 0xff);
+        int index = (int)((cqe.user_data >> 8) & 0xffffff);
+        struct save_slot *s;
+
+        if (OP_RECV == op)
+        {
+            recv_done = 1;
+            recv_result = cqe.res;
+            continue;
+        }
+        s = &slots[index];
+        if (!s->saving || (uint8_t)(cqe.user_data >> 32) != s->generation)
+            continue;
+        /* Successes other than the close post nothing, a short write counts as failed */
+        if (OP_CLOSE != op || cqe.res < 0)
+            syslog(LOG_ERR, "Failed to write %s: %s", s->path, strerror(cqe.res < 0 ? -cqe.res : EIO));
+        s->saving = 0;
+        free_list[free_count++] = index;
+    }
+}
+
+/**
+ * @brief   Take a free buffer to receive into, waiting for a chain to
+ *          finish if all are being written.
+ *
+ * @return  A free buffer.
+ */
+struct frame_buffer *uring_io_get(void)
+{
+    reap();
+    while (!free_count)
+    {
+        if (-1 == uring_submit(&ring, 1))
+            syslog(LOG_ERR, "Failed to wait for frame writes: %s", strerror(errno));
+        reap();
+    }
+    return &slots[free_list[--free_count]].frame;
+}
+
+/**
+ * @brief   Queue a filled buffer to be saved; it goes to the kernel with the
+ *          next receive or uring_io_stop().
+ *
+ * @param   frame   Buffer obtained from uring_io_get(), with its header,
+ *                  name and number set.
+ *
+ * @return  This function does not return a value.
+ */
+void uring_io_submit(struct frame_buffer *frame)
+{
+    struct save_slot *s = (struct save_slot *)frame;
+    unsigned int index = (unsigned int)(s - slots);
+    uint64_t tag = (uint64_t)++s->generation << 32 | (uint64_t)index << 8;
+    char header[HEADER_SIZE];
+    size_t header_len = describe_frame(frame, s->path, sizeof(s->path), header, sizeof(header));
+    struct io_uring_sqe *sqe;
+
+    memcpy(frame->data - header_len, header, header_len);
+    s->saving = 1;
+
+    /* The ring has room for a chain per buffer, none of these can fail */
+    sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)s->path;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = 0666;
+    sqe->file_index = index + 1;
+    sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = tag | OP_OPEN;
+
+    sqe = uring_get_sqe(&ring);
+    sqe->opcode = fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = (int)index;
+    sqe->addr = (uint64_t)(uintptr_t)(frame->data - header_len);
+    sqe->len = (uint32_t)(header_len + frame->header.payload_size);
+    sqe->buf_index = (uint16_t)index;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = tag | OP_WRITE;
+
+    sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = index + 1;
+    sqe->user_data = tag | OP_CLOSE;
+}
+
+/**
+ * @brief   Return a buffer without saving it.
+ *
+ * @param   frame   Buffer obtained from uring_io_get().
+ *
+ * @return  This function does not return a value.
+ */
+void uring_io_put(struct frame_buffer *frame)
+{
+    free_list[free_count++] = (int)((struct save_slot *)frame - slots);
+}
+
+/**
+ * @brief   Receive exactly len bytes, submitting the queued writes with the
+ *          receive.
+ *
+ * @param   fd      Connected socket.
+ * @param   buf     Where the bytes go.
+ * @param   len     Number of bytes.
+ *
+ * @return  0 on success, -1 on error or EOF.
+ */
+int uring_io_recv(int fd, unsigned char *buf, size_t len)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!len)
+        return 0;
+    sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->user_data = OP_RECV;
+
+    recv_done = 0;
+    while (!recv_done)
+    {
+        if (-1 == uring_submit(&ring, 1))
+            return -1;
+        reap();
+    }
+    return recv_result == (int)len ? 0 : -1;
+}
+
+/**
+ * @brief   Wait for every queued frame to be written and release the ring.
+ *
+ * @return  Number of io_uring_enter() calls made since uring_io_start().
+ */
+unsigned long uring_io_stop(void)
+{
+    unsigned long enters;
+
+    reap();
+    while (free_count < slot_count)
+    {
+        if (-1 == uring_submit(&ring, 1))
+            break;
+        reap();
+    }
+    enters = ring.enters;
+    uring_exit(&ring);
+    for (int i = 0; i < slot_count; i++)
+        free(slots[i].base);
+    free(slots);
+    free(free_list);
+    slots = NULL;
+    free_list = NULL;
+    slot_count = free_count = 0;
+    return enters;
+}
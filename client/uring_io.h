@@ -0,0 +1,30 @@
+/**
+ * @file uring_io.h
+ * @brief Receiving frames and writing them to disk through one io_uring,
+ *        in place of recv() loops and writer threads.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __URING_IO_H__
+#define __URING_IO_H__
+
+#include <stddef.h>
+#include "writer_pool.h"
+
+/*
+ * Fills in the path a frame is saved to and the header that goes before
+ * its data, returns the header's length
+ */
+typedef size_t (*frame_file_fn)(const struct frame_buffer *frame, char *path, size_t path_size,
+                                char *header, size_t header_size);
+
+int uring_io_start(int buffers, size_t buffer_size, frame_file_fn describe);
+struct frame_buffer *uring_io_get(void);
+void uring_io_submit(struct frame_buffer *frame);
+void uring_io_put(struct frame_buffer *frame);
+int uring_io_recv(int fd, unsigned char *buf, size_t len);
+unsigned long uring_io_stop(void);
+
+#endif /* __URING_IO_H__ */
@@ -0,0 +1,195 @@
+/**
+ * @file writer_pool.c
+ * @brief Preallocated frame buffers handed from the receive loop to a pool
+ *        of disk writer threads.
+ *
+ * All buffers are allocated up front and cycle between a free list and a
+ * bounded FIFO of filled frames. The receive loop takes a free buffer,
+ * fills it from the socket and queues it; writer threads take queued
+ * frames, persist them and return the buffers. Receiving only waits when
+ * every buffer is queued or being written, so the socket keeps draining
+ * while the disk catches up on a burst.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "writer_pool.h"
+
+static struct frame_buffer *buffers;
+static struct frame_buffer **free_list;
+static struct frame_buffer **queue;
+static int buffer_count, free_count;
+static int queue_head, queue_len;
+static int stopping;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frame_free = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t frame_queued = PTHREAD_COND_INITIALIZER;
+static pthread_t *threads;
+static int thread_count;
+static frame_writer_fn writer;
+
+static void *writer_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    for (;;)
+    {
+        struct frame_buffer *frame;
+
+        while (!queue_len && !stopping)
+            pthread_cond_wait(&frame_queued, &lock);
+        /* Whatever is queued is written before the pool stops */
+        if (!queue_len)
+            break;
+        frame = queue[queue_head];
+        queue_head = (queue_head + 1) % buffer_count;
+        queue_len--;
+        pthread_mutex_unlock(&lock);
+
+        writer(frame);
+
+        pthread_mutex_lock(&lock);
+        free_list[free_count++] = frame;
+        pthread_cond_signal(&frame_free);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * @brief   Allocate the frame buffers and start the writer threads.
+ *
+ * @param   writers     Number of writer threads.
+ * @param   count       Number of frame buffers, at least one per writer
+ *                      plus one being received.
+ * @param   buffer_size Size of each buffer in bytes.
+ * @param   write_frame Called on a writer thread for every queued frame.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int writer_pool_start(int writers, int count, size_t buffer_size, frame_writer_fn write_frame)
+{
+    if (writers < 1 || count < writers + 1)
+        return -1;
+
+    buffers = calloc((size_t)count, sizeof(*buffers));
+    free_list = calloc((size_t)count, sizeof(*free_list));
+    queue = calloc((size_t)count, sizeof(*queue));
+    threads = calloc((size_t)writers, sizeof(*threads));
+    if (!buffers || !free_list || !queue || !threads)
+    {
+        syslog(LOG_ERR, "Out of memory for the writer pool");
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        buffers[i].data = malloc(buffer_size);
+        if (!buffers[i].data)
+        {
+            syslog(LOG_ERR, "Out of memory for frame buffer %d", i);
+            return -1;
+        }
+        buffers[i].capacity = buffer_size;
+        free_list[free_count++] = &buffers[i];
+    }
+    buffer_count = count;
+    writer = write_frame;
+
+    for (; thread_count < writers; thread_count++)
+    {
+        if (0 != pthread_create(&threads[thread_count], NULL, writer_thread, NULL))
+        {
+            syslog(LOG_ERR, "Failed to start writer thread %d", thread_count);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief   Take a free buffer to receive into, waiting for a writer to
+ *          return one if all are in use.
+ *
+ * @return  A free buffer.
+ */
+struct frame_buffer *writer_pool_get(void)
+{
+    struct frame_buffer *frame;
+
+    pthread_mutex_lock(&lock);
+    while (!free_count)
+        pthread_cond_wait(&frame_free, &lock);
+    frame = free_list[--free_count];
+    pthread_mutex_unlock(&lock);
+    return frame;
+}
+
+/**
+ * @brief   Take a free buffer to receive into without waiting.
+ *
+ * @return  A free buffer, or NULL if all are queued or being written.
+ */
+struct frame_buffer *writer_pool_try_get(void)
+{
+    struct frame_buffer *frame = NULL;
+
+    pthread_mutex_lock(&lock);
+    if (free_count)
+        frame = free_list[--free_count];
+    pthread_mutex_unlock(&lock);
+    return frame;
+}
+
+/**
+ * @brief   Queue a filled buffer for writing.
+ *
+ * @param   frame   Buffer obtained from writer_pool_get().
+ *
+ * @return  This function does not return a value.
+ */
+void writer_pool_submit(struct frame_buffer *frame)
+{
+    pthread_mutex_lock(&lock);
+    queue[(queue_head + queue_len) % buffer_count] = frame;
+    queue_len++;
+    pthread_cond_signal(&frame_queued);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief   Return a buffer that turned out not to need writing.
+ *
+ * @param   frame   Buffer obtained from writer_pool_get().
+ *
+ * @return  This function does not return a value.
+ */
+void writer_pool_put(struct frame_buffer *frame)
+{
+    pthread_mutex_lock(&lock);
+    free_list[free_count++] = frame;
+    pthread_cond_signal(&frame_free);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief   Write out every queued frame and stop the writer threads.
+ *
+ * @return  This function does not return a value.
+ */
+void writer_pool_stop(void)
+{
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&frame_queued);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+    thread_count = 0;
+}
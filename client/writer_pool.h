@@ -0,0 +1,35 @@
+/**
+ * @file writer_pool.h
+ * @brief Preallocated frame buffers handed from the receive loop to a pool
+ *        of disk writer threads.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __WRITER_POOL_H__
+#define __WRITER_POOL_H__
+
+#include <stddef.h>
+#include "../common/frame_protocol.h"
+
+struct frame_buffer
+{
+    unsigned char *data;
+    size_t capacity;
+    struct frame_header header;
+    const char *dir;            /* output directory, NULL for frames/ */
+    const char *name;           /* file name prefix, e.g. "frame" or "history" */
+    int number;                 /* frame number within that prefix */
+};
+
+typedef void (*frame_writer_fn)(const struct frame_buffer *frame);
+
+int writer_pool_start(int writers, int buffers, size_t buffer_size, frame_writer_fn write_frame);
+struct frame_buffer *writer_pool_get(void);
+struct frame_buffer *writer_pool_try_get(void);
+void writer_pool_submit(struct frame_buffer *frame);
+void writer_pool_put(struct frame_buffer *frame);
+void writer_pool_stop(void);
+
+#endif /* __WRITER_POOL_H__ */
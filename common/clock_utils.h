@@ -0,0 +1,27 @@
+/**
+ * @file clock_utils.h
+ * @brief Monotonic time helpers shared by the server and the client.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __CLOCK_UTILS_H__
+#define __CLOCK_UTILS_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief   Returns the current CLOCK_MONOTONIC time in microseconds.
+ *
+ * @return  Microseconds since an unspecified fixed point in the past.
+ */
+static inline uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+#endif /* __CLOCK_UTILS_H__ */
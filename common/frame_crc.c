@@ -0,0 +1,341 @@
+/**
+ * @file frame_crc.c
+ * @brief CRC32C of frames, with the CPU's CRC instructions where it has them.
+ *
+ * The SSE4.2 crc32 instruction and the ARMv8 CRC32C instructions take 8
+ * bytes at a time but several cycles each, so long buffers are cut into
+ * three streams that run interleaved and are then merged with the tables
+ * that shift a CRC over a run of zero bytes (the method of Mark Adler's
+ * crc32c.c). Whether the CPU has the instructions is asked once at run
+ * time, so one build serves every machine; without them a slicing-by-8
+ * table version is used. At VGA sizes the hardware version costs a small
+ * fraction of what sending the frame does.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <pthread.h>
+#include "frame_crc.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_ARM
+#endif
+
+#define POLY 0x82f63b78u        /* CRC-32C, reflected */
+#define LONG_BLOCK 8192         /* bytes per stream of the interleaved loops */
+#define SHORT_BLOCK 256
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static uint32_t (*update)(uint32_t crc, const unsigned char *p, size_t len);
+static const char *implementation;
+static uint32_t table[8][256];
+
+/* Slicing-by-8, for CPUs without CRC instructions */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len && ((uintptr_t)p & 7))
+    {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        crc ^= (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        crc = table[7][crc & 0xff] ^ table[6][(crc >> 8) & 0xff] ^ table[5][(crc >> 16) & 0xff] ^
+              table[4][crc >> 24] ^ table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+    }
+    while (len--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+static uint32_t long_shift[4][256], short_shift[4][256];
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* The operator that appends len zero bytes to a CRC, len a power of two */
+static void zeros_operator(uint32_t *even, size_t len)
+{
+    uint32_t odd[32];
+    uint32_t row = 1;
+
+    odd[0] = POLY;              /* one zero bit */
+    for (int n = 1; n < 32; n++, row <<= 1)
+        odd[n] = row;
+    gf2_matrix_square(even, odd);   /* two */
+    gf2_matrix_square(odd, even);   /* four */
+    /* Each square doubles, the first one makes a whole byte */
+    for (;;)
+    {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (!len)
+            return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+        if (!len)
+            break;
+    }
+    memcpy(even, odd, sizeof(odd));
+}
+
+static void make_shift_table(uint32_t shift[4][256], size_t len)
+{
+    uint32_t op[32];
+
+    zeros_operator(op, len);
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        shift[0][n] = gf2_matrix_times(op, n);
+        shift[1][n] = gf2_matrix_times(op, n << 8);
+        shift[2][n] = gf2_matrix_times(op, n << 16);
+        shift[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static inline uint32_t shift_crc(uint32_t shift[4][256], uint32_t crc)
+{
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^ shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+static inline uint64_t load64(const unsigned char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+#endif
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c0 = crc, c1, c2;
+
+    while (len && ((uintptr_t)p & 7))
+    {
+        c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+        len--;
+    }
+    for (; len >= 3 * LONG_BLOCK; len -= 3 * LONG_BLOCK, p += 3 * LONG_BLOCK)
+    {
+        const unsigned char *end = p + LONG_BLOCK;
+
+        for (c1 = c2 = 0; p < end; p += 8)
+        {
+            c0 = _mm_crc32_u64(c0, load64(p));
+            c1 = _mm_crc32_u64(c1, load64(p + LONG_BLOCK));
+            c2 = _mm_crc32_u64(c2, load64(p + 2 * LONG_BLOCK));
+        }
+        p -= LONG_BLOCK;
+        c0 = shift_crc(long_shift, (uint32_t)c0) ^ (uint32_t)c1;
+        c0 = shift_crc(long_shift, (uint32_t)c0) ^ (uint32_t)c2;
+    }
+    for (; len >= 3 * SHORT_BLOCK; len -= 3 * SHORT_BLOCK, p += 3 * SHORT_BLOCK)
+    {
+        const unsigned char *end = p + SHORT_BLOCK;
+
+        for (c1 = c2 = 0; p < end; p += 8)
+        {
+            c0 = _mm_crc32_u64(c0, load64(p));
+            c1 = _mm_crc32_u64(c1, load64(p + SHORT_BLOCK));
+            c2 = _mm_crc32_u64(c2, load64(p + 2 * SHORT_BLOCK));
+        }
+        p -= SHORT_BLOCK;
+        c0 = shift_crc(short_shift, (uint32_t)c0) ^ (uint32_t)c1;
+        c0 = shift_crc(short_shift, (uint32_t)c0) ^ (uint32_t)c2;
+    }
+    for (; len >= 8; len -= 8, p += 8)
+        c0 = _mm_crc32_u64(c0, load64(p));
+    while (len--)
+        c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+    return (uint32_t)c0;
+}
+#endif
+
+#ifdef CRC32C_ARM
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint32_t c0 = crc, c1, c2;
+
+    while (len && ((uintptr_t)p & 7))
+    {
+        c0 = __crc32cb(c0, *p++);
+        len--;
+    }
+    for (; len >= 3 * LONG_BLOCK; len -= 3 * LONG_BLOCK, p += 3 * LONG_BLOCK)
+    {
+        const unsigned char *end = p + LONG_BLOCK;
+
+        for (c1 = c2 = 0; p < end; p += 8)
+        {
+            c0 = __crc32cd(c0, load64(p));
+            c1 = __crc32cd(c1, load64(p + LONG_BLOCK));
+            c2 = __crc32cd(c2, load64(p + 2 * LONG_BLOCK));
+        }
+        p -= LONG_BLOCK;
+        c0 = shift_crc(long_shift, c0) ^ c1;
+        c0 = shift_crc(long_shift, c0) ^ c2;
+    }
+    for (; len >= 3 * SHORT_BLOCK; len -= 3 * SHORT_BLOCK, p += 3 * SHORT_BLOCK)
+    {
+        const unsigned char *end = p + SHORT_BLOCK;
+
+        for (c1 = c2 = 0; p < end; p += 8)
+        {
+            c0 = __crc32cd(c0, load64(p));
+            c1 = __crc32cd(c1, load64(p + SHORT_BLOCK));
+            c2 = __crc32cd(c2, load64(p + 2 * SHORT_BLOCK));
+        }
+        p -= SHORT_BLOCK;
+        c0 = shift_crc(short_shift, c0) ^ c1;
+        c0 = shift_crc(short_shift, c0) ^ c2;
+    }
+    for (; len >= 8; len -= 8, p += 8)
+        c0 = __crc32cd(c0, load64(p));
+    while (len--)
+        c0 = __crc32cb(c0, *p++);
+    return c0;
+}
+#endif
+
+/* Builds the tables and picks the fastest version the CPU runs */
+static void crc32c_init(void)
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = n;
+
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+        table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int k = 1; k < 8; k++)
+            table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];
+    update = crc32c_sw;
+    implementation = "software";
+
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+    make_shift_table(long_shift, LONG_BLOCK);
+    make_shift_table(short_shift, SHORT_BLOCK);
+#endif
+#ifdef CRC32C_X86
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        update = crc32c_sse42;
+        implementation = "sse4.2";
+    }
+#endif
+#ifdef CRC32C_ARM
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+    {
+        update = crc32c_armv8;
+        implementation = "armv8";
+    }
+#endif
+}
+
+/**
+ * @brief   Extend a CRC32C over more data.
+ *
+ * @param   crc     0 to start, or what an earlier call returned.
+ * @param   data    Bytes to add.
+ * @param   len     Number of bytes.
+ *
+ * @return  The CRC32C of everything so far.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&once, crc32c_init);
+    return ~update(~crc, data, len);
+}
+
+/**
+ * @brief   Tells which version crc32c() runs on this CPU.
+ *
+ * @return  "sse4.2", "armv8" or "software".
+ */
+const char *crc32c_implementation(void)
+{
+    pthread_once(&once, crc32c_init);
+    return implementation;
+}
+
+/* The CRC a frame with FRAME_FLAG_CRC carries, trailer excluded */
+static uint32_t frame_crc(const struct frame_header *h, const unsigned char *payload)
+{
+    unsigned char packed[FRAME_HEADER_SIZE];
+
+    frame_header_pack(h, packed);
+    return crc32c(crc32c(0, packed, sizeof(packed)), payload, h->payload_size - FRAME_CRC_SIZE);
+}
+
+/**
+ * @brief   Append the CRC to a frame about to be sent.
+ *
+ * Sets FRAME_FLAG_CRC and grows payload_size by FRAME_CRC_SIZE; the header
+ * must be packed after this call.
+ *
+ * @param   h       Header of the frame, complete but for the CRC.
+ * @param   payload The payload, with FRAME_CRC_SIZE bytes of room after it.
+ *
+ * @return  This function does not return a value.
+ */
+void frame_crc_seal(struct frame_header *h, unsigned char *payload)
+{
+    h->flags |= FRAME_FLAG_CRC;
+    h->payload_size += FRAME_CRC_SIZE;
+    put_be32(payload + h->payload_size - FRAME_CRC_SIZE, frame_crc(h, payload));
+}
+
+/**
+ * @brief   Verify a received frame and strip its CRC.
+ *
+ * Frames without FRAME_FLAG_CRC pass unchanged. Otherwise the flag and
+ * the trailing CRC are removed from the header, whether or not it matched,
+ * so the header describes the image alone.
+ *
+ * @param   h       Header as received.
+ * @param   payload The payload as received.
+ *
+ * @return  0 if the frame is intact or carries no CRC, -1 on a mismatch.
+ */
+int frame_crc_check(struct frame_header *h, const unsigned char *payload)
+{
+    int status;
+
+    if (!(h->flags & FRAME_FLAG_CRC))
+        return 0;
+    if (h->payload_size < FRAME_CRC_SIZE)
+        return -1;
+    status = frame_crc(h, payload) == get_be32(payload + h->payload_size - FRAME_CRC_SIZE) ? 0 : -1;
+    h->flags &= (uint16_t)~FRAME_FLAG_CRC;
+    h->payload_size -= FRAME_CRC_SIZE;
+    return status;
+}
@@ -0,0 +1,27 @@
+/**
+ * @file frame_crc.h
+ * @brief CRC32C of frames, with the CPU's CRC instructions where it has them.
+ *
+ * A frame with FRAME_FLAG_CRC carries, as the last FRAME_CRC_SIZE bytes of
+ * its payload, the CRC32C (Castagnoli) of its packed header followed by the
+ * rest of the payload, big endian. payload_size counts those bytes, so a
+ * receiver reads the frame exactly as it would without them.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __FRAME_CRC_H__
+#define __FRAME_CRC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "frame_protocol.h"
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+const char *crc32c_implementation(void);
+
+void frame_crc_seal(struct frame_header *h, unsigned char *payload);
+int frame_crc_check(struct frame_header *h, const unsigned char *payload);
+
+#endif /* __FRAME_CRC_H__ */
@@ -0,0 +1,358 @@
+/**
+ * @file frame_delta.c
+ * @brief Tile delta frames: encoding on the server, rebuilding on clients.
+ *
+ * The server keeps, per client and image, a copy of what that client last
+ * received and compares each tile of a new frame with it by the sum of
+ * absolute differences of its samples, 16 at a time with SSE2 where
+ * available. Tiles within the threshold are left out, so the client's image
+ * may lag the scene by at most the threshold per sample until that tile
+ * changes for real or the next keyframe. Comparing with what the client
+ * has, rather than with the previous capture, keeps slow drifts from ever
+ * accumulating unseen.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "frame_delta.h"
+
+struct plane
+{
+    size_t offset;              /* from the start of the image */
+    unsigned int width, height; /* in samples */
+    unsigned int bytes;         /* per sample */
+    unsigned int shift;         /* chroma subsampling, in each direction */
+};
+
+/* Where one tile lies in one plane */
+struct span
+{
+    size_t start;
+    size_t stride;
+    size_t len;                 /* bytes per row */
+    unsigned int rows;
+};
+
+/* Describes the planes of a format, returns how many there are */
+static int format_planes(unsigned int format, unsigned int width, unsigned int height, struct plane p[3])
+{
+    unsigned int cw = (width + 1) / 2, ch = (height + 1) / 2;
+    size_t luma = (size_t)width * height;
+
+    p[0].offset = 0;
+    p[0].width = width;
+    p[0].height = height;
+    p[0].shift = 0;
+    switch (format)
+    {
+    case FRAME_FMT_RGB24:
+        p[0].bytes = 3;
+        return 1;
+    case FRAME_FMT_RGB565:
+        p[0].bytes = 2;
+        return 1;
+    case FRAME_FMT_GRAY:
+        p[0].bytes = 1;
+        return 1;
+    case FRAME_FMT_NV12:
+        p[0].bytes = 1;
+        p[1] = (struct plane){ luma, cw, ch, 2, 1 };
+        return 2;
+    case FRAME_FMT_I420:
+        p[0].bytes = 1;
+        p[1] = (struct plane){ luma, cw, ch, 1, 1 };
+        p[2] = (struct plane){ luma + (size_t)cw * ch, cw, ch, 1, 1 };
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+static void tile_span(const struct plane *p, unsigned int tx, unsigned int ty, struct span *s)
+{
+    unsigned int x0 = (tx * FRAME_TILE_SIZE) >> p->shift, y0 = (ty * FRAME_TILE_SIZE) >> p->shift;
+    unsigned int x1 = ((tx + 1) * FRAME_TILE_SIZE) >> p->shift, y1 = ((ty + 1) * FRAME_TILE_SIZE) >> p->shift;
+
+    if (x1 > p->width)
+        x1 = p->width;
+    if (y1 > p->height)
+        y1 = p->height;
+    s->stride = (size_t)p->width * p->bytes;
+    s->start = p->offset + y0 * s->stride + (size_t)x0 * p->bytes;
+    s->len = (size_t)(x1 - x0) * p->bytes;
+    s->rows = y1 - y0;
+}
+
+/* Sum of absolute differences of two rows of samples */
+static uint32_t row_sad(const unsigned char *a, const unsigned char *b, size_t len)
+{
+    uint32_t sum = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+
+    for (; i + 16 <= len; i += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                              _mm_loadu_si128((const __m128i *)(b + i))));
+    sum = (uint32_t)_mm_cvtsi128_si32(acc) + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for (; i < len; i++)
+        sum += (uint32_t)abs(a[i] - b[i]);
+    return sum;
+}
+
+/**
+ * @brief   Size of the tile bitmap a delta payload starts with.
+ *
+ * @param   width   Image width in pixels.
+ * @param   height  Image height in pixels.
+ *
+ * @return  Size in bytes.
+ */
+uint32_t frame_delta_bitmap_bytes(unsigned int width, unsigned int height)
+{
+    uint32_t tiles = ((width + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE) *
+                     ((height + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE);
+
+    return (tiles + 7) / 8;
+}
+
+/**
+ * @brief   Encode the tiles of an image that differ from a reference.
+ *
+ * The changed tiles are copied into the reference as well, so it keeps
+ * matching what the receiver rebuilds.
+ *
+ * @param   format      enum frame_format of both images.
+ * @param   width       Image width in pixels.
+ * @param   height      Image height in pixels.
+ * @param   image       The new image.
+ * @param   ref         What the receiver has; updated.
+ * @param   threshold   Mean absolute difference per sample a tile may have
+ *                      and still be left out.
+ * @param   dst         Destination, room for frame_format_bytes().
+ *
+ * @return  Size of the delta payload, or 0 if it would not be smaller than
+ *          the image; the reference is then partly updated and the caller
+ *          sends the whole image instead and copies it into the reference.
+ */
+size_t frame_delta_encode(unsigned int format, unsigned int width, unsigned int height,
+                          const unsigned char *image, unsigned char *ref, unsigned int threshold,
+                          unsigned char *dst)
+{
+    struct plane planes[3];
+    int count = format_planes(format, width, height, planes);
+    unsigned int cols = (width + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+    unsigned int rows = (height + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+    size_t full = frame_format_bytes(format, width, height);
+    size_t bitmap = frame_delta_bitmap_bytes(width, height);
+    unsigned char *out = dst + bitmap;
+
+    if (!count || bitmap >= full)
+        return 0;
+    memset(dst, 0, bitmap);
+    for (unsigned int ty = 0; ty < rows; ty++)
+    {
+        for (unsigned int tx = 0; tx < cols; tx++)
+        {
+            struct span spans[3];
+            unsigned int tile = ty * cols + tx;
+            uint64_t sad = 0, limit;
+            size_t bytes = 0;
+
+            for (int p = 0; p < count; p++)
+            {
+                tile_span(&planes[p], tx, ty, &spans[p]);
+                bytes += spans[p].len * spans[p].rows;
+            }
+            limit = (uint64_t)threshold * bytes;
+            for (int p = 0; p < count && sad <= limit; p++)
+            {
+                const struct span *s = &spans[p];
+                for (unsigned int r = 0; r < s->rows && sad <= limit; r++)
+                    sad += row_sad(image + s->start + r * s->stride, ref + s->start + r * s->stride, s->len);
+            }
+            if (sad <= limit)
+                continue;
+
+            if ((size_t)(out - dst) + bytes >= full)
+                return 0;
+            dst[tile / 8] |= (unsigned char)(1u << (tile % 8));
+            for (int p = 0; p < count; p++)
+            {
+                const struct span *s = &spans[p];
+                for (unsigned int r = 0; r < s->rows; r++, out += s->len)
+                {
+                    memcpy(out, image + s->start + r * s->stride, s->len);
+                    memcpy(ref + s->start + r * s->stride, out, s->len);
+                }
+            }
+        }
+    }
+    return (size_t)(out - dst);
+}
+
+/**
+ * @brief   Apply a delta payload to the image it was encoded against.
+ *
+ * @param   format  enum frame_format of the image.
+ * @param   width   Image width in pixels.
+ * @param   height  Image height in pixels.
+ * @param   delta   Delta payload.
+ * @param   len     Size of the delta payload.
+ * @param   ref     The image to update.
+ *
+ * @return  0 on success, -1 if the payload does not match its bitmap; the
+ *          image may then be partly updated.
+ */
+int frame_delta_apply(unsigned int format, unsigned int width, unsigned int height,
+                      const unsigned char *delta, size_t len, unsigned char *ref)
+{
+    struct plane planes[3];
+    int count = format_planes(format, width, height, planes);
+    unsigned int cols = (width + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+    unsigned int rows = (height + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+    size_t bitmap = frame_delta_bitmap_bytes(width, height);
+    const unsigned char *in = delta + bitmap, *end = delta + len;
+
+    if (!count || len < bitmap)
+        return -1;
+    for (unsigned int tile = 0; tile < cols * rows; tile++)
+    {
+        if (!(delta[tile / 8] & (1u << (tile % 8))))
+            continue;
+        for (int p = 0; p < count; p++)
+        {
+            struct span s;
+
+            tile_span(&planes[p], tile % cols, tile / cols, &s);
+            if ((size_t)(end - in) < s.len * s.rows)
+                return -1;
+            for (unsigned int r = 0; r < s.rows; r++, in += s.len)
+                memcpy(ref + s.start + r * s.stride, in, s.len);
+        }
+    }
+    return in == end ? 0 : -1;
+}
+
+/* Reference slot of a frame: its region, or 0 for the whole frame */
+static unsigned int image_index(const struct frame_header *header)
+{
+    return (header->flags & FRAME_FLAG_ROI) ? FRAME_ROI_INDEX(header->flags) : 0;
+}
+
+/**
+ * @brief   Tell whether a frame can be turned into a whole image.
+ *
+ * @param   refs    The client's references.
+ * @param   header  Header of the frame.
+ *
+ * @return  1 for whole frames and for deltas against a reference of the
+ *          same size and format, 0 otherwise.
+ */
+int frame_delta_usable(const struct frame_delta_refs *refs, const struct frame_header *header)
+{
+    unsigned int i = image_index(header);
+
+    if (!(header->flags & FRAME_FLAG_DELTA))
+        return 1;
+    return i < FRAME_MAX_ROIS && refs->valid[i] && refs->header[i].width == header->width &&
+           refs->header[i].height == header->height && refs->header[i].format == header->format;
+}
+
+/**
+ * @brief   Keep a live whole frame as the reference, or rebuild a delta.
+ *
+ * A rebuilt delta replaces the payload with the whole image and loses its
+ * FRAME_FLAG_DELTA, so it can be saved like any other frame. History frames
+ * are always whole and are left alone.
+ *
+ * @param   refs        The client's references.
+ * @param   header      Header of the frame; updated for a rebuilt delta.
+ * @param   payload     The received payload; replaced by a rebuilt delta.
+ * @param   capacity    Size of the payload buffer.
+ *
+ * @return  0 on success, -1 if a delta could not be applied; the client
+ *          should ask for a keyframe.
+ */
+int frame_delta_rebuild(struct frame_delta_refs *refs, struct frame_header *header, unsigned char *payload,
+                        size_t capacity)
+{
+    unsigned int i = image_index(header);
+    size_t full = frame_format_bytes(header->format, header->width, header->height);
+
+    if (header->flags & FRAME_FLAG_HISTORY)
+        return 0;
+    if (i >= FRAME_MAX_ROIS || !full || full > capacity)
+        return -1;
+
+    if (!(header->flags & FRAME_FLAG_DELTA))
+    {
+        if (refs->capacity[i] < full)
+        {
+            unsigned char *grown = realloc(refs->image[i], full);
+            if (!grown)
+            {
+                refs->valid[i] = 0;
+                return 0;
+            }
+            refs->image[i] = grown;
+            refs->capacity[i] = full;
+        }
+        memcpy(refs->image[i], payload, full);
+        refs->header[i] = *header;
+        refs->valid[i] = 1;
+        refs->keyframe_requested = 0;
+        return 0;
+    }
+
+    if (!frame_delta_usable(refs, header) ||
+        -1 == frame_delta_apply(header->format, header->width, header->height, payload, header->payload_size,
+                                refs->image[i]))
+    {
+        refs->valid[i] = 0;
+        return -1;
+    }
+    memcpy(payload, refs->image[i], full);
+    header->payload_size = (uint32_t)full;
+    header->flags &= (uint16_t)~FRAME_FLAG_DELTA;
+    return 0;
+}
+
+/**
+ * @brief   Forget the reference of a live frame that was not received, so
+ *          the deltas that follow are not applied to a stale image.
+ *
+ * @param   refs    The client's references.
+ * @param   header  Header of the lost frame.
+ *
+ * @return  This function does not return a value.
+ */
+void frame_delta_lost(struct frame_delta_refs *refs, const struct frame_header *header)
+{
+    unsigned int i = image_index(header);
+
+    if (!(header->flags & FRAME_FLAG_HISTORY) && i < FRAME_MAX_ROIS)
+        refs->valid[i] = 0;
+}
+
+/**
+ * @brief   Free the references.
+ *
+ * @param   refs    The client's references.
+ *
+ * @return  This function does not return a value.
+ */
+void frame_delta_free(struct frame_delta_refs *refs)
+{
+    for (int i = 0; i < FRAME_MAX_ROIS; i++)
+        free(refs->image[i]);
+    memset(refs, 0, sizeof(*refs));
+}
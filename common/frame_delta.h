@@ -0,0 +1,46 @@
+/**
+ * @file frame_delta.h
+ * @brief Tile delta frames: encoding on the server, rebuilding on clients.
+ *
+ * A delta payload starts with a bitmap of one bit per FRAME_TILE_SIZE
+ * square tile of the image, in raster order, least significant bit first.
+ * The samples of every tile whose bit is set follow in the same order; a
+ * tile's samples are its rows in each plane of the format in turn, cut to
+ * the image edge and to the plane's chroma subsampling. Everything else is
+ * unchanged from the image the receiver already has.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __FRAME_DELTA_H__
+#define __FRAME_DELTA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "frame_protocol.h"
+
+/* The last whole image of each stream a client receives, to apply deltas to */
+struct frame_delta_refs
+{
+    unsigned char *image[FRAME_MAX_ROIS];   /* indexed by region, 0 for whole frames */
+    size_t capacity[FRAME_MAX_ROIS];
+    struct frame_header header[FRAME_MAX_ROIS];     /* size and format of each image */
+    int valid[FRAME_MAX_ROIS];
+    int keyframe_requested;     /* asked for a keyframe that has not come yet */
+};
+
+uint32_t frame_delta_bitmap_bytes(unsigned int width, unsigned int height);
+size_t frame_delta_encode(unsigned int format, unsigned int width, unsigned int height,
+                          const unsigned char *image, unsigned char *ref, unsigned int threshold,
+                          unsigned char *dst);
+int frame_delta_apply(unsigned int format, unsigned int width, unsigned int height,
+                      const unsigned char *delta, size_t len, unsigned char *ref);
+
+int frame_delta_usable(const struct frame_delta_refs *refs, const struct frame_header *header);
+int frame_delta_rebuild(struct frame_delta_refs *refs, struct frame_header *header, unsigned char *payload,
+                        size_t capacity);
+void frame_delta_lost(struct frame_delta_refs *refs, const struct frame_header *header);
+void frame_delta_free(struct frame_delta_refs *refs);
+
+#endif /* __FRAME_DELTA_H__ */
@@ -0,0 +1,391 @@
+/**
+ * @file frame_protocol.h
+ * @brief Wire format shared by server_sock and client_sock.
+ *
+ * Every frame sent by the server is preceded by a fixed size header that
+ * describes the payload that follows it. The header is serialised field by
+ * field in network byte order so both ends agree on it regardless of
+ * compiler padding or host endianness.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __FRAME_PROTOCOL_H__
+#define __FRAME_PROTOCOL_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define FRAME_PORT 9000
+#define FRAME_MAGIC 0x46524d31u /* "FRM1" */
+#define FRAME_HEADER_SIZE 28
+#define COMMAND_MAGIC 0x434d4431u /* "CMD1" */
+#define COMMAND_SIZE 24
+
+/* Largest payload a frame may carry: a full 640x480 RGB24 image */
+#define FRAME_MAX_PAYLOAD ((614400 * 6) / 4)
+
+enum frame_format
+{
+    FRAME_FMT_RGB24 = 0,    /* R, G, B bytes per pixel */
+    FRAME_FMT_RGB565 = 1,   /* 16 bits per pixel, little endian, red in the top 5 bits */
+    FRAME_FMT_NV12 = 2,     /* Y plane, then interleaved U/V at half resolution */
+    FRAME_FMT_I420 = 3,     /* Y plane, then U and V planes at half resolution */
+    FRAME_FMT_GRAY = 4,     /* Y plane only */
+    FRAME_FMT_COUNT
+};
+
+/* frame_header.flags */
+#define FRAME_FLAG_HISTORY      0x0001  /* frame replayed from the history ring */
+#define FRAME_FLAG_HISTORY_END  0x0002  /* empty frame closing a history replay */
+#define FRAME_FLAG_ROI          0x0004  /* one region of interest, index in bits 8-11 */
+#define FRAME_ROI_INDEX(flags)  (((flags) >> 8) & 0x0f)
+#define FRAME_FLAG_DELTA        0x0008  /* only the changed tiles, see frame_delta.h */
+#define FRAME_FLAG_CRC          0x0010  /* payload ends in a CRC32C, see frame_crc.h */
+
+/* Bytes of the CRC32C at the end of a FRAME_FLAG_CRC payload */
+#define FRAME_CRC_SIZE 4
+
+#define FRAME_MAX_ROIS 4
+#define FRAME_ROI_MIN_SIZE 8    /* smallest ROI side, in pixels after its scale */
+
+/* Delta frames split the image into tiles of this many pixels square */
+#define FRAME_TILE_SIZE 16
+
+/* Simulcast levels: the full frame, then each level half the size of the one before */
+#define FRAME_PYRAMID_LEVELS 3
+
+/* Commands a client may send to the server at any time */
+enum command_type
+{
+    /*
+     * Replay frames kept in the server's history ring. arg0 and arg1 are the
+     * start and end of the range as frame_header timestamps; an end of 0
+     * means "up to now". With COMMAND_FLAG_RELATIVE, arg0 is instead how
+     * many microseconds before now the range starts.
+     */
+    COMMAND_HISTORY = 1,
+    /* Send frames in another enum frame_format (arg0) from the next frame on */
+    COMMAND_FORMAT = 2,
+    /*
+     * Crop, scale, rotate and mirror every frame from the next one on; see
+     * frame_transform_pack(). All zero arguments restore the full frame.
+     * Any regions of interest are cleared.
+     */
+    COMMAND_TRANSFORM = 3,
+    /*
+     * Set region of interest number index (0 to FRAME_MAX_ROIS - 1), see
+     * frame_roi_pack(); a zero width removes it. While a client has ROIs
+     * each captured frame is sent as one FRAME_FLAG_ROI frame per region,
+     * in index order, instead of the whole image.
+     */
+    COMMAND_ROI = 4,
+    /*
+     * Switch to the whole frame at simulcast level arg0 (0 to
+     * FRAME_PYRAMID_LEVELS - 1): full size, 1/2 or 1/4 in each direction.
+     * The server makes every level in the same pass as the full frame, so
+     * a switch takes effect with the next frame. Any transform and regions
+     * of interest are cleared.
+     */
+    COMMAND_LEVEL = 5,
+    /*
+     * Send live frames as FRAME_FLAG_DELTA frames holding only the tiles
+     * that changed since the previous frame, with a whole keyframe every
+     * arg0 frames; 0 turns deltas off. A tile counts as changed when its
+     * samples differ from what the client last received by more than arg1
+     * on average, so 0 sends every change.
+     */
+    COMMAND_DELTA = 6,
+    /* Send the next live frame whole, e.g. after the client lost a delta */
+    COMMAND_KEYFRAME = 7,
+    /*
+     * End every frame from the next one on with a CRC32C of its header and
+     * payload (FRAME_FLAG_CRC) if arg0 is non-zero, or stop doing so.
+     */
+    COMMAND_CRC = 8,
+};
+
+#define COMMAND_FLAG_RELATIVE 0x0001
+
+struct frame_header
+{
+    uint32_t magic;
+    uint32_t sequence;      /* capture sequence number */
+    uint64_t timestamp_us;  /* capture time, CLOCK_MONOTONIC microseconds */
+    uint16_t width;
+    uint16_t height;
+    uint8_t  format;        /* enum frame_format */
+    uint8_t  level;         /* quality ladder step the frame was produced at */
+    uint16_t flags;
+    uint32_t payload_size;  /* bytes following the header */
+};
+
+/* Geometry of the image a client receives, applied to the captured frame */
+struct frame_transform
+{
+    uint16_t crop_x;        /* top left corner of the source rectangle */
+    uint16_t crop_y;
+    uint16_t crop_width;    /* 0 extends the rectangle to the frame edge */
+    uint16_t crop_height;
+    uint16_t width;         /* output size after rotation, 0 keeps the crop's */
+    uint16_t height;
+    uint8_t  rotation;      /* clockwise quarter turns, 0 to 3 */
+    uint8_t  mirror;        /* non-zero flips left-right before rotating */
+};
+
+/* A rectangle of the captured frame, box-filtered down by scale */
+struct frame_roi
+{
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+    uint8_t  index;         /* which of the client's regions */
+    uint8_t  scale;         /* integer downscale factor, 1 for full size */
+};
+
+struct command
+{
+    uint32_t magic;
+    uint16_t type;          /* enum command_type */
+    uint16_t flags;
+    uint64_t arg0;
+    uint64_t arg1;
+};
+
+static inline void put_be16(unsigned char *p, uint16_t v)
+{
+    v = htons(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void put_be32(unsigned char *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint16_t get_be16(const unsigned char *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohs(v);
+}
+
+static inline uint32_t get_be32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static inline void put_be64(unsigned char *p, uint64_t v)
+{
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+static inline uint64_t get_be64(const unsigned char *p)
+{
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+/**
+ * @brief   Returns the payload size of a frame in a given format.
+ *
+ * The 4:2:0 formats round odd chroma dimensions up.
+ *
+ * @param   format  enum frame_format of the payload.
+ * @param   width   Image width in pixels.
+ * @param   height  Image height in pixels.
+ *
+ * @return  Size in bytes, 0 for an unknown format.
+ */
+static inline uint32_t frame_format_bytes(unsigned int format, uint32_t width, uint32_t height)
+{
+    uint32_t pixels = width * height;
+
+    switch (format)
+    {
+    case FRAME_FMT_RGB24:
+        return pixels * 3;
+    case FRAME_FMT_RGB565:
+        return pixels * 2;
+    case FRAME_FMT_NV12:
+    case FRAME_FMT_I420:
+        return pixels + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+    case FRAME_FMT_GRAY:
+        return pixels;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief   Returns the short name of a format, as used on command lines and
+ *          in file extensions, or NULL for an unknown format.
+ */
+static inline const char *frame_format_name(unsigned int format)
+{
+    static const char *const names[FRAME_FMT_COUNT] = { "rgb24", "rgb565", "nv12", "i420", "gray" };
+
+    return format < FRAME_FMT_COUNT ? names[format] : NULL;
+}
+
+/**
+ * @brief   Serialise a frame header into its wire representation.
+ *
+ * @param   h     Header to serialise.
+ * @param   out   Destination, at least FRAME_HEADER_SIZE bytes.
+ *
+ * @return  This function does not return a value.
+ */
+static inline void frame_header_pack(const struct frame_header *h, unsigned char *out)
+{
+    put_be32(out + 0, h->magic);
+    put_be32(out + 4, h->sequence);
+    put_be64(out + 8, h->timestamp_us);
+    put_be16(out + 16, h->width);
+    put_be16(out + 18, h->height);
+    out[20] = h->format;
+    out[21] = h->level;
+    put_be16(out + 22, h->flags);
+    put_be32(out + 24, h->payload_size);
+}
+
+/**
+ * @brief   Parse a frame header from its wire representation.
+ *
+ * @param   in    Source, at least FRAME_HEADER_SIZE bytes.
+ * @param   h     Header to fill in.
+ *
+ * @return  0 if the header carries the expected magic, -1 otherwise.
+ */
+static inline int frame_header_unpack(const unsigned char *in, struct frame_header *h)
+{
+    h->magic = get_be32(in + 0);
+    h->sequence = get_be32(in + 4);
+    h->timestamp_us = get_be64(in + 8);
+    h->width = get_be16(in + 16);
+    h->height = get_be16(in + 18);
+    h->format = in[20];
+    h->level = in[21];
+    h->flags = get_be16(in + 22);
+    h->payload_size = get_be32(in + 24);
+    return (FRAME_MAGIC == h->magic) ? 0 : -1;
+}
+
+/**
+ * @brief   Serialise a client command into its wire representation.
+ *
+ * @param   c     Command to serialise.
+ * @param   out   Destination, at least COMMAND_SIZE bytes.
+ *
+ * @return  This function does not return a value.
+ */
+static inline void command_pack(const struct command *c, unsigned char *out)
+{
+    put_be32(out + 0, c->magic);
+    put_be16(out + 4, c->type);
+    put_be16(out + 6, c->flags);
+    put_be64(out + 8, c->arg0);
+    put_be64(out + 16, c->arg1);
+}
+
+/**
+ * @brief   Parse a client command from its wire representation.
+ *
+ * @param   in    Source, at least COMMAND_SIZE bytes.
+ * @param   c     Command to fill in.
+ *
+ * @return  0 if the command carries the expected magic, -1 otherwise.
+ */
+static inline int command_unpack(const unsigned char *in, struct command *c)
+{
+    c->magic = get_be32(in + 0);
+    c->type = get_be16(in + 4);
+    c->flags = get_be16(in + 6);
+    c->arg0 = get_be64(in + 8);
+    c->arg1 = get_be64(in + 16);
+    return (COMMAND_MAGIC == c->magic) ? 0 : -1;
+}
+
+/**
+ * @brief   Store a transform in the arguments of a COMMAND_TRANSFORM.
+ *
+ * arg0 holds the crop rectangle as x, y, width, height from the top 16
+ * bits down; arg1 the output width and height in its top 32 bits, the
+ * rotation in bits 8-15 and the mirror flag in bit 0.
+ *
+ * @param   t     Transform to store.
+ * @param   c     Command whose arguments are filled in.
+ *
+ * @return  This function does not return a value.
+ */
+static inline void frame_transform_pack(const struct frame_transform *t, struct command *c)
+{
+    c->arg0 = ((uint64_t)t->crop_x << 48) | ((uint64_t)t->crop_y << 32) |
+              ((uint64_t)t->crop_width << 16) | t->crop_height;
+    c->arg1 = ((uint64_t)t->width << 48) | ((uint64_t)t->height << 32) |
+              ((uint64_t)t->rotation << 8) | (t->mirror ? 1u : 0u);
+}
+
+/**
+ * @brief   Read a transform back from the arguments of a COMMAND_TRANSFORM.
+ *
+ * @param   c     Received command.
+ * @param   t     Transform to fill in.
+ *
+ * @return  This function does not return a value.
+ */
+static inline void frame_transform_unpack(const struct command *c, struct frame_transform *t)
+{
+    t->crop_x = (uint16_t)(c->arg0 >> 48);
+    t->crop_y = (uint16_t)(c->arg0 >> 32);
+    t->crop_width = (uint16_t)(c->arg0 >> 16);
+    t->crop_height = (uint16_t)c->arg0;
+    t->width = (uint16_t)(c->arg1 >> 48);
+    t->height = (uint16_t)(c->arg1 >> 32);
+    t->rotation = (uint8_t)(c->arg1 >> 8);
+    t->mirror = (uint8_t)(c->arg1 & 1);
+}
+
+/**
+ * @brief   Store a region in the arguments of a COMMAND_ROI.
+ *
+ * arg0 holds the rectangle as x, y, width, height from the top 16 bits
+ * down, like a transform's crop; arg1 the index in bits 8-15 and the
+ * scale in bits 0-7.
+ *
+ * @param   r     Region to store.
+ * @param   c     Command whose arguments are filled in.
+ *
+ * @return  This function does not return a value.
+ */
+static inline void frame_roi_pack(const struct frame_roi *r, struct command *c)
+{
+    c->arg0 = ((uint64_t)r->x << 48) | ((uint64_t)r->y << 32) | ((uint64_t)r->width << 16) | r->height;
+    c->arg1 = ((uint64_t)r->index << 8) | r->scale;
+}
+
+/**
+ * @brief   Read a region back from the arguments of a COMMAND_ROI.
+ *
+ * @param   c     Received command.
+ * @param   r     Region to fill in.
+ *
+ * @return  This function does not return a value.
+ */
+static inline void frame_roi_unpack(const struct command *c, struct frame_roi *r)
+{
+    r->x = (uint16_t)(c->arg0 >> 48);
+    r->y = (uint16_t)(c->arg0 >> 32);
+    r->width = (uint16_t)(c->arg0 >> 16);
+    r->height = (uint16_t)c->arg0;
+    r->index = (uint8_t)(c->arg1 >> 8);
+    r->scale = (uint8_t)c->arg1;
+}
+
+#endif /* __FRAME_PROTOCOL_H__ */
@@ -0,0 +1,57 @@
+/**
+ * @file shm_protocol.h
+ * @brief Layout of the shared-memory frame ring served to local consumers.
+ *
+ * A consumer connects to the server's Unix domain socket and receives two
+ * descriptors with SCM_RIGHTS: a memfd holding the ring, which it maps
+ * read-only, and an eventfd that is incremented for every published frame.
+ * Both sides run on the same host, so the layout uses native byte order.
+ *
+ * The ring starts with a struct shm_ring_header followed by slot_count
+ * slots of slot_size bytes each. Every slot starts with a struct
+ * shm_slot_header and has its payload at SHM_PAYLOAD_OFFSET. Frames are
+ * written round robin, so frame N is in slot N % slot_count.
+ *
+ * Each slot is guarded by its sequence field: the server zeroes it before
+ * rewriting the slot and stores the frame's sequence number once the slot
+ * is complete. A consumer reads the sequence (acquire), uses the payload in
+ * place, then reads the sequence again; if it changed or was 0, the frame
+ * was overwritten while being used and must be discarded.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __SHM_PROTOCOL_H__
+#define __SHM_PROTOCOL_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SHM_MAGIC 0x53484d31u   /* "SHM1" */
+#define SHM_VERSION 1
+#define SHM_DEFAULT_PATH "/tmp/camera_frames.sock"
+#define SHM_PAYLOAD_OFFSET 64
+#define SHM_HEADER_SIZE 4096
+
+struct shm_ring_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;             /* bytes per slot, header included */
+    _Atomic uint64_t latest;        /* sequence of the newest complete frame */
+};
+
+struct shm_slot_header
+{
+    _Atomic uint64_t sequence;      /* 0 while the slot is being written */
+    uint64_t timestamp_us;          /* capture time, CLOCK_MONOTONIC */
+    uint16_t width;
+    uint16_t height;
+    uint8_t  format;                /* enum frame_format */
+    uint8_t  reserved[3];
+    uint32_t payload_size;
+};
+
+#endif /* __SHM_PROTOCOL_H__ */
@@ -0,0 +1,274 @@
+/**
+ * @file trace.c
+ * @brief Per-thread trace rings and their Chrome trace-format export.
+ *
+ * A thread gets its ring on its first trace point after tracing was turned
+ * on. Only the owning thread writes a ring: it fills the next event and then
+ * publishes it by advancing the ring's head with release ordering. A dump
+ * may run while the threads keep recording, so it copies a ring first and
+ * then drops whatever the owner may have overwritten during the copy.
+ * Rings are never freed, so the spans of threads that already exited are
+ * still in the dump.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+struct trace_event
+{
+    const char *name;
+    uint64_t start_ns;
+    uint32_t duration_ns;
+    uint32_t arg;
+};
+
+struct trace_ring
+{
+    atomic_uint_fast64_t head;      /* events ever recorded */
+    pid_t tid;
+    char thread_name[16];
+    struct trace_event events[TRACE_RING_EVENTS];
+};
+
+atomic_int trace_enabled;
+
+static struct trace_ring *_Atomic rings[TRACE_MAX_THREADS];
+static atomic_int ring_count;
+static _Thread_local struct trace_ring *my_ring;
+static _Thread_local int my_ring_failed;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t dump_requested;
+static const char *dump_path;
+
+static void toggle_handler(int sig)
+{
+    (void)sig;
+    atomic_fetch_xor(&trace_enabled, 1);
+}
+
+static void dump_handler(int sig)
+{
+    (void)sig;
+    dump_requested = 1;
+}
+
+static void dump_at_exit(void)
+{
+    int count = atomic_load(&ring_count);
+
+    for (int i = 0; i < count && i < TRACE_MAX_THREADS; i++)
+    {
+        struct trace_ring *ring = atomic_load(&rings[i]);
+        if (ring && atomic_load_explicit(&ring->head, memory_order_acquire))
+        {
+            trace_dump(dump_path);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief   Creates the calling thread's ring, or returns NULL if there is
+ *          no memory or no room for another thread.
+ */
+static struct trace_ring *create_ring(void)
+{
+    struct trace_ring *ring;
+    int index = atomic_fetch_add(&ring_count, 1);
+
+    if (index >= TRACE_MAX_THREADS || !(ring = calloc(1, sizeof(*ring))))
+    {
+        syslog(LOG_ERR, "No trace ring for thread %ld", (long)syscall(SYS_gettid));
+        my_ring_failed = 1;
+        return NULL;
+    }
+    ring->tid = (pid_t)syscall(SYS_gettid);
+    if (0 != pthread_getname_np(pthread_self(), ring->thread_name, sizeof(ring->thread_name)))
+        snprintf(ring->thread_name, sizeof(ring->thread_name), "%d", (int)ring->tid);
+    atomic_store(&rings[index], ring);
+    my_ring = ring;
+    return ring;
+}
+
+/**
+ * @brief   Install the SIGUSR1/SIGUSR2 handlers and the dump at exit.
+ *
+ * @param   path    File that dumps are written to.
+ * @param   enabled Non-zero to start tracing right away.
+ *
+ * @return  0 on success, -1 if a handler could not be installed.
+ */
+int trace_setup(const char *path, int enabled)
+{
+    struct sigaction sa;
+
+    dump_path = path;
+    atomic_store(&trace_enabled, enabled ? 1 : 0);
+
+    /* No SA_RESTART, so a blocked poll() returns and services the dump */
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = toggle_handler;
+    if (-1 == sigaction(SIGUSR1, &sa, NULL))
+        return -1;
+    sa.sa_handler = dump_handler;
+    if (-1 == sigaction(SIGUSR2, &sa, NULL))
+        return -1;
+    atexit(dump_at_exit);
+    return 0;
+}
+
+/**
+ * @brief   Record one complete span in the calling thread's ring.
+ *
+ * Normally reached through trace_end().
+ *
+ * @param   name        Stage name, a string literal.
+ * @param   start_ns    Start of the span, CLOCK_MONOTONIC nanoseconds.
+ * @param   end_ns      End of the span.
+ * @param   arg         Value shown with the span, usually the frame number.
+ *
+ * @return  This function does not return a value.
+ */
+void trace_record(const char *name, uint64_t start_ns, uint64_t end_ns, uint32_t arg)
+{
+    struct trace_ring *ring = my_ring;
+    struct trace_event *e;
+    uint64_t head, duration;
+
+    if (!ring)
+    {
+        if (my_ring_failed || !(ring = create_ring()))
+            return;
+    }
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    duration = end_ns - start_ns;
+    e = &ring->events[head % TRACE_RING_EVENTS];
+    e->name = name;
+    e->start_ns = start_ns;
+    e->duration_ns = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+    e->arg = arg;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * @brief   Write a dump if one was requested with SIGUSR2.
+ *
+ * Called from a program's main loop, where file I/O is safe.
+ *
+ * @return  This function does not return a value.
+ */
+void trace_service(void)
+{
+    if (dump_requested)
+    {
+        dump_requested = 0;
+        trace_dump(dump_path);
+    }
+}
+
+/* Thread names come from pthread_setname_np(), only quotes need care */
+static void write_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        if ('"' == *s || '\\' == *s)
+            fputc('\\', f);
+        fputc((unsigned char)*s >= 0x20 ? *s : '?', f);
+    }
+    fputc('"', f);
+}
+
+/**
+ * @brief   Write the recorded spans of every thread as Chrome trace JSON.
+ *
+ * @param   path    Output file, replaced if it exists.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int trace_dump(const char *path)
+{
+    struct trace_event *copy;
+    int count = atomic_load(&ring_count);
+    int pid = (int)getpid();
+    int first = 1;
+    uint64_t written = 0;
+    FILE *f;
+
+    if (!path)
+        return -1;
+    copy = malloc(sizeof(struct trace_event) * TRACE_RING_EVENTS);
+    if (!copy)
+        return -1;
+    pthread_mutex_lock(&dump_lock);
+    f = fopen(path, "w");
+    if (!f)
+    {
+        syslog(LOG_ERR, "Cannot write trace %s: %s", path, strerror(errno));
+        pthread_mutex_unlock(&dump_lock);
+        free(copy);
+        return -1;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int i = 0; i < count && i < TRACE_MAX_THREADS; i++)
+    {
+        struct trace_ring *ring = atomic_load(&rings[i]);
+        uint64_t head, oldest, valid_from;
+
+        if (!ring)
+            continue;
+
+        fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                first ? "" : ",\n", pid, (int)ring->tid);
+        write_json_string(f, ring->thread_name);
+        fprintf(f, "}}");
+        first = 0;
+
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        oldest = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        for (uint64_t n = oldest; n < head; n++)
+            copy[n % TRACE_RING_EVENTS] = ring->events[n % TRACE_RING_EVENTS];
+
+        /* Anything the owner wrote during the copy may be torn */
+        valid_from = atomic_load_explicit(&ring->head, memory_order_acquire);
+        valid_from = valid_from > TRACE_RING_EVENTS ? valid_from - TRACE_RING_EVENTS : 0;
+        for (uint64_t n = oldest > valid_from ? oldest : valid_from; n < head; n++)
+        {
+            const struct trace_event *e = &copy[n % TRACE_RING_EVENTS];
+
+            fprintf(f, ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03u,"
+                       "\"dur\":%u.%03u,\"args\":{\"frame\":%u}}",
+                    e->name, pid, (int)ring->tid, (unsigned long long)(e->start_ns / 1000),
+                    (unsigned int)(e->start_ns % 1000), e->duration_ns / 1000, e->duration_ns % 1000, e->arg);
+            written++;
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    if (0 != fclose(f))
+    {
+        syslog(LOG_ERR, "Cannot write trace %s: %s", path, strerror(errno));
+        pthread_mutex_unlock(&dump_lock);
+        free(copy);
+        return -1;
+    }
+    pthread_mutex_unlock(&dump_lock);
+    free(copy);
+    syslog(LOG_INFO, "Wrote %llu trace events to %s", (unsigned long long)written, path);
+    return 0;
+}
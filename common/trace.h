@@ -0,0 +1,74 @@
+/**
+ * @file trace.h
+ * @brief Per-stage trace points shared by the server and the client.
+ *
+ * Each thread records complete spans (name, start, duration, frame number)
+ * into a ring of its own, so recording takes no lock and never blocks. The
+ * rings can be written out as Chrome trace-format JSON, which chrome://tracing
+ * and ui.perfetto.dev both open. Timestamps are CLOCK_MONOTONIC, so traces
+ * taken by a server and a client on the same host line up.
+ *
+ * While tracing is off a trace point costs one relaxed load and a branch.
+ * SIGUSR1 toggles tracing and SIGUSR2 asks for a dump, which the program
+ * writes the next time it calls trace_service(). Whatever was recorded is
+ * also written at exit.
+ *
+ * Span names must be string literals: only the pointer is stored.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define TRACE_RING_EVENTS 16384     /* per thread, oldest overwritten first */
+#define TRACE_MAX_THREADS 64
+
+extern atomic_int trace_enabled;
+
+int trace_setup(const char *path, int enabled);
+void trace_record(const char *name, uint64_t start_ns, uint64_t end_ns, uint32_t arg);
+void trace_service(void);
+int trace_dump(const char *path);
+
+/**
+ * @brief   Returns the CLOCK_MONOTONIC time in nanoseconds.
+ */
+static inline uint64_t trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief   Starts a span.
+ *
+ * @return  The start time to pass to trace_end(), or 0 if tracing is off.
+ */
+static inline uint64_t trace_begin(void)
+{
+    return atomic_load_explicit(&trace_enabled, memory_order_relaxed) ? trace_now_ns() : 0;
+}
+
+/**
+ * @brief   Ends a span started with trace_begin().
+ *
+ * @param   name    Stage name, a string literal.
+ * @param   start   Value returned by trace_begin(); 0 records nothing.
+ * @param   arg     Frame sequence number or other value shown with the span.
+ *
+ * @return  This function does not return a value.
+ */
+static inline void trace_end(const char *name, uint64_t start, uint32_t arg)
+{
+    if (start)
+        trace_record(name, start, trace_now_ns(), arg);
+}
+
+#endif /* __TRACE_H__ */
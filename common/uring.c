@@ -0,0 +1,302 @@
+/**
+ * @file uring.c
+ * @brief A minimal io_uring: rings, submission and registered files and buffers,
+ *        on the raw system calls so no library is needed.
+ *
+ * Only what the frame paths use is here: entries are filled in with
+ * uring_get_sqe() and handed to the kernel in one io_uring_enter() by
+ * uring_submit(), which can also wait for completions, and completions are
+ * taken off the ring with uring_peek() without a system call. The ring
+ * indices shared with the kernel are read with acquire and published with
+ * release ordering. A kernel without io_uring, or one where it is switched
+ * off, makes uring_init() fail and the caller keeps its ordinary
+ * system-call path.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+#define RING_INDEX(p) ((_Atomic unsigned int *)(p))
+
+/**
+ * @brief   Create a ring and map it.
+ *
+ * @param   r       Ring to set up.
+ * @param   entries Submission entries, rounded up to a power of two by the
+ *                  kernel; the completion ring gets twice as many.
+ * @param   flags   IORING_SETUP_* flags, dropped if the kernel does not
+ *                  know them.
+ *
+ * @return  0 on success, -1 with errno set if io_uring is not available.
+ */
+int uring_init(struct uring *r, unsigned int entries, unsigned int flags)
+{
+    struct io_uring_params p;
+    int saved;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->sq_map = r->cq_map = MAP_FAILED;
+    r->sqes = MAP_FAILED;
+    p.flags = flags;
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0 && flags && EINVAL == errno)
+    {
+        memset(&p, 0, sizeof(p));
+        r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (r->fd < 0)
+        return -1;
+    r->features = p.features;
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_map_size > r->sq_map_size)
+            r->sq_map_size = r->cq_map_size;
+        r->cq_map_size = r->sq_map_size;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == r->sq_map)
+        goto fail;
+    r->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_map
+              : mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_CQ_RING);
+    if (MAP_FAILED == r->cq_map)
+        goto fail;
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == r->sqes)
+        goto fail;
+
+    r->sq_head = (unsigned int *)((char *)r->sq_map + p.sq_off.head);
+    r->sq_tail = (unsigned int *)((char *)r->sq_map + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)((char *)r->sq_map + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)((char *)r->sq_map + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned int *)((char *)r->cq_map + p.cq_off.head);
+    r->cq_tail = (unsigned int *)((char *)r->cq_map + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)((char *)r->cq_map + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_map + p.cq_off.cqes);
+    return 0;
+
+fail:
+    saved = errno;
+    uring_exit(r);
+    errno = saved;
+    return -1;
+}
+
+/**
+ * @brief   Unmap and close a ring. Requests still in flight are cancelled
+ *          by the kernel.
+ *
+ * @param   r   Ring set up by uring_init(), or one it failed on.
+ *
+ * @return  This function does not return a value.
+ */
+void uring_exit(struct uring *r)
+{
+    if (MAP_FAILED != r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (MAP_FAILED != r->cq_map && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_size);
+    if (MAP_FAILED != r->sq_map)
+        munmap(r->sq_map, r->sq_map_size);
+    if (r->fd >= 0)
+        close(r->fd);
+    r->sq_map = r->cq_map = MAP_FAILED;
+    r->sqes = MAP_FAILED;
+    r->fd = -1;
+}
+
+/**
+ * @brief   Take the next free submission entry.
+ *
+ * @param   r   Ring to queue on.
+ *
+ * @return  A cleared entry that goes to the kernel with the next
+ *          uring_submit(), or NULL if the submission ring is full.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    unsigned int head = atomic_load_explicit(RING_INDEX(r->sq_head), memory_order_acquire);
+    unsigned int tail = *r->sq_tail + r->queued;
+    unsigned int index;
+
+    if (tail - head >= r->sq_entries)
+        return NULL;
+    index = tail & *r->sq_mask;
+    r->sq_array[index] = index;
+    r->queued++;
+    memset(&r->sqes[index], 0, sizeof(r->sqes[index]));
+    return &r->sqes[index];
+}
+
+/**
+ * @brief   Hand every queued entry to the kernel in one system call.
+ *
+ * @param   r       Ring to submit.
+ * @param   wait    Completions to wait for before returning, 0 returns as
+ *                  soon as the entries are submitted.
+ *
+ * @return  Entries submitted, 0 without a system call if there was
+ *          nothing to submit or wait for, -1 with errno set on failure.
+ */
+int uring_submit(struct uring *r, unsigned int wait)
+{
+    unsigned int pending;
+    int ret;
+
+    if (r->queued)
+    {
+        atomic_store_explicit(RING_INDEX(r->sq_tail), *r->sq_tail + r->queued, memory_order_release);
+        r->queued = 0;
+    }
+    for (;;)
+    {
+        pending = *r->sq_tail - atomic_load_explicit(RING_INDEX(r->sq_head), memory_order_acquire);
+        if (!pending && !wait)
+            return 0;
+        r->enters++;
+        ret = (int)syscall(__NR_io_uring_enter, r->fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0 || EINTR != errno)
+            return ret;
+        /* Interrupted while waiting: go on unless a completion came in */
+        if (*r->cq_head != atomic_load_explicit(RING_INDEX(r->cq_tail), memory_order_acquire))
+            wait = 0;
+    }
+}
+
+/**
+ * @brief   Take the oldest completion off the ring, without a system call.
+ *
+ * @param   r   Ring to reap.
+ * @param   cqe Set to the completion.
+ *
+ * @return  0 if there was one, -1 if the completion ring is empty.
+ */
+int uring_peek(struct uring *r, struct io_uring_cqe *cqe)
+{
+    unsigned int head = *r->cq_head;
+
+    if (head == atomic_load_explicit(RING_INDEX(r->cq_tail), memory_order_acquire))
+        return -1;
+    *cqe = r->cqes[head & *r->cq_mask];
+    atomic_store_explicit(RING_INDEX(r->cq_head), head + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * @brief   Wait until the completion of one request is on the ring.
+ *
+ * Completions are left on the ring, that one included, for the caller's
+ * usual uring_peek() loop to take.
+ *
+ * @param   r           Ring the request was submitted on.
+ * @param   user_data   The request's user_data.
+ *
+ * @return  0 once it is there, -1 with errno set if waiting failed.
+ */
+int uring_wait_for(struct uring *r, uint64_t user_data)
+{
+    for (;;)
+    {
+        unsigned int head = *r->cq_head;
+        unsigned int tail = atomic_load_explicit(RING_INDEX(r->cq_tail), memory_order_acquire);
+
+        for (unsigned int i = head; i != tail; i++)
+            if (r->cqes[i & *r->cq_mask].user_data == user_data)
+                return 0;
+        if (-1 == uring_submit(r, tail - head + 1))
+            return -1;
+    }
+}
+
+/**
+ * @brief   Register a table of files requests can name by index with
+ *          IOSQE_FIXED_FILE, and open into directly.
+ *
+ * @param   r       Ring to register with.
+ * @param   fds     Descriptors to start the table with, -1 for empty slots.
+ * @param   count   Size of the table.
+ *
+ * @return  0 on success, -1 with errno set.
+ */
+int uring_register_files(struct uring *r, const int *fds, unsigned int count)
+{
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, fds, count) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief   Register buffers the *_FIXED operations can name by index, so
+ *          the kernel maps them once instead of on every request.
+ *
+ * @param   r       Ring to register with.
+ * @param   iov     The buffers.
+ * @param   count   Number of buffers.
+ *
+ * @return  0 on success, -1 with errno set, e.g. ENOMEM past the locked
+ *          memory limit.
+ */
+int uring_register_buffers(struct uring *r, const struct iovec *iov, unsigned int count)
+{
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, count) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief   Register a table of empty buffer slots, to be filled and emptied
+ *          one at a time with uring_update_buffer().
+ *
+ * @param   r       Ring to register with.
+ * @param   count   Number of slots.
+ *
+ * @return  0 on success, -1 with errno set if the kernel predates sparse
+ *          buffer tables (5.19).
+ */
+int uring_reserve_buffers(struct uring *r, unsigned int count)
+{
+    struct io_uring_rsrc_register reg;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = count;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief   Put a buffer in a slot of the table, or empty the slot.
+ *
+ * Requests in flight on the slot's previous buffer keep it mapped until
+ * they complete.
+ *
+ * @param   r       Ring the table belongs to.
+ * @param   index   Slot to replace.
+ * @param   base    The buffer, NULL to empty the slot.
+ * @param   len     Its size, 0 to empty the slot.
+ *
+ * @return  0 on success, -1 with errno set.
+ */
+int uring_update_buffer(struct uring *r, unsigned int index, void *base, size_t len)
+{
+    struct iovec iov = { base, len };
+    struct io_uring_rsrc_update2 update;
+
+    memset(&update, 0, sizeof(update));
+    update.offset = index;
+    update.data = (uint64_t)(uintptr_t)&iov;
+    update.nr = 1;
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) < 0 ? -1 : 0;
+}
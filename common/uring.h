@@ -0,0 +1,47 @@
+/**
+ * @file uring.h
+ * @brief A minimal io_uring: rings, submission and registered files and buffers,
+ *        on the raw system calls so no library is needed.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct uring
+{
+    int fd;
+    unsigned int features;      /* IORING_FEAT_* of the kernel */
+    /* Submission ring */
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_entries;
+    unsigned int queued;        /* entries filled in but not yet submitted */
+    /* Completion ring */
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Mappings, released by uring_exit() */
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    unsigned long enters;       /* io_uring_enter() calls made */
+};
+
+int uring_init(struct uring *r, unsigned int entries, unsigned int flags);
+void uring_exit(struct uring *r);
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+int uring_submit(struct uring *r, unsigned int wait);
+int uring_peek(struct uring *r, struct io_uring_cqe *cqe);
+int uring_wait_for(struct uring *r, uint64_t user_data);
+int uring_register_files(struct uring *r, const int *fds, unsigned int count);
+int uring_register_buffers(struct uring *r, const struct iovec *iov, unsigned int count);
+int uring_reserve_buffers(struct uring *r, unsigned int count);
+int uring_update_buffer(struct uring *r, unsigned int index, void *base, size_t len);
+
+#endif /* __URING_H__ */
@@ -0,0 +1,251 @@
+/**
+ * @file adaptive_quality.c
+ * @brief Per-client quality ladder driven by measured throughput and
+ *        socket send-queue depth.
+ *
+ * Each client walks a ladder of (resolution, frame rate) steps. The server
+ * samples how many bytes the peer has acknowledged and how many are still
+ * queued in the kernel (SIOCOUTQ) for the client socket. When the queue
+ * would take longer than QUEUE_DELAY_TARGET_US to drain, or the previous
+ * frame has not even been handed to the kernel yet, the client is stepped
+ * down to the best step its measured throughput can sustain. After a
+ * congestion free hold period it is probed one step back up; probes that
+ * fail straight away double the hold period so a bottlenecked link does not
+ * oscillate.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#include <stdio.h>
+#include "adaptive_quality.h"
+#include "camera_drivers.h"
+#include "../common/frame_protocol.h"
+
+#define QUEUE_DELAY_TARGET_US 100000
+#define WINDOW_US 250000
+#define DOWN_SETTLE_US 300000
+#define HOLD_UP_MIN_US 2000000
+#define HOLD_UP_MAX_US 30000000
+#define THROUGHPUT_HEADROOM 0.8
+
+static const struct quality_step ladder[] =
+{
+    { 1, 1 },   /* 640x480 every frame */
+    { 1, 2 },   /* 640x480 every 2nd frame */
+    { 2, 1 },   /* 320x240 every frame */
+    { 2, 2 },   /* 320x240 every 2nd frame */
+    { 4, 1 },   /* 160x120 every frame */
+    { 4, 2 },   /* 160x120 every 2nd frame */
+    { 4, 4 },   /* 160x120 every 4th frame */
+};
+
+#define LADDER_SIZE (sizeof(ladder) / sizeof(ladder[0]))
+
+/**
+ * @brief   Returns the number of steps in the quality ladder.
+ *
+ * @return  Number of ladder steps.
+ */
+unsigned int quality_levels(void)
+{
+    return LADDER_SIZE;
+}
+
+/**
+ * @brief   Returns the ladder step for a level, clamped to the ladder.
+ *
+ * @param   level   Ladder index, 0 is the best quality.
+ *
+ * @return  Pointer to the ladder step.
+ */
+const struct quality_step *quality_get_step(unsigned int level)
+{
+    if (level >= LADDER_SIZE)
+        level = LADDER_SIZE - 1;
+    return &ladder[level];
+}
+
+/**
+ * @brief   Returns the size of one image a client receives at a level.
+ *
+ * @param   q       Quality state of the client.
+ * @param   level   Ladder index.
+ * @param   image   Which of the images sent per frame.
+ * @param   width   Receives the width, at least 1.
+ * @param   height  Receives the height, at least 1.
+ *
+ * @return  This function does not return a value.
+ */
+void quality_output_size(const struct quality_state *q, unsigned int level, unsigned int image,
+                         unsigned int *width, unsigned int *height)
+{
+    const struct quality_step *step = quality_get_step(level);
+
+    *width = q->width[image] / step->scale ? q->width[image] / step->scale : 1;
+    *height = q->height[image] / step->scale ? q->height[image] / step->scale : 1;
+}
+
+/**
+ * @brief   Returns the payload bytes of one frame at the given level.
+ *
+ * @param   q       Quality state of the client, for its format and sizes.
+ * @param   level   Ladder index.
+ *
+ * @return  Payload size in bytes, summed over every image of the frame.
+ */
+size_t quality_frame_bytes(const struct quality_state *q, unsigned int level)
+{
+    size_t bytes = 0;
+
+    for (unsigned int i = 0; i < q->images; i++)
+    {
+        unsigned int width, height;
+
+        quality_output_size(q, level, i, &width, &height);
+        bytes += frame_format_bytes(q->format, width, height);
+    }
+    return bytes;
+}
+
+/**
+ * @brief   Returns the bytes per second a level needs at a capture rate.
+ */
+static double level_rate(const struct quality_state *q, unsigned int level, double fps)
+{
+    return (double)quality_frame_bytes(q, level) * fps / quality_get_step(level)->frame_divisor;
+}
+
+/**
+ * @brief   Moves the client to a new ladder level.
+ */
+static void set_level(struct quality_state *q, unsigned int level, uint64_t now_us)
+{
+    q->level = level;
+    q->level_since_us = now_us;
+    q->frame_count = 0;
+}
+
+/**
+ * @brief   Initialise the quality state of a newly connected client.
+ *
+ * Clients start at the best step and are only stepped down once the link
+ * shows it cannot keep up.
+ *
+ * @param   q       Quality state to initialise.
+ * @param   now_us  Current monotonic time in microseconds.
+ *
+ * @return  This function does not return a value.
+ */
+void quality_init(struct quality_state *q, uint64_t now_us)
+{
+    memset(q, 0, sizeof(*q));
+    q->hold_up_us = HOLD_UP_MIN_US;
+    q->images = 1;
+    q->width[0] = HRES;
+    q->height[0] = VRES;
+    q->window_start_us = now_us;
+    set_level(q, 0, now_us);
+}
+
+/**
+ * @brief   Feed one set of link measurements into the controller.
+ *
+ * Called once per captured frame, before deciding what to send the client.
+ *
+ * @param   q           Quality state of the client.
+ * @param   now_us      Current monotonic time in microseconds.
+ * @param   bytes_sent  Total bytes handed to the kernel for this client.
+ * @param   queued      Bytes still queued in the socket (SIOCOUTQ), or -1
+ *                      if the kernel could not report it.
+ * @param   backlogged  Non-zero if the previous frame is still only
+ *                      partially handed to the kernel.
+ * @param   fps         Current capture rate in frames per second.
+ *
+ * @return  -1 if the client stepped down, 1 if it stepped up, 0 otherwise.
+ */
+int quality_update(struct quality_state *q, uint64_t now_us, uint64_t bytes_sent,
+                   int queued, int backlogged, double fps)
+{
+    uint64_t acked = bytes_sent;
+    int congested;
+
+    if (queued > 0 && (uint64_t)queued <= bytes_sent)
+        acked = bytes_sent - (uint64_t)queued;
+
+    /* Delivered throughput over a short window, smoothed across windows */
+    if (now_us - q->window_start_us >= WINDOW_US)
+    {
+        double rate = (double)(acked - q->window_acked) * 1e6 /
+                      (double)(now_us - q->window_start_us);
+        q->throughput = (q->throughput > 0) ? (0.7 * q->throughput + 0.3 * rate) : rate;
+        q->window_start_us = now_us;
+        q->window_acked = acked;
+    }
+
+    q->queue_delay_us = 0;
+    if (queued > 0 && q->throughput > 0)
+        q->queue_delay_us = (double)queued * 1e6 / q->throughput;
+
+    congested = backlogged || q->queue_delay_us > QUEUE_DELAY_TARGET_US;
+
+    if (congested)
+    {
+        unsigned int target;
+
+        if (q->level + 1 >= LADDER_SIZE || now_us - q->last_down_us < DOWN_SETTLE_US)
+            return 0;
+
+        /* A probe that failed right away means the link is at its limit */
+        if (q->last_up_us && now_us - q->last_up_us < q->hold_up_us)
+        {
+            q->hold_up_us *= 2;
+            if (q->hold_up_us > HOLD_UP_MAX_US)
+                q->hold_up_us = HOLD_UP_MAX_US;
+        }
+
+        /* Jump straight to the best step the measured throughput sustains */
+        target = q->level + 1;
+        if (q->throughput > 0 && fps > 0)
+        {
+            while (target + 1 < LADDER_SIZE &&
+                   level_rate(q, target, fps) > THROUGHPUT_HEADROOM * q->throughput)
+                target++;
+        }
+
+        set_level(q, target, now_us);
+        q->last_down_us = now_us;
+        return -1;
+    }
+
+    if (q->level > 0 &&
+        now_us - q->level_since_us >= q->hold_up_us &&
+        now_us - q->last_down_us >= q->hold_up_us &&
+        q->queue_delay_us < QUEUE_DELAY_TARGET_US / 4)
+    {
+        set_level(q, q->level - 1, now_us);
+        q->last_up_us = now_us;
+        return 1;
+    }
+
+    /* A level that has been stable for a while resets the probe backoff */
+    if (q->hold_up_us > HOLD_UP_MIN_US && now_us - q->level_since_us >= 4 * q->hold_up_us)
+        q->hold_up_us = HOLD_UP_MIN_US;
+
+    return 0;
+}
+
+/**
+ * @brief   Decide whether the current frame should be sent at this level.
+ *
+ * Implements the frame rate part of the ladder by sending one frame out of
+ * every frame_divisor frames.
+ *
+ * @param   q   Quality state of the client.
+ *
+ * @return  1 if the frame should be sent, 0 if it should be skipped.
+ */
+int quality_should_send(struct quality_state *q)
+{
+    return (q->frame_count++ % quality_get_step(q->level)->frame_divisor) == 0;
+}
@@ -0,0 +1,51 @@
+/**
+ * @file adaptive_quality.h
+ * @brief Per-client quality ladder driven by measured throughput and
+ *        socket send-queue depth.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __ADAPTIVE_QUALITY_H__
+#define __ADAPTIVE_QUALITY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../common/frame_protocol.h"
+
+struct quality_step
+{
+    unsigned int scale;          /* output is width/scale x height/scale */
+    unsigned int frame_divisor;  /* send one out of every frame_divisor frames */
+};
+
+struct quality_state
+{
+    unsigned int level;          /* index into the ladder, 0 is best */
+    unsigned long frame_count;   /* frames offered since entering the level */
+    uint64_t level_since_us;     /* when the current level was entered */
+    uint64_t last_down_us;       /* when we last stepped down */
+    uint64_t last_up_us;         /* when we last stepped up */
+    uint64_t hold_up_us;         /* congestion free time needed to step up */
+    uint64_t window_start_us;    /* throughput sampling window */
+    uint64_t window_acked;       /* bytes acknowledged at window start */
+    double throughput;           /* smoothed delivered bytes per second */
+    double queue_delay_us;       /* estimated time to drain the send queue */
+    unsigned int format;         /* enum frame_format, sets the bytes per level */
+    unsigned int images;         /* images sent per frame, 1 unless the client set ROIs */
+    unsigned int width[FRAME_MAX_ROIS];  /* full quality size of each image: HRES x VRES */
+    unsigned int height[FRAME_MAX_ROIS]; /* unless the client asked for a transform or ROIs */
+};
+
+unsigned int quality_levels(void);
+const struct quality_step *quality_get_step(unsigned int level);
+void quality_output_size(const struct quality_state *q, unsigned int level, unsigned int image,
+                         unsigned int *width, unsigned int *height);
+size_t quality_frame_bytes(const struct quality_state *q, unsigned int level);
+void quality_init(struct quality_state *q, uint64_t now_us);
+int quality_update(struct quality_state *q, uint64_t now_us, uint64_t bytes_sent,
+                   int queued, int backlogged, double fps);
+int quality_should_send(struct quality_state *q);
+
+#endif /* __ADAPTIVE_QUALITY_H__ */
@@ -16,7 +16,7 @@
 
 
 
-
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,13 +36,17 @@
 #include <math.h>
 #include <limits.h>
 #include "camera_drivers.h"
+#include "color_convert.h"
+#include "input_format.h"
+#include "synthetic_camera.h"
+#include "metrics.h"
+#include "../common/clock_utils.h"
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
-#define HRES 640
-#define VRES 480
 
 
 static struct v4l2_format fmt;
+static struct input_layout layout;      /* what the driver delivers */
 
 struct buffer 
 {
@@ -56,6 +60,8 @@ struct buffer          *buffers;
 static unsigned int     n_buffers;
 struct v4l2_buffer buf_service;
 unsigned char bigbuffer[(1280*960)];
+unsigned char rawbuffer[YUYV_FRAME_SIZE];
+static size_t raw_len;
 
 /**
  * @brief   Handle an error and exit the program.
@@ -105,58 +111,11 @@ static int xioctl(int fh, int request, void *arg)
 }
 
 
-/**
- * @brief   Perform color conversion from YUV to RGB.
- *
- * This function performs color conversion from YUV color space to RGB color space.
- * Given the Y, U, and V values, it calculates the corresponding RGB values and
- * stores them in the provided pointers `r`, `g`, and `b`. The conversion is done
- * using integer arithmetic to avoid floating-point operations.
- *
- * @param   y   Y component value.
- * @param   u   U component value.
- * @param   v   V component value.
- * @param   r   Pointer to store the resulting red component value.
- * @param   g   Pointer to store the resulting green component value.
- * @param   b   Pointer to store the resulting blue component value.
- *
- * @return  This function does not return a value.
- */
-void transformation_color_conversion(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b)
-{
-   int r1, g1, b1;
-
-   // replaces floating point coefficients
-   int c = y-16, d = u - 128, e = v - 128;       
-
-   // Conversion that avoids floating point
-   r1 = (298 * c           + 409 * e + 128) >> 8;
-   g1 = (298 * c - 100 * d - 208 * e + 128) >> 8;
-   b1 = (298 * c + 516 * d           + 128) >> 8;
-
-   // Computed values may need clipping.
-   if (r1 > 255) r1 = 255;
-   if (g1 > 255) g1 = 255;
-   if (b1 > 255) b1 = 255;
-
-   if (r1 < 0) r1 = 0;
-   if (g1 < 0) g1 = 0;
-   if (b1 < 0) b1 = 0;
-
-   *r = r1 ;
-   *g = g1 ;
-   *b = b1 ;
-}
-
-
 /**
  * @brief   Perform continuous color transformation on input data.
  *
  * This function performs a continuous color transformation on the provided input
- * data `p` of size `size`. The input data is processed in blocks of four elements,
- * where each block consists of Y, U, Y2, and V values. For each block, the
- * transformation_color_conversion function is called to convert YUV to RGB values,
- * and the resulting RGB values are stored in the `bigbuffer`.
+ * data `p` of size `size` and stores the resulting RGB values in the `bigbuffer`.
  *
  * @param   p       Pointer to the input data.
  * @param   size    Size of the input data in bytes.
@@ -165,15 +124,7 @@ void transformation_color_conversion(int y, int u, int v, unsigned char *r, unsi
  */
 void continuous_transformation(const unsigned char *p, int size)
 {
-    int i, newi, newsize=0;
-    int y_temp, y2_temp, u_temp, v_temp;
-    unsigned char *pptr = (unsigned char *)p;
-    for(int i=0, newi=0; i<size; i=i+4, newi=newi+6)
-    {
-        y_temp=(int)pptr[i]; u_temp=(int)pptr[i+1]; y2_temp=(int)pptr[i+2]; v_temp=(int)pptr[i+3];
-        transformation_color_conversion(y_temp, u_temp, v_temp, &bigbuffer[newi], &bigbuffer[newi+1], &bigbuffer[newi+2]);
-        transformation_color_conversion(y2_temp, u_temp, v_temp, &bigbuffer[newi+3], &bigbuffer[newi+4], &bigbuffer[newi+5]);
-    }
+    yuyv_to_rgb_fast(p, size, bigbuffer);
 }
 
 /**
@@ -331,6 +282,38 @@ void init_mmap(void)
         }
 }
 
+/**
+ * @brief   Pick the YUV to RGB conversion the camera's frames need.
+ *
+ * Follows the Y'CbCr encoding and quantization the driver reports, and
+ * the V4L2 defaults derived from the colorspace where it leaves them
+ * unset. Raw Bayer frames are unpacked with BT.601 limited range, so they
+ * are always converted back with it.
+ *
+ * @param   pix     The format the driver settled on.
+ *
+ * @return  This function does not return a value.
+ */
+static void select_color_conversion(const struct v4l2_pix_format *pix)
+{
+    unsigned int encoding = pix->ycbcr_enc, quantization = pix->quantization;
+    unsigned int matrix, range;
+
+    if (V4L2_YCBCR_ENC_DEFAULT == encoding)
+        encoding = V4L2_MAP_YCBCR_ENC_DEFAULT(pix->colorspace);
+    if (V4L2_QUANTIZATION_DEFAULT == quantization)
+        quantization = V4L2_MAP_QUANTIZATION_DEFAULT(0, pix->colorspace, encoding);
+
+    matrix = V4L2_YCBCR_ENC_709 == encoding || V4L2_YCBCR_ENC_XV709 == encoding ? COLOR_BT709 : COLOR_BT601;
+    range = V4L2_QUANTIZATION_FULL_RANGE == quantization ? COLOR_FULL : COLOR_LIMITED;
+    if (layout.format >= INPUT_BAYER_BGGR)
+        matrix = COLOR_BT601, range = COLOR_LIMITED;
+
+    color_convert_select(matrix, range);
+    syslog(LOG_INFO, "Converting with %s (colorspace %u, encoding %u, quantization %u)", color_convert_name(),
+           pix->colorspace, pix->ycbcr_enc, pix->quantization);
+}
+
 /**
  * @brief   Initialize the video capture device.
  *
@@ -339,7 +322,9 @@ void init_mmap(void)
  * - Checks if the device supports video capture and streaming.
  * - Sets the exposure mode to manual and the exposure time to a specific value.
  * - Selects video input, video standard, and cropping capabilities if available.
- * - Sets the desired video format (width, height, pixel format).
+ * - Sets the video size and the first pixel format, in order of preference,
+ *   that the driver accepts and input_to_yuyv() can unpack.
+ * - Selects the colour matrix and range the driver reports for it.
  * - Initializes memory mapping for capturing video frames using init_mmap function.
  * If any ioctl call returns an error, the errno_exit function is used to handle
  * the error with an appropriate error message.
@@ -430,32 +415,53 @@ void init_device(void)
 
         }
     }
-    CLEAR(fmt);
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width       = HRES;
-    fmt.fmt.pix.height      = VRES;
-
-    // Specify the Pixel Coding Formate here
-
-    // This one works for Logitech C200
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-    fmt.fmt.pix.field       = V4L2_FIELD_NONE;
-
-    if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
+    /* Ask for each format the server can unpack, best first, and take the
+       first one the driver accepts at full size */
+    for (int f = 0; f < INPUT_FORMAT_COUNT; f++)
     {
-        errno_exit("VIDIOC_S_FMT");
+        CLEAR(fmt);
+        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        fmt.fmt.pix.width       = HRES;
+        fmt.fmt.pix.height      = VRES;
+        fmt.fmt.pix.pixelformat = input_format_fourcc((enum input_format)f);
+        fmt.fmt.pix.field       = V4L2_FIELD_NONE;
+
+        if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
+        {
+            if (EINVAL == errno)
+                continue;
+            errno_exit("VIDIOC_S_FMT");
+        }
+        /* Drivers substitute a format of their own rather than fail */
+        if (input_format_from_fourcc(fmt.fmt.pix.pixelformat) >= 0 &&
+            HRES == fmt.fmt.pix.width && VRES == fmt.fmt.pix.height)
+            break;
+        fmt.fmt.pix.pixelformat = 0;
     }
+    if (input_format_from_fourcc(fmt.fmt.pix.pixelformat) < 0)
+    {
+        fprintf(stderr, "%s offers no supported pixel format at %ux%u\n", dev_name, HRES, VRES);
+        exit(EXIT_FAILURE);
+    }
+    layout.format = (enum input_format)input_format_from_fourcc(fmt.fmt.pix.pixelformat);
+    layout.width = HRES;
+    layout.height = VRES;
+
     /* Buggy driver paranoia. */
-    min = fmt.fmt.pix.width * 2;
+    min = fmt.fmt.pix.width * (INPUT_YUYV == layout.format || INPUT_UYVY == layout.format ? 2 : 1);
     if (fmt.fmt.pix.bytesperline < min)
     {
         fmt.fmt.pix.bytesperline = min;
     }
-    min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+    layout.stride = fmt.fmt.pix.bytesperline;
+    min = (unsigned int)input_format_size(&layout);
     if (fmt.fmt.pix.sizeimage < min)
     {
         fmt.fmt.pix.sizeimage = min;
     }
+    syslog(LOG_INFO, "Capturing %s at %ux%u, %u bytes per line", input_format_name(layout.format),
+           HRES, VRES, fmt.fmt.pix.bytesperline);
+    select_color_conversion(&fmt.fmt.pix);
     init_mmap();
 }
 
@@ -514,18 +520,29 @@ void open_device(void)
 
 
 /**
- * @brief   Reads a frame from the video device using Video4Linux2 (V4L2) API.
- *
- * This function dequeues a frame buffer from the video capture device, performs
- * continuous transformation on the captured frame, and enqueues the buffer back.
- * It handles errors and returns 0 if no frame is available, or 1 on successful frame capture.
- *
- * @return  0 if no frame is available, 1 on successful frame capture.
+ * @brief   Dequeues a filled frame, copies it out and requeues the buffer.
+ *
+ * This is the capture half of frames_reading() on its own, for callers that
+ * run the conversion elsewhere. The buffer goes back to the driver as soon
+ * as the copy is done. Frames in any other format than unpadded YUYV are
+ * unpacked into YUYV as they are copied. A buffer shorter than a whole frame
+ * is requeued without being copied and counted as a V4L2 error.
+ *
+ * @param   dst             Where to copy the frame as YUYV, or NULL to discard it.
+ * @param   cap             Size of dst in bytes.
+ * @param   len             Receives the number of bytes copied.
+ * @param   timestamp_us    If not NULL, receives the driver's capture time in
+ *                          CLOCK_MONOTONIC microseconds, or 0 if the driver
+ *                          does not timestamp on the monotonic clock.
+ *
+ * @return  0 if no usable frame is available, 1 on successful frame capture.
  */
-static int frames_reading(void)
+int camera_capture_raw(unsigned char *dst, size_t cap, size_t *len, uint64_t *timestamp_us)
 {
     struct v4l2_buffer buf_service;
-    unsigned int i;
+
+    if (synthetic_camera_active())
+        return synthetic_camera_capture(dst, cap, len, timestamp_us);
 
     CLEAR(buf_service);
 
@@ -543,6 +560,7 @@ static int frames_reading(void)
             /* Could ignore EIO, but drivers should only set for serious errors, although some set for
                non-fatal errors too.
              */
+            metrics_add(METRIC_V4L2_ERRORS, 1);
             return 0;
 
         default:
@@ -552,7 +570,34 @@ static int frames_reading(void)
     }
 
     assert(buf_service.index < n_buffers);
-    continuous_transformation(buffers[buf_service.index].start, buf_service.bytesused);
+    metrics_add(METRIC_FRAMES_CAPTURED, 1);
+    *len = 0;
+    if (dst && (buf_service.bytesused < input_format_size(&layout) || cap < YUYV_FRAME_SIZE))
+    {
+        /* A short buffer holds a truncated frame, whatever the format */
+        metrics_add(METRIC_V4L2_ERRORS, 1);
+        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf_service))
+            errno_exit("VIDIOC_QBUF");
+        return 0;
+    }
+    if (dst && INPUT_YUYV == layout.format && layout.stride == HRES * 2)
+    {
+        *len = YUYV_FRAME_SIZE;
+        memcpy(dst, buffers[buf_service.index].start, *len);
+    }
+    else if (dst)
+    {
+        /* Unpacking into YUYV is the copy */
+        input_to_yuyv(&layout, buffers[buf_service.index].start, dst);
+        *len = YUYV_FRAME_SIZE;
+    }
+    if (timestamp_us)
+    {
+        *timestamp_us = 0;
+        if (V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC == (buf_service.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK))
+            *timestamp_us = (uint64_t)buf_service.timestamp.tv_sec * 1000000u +
+                            (uint64_t)buf_service.timestamp.tv_usec;
+    }
 
     if (-1 == xioctl(fd, VIDIOC_QBUF, &buf_service))
         errno_exit("VIDIOC_QBUF");
@@ -560,6 +605,32 @@ static int frames_reading(void)
     return 1;
 }
 
+/**
+ * @brief   Reads a frame from the video device using Video4Linux2 (V4L2) API.
+ *
+ * This function dequeues a frame buffer from the video capture device, copies
+ * the raw frame out of it and enqueues the buffer back straight away, then
+ * performs continuous transformation on the copy. Converting from the copy
+ * keeps the conversion reading cached memory even on drivers whose mmap
+ * buffers are uncached.
+ * It handles errors and returns 0 if no frame is available, or 1 on successful frame capture.
+ *
+ * @return  0 if no frame is available, 1 on successful frame capture.
+ */
+static int frames_reading(void)
+{
+    uint64_t convert_start;
+
+    if (!camera_capture_raw(rawbuffer, sizeof(rawbuffer), &raw_len, NULL))
+        return 0;
+
+    convert_start = monotonic_us();
+    continuous_transformation(rawbuffer, (int)raw_len);
+    metrics_observe(METRIC_CONVERT_US, monotonic_us() - convert_start);
+
+    return 1;
+}
+
 /**
  * @brief   Captures a picture from the video device and waits for a frame to be available.
  *
@@ -620,3 +691,19 @@ unsigned char *return_pic_buffer()
     capture_pic();
     return bigbuffer;
 }
+
+/**
+ * @brief   Returns the file descriptor of the open capture device.
+ *
+ * The descriptor is opened non-blocking, so callers can wait for it to become
+ * readable alongside their own descriptors and then call camera_capture_raw().
+ *
+ * @return  The capture device file descriptor, or -1 if it is not open.
+ */
+int camera_get_fd(void)
+{
+    if (synthetic_camera_active())
+        return synthetic_camera_fd();
+    return fd;
+}
+
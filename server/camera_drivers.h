@@ -12,6 +12,14 @@
 #ifndef __CAMERA_DRIVERS_H__
 #define __CAMERA_DRIVERS_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define HRES 640
+#define VRES 480
+#define RGB_FRAME_SIZE (HRES * VRES * 3)
+#define YUYV_FRAME_SIZE (HRES * VRES * 2)
+
 void start_capturing(void);
 void uninit_device(void);
 void init_device(void);
@@ -20,5 +28,7 @@ void open_device(void);
 void capture_pic(void);
 unsigned char *return_pic_buffer();
 void stop_capturing(void);
+int camera_get_fd(void);
+int camera_capture_raw(unsigned char *dst, size_t cap, size_t *len, uint64_t *timestamp_us);
 
 #endif /* __CAMERA_DRIVERS_H__ */
\ No newline at end of file
@@ -0,0 +1,427 @@
+/**
+ * @file capture_pipeline.c
+ * @brief Capture and conversion threads feeding converted frames to the
+ *        server's send loop.
+ *
+ * The capture thread only waits for the device, copies each frame out of
+ * the V4L2 buffer into a free slot and requeues the buffer. The conversion
+ * thread turns captured slots into RGB, together with the half and quarter
+ * size images the sessions' thumbnail streams are cut from, and signals the
+ * send loop through an eventfd. Both threads can be given a SCHED_FIFO
+ * priority and a CPU of their own, so a busy send loop or an unrelated
+ * process cannot delay the dequeue. A stage that falls behind never
+ * blocks the stage before it: the oldest frame not yet being worked on
+ * is recycled instead.
+ *
+ * When nothing but the client sessions needs the frames, and they convert
+ * from YUYV themselves while streaming, no RGB images are made or even
+ * allocated and the conversion thread only runs motion analysis.
+ *
+ * The conversion thread counts cycles, instructions, cache and branch misses
+ * of every conversion where the hardware counters are available. With the
+ * motion gate on it also compares each frame with the motion background
+ * once the conversion is done, timed separately.
+ *
+ * The capture thread also measures how late it wakes up relative to the
+ * driver's capture timestamp and how far each frame interval strays from
+ * the running average, and reports both through the metrics endpoint and a
+ * periodic syslog summary.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "capture_pipeline.h"
+#include "color_convert.h"
+#include "metrics.h"
+#include "motion.h"
+#include "perf_counters.h"
+#include "../common/clock_utils.h"
+#include "../common/trace.h"
+
+#define PIPELINE_SLOTS 4
+#define CAPTURE_TIMEOUT_MS 2000
+#define JITTER_REPORT_US 10000000
+
+enum slot_state
+{
+    SLOT_FREE,
+    SLOT_CAPTURING,
+    SLOT_CAPTURED,      /* raw frame waiting for conversion */
+    SLOT_CONVERTING,
+    SLOT_READY,         /* converted, waiting for the send loop */
+    SLOT_IN_USE,        /* held by the send loop */
+};
+
+static struct pipeline_frame slots[PIPELINE_SLOTS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t captured = PTHREAD_COND_INITIALIZER;
+static pthread_t capture_tid, convert_tid;
+static struct pipeline_config cfg;
+static int event_fd = -1, stop_fd = -1;
+static atomic_int stopping;
+
+/**
+ * @brief   Returns the oldest slot in the given state, or NULL. Call locked.
+ */
+static struct pipeline_frame *oldest_in(int state)
+{
+    struct pipeline_frame *best = NULL;
+
+    for (int i = 0; i < PIPELINE_SLOTS; i++)
+    {
+        if (slots[i].state == state && (!best || slots[i].sequence < best->sequence))
+            best = &slots[i];
+    }
+    return best;
+}
+
+/**
+ * @brief   Finds a slot for the next capture, recycling a stale frame if
+ *          every slot is taken.
+ */
+static struct pipeline_frame *claim_slot(void)
+{
+    struct pipeline_frame *s;
+
+    pthread_mutex_lock(&lock);
+    s = oldest_in(SLOT_FREE);
+    if (!s)
+    {
+        s = oldest_in(SLOT_READY);
+        if (!s)
+            s = oldest_in(SLOT_CAPTURED);
+        if (s)
+            metrics_add(METRIC_PIPELINE_OVERRUNS, 1);
+    }
+    if (s)
+        s->state = SLOT_CAPTURING;
+    pthread_mutex_unlock(&lock);
+    return s;
+}
+
+static void set_state(struct pipeline_frame *s, int state)
+{
+    pthread_mutex_lock(&lock);
+    s->state = state;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief   Capture thread: dequeue, copy out, requeue, hand to conversion.
+ */
+static void *capture_thread(void *arg)
+{
+    struct pollfd pfds[2];
+    uint32_t sequence = 0;
+    uint64_t last_ts = 0, report_start = monotonic_us();
+    double interval_avg = 0;
+    uint64_t jitter_max = 0, jitter_sum = 0, wakeup_max = 0, samples = 0;
+
+    (void)arg;
+    rt_apply("capture", &cfg.capture);
+
+    pfds[0].fd = camera_get_fd();
+    pfds[0].events = POLLIN;
+    pfds[1].fd = stop_fd;
+    pfds[1].events = POLLIN;
+
+    for (;;)
+    {
+        struct pipeline_frame *s;
+        uint64_t driver_ts, now, ts, span;
+        size_t discarded;
+        int r = poll(pfds, 2, CAPTURE_TIMEOUT_MS);
+
+        if (-1 == r)
+        {
+            if (EINTR == errno)
+                continue;
+            syslog(LOG_ERR, "Capture poll failed: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (0 == r)
+        {
+            syslog(LOG_ERR, "No frame from the camera in %d ms", CAPTURE_TIMEOUT_MS);
+            exit(EXIT_FAILURE);
+        }
+        if (pfds[1].revents & POLLIN)
+            break;
+
+        s = claim_slot();
+        if (!s)
+        {
+            /* Every slot is being converted or sent, keep the driver moving */
+            camera_capture_raw(NULL, 0, &discarded, NULL);
+            metrics_add(METRIC_PIPELINE_OVERRUNS, 1);
+            continue;
+        }
+        span = trace_begin();
+        if (!camera_capture_raw(s->raw, YUYV_FRAME_SIZE, &s->raw_len, &driver_ts))
+        {
+            set_state(s, SLOT_FREE);
+            continue;
+        }
+
+        now = monotonic_us();
+        ts = driver_ts ? driver_ts : now;
+        if (driver_ts && now >= driver_ts)
+        {
+            metrics_observe(METRIC_CAPTURE_WAKEUP_US, now - driver_ts);
+            if (now - driver_ts > wakeup_max)
+                wakeup_max = now - driver_ts;
+        }
+        if (last_ts && ts > last_ts)
+        {
+            double interval = (double)(ts - last_ts);
+            if (interval_avg > 0)
+            {
+                uint64_t jitter = (uint64_t)((interval > interval_avg) ? interval - interval_avg
+                                                                       : interval_avg - interval);
+                metrics_observe(METRIC_FRAME_JITTER_US, jitter);
+                jitter_sum += jitter;
+                if (jitter > jitter_max)
+                    jitter_max = jitter;
+                samples++;
+            }
+            interval_avg = (interval_avg > 0) ? 0.95 * interval_avg + 0.05 * interval : interval;
+        }
+        last_ts = ts;
+
+        s->sequence = ++sequence;
+        s->timestamp_us = ts;
+        trace_end("capture", span, s->sequence);
+        pthread_mutex_lock(&lock);
+        s->state = SLOT_CAPTURED;
+        pthread_cond_signal(&captured);
+        pthread_mutex_unlock(&lock);
+
+        if (now - report_start >= JITTER_REPORT_US && samples)
+        {
+            syslog(LOG_INFO, "Capture jitter avg %llu us max %llu us, wakeup latency max %llu us",
+                   (unsigned long long)(jitter_sum / samples), (unsigned long long)jitter_max,
+                   (unsigned long long)wakeup_max);
+            jitter_max = jitter_sum = wakeup_max = samples = 0;
+            report_start = now;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief   Conversion thread: YUYV to RGB for each captured slot.
+ */
+static void *convert_thread(void *arg)
+{
+    struct perf_counters counters;
+    uint64_t one = 1;
+
+    (void)arg;
+    rt_apply("convert", &cfg.convert);
+    perf_counters_open(&counters, "conversion");
+
+    pthread_mutex_lock(&lock);
+    for (;;)
+    {
+        struct pipeline_frame *s;
+        struct perf_sample before, after, delta;
+        uint64_t start, span;
+
+        while (!atomic_load(&stopping) && !(s = oldest_in(SLOT_CAPTURED)))
+            pthread_cond_wait(&captured, &lock);
+        if (atomic_load(&stopping))
+            break;
+        s->state = SLOT_CONVERTING;
+        pthread_mutex_unlock(&lock);
+
+        s->pyramid = 0;
+        if (s->rgb)
+        {
+            span = trace_begin();
+            start = monotonic_us();
+            perf_counters_read(&counters, &before);
+            s->pyramid = YUYV_FRAME_SIZE == s->raw_len;
+            if (s->pyramid)
+                yuyv_to_rgb_pyramid(s->raw, HRES, VRES, s->rgb, s->half, s->quarter);
+            else
+                yuyv_to_rgb_fast(s->raw, (int)s->raw_len, s->rgb);
+            perf_counters_read(&counters, &after);
+            metrics_observe(METRIC_CONVERT_US, monotonic_us() - start);
+            perf_counters_delta(&before, &after, &delta);
+            metrics_stage_counters(METRIC_STAGE_CONVERT, &delta);
+            trace_end("convert", span, s->sequence);
+        }
+
+        s->motion_cells = MOTION_NOT_ANALYSED;
+        if (motion_enabled() && YUYV_FRAME_SIZE == s->raw_len)
+        {
+            start = monotonic_us();
+            s->motion_cells = motion_analyse(s->raw);
+            metrics_observe(METRIC_MOTION_US, monotonic_us() - start);
+        }
+
+        pthread_mutex_lock(&lock);
+        s->state = SLOT_READY;
+        pthread_mutex_unlock(&lock);
+        if ((ssize_t)sizeof(one) != write(event_fd, &one, sizeof(one)))
+            syslog(LOG_ERR, "Failed to signal a converted frame");
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    perf_counters_close(&counters);
+    return NULL;
+}
+
+/**
+ * @brief   Allocate the frame slots and start the capture and conversion
+ *          threads.
+ *
+ * The camera must already be streaming. Slot memory is prefaulted here so
+ * neither thread takes a page fault on its first frames.
+ *
+ * @param   config  Scheduling of the two threads, and whether RGB images
+ *                  are made at all.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int pipeline_start(const struct pipeline_config *config)
+{
+    cfg = *config;
+
+    for (int i = 0; i < PIPELINE_SLOTS; i++)
+    {
+        slots[i].raw = aligned_alloc(64, YUYV_FRAME_SIZE);
+        if (!slots[i].raw)
+        {
+            syslog(LOG_ERR, "Out of memory for capture slots");
+            return -1;
+        }
+        rt_prefault(slots[i].raw, YUYV_FRAME_SIZE);
+        slots[i].state = SLOT_FREE;
+        if (cfg.raw_only)
+            continue;
+
+        slots[i].rgb = aligned_alloc(64, RGB_FRAME_SIZE);
+        slots[i].half = aligned_alloc(64, RGB_FRAME_SIZE / 4);
+        slots[i].quarter = aligned_alloc(64, RGB_FRAME_SIZE / 16);
+        if (!slots[i].rgb || !slots[i].half || !slots[i].quarter)
+        {
+            syslog(LOG_ERR, "Out of memory for capture slots");
+            return -1;
+        }
+        rt_prefault(slots[i].rgb, RGB_FRAME_SIZE);
+        rt_prefault(slots[i].half, RGB_FRAME_SIZE / 4);
+        rt_prefault(slots[i].quarter, RGB_FRAME_SIZE / 16);
+    }
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (event_fd < 0 || stop_fd < 0)
+    {
+        syslog(LOG_ERR, "Failed to create pipeline eventfds: %s", strerror(errno));
+        return -1;
+    }
+
+    if (0 != pthread_create(&capture_tid, NULL, capture_thread, NULL) ||
+        0 != pthread_create(&convert_tid, NULL, convert_thread, NULL))
+    {
+        syslog(LOG_ERR, "Failed to start the capture threads");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Returns a descriptor that becomes readable when a converted
+ *          frame is ready.
+ *
+ * @return  The pipeline's eventfd.
+ */
+int pipeline_event_fd(void)
+{
+    return event_fd;
+}
+
+/**
+ * @brief   Take the newest converted frame.
+ *
+ * Older converted frames that the send loop never got to are released, so
+ * the loop always works on the most recent frame.
+ *
+ * @return  The frame, to be given back with pipeline_release(), or NULL
+ *          if no converted frame is ready.
+ */
+struct pipeline_frame *pipeline_acquire(void)
+{
+    struct pipeline_frame *newest = NULL;
+    uint64_t count;
+
+    if (-1 == read(event_fd, &count, sizeof(count)) && EAGAIN != errno)
+        syslog(LOG_ERR, "Failed to read the pipeline eventfd: %s", strerror(errno));
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < PIPELINE_SLOTS; i++)
+    {
+        if (SLOT_READY != slots[i].state)
+            continue;
+        if (newest && newest->sequence > slots[i].sequence)
+        {
+            slots[i].state = SLOT_FREE;
+            metrics_add(METRIC_PIPELINE_OVERRUNS, 1);
+            continue;
+        }
+        if (newest)
+        {
+            newest->state = SLOT_FREE;
+            metrics_add(METRIC_PIPELINE_OVERRUNS, 1);
+        }
+        newest = &slots[i];
+    }
+    if (newest)
+        newest->state = SLOT_IN_USE;
+    pthread_mutex_unlock(&lock);
+    return newest;
+}
+
+/**
+ * @brief   Give a frame obtained from pipeline_acquire() back.
+ *
+ * @param   frame   Frame to release.
+ *
+ * @return  This function does not return a value.
+ */
+void pipeline_release(struct pipeline_frame *frame)
+{
+    set_state(frame, SLOT_FREE);
+}
+
+/**
+ * @brief   Stop and join the capture and conversion threads.
+ *
+ * @return  This function does not return a value.
+ */
+void pipeline_stop(void)
+{
+    uint64_t one = 1;
+
+    if (stop_fd < 0)
+        return;
+    atomic_store(&stopping, 1);
+    if ((ssize_t)sizeof(one) != write(stop_fd, &one, sizeof(one)))
+        syslog(LOG_ERR, "Failed to signal the capture thread");
+    pthread_mutex_lock(&lock);
+    pthread_cond_broadcast(&captured);
+    pthread_mutex_unlock(&lock);
+    pthread_join(capture_tid, NULL);
+    pthread_join(convert_tid, NULL);
+}
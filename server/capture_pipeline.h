@@ -0,0 +1,45 @@
+/**
+ * @file capture_pipeline.h
+ * @brief Capture and conversion threads feeding converted frames to the
+ *        server's send loop.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __CAPTURE_PIPELINE_H__
+#define __CAPTURE_PIPELINE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "camera_drivers.h"
+#include "rt_sched.h"
+
+struct pipeline_frame
+{
+    unsigned char *raw;         /* YUYV as captured */
+    size_t raw_len;
+    unsigned char *rgb;         /* converted RGB24, NULL if the sessions convert themselves */
+    unsigned char *half;        /* rgb box-filtered to half size */
+    unsigned char *quarter;     /* and to quarter size */
+    int pyramid;                /* half and quarter hold this frame */
+    unsigned int motion_cells;  /* motion_analyse() result or MOTION_NOT_ANALYSED */
+    uint32_t sequence;
+    uint64_t timestamp_us;      /* capture time, CLOCK_MONOTONIC */
+    int state;                  /* owned by capture_pipeline.c */
+};
+
+struct pipeline_config
+{
+    struct rt_thread_config capture;
+    struct rt_thread_config convert;
+    int raw_only;               /* nothing needs RGB images, only motion analysis runs */
+};
+
+int pipeline_start(const struct pipeline_config *config);
+int pipeline_event_fd(void);
+struct pipeline_frame *pipeline_acquire(void);
+void pipeline_release(struct pipeline_frame *frame);
+void pipeline_stop(void);
+
+#endif /* __CAPTURE_PIPELINE_H__ */
@@ -0,0 +1,1216 @@
+/**
+ * @file client_session.c
+ * @brief State kept by the server for each connected client.
+ *
+ * Client sockets are non-blocking. Each client owns one outgoing frame
+ * buffer; a frame that has not been fully handed to the kernel by the time
+ * the next one is captured makes the client drop that next frame instead of
+ * queueing it, so a slow client never accumulates latency or stalls the
+ * others.
+ *
+ * The adaptive quality controller picks the ladder step each frame is
+ * rendered at, in the format the client asked for: RGB24 frames are cut
+ * from the pipeline's shared full, half and quarter size RGB images, the
+ * compact formats are converted straight from the captured YUYV frame. A
+ * client may subscribe to the half or quarter size stream instead of the
+ * full frame, and the ladder then scales that level further down. A client
+ * that asked for a crop, scale or rotation gets every frame converted
+ * through that transform instead, and the ladder scales the transformed
+ * size. With regions of interest, only those rectangles are rendered and
+ * sent, one frame each; RGB24 regions are cut from the shared RGB image,
+ * and a region another client already rendered for the same frame is
+ * copied, not converted again.
+ *
+ * A client that asked for delta frames gets only the tiles of each image
+ * that changed from what it last received, with a whole keyframe at its
+ * chosen interval, on request and whenever the images change size, format
+ * or region. Clients that ask for it get a CRC32C at the end of every frame
+ * to check it arrived intact.
+ *
+ * With a band size set, whole RGB24, RGB565 and grey frames are streamed:
+ * the frame is converted from YUYV a band of rows at a time into the
+ * session's band-sized buffer and each band is sent as soon as it is
+ * made, so the first byte leaves after one band's conversion and the
+ * buffer stays cache resident. If the socket fills up part way, the rest
+ * of the frame is converted into a whole frame buffer, allocated then,
+ * so no frame slot is held past the send loop's pass. Regions,
+ * transforms, deltas and the 4:2:0 formats need the whole image and are
+ * always rendered whole.
+ *
+ * With io_uring, sends are not made one socket at a time: each client's
+ * unsent frame is queued on a ring as one write from its frame buffer,
+ * registered with the ring where the kernel and the locked memory limit
+ * allow, and everything queued during a pass of the send loop goes to the
+ * kernel in one io_uring_enter(). A write usually takes the whole frame,
+ * but completes short when the socket fills up, and the rest is queued
+ * again as its completion is handled. Completions only wake the loop while
+ * a replay is waiting to queue its next frame; otherwise they are picked
+ * up when the next frame arrives. A session closed with a send in flight
+ * cancels it and waits for its completion before freeing the buffer. Band
+ * streaming needs every band sent before the next is converted and is not
+ * used with the ring; commands, rare and tiny, are still read when poll()
+ * says so.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/sockios.h>
+#include "client_session.h"
+#include "camera_drivers.h"
+#include "color_convert.h"
+#include "metrics.h"
+#include "history.h"
+#include "../common/frame_protocol.h"
+#include "../common/frame_delta.h"
+#include "../common/frame_crc.h"
+#include "../common/uring.h"
+#include "../common/clock_utils.h"
+
+#define FRAME_BUFFER_SIZE (FRAME_MAX_ROIS * (FRAME_HEADER_SIZE + FRAME_CRC_SIZE) + FRAME_MAX_PAYLOAD)
+
+/* user_data of a session's send on the ring, and of requests that cancel one */
+#define SEND_TAG(s) ((uint64_t)generation[(s)->slot] << 8 | (uint64_t)(s)->slot)
+#define CANCEL_TAG (1ull << 63)
+
+/* Bytes of converted rows per streamed band, 0 renders every frame whole */
+static size_t band_bytes;
+
+/* With io_uring, sends are queued here and submitted once per pass */
+static struct uring ring;
+static int uring_active;
+static int buffer_slots;        /* the ring has a registered buffer slot per session */
+static uint8_t generation[MAX_CLIENTS]; /* tells completions for a closed session from its successor's */
+
+/**
+ * @brief   Stream whole frames in bands of rows instead of rendering them
+ *          whole first.
+ *
+ * Must be called before any client connects.
+ *
+ * @param   bytes   Converted bytes per band, rounded down to whole rows
+ *                  but at least one row; 0 turns streaming off.
+ *
+ * @return  This function does not return a value.
+ */
+void session_set_band_size(size_t bytes)
+{
+    band_bytes = bytes;
+}
+
+/**
+ * @brief   Send frames through io_uring instead of send().
+ *
+ * Must be called before any client connects, and not together with
+ * session_set_band_size().
+ *
+ * @param   entries Submission ring size, at least MAX_CLIENTS.
+ *
+ * @return  0 on success, -1 if the kernel has no io_uring for this process.
+ */
+int session_use_uring(unsigned int entries)
+{
+    if (-1 == uring_init(&ring, entries, 0))
+    {
+        syslog(LOG_ERR, "io_uring is not available: %s", strerror(errno));
+        return -1;
+    }
+    /* Before 5.19 buffers cannot come and go with clients, and are sent unregistered */
+    buffer_slots = 0 == uring_reserve_buffers(&ring, MAX_CLIENTS);
+    if (!buffer_slots)
+        syslog(LOG_INFO, "No registered buffers for sends: %s", strerror(errno));
+    uring_active = 1;
+    return 0;
+}
+
+/**
+ * @brief   The descriptor to poll for send completions.
+ *
+ * @return  The ring's descriptor, -1 without io_uring.
+ */
+int session_uring_fd(void)
+{
+    return uring_active ? ring.fd : -1;
+}
+
+/**
+ * @brief   Tells whether the session has to hear about its send completing
+ *          as soon as it does.
+ *
+ * Only a replay does, to queue its next frame; a live frame's completion
+ * can wait for the next frame to wake the send loop.
+ *
+ * @param   s   Session to check.
+ *
+ * @return  Non-zero if a replay frame is being sent through the ring.
+ */
+int session_wants_completion(const struct client_session *s)
+{
+    return s->sending && s->replaying;
+}
+
+/**
+ * @brief   Grows the frame buffer to hold any whole frame.
+ *
+ * @return  0 on success, -1 if out of memory.
+ */
+static int reserve_frame_buffer(struct client_session *s)
+{
+    unsigned char *buf;
+
+    if (s->out_cap >= FRAME_BUFFER_SIZE)
+        return 0;
+    if (!(buf = realloc(s->out_buf, FRAME_BUFFER_SIZE)))
+    {
+        syslog(LOG_ERR, "Out of memory for a frame of client %s", inet_ntoa(s->addr.sin_addr));
+        return -1;
+    }
+    s->out_buf = buf;
+    s->out_cap = FRAME_BUFFER_SIZE;
+    return 0;
+}
+
+/**
+ * @brief   Initialise a session for a freshly accepted client socket.
+ *
+ * @param   s       Session to initialise.
+ * @param   slot    Index of the session in the server's session table.
+ * @param   fd      Connected, non-blocking client socket.
+ * @param   addr    Peer address, used for logging.
+ *
+ * @return  0 on success, -1 if the frame buffer could not be allocated.
+ */
+int session_open(struct client_session *s, int slot, int fd, const struct sockaddr_in *addr)
+{
+    char name[32];
+
+    memset(s, 0, sizeof(*s));
+    /* Streaming sessions start with room for one band and its header */
+    s->out_cap = band_bytes ? FRAME_HEADER_SIZE + (band_bytes > HRES * 3 ? band_bytes : HRES * 3) + FRAME_CRC_SIZE
+                            : FRAME_BUFFER_SIZE;
+    s->out_buf = malloc(s->out_cap);
+    if (!s->out_buf)
+    {
+        syslog(LOG_ERR, "Out of memory for client %s", inet_ntoa(addr->sin_addr));
+        s->fd = -1;
+        return -1;
+    }
+    s->fd = fd;
+    s->slot = slot;
+    s->addr = *addr;
+    quality_init(&s->quality, monotonic_us());
+    if (buffer_slots)
+    {
+        /* Pinned memory counts against RLIMIT_MEMLOCK, past it sends go unregistered */
+        s->fixed_buffer = 0 == uring_update_buffer(&ring, (unsigned int)slot, s->out_buf, s->out_cap);
+        if (!s->fixed_buffer)
+            syslog(LOG_INFO, "Frames for %s are sent from an unregistered buffer: %s",
+                   inet_ntoa(addr->sin_addr), strerror(errno));
+    }
+
+    snprintf(name, sizeof(name), "%s:%u", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+    metrics_client_open(slot, name);
+    return 0;
+}
+
+/**
+ * @brief   Close the client socket and release the session.
+ *
+ * @param   s   Session to close.
+ *
+ * @return  This function does not return a value.
+ */
+void session_close(struct client_session *s)
+{
+    syslog(LOG_INFO, "Closed connection with %s (%lu frames sent, %lu dropped)",
+           inet_ntoa(s->addr.sin_addr), s->frames_sent, s->frames_dropped);
+    printf("Closed connection with %s\n", inet_ntoa(s->addr.sin_addr));
+    if (s->sending)
+    {
+        struct io_uring_sqe *sqe;
+        unsigned long enters;
+
+        /*
+         * The kernel may still be reading out_buf. The send has to reach it
+         * while the descriptor is still this client's, be cancelled, or fail
+         * on the shut down socket if it is already running, and complete
+         * before the buffer is freed.
+         */
+        if (!(sqe = uring_get_sqe(&ring)))
+        {
+            session_uring_submit();
+            sqe = uring_get_sqe(&ring);
+        }
+        if (sqe)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = SEND_TAG(s);
+            sqe->user_data = CANCEL_TAG;
+        }
+        session_uring_submit();
+        shutdown(s->fd, SHUT_RDWR);
+        enters = ring.enters;
+        if (-1 == uring_wait_for(&ring, SEND_TAG(s)))
+        {
+            syslog(LOG_ERR, "Failed to wait for the last send to %s, keeping its buffer: %s",
+                   inet_ntoa(s->addr.sin_addr), strerror(errno));
+            s->out_buf = NULL;
+        }
+        metrics_add(METRIC_IO_SYSCALLS, ring.enters - enters);
+        s->sending = 0;
+    }
+    generation[s->slot]++;
+    if (s->fixed_buffer)
+        uring_update_buffer(&ring, (unsigned int)s->slot, NULL, 0);
+    if (s->fd >= 0)
+        close(s->fd);
+    metrics_client_close(s->slot);
+    free(s->out_buf);
+    free(s->delta_ref);
+    s->out_buf = NULL;
+    s->delta_ref = NULL;
+    s->fd = -1;
+}
+
+/**
+ * @brief   Tells whether part of the current frame is still unsent.
+ *
+ * @param   s   Session to check.
+ *
+ * @return  Non-zero if the session is waiting for socket buffer space.
+ */
+int session_pending(const struct client_session *s)
+{
+    return s->out_off < s->out_len;
+}
+
+/**
+ * @brief   Tells whether the session needs to be told about write space.
+ *
+ * With io_uring, only a history replay waiting for its first frame does;
+ * the ring carries everything else.
+ *
+ * @param   s   Session to check.
+ *
+ * @return  Non-zero if a frame is in flight or a history replay is running.
+ */
+int session_wants_write(const struct client_session *s)
+{
+    if (uring_active)
+        return s->replaying && !session_pending(s);
+    return session_pending(s) || s->replaying;
+}
+
+/*
+ * Regions rendered for recent frames. Clients asking for the same region
+ * of the same frame, at the same size and in the same format, get a copy
+ * of the first client's conversion instead of converting it again.
+ */
+struct shared_region
+{
+    uint32_t sequence;
+    uint8_t format;
+    struct frame_transform t;   /* source rectangle and output size */
+    size_t len;
+    size_t capacity;
+    unsigned char *data;
+};
+
+static struct shared_region shared[MAX_CLIENTS * FRAME_MAX_ROIS];
+static unsigned int shared_next;
+
+/* Where a delta is encoded before it replaces the image in the frame buffer */
+static unsigned char *delta_buf;
+
+static struct shared_region *shared_find(uint32_t sequence, uint8_t format, const struct frame_transform *t)
+{
+    for (size_t i = 0; i < sizeof(shared) / sizeof(shared[0]); i++)
+    {
+        if (shared[i].len && shared[i].sequence == sequence && shared[i].format == format &&
+            0 == memcmp(&shared[i].t, t, sizeof(*t)))
+            return &shared[i];
+    }
+    return NULL;
+}
+
+static void shared_store(uint32_t sequence, uint8_t format, const struct frame_transform *t,
+                         const unsigned char *data, size_t len)
+{
+    struct shared_region *r = &shared[shared_next++ % (sizeof(shared) / sizeof(shared[0]))];
+
+    if (r->capacity < len)
+    {
+        free(r->data);
+        r->data = malloc(len);
+        r->capacity = r->data ? len : 0;
+    }
+    r->len = 0;
+    if (!r->data)
+        return;
+    memcpy(r->data, data, len);
+    r->sequence = sequence;
+    r->format = format;
+    r->t = *t;
+    r->len = len;
+}
+
+/**
+ * @brief   Recomputes the images the client receives per frame.
+ *
+ * One image per region of interest in index order if it set any,
+ * otherwise the whole frame, transformed if it asked for that.
+ */
+static void update_images(struct client_session *s)
+{
+    unsigned int images = 0;
+
+    for (unsigned int i = 0; i < FRAME_MAX_ROIS; i++)
+    {
+        const struct frame_roi *r = &s->rois[i];
+
+        if (!r->width)
+            continue;
+        s->image_roi[images] = (uint8_t)i;
+        s->quality.width[images] = r->width / r->scale;
+        s->quality.height[images] = r->height / r->scale;
+        images++;
+    }
+    if (!images)
+    {
+        s->quality.width[0] = s->transformed ? s->transform.width : HRES >> s->pyramid_level;
+        s->quality.height[0] = s->transformed ? s->transform.height : VRES >> s->pyramid_level;
+        images = 1;
+    }
+    s->quality.images = images;
+}
+
+/**
+ * @brief   Renders one image of a frame for the client at a ladder level.
+ *
+ * @return  0 on success, -1 if the frame lacks the source the client's
+ *          format or transform needs.
+ */
+static int render_image(struct client_session *s, const unsigned char *const *rgb, const unsigned char *raw,
+                        uint32_t sequence, unsigned int level, unsigned int image, unsigned char *dst)
+{
+    const struct quality_step *step = quality_get_step(level);
+    struct frame_transform t = s->transform;
+    unsigned int width, height, scale = step->scale << s->pyramid_level;
+    unsigned int from = 0;
+
+    quality_output_size(&s->quality, level, image, &width, &height);
+    if (s->rois[s->image_roi[image]].width)
+    {
+        const struct frame_roi *r = &s->rois[s->image_roi[image]];
+        scale = r->scale * step->scale;
+        struct shared_region *copy;
+        size_t len = frame_format_bytes(s->format, width, height);
+
+        /* The rectangle is trimmed to a whole number of output pixels */
+        memset(&t, 0, sizeof(t));
+        t.crop_x = r->x;
+        t.crop_y = r->y;
+        t.crop_width = (uint16_t)(width * scale);
+        t.crop_height = (uint16_t)(height * scale);
+        t.width = (uint16_t)width;
+        t.height = (uint16_t)height;
+        if ((copy = shared_find(sequence, s->format, &t)))
+        {
+            memcpy(dst, copy->data, len);
+            metrics_add(METRIC_ROI_SHARED, 1);
+            return 0;
+        }
+        if (FRAME_FMT_RGB24 == s->format && rgb)
+            rgb_crop_downscale(rgb[0], HRES, r->x, r->y, width, height, scale, dst);
+        else if (!raw || -1 == yuyv_transform(raw, HRES, VRES, &t, s->format, dst))
+            return -1;
+        shared_store(sequence, s->format, &t, dst, len);
+        return 0;
+    }
+    if (s->transformed)
+    {
+        if (!raw)
+            return -1;
+        t.width = (uint16_t)width;
+        t.height = (uint16_t)height;
+        return yuyv_transform(raw, HRES, VRES, &t, s->format, dst);
+    }
+    if (FRAME_FMT_RGB24 == s->format && rgb)
+    {
+        /* Start from the smallest level the scale is a multiple of */
+        while (from + 1 < FRAME_PYRAMID_LEVELS && rgb[from + 1] && !(scale & ((2u << from) - 1)))
+            from++;
+        rgb_downscale(rgb[from], HRES >> from, VRES >> from, scale >> from, dst);
+        return 0;
+    }
+    return raw ? yuyv_convert(raw, HRES, VRES, scale, s->format, dst) : -1;
+}
+
+/**
+ * @brief   Tells whether the next live frame must go out whole: the
+ *          client's keyframe interval is up, it asked for one, or its
+ *          images no longer match the ones deltas would be taken against.
+ */
+static int keyframe_due(const struct client_session *s, unsigned int level)
+{
+    if (s->keyframe_wanted || s->since_keyframe >= s->keyframe_interval || s->ref_images != s->quality.images)
+        return 1;
+    for (unsigned int i = 0; i < s->quality.images; i++)
+    {
+        unsigned int width, height;
+        uint16_t flags = s->rois[s->image_roi[i]].width ? (uint16_t)(FRAME_FLAG_ROI | (s->image_roi[i] << 8)) : 0;
+
+        quality_output_size(&s->quality, level, i, &width, &height);
+        if (s->ref_header[i].width != width || s->ref_header[i].height != height ||
+            s->ref_header[i].format != s->format || s->ref_header[i].flags != flags)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Fills the frame buffer with every image of a frame, each behind
+ *          a header of its own.
+ *
+ * Live frames for a client that takes deltas carry only the changed tiles
+ * of each image, unless a keyframe is due or the delta would be no smaller.
+ * Each image is sealed with its CRC last, so the CRC covers what is sent.
+ *
+ * @return  0 on success, -1 if the frame could not be rendered.
+ */
+static int load_frame(struct client_session *s, const unsigned char *const *rgb, const unsigned char *raw,
+                      uint32_t sequence, uint64_t timestamp_us, unsigned int level, uint16_t flags)
+{
+    size_t len = 0, ref_off = 0;
+    int delta = s->keyframe_interval && s->delta_ref && !(flags & FRAME_FLAG_HISTORY);
+    int key = delta && keyframe_due(s, level);
+
+    if (-1 == reserve_frame_buffer(s))
+        return -1;
+    for (unsigned int i = 0; i < s->quality.images; i++)
+    {
+        struct frame_header hdr;
+        unsigned int width, height;
+        unsigned char *payload = s->out_buf + len + FRAME_HEADER_SIZE;
+
+        quality_output_size(&s->quality, level, i, &width, &height);
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = FRAME_MAGIC;
+        hdr.sequence = sequence;
+        hdr.timestamp_us = timestamp_us;
+        hdr.width = (uint16_t)width;
+        hdr.height = (uint16_t)height;
+        hdr.format = s->format;
+        hdr.level = (uint8_t)level;
+        hdr.flags = flags;
+        if (s->rois[s->image_roi[i]].width)
+            hdr.flags |= (uint16_t)(FRAME_FLAG_ROI | (s->image_roi[i] << 8));
+        hdr.payload_size = frame_format_bytes(s->format, width, height);
+        if (-1 == render_image(s, rgb, raw, sequence, level, i, payload))
+        {
+            /* The references may already be ahead of the client */
+            s->keyframe_wanted |= delta;
+            return -1;
+        }
+        if (delta)
+        {
+            uint32_t full = hdr.payload_size;
+            size_t delta_len = key ? 0 : frame_delta_encode(s->format, width, height, payload,
+                                                            s->delta_ref + ref_off, s->delta_threshold, delta_buf);
+
+            s->ref_header[i] = hdr;
+            if (delta_len)
+            {
+                memcpy(payload, delta_buf, delta_len);
+                hdr.flags |= FRAME_FLAG_DELTA;
+                hdr.payload_size = (uint32_t)delta_len;
+                metrics_add(METRIC_DELTA_FRAMES, 1);
+                metrics_add(METRIC_DELTA_BYTES_SAVED, full - delta_len);
+            }
+            else
+            {
+                memcpy(s->delta_ref + ref_off, payload, full);
+                metrics_add(METRIC_KEYFRAMES, 1);
+            }
+            ref_off += full;
+        }
+        if (s->crc)
+        {
+            uint64_t start = monotonic_us();
+
+            frame_crc_seal(&hdr, payload);
+            metrics_observe(METRIC_CRC_US, monotonic_us() - start);
+        }
+        frame_header_pack(&hdr, s->out_buf + len);
+        len += FRAME_HEADER_SIZE + hdr.payload_size;
+    }
+    if (delta)
+    {
+        s->ref_images = s->quality.images;
+        s->keyframe_wanted = 0;
+        s->since_keyframe = key ? 1 : s->since_keyframe + 1;
+    }
+    s->out_len = len;
+    s->out_off = 0;
+    return 0;
+}
+
+/**
+ * @brief   Fills the frame buffer with the empty frame that closes the
+ *          history part of a replay.
+ */
+static void load_history_end(struct client_session *s)
+{
+    struct frame_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = FRAME_MAGIC;
+    hdr.format = s->format;
+    hdr.flags = FRAME_FLAG_HISTORY_END;
+    if (s->crc)
+        frame_crc_seal(&hdr, s->out_buf + FRAME_HEADER_SIZE);
+    frame_header_pack(&hdr, s->out_buf);
+    s->out_len = FRAME_HEADER_SIZE + hdr.payload_size;
+    s->out_off = 0;
+}
+
+/**
+ * @brief   Fills the frame buffer with the next history frame of a replay.
+ *
+ * Ends the history with an empty FRAME_FLAG_HISTORY_END frame once the
+ * range is exhausted, or once it reaches replay_live_us. Frames from then
+ * on are sent from the ring as live frames, at the client's quality level,
+ * until the replay has caught up with the newest frame offered.
+ */
+static void load_replay_frame(struct client_session *s)
+{
+    struct history_frame h;
+    int found = 0 == history_find(s->replay_sequence, s->replay_start_us, &h) &&
+                h.timestamp_us <= s->replay_end_us;
+
+    if (found && s->replay_live_us && h.timestamp_us >= s->replay_live_us && !s->replay_past_history)
+    {
+        s->replay_past_history = 1;
+        load_history_end(s);
+        return;
+    }
+    if (found)
+    {
+        s->replay_sequence = h.sequence + 1;
+        if (0 == load_frame(s, NULL, h.data, h.sequence, h.timestamp_us,
+                            s->replay_past_history ? s->quality.level : 0,
+                            s->replay_past_history ? 0 : FRAME_FLAG_HISTORY))
+            return;
+    }
+
+    s->replaying = 0;
+    if (s->replay_past_history)
+    {
+        /* Caught up, the next frame offered goes out as usual */
+        s->out_len = s->out_off = 0;
+        return;
+    }
+    load_history_end(s);
+}
+
+/**
+ * @brief   Start streaming the history frames captured in a time range.
+ *
+ * With live_us set, frames captured from then on are not history: they
+ * follow the history end as live frames, and the range is extended to each
+ * newer frame offered until the replay catches up with them.
+ */
+static void start_replay(struct client_session *s, uint64_t start_us, uint64_t end_us, uint64_t live_us)
+{
+    s->replay_sequence = 0;
+    s->replay_start_us = start_us;
+    s->replay_end_us = end_us;
+    s->replay_live_us = live_us;
+    s->replay_past_history = 0;
+    s->replaying = 1;
+}
+
+/**
+ * @brief   Queue the unsent part of out_buf on the ring as one write, unless
+ *          one is queued already.
+ *
+ * A registered buffer is written with WRITE_FIXED, otherwise SEND with
+ * MSG_WAITALL sends from unregistered memory. Either can complete having
+ * taken only part of it, when the socket fills up or the connection fails;
+ * session_uring_complete() then queues the rest.
+ *
+ * @return  0 on success, -1 if the ring could not take it.
+ */
+static int queue_send(struct client_session *s)
+{
+    struct io_uring_sqe *sqe;
+
+    if (s->sending || s->out_off >= s->out_len)
+        return 0;
+    if (!(sqe = uring_get_sqe(&ring)))
+    {
+        session_uring_submit();
+        if (!(sqe = uring_get_sqe(&ring)))
+        {
+            syslog(LOG_ERR, "No room on the ring for a send to %s", inet_ntoa(s->addr.sin_addr));
+            return -1;
+        }
+    }
+    if (s->fixed_buffer)
+    {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = (uint16_t)s->slot;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    }
+    sqe->fd = s->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(s->out_buf + s->out_off);
+    sqe->len = (uint32_t)(s->out_len - s->out_off);
+    sqe->user_data = SEND_TAG(s);
+    s->sending = 1;
+    s->captured_us = 0;
+    return 0;
+}
+
+/**
+ * @brief   send() as much of out_buf as the socket accepts, without timing
+ *          it.
+ *
+ * @return  0 on success (including a partial send), -1 if the connection
+ *          failed.
+ */
+static int send_out(struct client_session *s)
+{
+    size_t before = s->out_off;
+    int status = 0;
+
+    while (s->out_off < s->out_len)
+    {
+        ssize_t n = send(s->fd, s->out_buf + s->out_off, s->out_len - s->out_off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        metrics_add(METRIC_IO_SYSCALLS, 1);
+        if (n < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            if (EAGAIN != errno && EWOULDBLOCK != errno)
+                status = -1;
+            break;
+        }
+        s->out_off += (size_t)n;
+        s->bytes_sent += (uint64_t)n;
+    }
+
+    metrics_add(METRIC_BYTES_SENT, s->out_off - before);
+    if (s->captured_us && s->out_off > before)
+    {
+        metrics_observe(METRIC_FIRST_BYTE_US, monotonic_us() - s->captured_us);
+        s->captured_us = 0;
+    }
+    return status;
+}
+
+/**
+ * @brief   Hand as much of out_buf to the kernel as it accepts.
+ *
+ * With io_uring this only queues it, see queue_send().
+ *
+ * @return  0 on success (including a partial send), -1 if the connection
+ *          failed.
+ */
+static int send_pending(struct client_session *s)
+{
+    uint64_t start = monotonic_us();
+    int status;
+
+    if (uring_active)
+        return queue_send(s);
+    status = send_out(s);
+    if (s->out_len)
+        metrics_observe(METRIC_SEND_US, monotonic_us() - start);
+    return status;
+}
+
+/**
+ * @brief   Hand as much of the pending frame to the kernel as it accepts.
+ *
+ * During a history replay, frames are loaded back to back for as long as
+ * the socket accepts them, so the replay runs at link speed.
+ *
+ * @param   s   Session to flush.
+ *
+ * @return  0 on success (including a partial send), -1 if the connection
+ *          failed and the session should be closed.
+ */
+int session_flush(struct client_session *s)
+{
+    for (;;)
+    {
+        int status = send_pending(s);
+
+        if (status || s->out_off < s->out_len)
+            return status;
+        if (s->out_len)
+        {
+            s->frames_sent++;
+            metrics_add(METRIC_FRAMES_SENT, 1);
+            s->out_len = s->out_off = 0;
+        }
+        if (!s->replaying)
+            return 0;
+        load_replay_frame(s);
+    }
+}
+
+/**
+ * @brief   Act on the sends the kernel has finished since the last call.
+ *
+ * Each completion moves its session on as a send() would have: the frame
+ * is counted, the next replay frame queued, or the session closed if the
+ * connection failed. Completions of a session closed in the meantime are
+ * dropped.
+ *
+ * @param   sessions    The server's session table, MAX_CLIENTS long.
+ *
+ * @return  This function does not return a value.
+ */
+void session_uring_complete(struct client_session *sessions)
+{
+    struct io_uring_cqe cqe;
+
+    while (uring_active && 0 == uring_peek(&ring, &cqe))
+    {
+        struct client_session *s = &sessions[cqe.user_data & 0xff];
+
+        if ((cqe.user_data & CANCEL_TAG) || s->fd < 0 || !s->sending || (uint8_t)(cqe.user_data >> 8) != generation[s->slot])
+            continue;
+        s->sending = 0;
+        if (cqe.res <= 0)
+        {
+            session_close(s);
+            continue;
+        }
+        s->out_off += (size_t)cqe.res;
+        s->bytes_sent += (uint64_t)cqe.res;
+        metrics_add(METRIC_BYTES_SENT, (uint64_t)cqe.res);
+        if (-1 == session_flush(s))
+            session_close(s);
+    }
+}
+
+/**
+ * @brief   Hand every send queued since the last call to the kernel, in one
+ *          system call for all clients and frames.
+ *
+ * @return  This function does not return a value.
+ */
+void session_uring_submit(void)
+{
+    unsigned long enters = ring.enters;
+
+    if (!uring_active)
+        return;
+    if (-1 == uring_submit(&ring, 0))
+        syslog(LOG_ERR, "Failed to submit sends: %s", strerror(errno));
+    metrics_add(METRIC_IO_SYSCALLS, ring.enters - enters);
+}
+
+/**
+ * @brief   Tells whether a live frame can be streamed to the client in
+ *          bands: one whole image in a format laid out row by row, with
+ *          nothing that needs the image complete before it is sent.
+ */
+static int band_streamable(const struct client_session *s, const struct frame_info *frame)
+{
+    return band_bytes && YUYV_FRAME_SIZE == frame->raw_len && 1 == s->quality.images &&
+           !s->rois[s->image_roi[0]].width && !s->transformed && !(s->keyframe_interval && s->delta_ref) &&
+           (FRAME_FMT_RGB24 == s->format || FRAME_FMT_RGB565 == s->format || FRAME_FMT_GRAY == s->format);
+}
+
+/* Where the rows of a frame being streamed come from */
+struct band_source
+{
+    const unsigned char *raw;
+    unsigned int scale;
+    unsigned int height;        /* output rows */
+    size_t row_bytes;           /* per output row */
+    int crc;
+};
+
+/*
+ * Appends output rows y to y + n - 1 to out_buf and folds them into the
+ * CRC, which follows the last row if the client checks frames
+ */
+static void append_rows(struct client_session *s, const struct band_source *src, unsigned int y, unsigned int n,
+                        uint32_t *crc)
+{
+    unsigned char *dst = s->out_buf + s->out_len;
+    size_t len = (size_t)n * src->row_bytes;
+
+    yuyv_convert(src->raw + (size_t)y * src->scale * HRES * 2, HRES, n * src->scale, src->scale, s->format, dst);
+    if (src->crc)
+    {
+        *crc = crc32c(*crc, dst, len);
+        if (y + n == src->height)
+        {
+            dst[len] = (unsigned char)(*crc >> 24);
+            dst[len + 1] = (unsigned char)(*crc >> 16);
+            dst[len + 2] = (unsigned char)(*crc >> 8);
+            dst[len + 3] = (unsigned char)*crc;
+            len += FRAME_CRC_SIZE;
+        }
+    }
+    s->out_len += len;
+}
+
+/**
+ * @brief   Converts and sends a live frame one band of rows at a time.
+ *
+ * Each band is converted straight from the captured YUYV frame into the
+ * frame buffer and handed to the socket before the next one is made. Once
+ * the socket stops taking them, the remaining rows are converted in one
+ * go into a whole frame buffer and left for session_flush(), since the
+ * captured frame is only valid during this call.
+ *
+ * @return  0 on success (including a partial send), -1 if the connection
+ *          failed and the session should be closed.
+ */
+static int stream_frame(struct client_session *s, const struct frame_info *frame)
+{
+    const struct quality_step *step = quality_get_step(s->quality.level);
+    struct band_source src;
+    struct frame_header hdr;
+    unsigned int width, rows, y = 0;
+    uint32_t crc = 0;
+    uint64_t send_us = 0;
+
+    quality_output_size(&s->quality, s->quality.level, 0, &width, &src.height);
+    src.raw = frame->raw;
+    src.scale = step->scale << s->pyramid_level;
+    src.row_bytes = frame_format_bytes(s->format, width, 1);
+    src.crc = s->crc;
+    rows = band_bytes >= src.row_bytes ? (unsigned int)(band_bytes / src.row_bytes) : 1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = FRAME_MAGIC;
+    hdr.sequence = frame->sequence;
+    hdr.timestamp_us = frame->timestamp_us;
+    hdr.width = (uint16_t)width;
+    hdr.height = (uint16_t)src.height;
+    hdr.format = s->format;
+    hdr.level = (uint8_t)s->quality.level;
+    hdr.payload_size = (uint32_t)(src.row_bytes * src.height);
+    if (s->crc)
+    {
+        hdr.flags = FRAME_FLAG_CRC;
+        hdr.payload_size += FRAME_CRC_SIZE;
+    }
+    frame_header_pack(&hdr, s->out_buf);
+    if (s->crc)
+        crc = crc32c(0, s->out_buf, FRAME_HEADER_SIZE);
+    s->out_len = FRAME_HEADER_SIZE;
+    s->out_off = 0;
+    s->captured_us = frame->timestamp_us;
+
+    /* The bands are one flush of the frame, their send() time is observed once */
+    while (y < src.height)
+    {
+        unsigned int n = src.height - y < rows ? src.height - y : rows;
+        uint64_t start;
+        int status;
+
+        append_rows(s, &src, y, n, &crc);
+        y += n;
+        start = monotonic_us();
+        status = send_out(s);
+        send_us += monotonic_us() - start;
+        if (-1 == status)
+            return -1;
+        if (s->out_off < s->out_len)
+            break;
+        s->out_len = s->out_off = 0;
+    }
+    metrics_observe(METRIC_SEND_US, send_us);
+
+    if (y < src.height)
+    {
+        /* The socket is full: keep what it has not taken and finish the frame whole */
+        if (-1 == reserve_frame_buffer(s))
+            return -1;
+        memmove(s->out_buf, s->out_buf + s->out_off, s->out_len - s->out_off);
+        s->out_len -= s->out_off;
+        s->out_off = 0;
+        append_rows(s, &src, y, src.height - y, &crc);
+        metrics_add(METRIC_BAND_SPILLS, 1);
+    }
+    if (s->out_len)
+        return session_flush(s);
+    s->frames_sent++;
+    metrics_add(METRIC_FRAMES_SENT, 1);
+    return 0;
+}
+
+/**
+ * @brief   Act on a command received from the client.
+ */
+static void handle_command(struct client_session *s, const struct command *cmd)
+{
+    uint64_t now = monotonic_us();
+
+    switch (cmd->type)
+    {
+    case COMMAND_HISTORY:
+        start_replay(s, (cmd->flags & COMMAND_FLAG_RELATIVE) ? ((cmd->arg0 < now) ? now - cmd->arg0 : 0) : cmd->arg0,
+                     cmd->arg1 ? cmd->arg1 : now, 0);
+        syslog(LOG_INFO, "Client %s requested %.1f s of history%s", inet_ntoa(s->addr.sin_addr),
+               (double)(s->replay_end_us - s->replay_start_us) / 1e6,
+               history_enabled() ? "" : " but none is kept");
+        break;
+    case COMMAND_FORMAT:
+        if (cmd->arg0 >= FRAME_FMT_COUNT)
+        {
+            syslog(LOG_ERR, "Client %s asked for unknown format %llu", inet_ntoa(s->addr.sin_addr),
+                   (unsigned long long)cmd->arg0);
+            break;
+        }
+        s->format = (uint8_t)cmd->arg0;
+        s->quality.format = s->format;
+        syslog(LOG_INFO, "Client %s switched to format %u", inet_ntoa(s->addr.sin_addr), s->format);
+        break;
+    case COMMAND_TRANSFORM:
+    {
+        struct frame_transform t;
+
+        frame_transform_unpack(cmd, &t);
+        if (-1 == transform_normalise(&t, HRES, VRES) ||
+            frame_format_bytes(FRAME_FMT_RGB24, t.width, t.height) > FRAME_MAX_PAYLOAD)
+        {
+            syslog(LOG_ERR, "Client %s asked for a transform that does not fit the frame",
+                   inet_ntoa(s->addr.sin_addr));
+            break;
+        }
+        s->transform = t;
+        s->transformed = !transform_is_identity(&t, HRES, VRES);
+        s->pyramid_level = 0;
+        memset(s->rois, 0, sizeof(s->rois));
+        update_images(s);
+        syslog(LOG_INFO, "Client %s receives %ux%u+%u+%u as %ux%u, %u quarter turns%s",
+               inet_ntoa(s->addr.sin_addr), t.crop_width, t.crop_height, t.crop_x, t.crop_y,
+               t.width, t.height, t.rotation, t.mirror ? ", mirrored" : "");
+        break;
+    }
+    case COMMAND_ROI:
+    {
+        struct frame_roi r, previous;
+        size_t worst = 0;
+
+        frame_roi_unpack(cmd, &r);
+        if (!r.scale)
+            r.scale = 1;
+        if (r.index >= FRAME_MAX_ROIS ||
+            (r.width && ((unsigned int)r.x + r.width > HRES || (unsigned int)r.y + r.height > VRES ||
+                         r.width / r.scale < FRAME_ROI_MIN_SIZE || r.height / r.scale < FRAME_ROI_MIN_SIZE)))
+        {
+            syslog(LOG_ERR, "Client %s asked for a region that does not fit the frame",
+                   inet_ntoa(s->addr.sin_addr));
+            break;
+        }
+        previous = s->rois[r.index];
+        s->rois[r.index] = r;
+        update_images(s);
+        /* Checked as RGB24, so that no later format change can overflow */
+        for (unsigned int i = 0; i < s->quality.images; i++)
+            worst += frame_format_bytes(FRAME_FMT_RGB24, s->quality.width[i], s->quality.height[i]);
+        if (worst > FRAME_MAX_PAYLOAD)
+        {
+            syslog(LOG_ERR, "Client %s asked for more regions than fit in a frame", inet_ntoa(s->addr.sin_addr));
+            s->rois[r.index] = previous;
+            update_images(s);
+            break;
+        }
+        syslog(LOG_INFO, "Client %s region %u: %ux%u+%u+%u at 1/%u", inet_ntoa(s->addr.sin_addr), r.index,
+               r.width, r.height, r.x, r.y, r.scale);
+        break;
+    }
+    case COMMAND_LEVEL:
+        if (cmd->arg0 >= FRAME_PYRAMID_LEVELS)
+        {
+            syslog(LOG_ERR, "Client %s asked for unknown level %llu", inet_ntoa(s->addr.sin_addr),
+                   (unsigned long long)cmd->arg0);
+            break;
+        }
+        s->pyramid_level = (uint8_t)cmd->arg0;
+        s->transformed = 0;
+        memset(&s->transform, 0, sizeof(s->transform));
+        memset(s->rois, 0, sizeof(s->rois));
+        update_images(s);
+        syslog(LOG_INFO, "Client %s switched to the %ux%u stream", inet_ntoa(s->addr.sin_addr),
+               HRES >> s->pyramid_level, VRES >> s->pyramid_level);
+        break;
+    case COMMAND_DELTA:
+        if (cmd->arg0 && !s->delta_ref)
+        {
+            s->delta_ref = malloc(FRAME_MAX_PAYLOAD);
+            if (!delta_buf)
+                delta_buf = malloc(FRAME_MAX_PAYLOAD);
+            if (!s->delta_ref || !delta_buf)
+            {
+                syslog(LOG_ERR, "Out of memory for delta frames of client %s", inet_ntoa(s->addr.sin_addr));
+                free(s->delta_ref);
+                s->delta_ref = NULL;
+                break;
+            }
+        }
+        s->keyframe_interval = cmd->arg0 < UINT32_MAX ? (uint32_t)cmd->arg0 : UINT32_MAX;
+        s->delta_threshold = cmd->arg1 < UINT8_MAX ? (uint32_t)cmd->arg1 : UINT8_MAX;
+        s->keyframe_wanted = 1;
+        if (s->keyframe_interval)
+            syslog(LOG_INFO, "Client %s receives delta frames, a keyframe every %u, threshold %u",
+                   inet_ntoa(s->addr.sin_addr), s->keyframe_interval, s->delta_threshold);
+        else
+            syslog(LOG_INFO, "Client %s receives whole frames", inet_ntoa(s->addr.sin_addr));
+        break;
+    case COMMAND_KEYFRAME:
+        s->keyframe_wanted = 1;
+        break;
+    case COMMAND_CRC:
+        s->crc = 0 != cmd->arg0;
+        syslog(LOG_INFO, "Client %s %s frame checksums (%s CRC32C)", inet_ntoa(s->addr.sin_addr),
+               s->crc ? "receives" : "no longer receives", crc32c_implementation());
+        break;
+    default:
+        syslog(LOG_ERR, "Client %s sent unknown command %u", inet_ntoa(s->addr.sin_addr), cmd->type);
+        break;
+    }
+}
+
+/**
+ * @brief   Read and act on whatever the client has sent.
+ *
+ * @param   s   Session to read from.
+ *
+ * @return  0 on success, -1 if the client disconnected, failed or sent
+ *          something that is not a command.
+ */
+int session_read(struct client_session *s)
+{
+    for (;;)
+    {
+        struct command cmd;
+        ssize_t n = recv(s->fd, s->in_buf + s->in_len, sizeof(s->in_buf) - s->in_len, MSG_DONTWAIT);
+
+        metrics_add(METRIC_IO_SYSCALLS, 1);
+
+        if (0 == n)
+            return -1;
+        if (n < 0)
+            return (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno) ? 0 : -1;
+
+        s->in_len += (size_t)n;
+        if (s->in_len < sizeof(s->in_buf))
+            continue;
+        s->in_len = 0;
+        if (-1 == command_unpack(s->in_buf, &cmd))
+        {
+            syslog(LOG_ERR, "Client %s sent a malformed command", inet_ntoa(s->addr.sin_addr));
+            return -1;
+        }
+        handle_command(s, &cmd);
+    }
+}
+
+/**
+ * @brief   Offer a newly captured frame to a client.
+ *
+ * Updates the quality controller with the current socket measurements and
+ * then either drops the frame (previous one still in flight), skips it
+ * (frame rate step of the ladder) or renders it at the client's current
+ * resolution and starts sending it. Frames the motion gate holds back are
+ * not sent; when it opens, the frames leading up to the motion are
+ * replayed from the history ring first. This frame and the ones captured
+ * while that drains follow from the ring as live frames, until the replay
+ * has caught up.
+ *
+ * @param   s       Session to serve.
+ * @param   frame   The frame just captured.
+ *
+ * @return  0 on success, -1 if the connection failed and the session should
+ *          be closed.
+ */
+int session_offer_frame(struct client_session *s, const struct frame_info *frame)
+{
+    const struct quality_step *step;
+    int queued = -1;
+    int backlogged = session_pending(s);
+    int change;
+    unsigned int width, height;
+
+    if (-1 == ioctl(s->fd, SIOCOUTQ, &queued))
+        queued = -1;
+    metrics_add(METRIC_IO_SYSCALLS, 1);
+    metrics_client_update(s->slot, (queued > 0 ? (uint64_t)queued : 0) + (s->out_len - s->out_off),
+                          s->quality.level);
+
+    change = quality_update(&s->quality, monotonic_us(), s->bytes_sent, queued,
+                            backlogged, frame->fps);
+    if (change)
+    {
+        step = quality_get_step(s->quality.level);
+        quality_output_size(&s->quality, s->quality.level, 0, &width, &height);
+        syslog(LOG_INFO, "Client %s stepped %s to level %u (%ux%u, 1/%u fps, %.0f KB/s)",
+               inet_ntoa(s->addr.sin_addr), (change < 0) ? "down" : "up",
+               s->quality.level, width, height,
+               step->frame_divisor, s->quality.throughput / 1024.0);
+    }
+
+    if (frame->preroll_from_us && history_enabled() && !s->replaying)
+        start_replay(s, frame->preroll_from_us, frame->timestamp_us, frame->timestamp_us);
+    else if (s->replaying && s->replay_live_us && !frame->still)
+        s->replay_end_us = frame->timestamp_us;
+
+    /* A history replay owns the connection until it finishes */
+    if (s->replaying)
+        return session_pending(s) ? 0 : session_flush(s);
+
+    if (frame->still)
+        return backlogged ? session_flush(s) : 0;
+
+    if (backlogged)
+    {
+        s->frames_dropped++;
+        metrics_add(METRIC_FRAMES_DROPPED, 1);
+        return session_flush(s);
+    }
+
+    if (!quality_should_send(&s->quality))
+    {
+        metrics_add(METRIC_FRAMES_SKIPPED, 1);
+        return 0;
+    }
+
+    if (band_streamable(s, frame))
+        return stream_frame(s, frame);
+    if (-1 == load_frame(s, frame->rgb ? frame->rgb_level : NULL,
+                         YUYV_FRAME_SIZE == frame->raw_len ? frame->raw : NULL,
+                         frame->sequence, frame->timestamp_us, s->quality.level, 0))
+    {
+        s->out_len = s->out_off = 0;
+        return 0;
+    }
+    s->captured_us = frame->timestamp_us;
+    return session_flush(s);
+}
@@ -0,0 +1,87 @@
+/**
+ * @file client_session.h
+ * @brief State kept by the server for each connected client.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __CLIENT_SESSION_H__
+#define __CLIENT_SESSION_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "adaptive_quality.h"
+#include "../common/frame_protocol.h"
+
+#define MAX_CLIENTS 8
+
+struct frame_info
+{
+    const unsigned char *rgb;   /* full resolution RGB24 image */
+    const unsigned char *rgb_level[FRAME_PYRAMID_LEVELS];   /* rgb at each simulcast level, NULL if not made */
+    const unsigned char *raw;   /* the same frame as captured, YUYV */
+    size_t raw_len;
+    uint32_t sequence;
+    uint64_t timestamp_us;
+    double fps;                 /* current capture rate */
+    int still;                  /* held back by the motion gate */
+    uint64_t preroll_from_us;   /* the motion gate opened, replay history since then */
+};
+
+struct client_session
+{
+    int fd;
+    int slot;                   /* index in the server's session table */
+    struct sockaddr_in addr;
+    unsigned char *out_buf;     /* header and payload of the frame in flight */
+    size_t out_cap;             /* a band, or whole frames once one needed it */
+    size_t out_len;
+    size_t out_off;             /* bytes of out_buf already handed to the kernel */
+    int sending;                /* the rest of out_buf is queued on the ring */
+    int fixed_buffer;           /* out_buf is registered with the ring */
+    uint64_t captured_us;       /* capture time of a live frame none of which is sent yet */
+    uint64_t bytes_sent;
+    unsigned long frames_sent;
+    unsigned long frames_dropped;
+    struct quality_state quality;
+    unsigned char in_buf[COMMAND_SIZE]; /* partially received command */
+    size_t in_len;
+    int replaying;              /* streaming frames out of the history ring */
+    uint32_t replay_sequence;   /* next history frame to send */
+    uint64_t replay_start_us;
+    uint64_t replay_end_us;
+    uint64_t replay_live_us;    /* frames captured from then on go out live, 0 if none do */
+    int replay_past_history;    /* history end sent, catching up on live frames */
+    uint8_t format;             /* enum frame_format the client asked for */
+    uint8_t pyramid_level;      /* simulcast level of the whole frame stream */
+    int transformed;            /* frames go through transform */
+    struct frame_transform transform;   /* normalised, at full quality */
+    struct frame_roi rois[FRAME_MAX_ROIS];  /* as asked for, width 0 if unset */
+    uint8_t image_roi[FRAME_MAX_ROIS];      /* region sent as each image, with ROIs */
+    uint32_t keyframe_interval; /* frames per keyframe with deltas, 0 sends every frame whole */
+    uint32_t delta_threshold;   /* mean sample difference of a tile that still counts as unchanged */
+    uint32_t since_keyframe;    /* live frames sent since the last keyframe */
+    int keyframe_wanted;
+    unsigned char *delta_ref;   /* each image as the client last received it, back to back */
+    struct frame_header ref_header[FRAME_MAX_ROIS]; /* size, format and region of each */
+    unsigned int ref_images;
+    int crc;                    /* frames end in a CRC32C */
+};
+
+void session_set_band_size(size_t bytes);
+int session_use_uring(unsigned int entries);
+int session_uring_fd(void);
+int session_wants_completion(const struct client_session *s);
+void session_uring_complete(struct client_session *sessions);
+void session_uring_submit(void);
+int session_open(struct client_session *s, int slot, int fd, const struct sockaddr_in *addr);
+void session_close(struct client_session *s);
+int session_pending(const struct client_session *s);
+int session_wants_write(const struct client_session *s);
+int session_flush(struct client_session *s);
+int session_read(struct client_session *s);
+int session_offer_frame(struct client_session *s, const struct frame_info *frame);
+
+#endif /* __CLIENT_SESSION_H__ */
@@ -0,0 +1,1180 @@
+/**
+ * @file color_convert.c
+ * @brief YUYV to RGB24 and compact output format conversion kernels.
+ *
+ * All kernels compute the same fixed-point formula as
+ * transformation_color_conversion() and are bit-exact with the scalar
+ * yuyv_to_rgb(), which `make bench` verifies for every matrix:
+ *
+ *   lut       per-component contributions precomputed into tables, and a
+ *             clipping table instead of compares
+ *   sse2      eight pixels at a time with 16-bit multiply-adds; saturating
+ *             packs do the clipping
+ *   parallel  the fastest single-threaded kernel split across a pool of
+ *             worker threads
+ *   downscale conversion fused with the adaptive-quality box filter, so
+ *             the full-resolution RGB image is never written out
+ *
+ * rgb_downscale() and rgb_crop_downscale() are that box filter on its own,
+ * for images that are already RGB24.
+ *
+ * The compact formats are produced straight from YUYV as well: grayscale
+ * and the 4:2:0 formats only average Y, U and V samples and never touch
+ * the colour math, RGB565 packs each converted output row as it is made.
+ *
+ * The matrix (BT.601 or BT.709) and range (limited or full) are picked
+ * once, from what the camera reports, by color_convert_select(). Its
+ * coefficients go into the same tables and vector constants the fixed
+ * BT.601 path used, so no kernel does any more work per pixel for it.
+ *
+ * yuyv_transform() adds the geometry: crop, integer or bilinear scaling,
+ * quarter-turn rotation and mirroring all decide where each output pixel
+ * is sampled from, so the transformed image is still made in one pass
+ * with no intermediate frame.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "color_convert.h"
+
+/*
+ * Fixed-point YUV to RGB coefficients, 8 fractional bits, for each matrix
+ * and range. Limited range scales Y by 255/219 after taking 16 off and
+ * chroma by 255/224; full range uses Y as it is. The chroma terms are
+ * 2(1-Kr), 2Kb(1-Kb)/Kg, 2Kr(1-Kr)/Kg and 2(1-Kb), rounded.
+ */
+struct color_coeffs
+{
+    const char *name;
+    int y_offset, y_gain;
+    int rv, gu, gv, bu;
+};
+
+static const struct color_coeffs coeff_table[COLOR_MATRIX_COUNT][COLOR_RANGE_COUNT] =
+{
+    [COLOR_BT601] =
+    {
+        [COLOR_LIMITED] = { "BT.601 limited range", 16, 298, 409, -100, -208, 516 },
+        [COLOR_FULL] = { "BT.601 full range", 0, 256, 359, -88, -183, 454 },
+    },
+    [COLOR_BT709] =
+    {
+        [COLOR_LIMITED] = { "BT.709 limited range", 16, 298, 459, -55, -136, 541 },
+        [COLOR_FULL] = { "BT.709 full range", 0, 256, 403, -48, -120, 475 },
+    },
+};
+
+/* What every kernel converts with; only changed by color_convert_select() */
+static const struct color_coeffs *coeffs = &coeff_table[COLOR_BT601][COLOR_LIMITED];
+
+static void lut_init(void);
+
+/**
+ * @brief   Choose the YUV to RGB matrix and range for all conversions.
+ *
+ * Rebuilds the conversion tables, so it must be called before any
+ * conversion runs, not while one does. The default is BT.601 limited
+ * range.
+ *
+ * @param   matrix  enum color_matrix the camera encodes with.
+ * @param   range   enum color_range of its samples.
+ *
+ * @return  0 on success, -1 for an unknown matrix or range.
+ */
+int color_convert_select(unsigned int matrix, unsigned int range)
+{
+    if (matrix >= COLOR_MATRIX_COUNT || range >= COLOR_RANGE_COUNT)
+        return -1;
+    coeffs = &coeff_table[matrix][range];
+    lut_init();
+    return 0;
+}
+
+/**
+ * @brief   Names the selected matrix and range, for logs.
+ */
+const char *color_convert_name(void)
+{
+    return coeffs->name;
+}
+
+/**
+ * @brief   Perform color conversion from YUV to RGB.
+ *
+ * This function performs color conversion from YUV color space to RGB color space.
+ * Given the Y, U, and V values, it calculates the corresponding RGB values and
+ * stores them in the provided pointers `r`, `g`, and `b`. The conversion is done
+ * using integer arithmetic to avoid floating-point operations, with the
+ * coefficients chosen by color_convert_select().
+ *
+ * @param   y   Y component value.
+ * @param   u   U component value.
+ * @param   v   V component value.
+ * @param   r   Pointer to store the resulting red component value.
+ * @param   g   Pointer to store the resulting green component value.
+ * @param   b   Pointer to store the resulting blue component value.
+ *
+ * @return  This function does not return a value.
+ */
+void transformation_color_conversion(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b)
+{
+   int r1, g1, b1;
+
+   // replaces floating point coefficients
+   int c = (y - coeffs->y_offset) * coeffs->y_gain, d = u - 128, e = v - 128;
+
+   // Conversion that avoids floating point
+   r1 = (c                    + coeffs->rv * e + 128) >> 8;
+   g1 = (c + coeffs->gu * d + coeffs->gv * e + 128) >> 8;
+   b1 = (c + coeffs->bu * d                    + 128) >> 8;
+
+   // Computed values may need clipping.
+   if (r1 > 255) r1 = 255;
+   if (g1 > 255) g1 = 255;
+   if (b1 > 255) b1 = 255;
+
+   if (r1 < 0) r1 = 0;
+   if (g1 < 0) g1 = 0;
+   if (b1 < 0) b1 = 0;
+
+   *r = r1 ;
+   *g = g1 ;
+   *b = b1 ;
+}
+
+
+/**
+ * @brief   Convert a YUYV image into a caller supplied RGB24 buffer.
+ *
+ * The input data is processed in blocks of four elements, where each block
+ * consists of Y, U, Y2, and V values. For each block, the
+ * transformation_color_conversion function is called to convert YUV to RGB
+ * values, and the resulting six RGB bytes are stored in `dst`.
+ *
+ * @param   p       Pointer to the YUYV input data.
+ * @param   size    Size of the input data in bytes.
+ * @param   dst     Destination, size * 3 / 2 bytes.
+ *
+ * @return  This function does not return a value.
+ */
+void yuyv_to_rgb(const unsigned char *p, int size, unsigned char *dst)
+{
+    int y_temp, y2_temp, u_temp, v_temp;
+    for(int i=0, newi=0; i<size; i=i+4, newi=newi+6)
+    {
+        y_temp=(int)p[i]; u_temp=(int)p[i+1]; y2_temp=(int)p[i+2]; v_temp=(int)p[i+3];
+        transformation_color_conversion(y_temp, u_temp, v_temp, &dst[newi], &dst[newi+1], &dst[newi+2]);
+        transformation_color_conversion(y2_temp, u_temp, v_temp, &dst[newi+3], &dst[newi+4], &dst[newi+5]);
+    }
+}
+
+
+/* Offset of value 0 in clip_table; sums >> 8 range from -277 to 546 */
+#define CLIP_OFFSET 384
+#define CLIP_RANGE 1024
+
+static int lut_ready;
+static int32_t y_term[256], rv_term[256], gu_term[256], gv_term[256], bu_term[256];
+static unsigned char clip_table[CLIP_RANGE];
+
+static void lut_init(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        y_term[i] = coeffs->y_gain * (i - coeffs->y_offset) + 128;
+        rv_term[i] = coeffs->rv * (i - 128);
+        gu_term[i] = coeffs->gu * (i - 128);
+        gv_term[i] = coeffs->gv * (i - 128);
+        bu_term[i] = coeffs->bu * (i - 128);
+    }
+    for (int i = 0; i < CLIP_RANGE; i++)
+    {
+        int v = i - CLIP_OFFSET;
+        clip_table[i] = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+    }
+    lut_ready = 1;
+}
+
+/**
+ * @brief   Table-driven YUYV to RGB24 conversion.
+ *
+ * @param   p       Pointer to the YUYV input data.
+ * @param   size    Size of the input data in bytes, a multiple of 4.
+ * @param   dst     Destination, size * 3 / 2 bytes.
+ *
+ * @return  This function does not return a value.
+ */
+void yuyv_to_rgb_lut(const unsigned char *p, int size, unsigned char *dst)
+{
+    if (!lut_ready)
+        lut_init();
+
+    for (int i = 0; i < size; i += 4, dst += 6)
+    {
+        int32_t y0 = y_term[p[i]], y1 = y_term[p[i + 2]];
+        int32_t r = rv_term[p[i + 3]];
+        int32_t g = gu_term[p[i + 1]] + gv_term[p[i + 3]];
+        int32_t b = bu_term[p[i + 1]];
+
+        dst[0] = clip_table[((y0 + r) >> 8) + CLIP_OFFSET];
+        dst[1] = clip_table[((y0 + g) >> 8) + CLIP_OFFSET];
+        dst[2] = clip_table[((y0 + b) >> 8) + CLIP_OFFSET];
+        dst[3] = clip_table[((y1 + r) >> 8) + CLIP_OFFSET];
+        dst[4] = clip_table[((y1 + g) >> 8) + CLIP_OFFSET];
+        dst[5] = clip_table[((y1 + b) >> 8) + CLIP_OFFSET];
+    }
+}
+
+#ifdef __SSE2__
+/**
+ * @brief   SSE2 YUYV to RGB24 conversion, eight pixels per step.
+ *
+ * Each output channel is built from two 16-bit multiply-adds of
+ * interleaved (c, d), (c, e) or (e, 1) pairs, so the 32-bit sums are
+ * exactly those of the scalar formula. Packing to 16 and then to unsigned
+ * 8 bits saturates, which is the same clipping to 0..255.
+ *
+ * @param   p       Pointer to the YUYV input data.
+ * @param   size    Size of the input data in bytes, a multiple of 4.
+ * @param   dst     Destination, size * 3 / 2 bytes.
+ *
+ * @return  This function does not return a value.
+ */
+void yuyv_to_rgb_sse2(const unsigned char *p, int size, unsigned char *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const struct color_coeffs *cc = coeffs;
+    const __m128i y_bias = _mm_set1_epi16((short)cc->y_offset);
+    const __m128i uv_bias = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi32(128);
+    const __m128i k_r = _mm_set_epi16((short)cc->rv, (short)cc->y_gain, (short)cc->rv, (short)cc->y_gain,
+                                      (short)cc->rv, (short)cc->y_gain, (short)cc->rv, (short)cc->y_gain);
+    const __m128i k_g1 = _mm_set_epi16((short)cc->gu, (short)cc->y_gain, (short)cc->gu, (short)cc->y_gain,
+                                       (short)cc->gu, (short)cc->y_gain, (short)cc->gu, (short)cc->y_gain);
+    const __m128i k_g2 = _mm_set_epi16(128, (short)cc->gv, 128, (short)cc->gv,
+                                       128, (short)cc->gv, 128, (short)cc->gv);
+    const __m128i k_b = _mm_set_epi16((short)cc->bu, (short)cc->y_gain, (short)cc->bu, (short)cc->y_gain,
+                                      (short)cc->bu, (short)cc->y_gain, (short)cc->bu, (short)cc->y_gain);
+    const __m128i one = _mm_set1_epi16(1);
+    int i = 0;
+
+    for (; i + 16 <= size; i += 16, dst += 24)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i lo = _mm_unpacklo_epi8(in, zero);
+        __m128i hi = _mm_unpackhi_epi8(in, zero);
+        __m128i ys, uvs, c, d, e, r, g, b;
+        __m128i ce_lo, ce_hi, cd_lo, cd_hi, e1_lo, e1_hi;
+        unsigned char rgb[3][16];
+
+        /* Y of all eight pixels, then U/V pairs */
+        ys = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(lo, 16), 16),
+                             _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16));
+        uvs = _mm_packs_epi32(_mm_srai_epi32(lo, 16), _mm_srai_epi32(hi, 16));
+        c = _mm_sub_epi16(ys, y_bias);
+        /* uvs holds U0 V0 U1 V1 ...; give every pixel its pair's U and V */
+        d = _mm_sub_epi16(_mm_shufflehi_epi16(_mm_shufflelo_epi16(uvs, 0xA0), 0xA0), uv_bias);
+        e = _mm_sub_epi16(_mm_shufflehi_epi16(_mm_shufflelo_epi16(uvs, 0xF5), 0xF5), uv_bias);
+
+        ce_lo = _mm_unpacklo_epi16(c, e);
+        ce_hi = _mm_unpackhi_epi16(c, e);
+        cd_lo = _mm_unpacklo_epi16(c, d);
+        cd_hi = _mm_unpackhi_epi16(c, d);
+        e1_lo = _mm_unpacklo_epi16(e, one);
+        e1_hi = _mm_unpackhi_epi16(e, one);
+
+        r = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(ce_lo, k_r), round), 8),
+                            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(ce_hi, k_r), round), 8));
+        g = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(cd_lo, k_g1), _mm_madd_epi16(e1_lo, k_g2)), 8),
+                            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(cd_hi, k_g1), _mm_madd_epi16(e1_hi, k_g2)), 8));
+        b = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(cd_lo, k_b), round), 8),
+                            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(cd_hi, k_b), round), 8));
+
+        _mm_storeu_si128((__m128i *)rgb[0], _mm_packus_epi16(r, r));
+        _mm_storeu_si128((__m128i *)rgb[1], _mm_packus_epi16(g, g));
+        _mm_storeu_si128((__m128i *)rgb[2], _mm_packus_epi16(b, b));
+        for (int k = 0; k < 8; k++)
+        {
+            dst[3 * k] = rgb[0][k];
+            dst[3 * k + 1] = rgb[1][k];
+            dst[3 * k + 2] = rgb[2][k];
+        }
+    }
+    if (i < size)
+        yuyv_to_rgb_lut(p + i, size - i, dst);
+}
+#endif
+
+/**
+ * @brief   Convert with the fastest single-threaded kernel available.
+ *
+ * @param   p       Pointer to the YUYV input data.
+ * @param   size    Size of the input data in bytes, a multiple of 4.
+ * @param   dst     Destination, size * 3 / 2 bytes.
+ *
+ * @return  This function does not return a value.
+ */
+void yuyv_to_rgb_fast(const unsigned char *p, int size, unsigned char *dst)
+{
+#ifdef __SSE2__
+    yuyv_to_rgb_sse2(p, size, dst);
+#else
+    yuyv_to_rgb_lut(p, size, dst);
+#endif
+}
+
+/* Worker pool for yuyv_to_rgb_parallel() */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+static pthread_t *workers;
+static int worker_count;
+static unsigned long generation;
+static int pending, pool_stopping;
+static const unsigned char *job_src;
+static unsigned char *job_dst;
+static int job_size;
+
+/* Bytes of input handed to each of parts workers, kept a multiple of 4 */
+static void job_slice(int part, int parts, int *offset, int *len)
+{
+    int pairs = job_size / 4;
+    int first = (int)((long)pairs * part / parts);
+    int last = (int)((long)pairs * (part + 1) / parts);
+
+    *offset = first * 4;
+    *len = (last - first) * 4;
+}
+
+static void *convert_worker(void *arg)
+{
+    int index = (int)(intptr_t)arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;)
+    {
+        int offset, len;
+
+        while (generation == seen && !pool_stopping)
+            pthread_cond_wait(&work_ready, &pool_lock);
+        if (pool_stopping)
+            break;
+        seen = generation;
+        /* Slice 0 is the caller's */
+        job_slice(index + 1, worker_count + 1, &offset, &len);
+        pthread_mutex_unlock(&pool_lock);
+
+        yuyv_to_rgb_fast(job_src + offset, len, job_dst + offset / 2 * 3);
+
+        pthread_mutex_lock(&pool_lock);
+        if (0 == --pending)
+            pthread_cond_signal(&work_done);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+/**
+ * @brief   Start the worker threads used by yuyv_to_rgb_parallel().
+ *
+ * @param   threads Total threads converting a frame, the caller included.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int convert_threads_start(int threads)
+{
+    if (threads < 2 || workers)
+        return 0;
+    workers = calloc((size_t)threads - 1, sizeof(*workers));
+    if (!workers)
+        return -1;
+    pool_stopping = 0;
+    for (; worker_count < threads - 1; worker_count++)
+    {
+        if (0 != pthread_create(&workers[worker_count], NULL, convert_worker, (void *)(intptr_t)worker_count))
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Stop the conversion worker threads.
+ *
+ * @return  This function does not return a value.
+ */
+void convert_threads_stop(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_stopping = 1;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < worker_count; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
+
+/**
+ * @brief   Convert a frame split across the worker pool.
+ *
+ * Falls back to yuyv_to_rgb_fast() when no workers were started.
+ *
+ * @param   p       Pointer to the YUYV input data.
+ * @param   size    Size of the input data in bytes, a multiple of 4.
+ * @param   dst     Destination, size * 3 / 2 bytes.
+ *
+ * @return  This function does not return a value.
+ */
+void yuyv_to_rgb_parallel(const unsigned char *p, int size, unsigned char *dst)
+{
+    int offset, len;
+
+    if (!worker_count)
+    {
+        yuyv_to_rgb_fast(p, size, dst);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    job_src = p;
+    job_dst = dst;
+    job_size = size;
+    pending = worker_count;
+    generation++;
+    pthread_cond_broadcast(&work_ready);
+    job_slice(0, worker_count + 1, &offset, &len);
+    pthread_mutex_unlock(&pool_lock);
+
+    yuyv_to_rgb_fast(p + offset, len, dst + offset / 2 * 3);
+
+    pthread_mutex_lock(&pool_lock);
+    while (pending)
+        pthread_cond_wait(&work_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief   Box filter an RGB24 image down by an integer factor.
+ *
+ * Each output pixel is the average of a scale x scale block of input
+ * pixels. A scale of 1 is a plain copy.
+ *
+ * @param   src     Source RGB24 image.
+ * @param   width   Source width in pixels.
+ * @param   height  Source height in pixels.
+ * @param   scale   Integer downscale factor.
+ * @param   dst     Destination, (width/scale) x (height/scale) RGB24.
+ *
+ * @return  This function does not return a value.
+ */
+void rgb_downscale(const unsigned char *src, unsigned int width, unsigned int height,
+                   unsigned int scale, unsigned char *dst)
+{
+    if (1 == scale)
+    {
+        memcpy(dst, src, (size_t)width * height * 3);
+        return;
+    }
+    rgb_crop_downscale(src, width, 0, 0, width / scale, height / scale, scale, dst);
+}
+
+/**
+ * @brief   Box filter a rectangle of an RGB24 image down by an integer factor.
+ *
+ * @param   src         Source RGB24 image.
+ * @param   width       Source width in pixels.
+ * @param   x           Left edge of the rectangle.
+ * @param   y           Top edge of the rectangle.
+ * @param   out_width   Output width; the rectangle is out_width * scale wide.
+ * @param   out_height  Output height.
+ * @param   scale       Integer downscale factor, 1 copies the rectangle.
+ * @param   dst         Destination, out_width x out_height RGB24.
+ *
+ * @return  This function does not return a value.
+ */
+void rgb_crop_downscale(const unsigned char *src, unsigned int width, unsigned int x, unsigned int y,
+                        unsigned int out_width, unsigned int out_height, unsigned int scale,
+                        unsigned char *dst)
+{
+    unsigned int area = scale * scale;
+
+    src += ((size_t)y * width + x) * 3;
+    if (1 == scale)
+    {
+        for (unsigned int oy = 0; oy < out_height; oy++)
+            memcpy(dst + (size_t)oy * out_width * 3, src + (size_t)oy * width * 3, (size_t)out_width * 3);
+        return;
+    }
+
+    for (unsigned int oy = 0; oy < out_height; oy++)
+    {
+        for (unsigned int ox = 0; ox < out_width; ox++)
+        {
+            unsigned int sum[3] = { 0, 0, 0 };
+            for (unsigned int dy = 0; dy < scale; dy++)
+            {
+                const unsigned char *row = src + ((size_t)(oy * scale + dy) * width + ox * scale) * 3;
+                for (unsigned int dx = 0; dx < scale * 3; dx += 3)
+                {
+                    sum[0] += row[dx];
+                    sum[1] += row[dx + 1];
+                    sum[2] += row[dx + 2];
+                }
+            }
+            *dst++ = (unsigned char)((sum[0] + area / 2) / area);
+            *dst++ = (unsigned char)((sum[1] + area / 2) / area);
+            *dst++ = (unsigned char)((sum[2] + area / 2) / area);
+        }
+    }
+}
+
+/**
+ * @brief   Convert and box-filter downscale in one pass.
+ *
+ * Produces exactly what yuyv_to_rgb() followed by rgb_downscale() would,
+ * but only ever holds `scale` converted rows at a time, which stay in
+ * cache, instead of writing and re-reading a full-resolution RGB image.
+ *
+ * @param   p       Pointer to the YUYV input data.
+ * @param   width   Input width in pixels, even.
+ * @param   height  Input height in pixels.
+ * @param   scale   Downscale factor.
+ * @param   dst     Destination, (width / scale) * (height / scale) * 3 bytes.
+ *
+ * @return  This function does not return a value.
+ */
+void yuyv_to_rgb_downscale(const unsigned char *p, unsigned int width, unsigned int height,
+                           unsigned int scale, unsigned char *dst)
+{
+    static _Thread_local unsigned char *rows;
+    static _Thread_local size_t rows_size;
+    unsigned int ow = width / scale, oh = height / scale;
+    unsigned int area = scale * scale;
+    size_t row_bytes = (size_t)width * 3;
+
+    if (1 == scale)
+    {
+        yuyv_to_rgb_fast(p, (int)(width * height * 2), dst);
+        return;
+    }
+    if (rows_size < row_bytes * scale)
+    {
+        free(rows);
+        rows = malloc(row_bytes * scale);
+        rows_size = rows ? row_bytes * scale : 0;
+        if (!rows)
+            return;
+    }
+
+    for (unsigned int oy = 0; oy < oh; oy++)
+    {
+        yuyv_to_rgb_fast(p + (size_t)oy * scale * width * 2, (int)(scale * width * 2), rows);
+        for (unsigned int ox = 0; ox < ow; ox++)
+        {
+            unsigned int sum[3] = { 0, 0, 0 };
+            for (unsigned int dy = 0; dy < scale; dy++)
+            {
+                const unsigned char *px = rows + dy * row_bytes + (size_t)ox * scale * 3;
+                for (unsigned int dx = 0; dx < scale * 3; dx += 3)
+                {
+                    sum[0] += px[dx];
+                    sum[1] += px[dx + 1];
+                    sum[2] += px[dx + 2];
+                }
+            }
+            *dst++ = (unsigned char)((sum[0] + area / 2) / area);
+            *dst++ = (unsigned char)((sum[1] + area / 2) / area);
+            *dst++ = (unsigned char)((sum[2] + area / 2) / area);
+        }
+    }
+}
+
+/* Box filters one output row from the scale rows of RGB24 starting at rows */
+static inline void rgb_box_row(const unsigned char *rows, unsigned int width, unsigned int scale, unsigned char *dst)
+{
+    unsigned int area = scale * scale;
+
+    for (unsigned int ox = 0; ox < width / scale; ox++)
+    {
+        unsigned int sum[3] = { 0, 0, 0 };
+        for (unsigned int dy = 0; dy < scale; dy++)
+        {
+            const unsigned char *px = rows + ((size_t)dy * width + ox * scale) * 3;
+            for (unsigned int dx = 0; dx < scale * 3; dx += 3)
+            {
+                sum[0] += px[dx];
+                sum[1] += px[dx + 1];
+                sum[2] += px[dx + 2];
+            }
+        }
+        *dst++ = (unsigned char)((sum[0] + area / 2) / area);
+        *dst++ = (unsigned char)((sum[1] + area / 2) / area);
+        *dst++ = (unsigned char)((sum[2] + area / 2) / area);
+    }
+}
+
+/**
+ * @brief   Full, half and quarter size RGB24 images in one pass.
+ *
+ * The frame is converted four rows at a time, and the two half size rows
+ * and the quarter size row they cover are box-filtered from those rows
+ * while they are still in cache, so the pyramid costs no second pass over
+ * the full image. Each level is exactly rgb_downscale() of the full image.
+ *
+ * @param   p       Pointer to the YUYV input data.
+ * @param   width   Input width in pixels, a multiple of 4.
+ * @param   height  Input height in pixels.
+ * @param   full    Destination, width * height * 3 bytes.
+ * @param   half    Destination, (width / 2) * (height / 2) * 3 bytes.
+ * @param   quarter Destination, (width / 4) * (height / 4) * 3 bytes.
+ *
+ * @return  This function does not return a value.
+ */
+void yuyv_to_rgb_pyramid(const unsigned char *p, unsigned int width, unsigned int height,
+                         unsigned char *full, unsigned char *half, unsigned char *quarter)
+{
+    size_t row = (size_t)width * 3, half_row = (size_t)(width / 2) * 3, quarter_row = (size_t)(width / 4) * 3;
+    unsigned int y = 0;
+
+    for (; y + 4 <= height; y += 4)
+    {
+        const unsigned char *rows = full + y * row;
+
+        yuyv_to_rgb_fast(p + (size_t)y * width * 2, (int)(width * 8), full + y * row);
+        rgb_box_row(rows, width, 2, half + (y / 2) * half_row);
+        rgb_box_row(rows + 2 * row, width, 2, half + (y / 2 + 1) * half_row);
+        rgb_box_row(rows, width, 4, quarter + (y / 4) * quarter_row);
+    }
+    if (y < height)
+    {
+        yuyv_to_rgb_fast(p + (size_t)y * width * 2, (int)((height - y) * width * 2), full + y * row);
+        if (y + 2 <= height)
+            rgb_box_row(full + y * row, width, 2, half + (y / 2) * half_row);
+    }
+}
+
+/**
+ * @brief   Luma-only output: the Y samples, box-filtered when downscaling.
+ *
+ * No colour math at all; at full resolution this is a byte gather, done
+ * sixteen pixels at a time with SSE2.
+ *
+ * @param   p       Pointer to the YUYV input data.
+ * @param   width   Input width in pixels, even.
+ * @param   height  Input height in pixels.
+ * @param   scale   Downscale factor.
+ * @param   dst     Destination, (width / scale) * (height / scale) bytes.
+ *
+ * @return  This function does not return a value.
+ */
+void yuyv_to_gray(const unsigned char *p, unsigned int width, unsigned int height,
+                  unsigned int scale, unsigned char *dst)
+{
+    unsigned int ow = width / scale, oh = height / scale;
+    unsigned int area = scale * scale;
+
+    if (1 == scale)
+    {
+        size_t pixels = (size_t)width * height, i = 0;
+#ifdef __SSE2__
+        const __m128i luma = _mm_set1_epi16(0x00ff);
+
+        for (; i + 16 <= pixels; i += 16)
+        {
+            __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 2 * i)), luma);
+            __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 2 * i + 16)), luma);
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+        }
+#endif
+        for (; i < pixels; i++)
+            dst[i] = p[2 * i];
+        return;
+    }
+
+    for (unsigned int oy = 0; oy < oh; oy++)
+    {
+        for (unsigned int ox = 0; ox < ow; ox++)
+        {
+            unsigned int sum = 0;
+            for (unsigned int dy = 0; dy < scale; dy++)
+            {
+                const unsigned char *row = p + ((size_t)(oy * scale + dy) * width + ox * scale) * 2;
+                for (unsigned int dx = 0; dx < scale * 2; dx += 2)
+                    sum += row[dx];
+            }
+            *dst++ = (unsigned char)((sum + area / 2) / area);
+        }
+    }
+}
+
+/**
+ * @brief   4:2:0 output, planar (I420) or with interleaved chroma (NV12).
+ *
+ * The luma plane is yuyv_to_gray(). Each chroma sample averages the U or
+ * V samples of the 2x2 output pixels it covers, i.e. of a 2*scale square
+ * of source pixels, which also halves YUYV's vertical chroma resolution.
+ *
+ * @param   p           Pointer to the YUYV input data.
+ * @param   width       Input width in pixels, even.
+ * @param   height      Input height in pixels.
+ * @param   scale       Downscale factor.
+ * @param   interleaved Non-zero for NV12, zero for I420.
+ * @param   dst         Destination, frame_format_bytes() of the output size.
+ *
+ * @return  This function does not return a value.
+ */
+void yuyv_to_yuv420(const unsigned char *p, unsigned int width, unsigned int height,
+                    unsigned int scale, int interleaved, unsigned char *dst)
+{
+    unsigned int ow = width / scale, oh = height / scale;
+    unsigned int cw = (ow + 1) / 2, ch = (oh + 1) / 2;
+    unsigned char *u = dst + (size_t)ow * oh;
+    unsigned char *v = interleaved ? u + 1 : u + (size_t)cw * ch;
+    size_t step = interleaved ? 2 : 1;
+
+    yuyv_to_gray(p, width, height, scale, dst);
+
+    for (unsigned int cy = 0; cy < ch; cy++)
+    {
+        unsigned int y0 = 2 * cy * scale, y1 = y0 + 2 * scale;
+
+        if (y1 > oh * scale)
+            y1 = oh * scale;
+        for (unsigned int cx = 0; cx < cw; cx++)
+        {
+            /* Source pixels x0..x1 are chroma pairs x0/2..(x1+1)/2 */
+            unsigned int x0 = 2 * cx * scale, x1 = x0 + 2 * scale;
+            unsigned int sum_u = 0, sum_v = 0, count;
+
+            if (x1 > ow * scale)
+                x1 = ow * scale;
+            count = ((x1 + 1) / 2 - x0 / 2) * (y1 - y0);
+            for (unsigned int y = y0; y < y1; y++)
+            {
+                const unsigned char *row = p + (size_t)y * width * 2;
+                for (unsigned int pair = x0 / 2; pair < (x1 + 1) / 2; pair++)
+                {
+                    sum_u += row[4 * pair + 1];
+                    sum_v += row[4 * pair + 3];
+                }
+            }
+            u[((size_t)cy * cw + cx) * step] = (unsigned char)((sum_u + count / 2) / count);
+            v[((size_t)cy * cw + cx) * step] = (unsigned char)((sum_v + count / 2) / count);
+        }
+    }
+}
+
+/**
+ * @brief   RGB565 output, converted one output row at a time.
+ *
+ * Each output row is converted (and box-filtered) into a row buffer with
+ * yuyv_to_rgb_downscale() and packed straight away, so the result is
+ * exactly the RGB24 image truncated to 5/6/5 bits.
+ *
+ * @param   p       Pointer to the YUYV input data.
+ * @param   width   Input width in pixels, even.
+ * @param   height  Input height in pixels.
+ * @param   scale   Downscale factor.
+ * @param   dst     Destination, (width / scale) * (height / scale) * 2 bytes.
+ *
+ * @return  This function does not return a value.
+ */
+void yuyv_to_rgb565(const unsigned char *p, unsigned int width, unsigned int height,
+                    unsigned int scale, unsigned char *dst)
+{
+    static _Thread_local unsigned char *row;
+    static _Thread_local size_t row_size;
+    unsigned int ow = width / scale, oh = height / scale;
+
+    if (row_size < (size_t)ow * 3)
+    {
+        free(row);
+        row = malloc((size_t)ow * 3);
+        row_size = row ? (size_t)ow * 3 : 0;
+        if (!row)
+            return;
+    }
+
+    for (unsigned int oy = 0; oy < oh; oy++)
+    {
+        yuyv_to_rgb_downscale(p + (size_t)oy * scale * width * 2, width, scale, scale, row);
+        for (unsigned int ox = 0; ox < ow; ox++, dst += 2)
+        {
+            const unsigned char *px = row + ox * 3;
+            unsigned int v = ((px[0] >> 3) << 11) | ((px[1] >> 2) << 5) | (px[2] >> 3);
+            dst[0] = (unsigned char)v;
+            dst[1] = (unsigned char)(v >> 8);
+        }
+    }
+}
+
+/**
+ * @brief   Convert a YUYV frame to any wire format, downscaled by scale.
+ *
+ * @param   p       Pointer to the YUYV input data.
+ * @param   width   Input width in pixels, even.
+ * @param   height  Input height in pixels.
+ * @param   scale   Downscale factor.
+ * @param   format  enum frame_format to produce.
+ * @param   dst     Destination, frame_format_bytes() of the output size.
+ *
+ * @return  0 on success, -1 for an unknown format.
+ */
+int yuyv_convert(const unsigned char *p, unsigned int width, unsigned int height, unsigned int scale,
+                 unsigned int format, unsigned char *dst)
+{
+    switch (format)
+    {
+    case FRAME_FMT_RGB24:
+        yuyv_to_rgb_downscale(p, width, height, scale, dst);
+        return 0;
+    case FRAME_FMT_RGB565:
+        yuyv_to_rgb565(p, width, height, scale, dst);
+        return 0;
+    case FRAME_FMT_NV12:
+    case FRAME_FMT_I420:
+        yuyv_to_yuv420(p, width, height, scale, FRAME_FMT_NV12 == format, dst);
+        return 0;
+    case FRAME_FMT_GRAY:
+        yuyv_to_gray(p, width, height, scale, dst);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief   Fills in a transform's defaults and checks it against a frame.
+ *
+ * @param   t       Transform to complete; zero crop sizes extend to the
+ *                  frame edge and a zero output size keeps the crop's.
+ * @param   width   Source frame width in pixels.
+ * @param   height  Source frame height in pixels.
+ *
+ * @return  0 if the transform fits the frame, -1 otherwise.
+ */
+int transform_normalise(struct frame_transform *t, unsigned int width, unsigned int height)
+{
+    if (t->crop_x >= width || t->crop_y >= height || t->rotation > 3)
+        return -1;
+    if (!t->crop_width)
+        t->crop_width = (uint16_t)(width - t->crop_x);
+    if (!t->crop_height)
+        t->crop_height = (uint16_t)(height - t->crop_y);
+    if ((unsigned int)t->crop_x + t->crop_width > width || (unsigned int)t->crop_y + t->crop_height > height)
+        return -1;
+    if (!t->width)
+        t->width = (t->rotation & 1) ? t->crop_height : t->crop_width;
+    if (!t->height)
+        t->height = (t->rotation & 1) ? t->crop_width : t->crop_height;
+    t->mirror = t->mirror ? 1 : 0;
+    return 0;
+}
+
+/**
+ * @brief   Tells whether a normalised transform leaves the frame as it is.
+ */
+int transform_is_identity(const struct frame_transform *t, unsigned int width, unsigned int height)
+{
+    return !t->crop_x && !t->crop_y && t->crop_width == width && t->crop_height == height &&
+           t->width == width && t->height == height && !t->rotation && !t->mirror;
+}
+
+/* Where the columns and rows of the unrotated output sample the source */
+struct transform_map
+{
+    const unsigned char *p;
+    size_t stride;              /* bytes per source row */
+    int box;                    /* integer ratio: average fx by fy blocks */
+    unsigned int fx, fy;
+    unsigned int x_first, x_last, y_last;  /* crop edges, inclusive */
+    uint32_t *xs, *ys;          /* first source pixel, or 16.16 position for bilinear */
+};
+
+/* Thread-local scratch that only ever grows */
+static void *scratch(void **buf, size_t *size, size_t need)
+{
+    if (*size < need)
+    {
+        free(*buf);
+        *buf = malloc(need);
+        *size = *buf ? need : 0;
+    }
+    return *buf;
+}
+
+/* 16.16 source position of output sample i of n, pixel centres aligned */
+static void bilinear_positions(uint32_t *pos, unsigned int n, unsigned int first, unsigned int len)
+{
+    uint64_t last = (uint64_t)(first + len - 1) << 16;
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        int64_t x = (int64_t)(((2 * (uint64_t)i + 1) * len << 16) / (2 * (uint64_t)n)) - 32768;
+        x += (int64_t)first << 16;
+        if (x < (int64_t)first << 16)
+            x = (int64_t)first << 16;
+        pos[i] = (uint32_t)((uint64_t)x > last ? last : (uint64_t)x);
+    }
+}
+
+/* Averages the Y, U and V samples of one fx by fy block of the source */
+static void sample_box(const struct transform_map *m, unsigned int u, unsigned int v, unsigned char *yuv)
+{
+    unsigned int x0 = m->xs[u], y0 = m->ys[v];
+    unsigned int first_pair = x0 / 2, last_pair = (x0 + m->fx - 1) / 2;
+    unsigned int sum_y = 0, sum_u = 0, sum_v = 0;
+    unsigned int area = m->fx * m->fy, pairs = (last_pair - first_pair + 1) * m->fy;
+
+    for (unsigned int dy = 0; dy < m->fy; dy++)
+    {
+        const unsigned char *row = m->p + (size_t)(y0 + dy) * m->stride;
+        for (unsigned int x = x0; x < x0 + m->fx; x++)
+            sum_y += row[2 * x];
+        for (unsigned int pair = first_pair; pair <= last_pair; pair++)
+        {
+            sum_u += row[4 * pair + 1];
+            sum_v += row[4 * pair + 3];
+        }
+    }
+    yuv[0] = (unsigned char)((sum_y + area / 2) / area);
+    yuv[1] = (unsigned char)((sum_u + pairs / 2) / pairs);
+    yuv[2] = (unsigned char)((sum_v + pairs / 2) / pairs);
+}
+
+/* One source pixel with its pair's chroma, for 1:1 crops and rotations */
+static void sample_point(const struct transform_map *m, unsigned int u, unsigned int v, unsigned char *yuv)
+{
+    unsigned int x = m->xs[u];
+    const unsigned char *row = m->p + (size_t)m->ys[v] * m->stride;
+
+    yuv[0] = row[2 * x];
+    yuv[1] = row[4 * (x / 2) + 1];
+    yuv[2] = row[4 * (x / 2) + 3];
+}
+
+static inline unsigned char lerp2(unsigned int a, unsigned int b, unsigned int c, unsigned int d,
+                                  unsigned int wx, unsigned int wy)
+{
+    unsigned int top = a * (256 - wx) + b * wx, bottom = c * (256 - wx) + d * wx;
+    return (unsigned char)((top * (256 - wy) + bottom * wy + 32768) >> 16);
+}
+
+/* Bilinear Y, U and V at a fractional source position */
+static void sample_bilinear(const struct transform_map *m, unsigned int u, unsigned int v, unsigned char *yuv)
+{
+    uint32_t x = m->xs[u], y = m->ys[v];
+    unsigned int x0 = x >> 16, y0 = y >> 16;
+    unsigned int x1 = x0 < m->x_last ? x0 + 1 : x0, y1 = y0 < m->y_last ? y0 + 1 : y0;
+    unsigned int wx = (x >> 8) & 0xff, wy = (y >> 8) & 0xff;
+    const unsigned char *r0 = m->p + (size_t)y0 * m->stride, *r1 = m->p + (size_t)y1 * m->stride;
+    /* A pair's chroma sits between its two pixels, at x = 2 * pair + 0.5 */
+    uint32_t lo = (m->x_first / 2) << 16;
+    uint32_t c = x > 32768 && ((x - 32768) >> 1) > lo ? (x - 32768) >> 1 : lo;
+    unsigned int c0 = c >> 16, c1 = c0 < m->x_last / 2 ? c0 + 1 : c0, wc = (c >> 8) & 0xff;
+
+    yuv[0] = lerp2(r0[2 * x0], r0[2 * x1], r1[2 * x0], r1[2 * x1], wx, wy);
+    yuv[1] = lerp2(r0[4 * c0 + 1], r0[4 * c1 + 1], r1[4 * c0 + 1], r1[4 * c1 + 1], wc, wy);
+    yuv[2] = lerp2(r0[4 * c0 + 3], r0[4 * c1 + 3], r1[4 * c0 + 3], r1[4 * c1 + 3], wc, wy);
+}
+
+/*
+ * Samples output row oy into interleaved Y, U, V triplets. Rotation and
+ * mirroring only change which unrotated column and row each output pixel
+ * reads, and along an output row that walks one of them by +-1.
+ */
+static void transform_row(const struct transform_map *m, const struct frame_transform *t, unsigned int oy,
+                          unsigned char *yuv)
+{
+    unsigned int uw = (t->rotation & 1) ? t->height : t->width;
+    unsigned int uh = (t->rotation & 1) ? t->width : t->height;
+    int u, v, du, dv;
+
+    switch (t->rotation)
+    {
+    case 1:
+        u = (int)oy; du = 0; v = (int)uh - 1; dv = -1;
+        break;
+    case 2:
+        u = (int)uw - 1; du = -1; v = (int)(uh - 1 - oy); dv = 0;
+        break;
+    case 3:
+        u = (int)(uw - 1 - oy); du = 0; v = 0; dv = 1;
+        break;
+    default:
+        u = 0; du = 1; v = (int)oy; dv = 0;
+        break;
+    }
+    if (t->mirror)
+    {
+        u = (int)uw - 1 - u;
+        du = -du;
+    }
+
+    if (m->box && 1 == m->fx && 1 == m->fy)
+    {
+        for (unsigned int ox = 0; ox < t->width; ox++, u += du, v += dv)
+            sample_point(m, (unsigned int)u, (unsigned int)v, yuv + 3 * ox);
+    }
+    else if (m->box)
+    {
+        for (unsigned int ox = 0; ox < t->width; ox++, u += du, v += dv)
+            sample_box(m, (unsigned int)u, (unsigned int)v, yuv + 3 * ox);
+    }
+    else
+    {
+        for (unsigned int ox = 0; ox < t->width; ox++, u += du, v += dv)
+            sample_bilinear(m, (unsigned int)u, (unsigned int)v, yuv + 3 * ox);
+    }
+}
+
+/* Writes one sampled row in a packed RGB format, RGB24 or RGB565 */
+static void pack_rgb_row(const unsigned char *yuv, unsigned int n, int rgb565, unsigned char *dst)
+{
+    for (unsigned int i = 0; i < n; i++, yuv += 3)
+    {
+        int32_t y = y_term[yuv[0]];
+        unsigned char r = clip_table[((y + rv_term[yuv[2]]) >> 8) + CLIP_OFFSET];
+        unsigned char g = clip_table[((y + gu_term[yuv[1]] + gv_term[yuv[2]]) >> 8) + CLIP_OFFSET];
+        unsigned char b = clip_table[((y + bu_term[yuv[1]]) >> 8) + CLIP_OFFSET];
+
+        if (rgb565)
+        {
+            unsigned int v = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+            *dst++ = (unsigned char)v;
+            *dst++ = (unsigned char)(v >> 8);
+        }
+        else
+        {
+            *dst++ = r;
+            *dst++ = g;
+            *dst++ = b;
+        }
+    }
+}
+
+/**
+ * @brief   Convert a YUYV frame to any wire format through a transform.
+ *
+ * Cropping, scaling, rotation and mirroring happen inside the conversion:
+ * every output pixel is sampled straight from the source and converted
+ * once, two output rows at a time so the 4:2:0 formats can average their
+ * chroma, and nothing but those two rows is ever buffered. Scaling by an
+ * integer ratio box-filters like the other kernels (each output pixel is
+ * converted from the average Y, U and V of its block), any other ratio is
+ * bilinear.
+ *
+ * @param   p       Pointer to the YUYV input data.
+ * @param   width   Input width in pixels, even.
+ * @param   height  Input height in pixels.
+ * @param   t       Transform, passed through transform_normalise().
+ * @param   format  enum frame_format to produce.
+ * @param   dst     Destination, frame_format_bytes() of t->width by t->height.
+ *
+ * @return  0 on success, -1 for an unknown format or out of memory.
+ */
+int yuyv_transform(const unsigned char *p, unsigned int width, unsigned int height,
+                   const struct frame_transform *t, unsigned int format, unsigned char *dst)
+{
+    static _Thread_local void *maps, *rows;
+    static _Thread_local size_t maps_size, rows_size;
+    unsigned int ow = t->width, oh = t->height;
+    unsigned int uw = (t->rotation & 1) ? oh : ow, uh = (t->rotation & 1) ? ow : oh;
+    unsigned int cw = (ow + 1) / 2, ch = (oh + 1) / 2;
+    unsigned char *chroma = dst + (size_t)ow * oh;
+    struct transform_map m;
+    unsigned char *yuv;
+
+    (void)height;
+    if (format >= FRAME_FMT_COUNT || !ow || !oh)
+        return -1;
+    if (!scratch(&maps, &maps_size, sizeof(uint32_t) * (uw + uh)) ||
+        !(yuv = scratch(&rows, &rows_size, (size_t)ow * 6)))
+        return -1;
+    if (!lut_ready)
+        lut_init();
+
+    m.p = p;
+    m.stride = (size_t)width * 2;
+    m.xs = maps;
+    m.ys = m.xs + uw;
+    m.x_first = t->crop_x;
+    m.x_last = t->crop_x + t->crop_width - 1u;
+    m.y_last = t->crop_y + t->crop_height - 1u;
+    m.box = 0 == t->crop_width % uw && 0 == t->crop_height % uh;
+    if (m.box)
+    {
+        m.fx = t->crop_width / uw;
+        m.fy = t->crop_height / uh;
+        for (unsigned int u = 0; u < uw; u++)
+            m.xs[u] = t->crop_x + u * m.fx;
+        for (unsigned int v = 0; v < uh; v++)
+            m.ys[v] = t->crop_y + v * m.fy;
+    }
+    else
+    {
+        m.fx = m.fy = 0;
+        bilinear_positions(m.xs, uw, t->crop_x, t->crop_width);
+        bilinear_positions(m.ys, uh, t->crop_y, t->crop_height);
+    }
+
+    for (unsigned int oy = 0; oy < oh; oy += 2)
+    {
+        unsigned int count = oy + 1 < oh ? 2 : 1;
+
+        for (unsigned int r = 0; r < count; r++)
+        {
+            const unsigned char *src = yuv + (size_t)r * ow * 3;
+
+            transform_row(&m, t, oy + r, yuv + (size_t)r * ow * 3);
+            if (FRAME_FMT_RGB24 == format || FRAME_FMT_RGB565 == format)
+            {
+                size_t bpp = FRAME_FMT_RGB24 == format ? 3 : 2;
+                pack_rgb_row(src, ow, FRAME_FMT_RGB565 == format, dst + (size_t)(oy + r) * ow * bpp);
+                continue;
+            }
+            for (unsigned int ox = 0; ox < ow; ox++)
+                dst[(size_t)(oy + r) * ow + ox] = src[3 * ox];
+        }
+        if (FRAME_FMT_NV12 != format && FRAME_FMT_I420 != format)
+            continue;
+
+        /* Each chroma sample averages the up to 2x2 output pixels it covers */
+        for (unsigned int cx = 0; cx < cw; cx++)
+        {
+            unsigned int sum_u = 0, sum_v = 0, n = 0;
+            size_t c = (size_t)(oy / 2) * cw + cx;
+
+            for (unsigned int r = 0; r < count; r++)
+            {
+                for (unsigned int ox = 2 * cx; ox < 2 * cx + 2 && ox < ow; ox++, n++)
+                {
+                    sum_u += yuv[((size_t)r * ow + ox) * 3 + 1];
+                    sum_v += yuv[((size_t)r * ow + ox) * 3 + 2];
+                }
+            }
+            if (FRAME_FMT_NV12 == format)
+            {
+                chroma[2 * c] = (unsigned char)((sum_u + n / 2) / n);
+                chroma[2 * c + 1] = (unsigned char)((sum_v + n / 2) / n);
+            }
+            else
+            {
+                chroma[c] = (unsigned char)((sum_u + n / 2) / n);
+                chroma[(size_t)cw * ch + c] = (unsigned char)((sum_v + n / 2) / n);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file color_convert.h
+ * @brief YUYV to RGB24 and compact output format conversion kernels.
+ *
+ * yuyv_to_rgb() is the scalar reference; every other RGB24 kernel produces
+ * the exact same bytes and only differs in speed. yuyv_convert() produces
+ * any enum frame_format straight from YUYV in one pass, and
+ * yuyv_transform() does the same through a crop, scale, rotation and mirror.
+ * Every RGB output uses the matrix and range set by color_convert_select().
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __COLOR_CONVERT_H__
+#define __COLOR_CONVERT_H__
+
+#include "../common/frame_protocol.h"
+
+/* YUV to RGB matrices */
+enum color_matrix
+{
+    COLOR_BT601,        /* standard definition, and what the server assumed before */
+    COLOR_BT709,        /* high definition */
+    COLOR_MATRIX_COUNT
+};
+
+/* Sample ranges: Y 16..235 and chroma 16..240, or all of 0..255 */
+enum color_range
+{
+    COLOR_LIMITED,
+    COLOR_FULL,
+    COLOR_RANGE_COUNT
+};
+
+int color_convert_select(unsigned int matrix, unsigned int range);
+const char *color_convert_name(void);
+void transformation_color_conversion(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b);
+void yuyv_to_rgb(const unsigned char *p, int size, unsigned char *dst);
+void yuyv_to_rgb_lut(const unsigned char *p, int size, unsigned char *dst);
+#ifdef __SSE2__
+void yuyv_to_rgb_sse2(const unsigned char *p, int size, unsigned char *dst);
+#endif
+void yuyv_to_rgb_fast(const unsigned char *p, int size, unsigned char *dst);
+
+int convert_threads_start(int threads);
+void convert_threads_stop(void);
+void yuyv_to_rgb_parallel(const unsigned char *p, int size, unsigned char *dst);
+
+void rgb_downscale(const unsigned char *src, unsigned int width, unsigned int height,
+                   unsigned int scale, unsigned char *dst);
+void rgb_crop_downscale(const unsigned char *src, unsigned int width, unsigned int x, unsigned int y,
+                        unsigned int out_width, unsigned int out_height, unsigned int scale,
+                        unsigned char *dst);
+void yuyv_to_rgb_downscale(const unsigned char *p, unsigned int width, unsigned int height,
+                           unsigned int scale, unsigned char *dst);
+void yuyv_to_rgb_pyramid(const unsigned char *p, unsigned int width, unsigned int height,
+                         unsigned char *full, unsigned char *half, unsigned char *quarter);
+
+void yuyv_to_gray(const unsigned char *p, unsigned int width, unsigned int height,
+                  unsigned int scale, unsigned char *dst);
+void yuyv_to_yuv420(const unsigned char *p, unsigned int width, unsigned int height,
+                    unsigned int scale, int interleaved, unsigned char *dst);
+void yuyv_to_rgb565(const unsigned char *p, unsigned int width, unsigned int height,
+                    unsigned int scale, unsigned char *dst);
+int yuyv_convert(const unsigned char *p, unsigned int width, unsigned int height, unsigned int scale,
+                 unsigned int format, unsigned char *dst);
+
+int transform_normalise(struct frame_transform *t, unsigned int width, unsigned int height);
+int transform_is_identity(const struct frame_transform *t, unsigned int width, unsigned int height);
+int yuyv_transform(const unsigned char *p, unsigned int width, unsigned int height,
+                   const struct frame_transform *t, unsigned int format, unsigned char *dst);
+
+#endif /* __COLOR_CONVERT_H__ */
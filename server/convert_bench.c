@@ -0,0 +1,898 @@
+/**
+ * @file convert_bench.c
+ * @brief Benchmark and bit-exactness check of the YUYV to RGB kernels.
+ *
+ * Usage: convert_bench [-r repetitions] [-t threads] [-f frames.yuyv -s WxH]
+ *
+ * Every kernel in color_convert.c is timed over synthetic frames at several
+ * resolutions, and over raw YUYV frames read from a file if one is given.
+ * For each run the median throughput in Mpixel/s, the median time stamp
+ * counter cycles per pixel and the coefficient of variation of the
+ * per-frame time are reported, and, where perf_event_open() gives access to
+ * the hardware counters, instructions per cycle and last level cache and
+ * branch misses per thousand pixels over all runs. The counters follow the
+ * calling thread only, so they are left out for the parallel kernel. Every
+ * kernel's output is compared byte for byte with the scalar reference
+ * (yuyv_to_rgb(), plus rgb_downscale() for the fused kernels, and plain
+ * per-pixel loops for the compact formats; the transform kernels against
+ * the same references, turned and mirrored where they rotate, and each
+ * pyramid level against rgb_downscale() of the full image), first over an
+ * input covering every Y, U and V value with each colour matrix and range,
+ * and then over each benchmark frame.
+ *
+ * The camera input kernels of input_format.c are checked the same way
+ * against per-pixel references, for every format at widths that are and
+ * are not a multiple of 16 and with rows padded past the image, and then
+ * timed on a padded 1280x720 frame. The exit status is non-zero if any
+ * kernel differs.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+#include "color_convert.h"
+#include "input_format.h"
+#include "perf_counters.h"
+
+#define WARMUP_RUNS 3
+#define DEFAULT_RUNS 30
+
+struct kernel
+{
+    const char *name;
+    unsigned int scale;         /* output is downscaled by this much */
+    void (*convert)(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                    unsigned char *dst);
+    unsigned int format;        /* enum frame_format produced */
+    unsigned int turns;         /* clockwise quarter turns, plus 4 if mirrored first */
+    unsigned int levels;        /* images of halving size written one after the other */
+};
+
+struct input
+{
+    const char *name;
+    unsigned int width, height;
+    unsigned char *yuyv;
+};
+
+static void run_scalar(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                       unsigned char *dst)
+{
+    (void)scale;
+    yuyv_to_rgb(p, (int)(w * h * 2), dst);
+}
+
+static void run_lut(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                    unsigned char *dst)
+{
+    (void)scale;
+    yuyv_to_rgb_lut(p, (int)(w * h * 2), dst);
+}
+
+#ifdef __SSE2__
+static void run_sse2(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                     unsigned char *dst)
+{
+    (void)scale;
+    yuyv_to_rgb_sse2(p, (int)(w * h * 2), dst);
+}
+#endif
+
+static void run_parallel(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                         unsigned char *dst)
+{
+    (void)scale;
+    yuyv_to_rgb_parallel(p, (int)(w * h * 2), dst);
+}
+
+/* What the server did before the fused kernel: convert, then downscale */
+static unsigned char *unfused_tmp;
+
+static void run_unfused(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                        unsigned char *dst)
+{
+    yuyv_to_rgb(p, (int)(w * h * 2), unfused_tmp);
+    rgb_downscale(unfused_tmp, w, h, scale, dst);
+}
+
+static void run_fused(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                      unsigned char *dst)
+{
+    yuyv_to_rgb_downscale(p, w, h, scale, dst);
+}
+
+static void run_format(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                       unsigned char *dst, unsigned int format)
+{
+    yuyv_convert(p, w, h, scale, format, dst);
+}
+
+static void run_gray(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                     unsigned char *dst)
+{
+    run_format(p, w, h, scale, dst, FRAME_FMT_GRAY);
+}
+
+static void run_nv12(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                     unsigned char *dst)
+{
+    run_format(p, w, h, scale, dst, FRAME_FMT_NV12);
+}
+
+static void run_i420(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                     unsigned char *dst)
+{
+    run_format(p, w, h, scale, dst, FRAME_FMT_I420);
+}
+
+static void run_rgb565(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                       unsigned char *dst)
+{
+    run_format(p, w, h, scale, dst, FRAME_FMT_RGB565);
+}
+
+static void run_transform(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                          unsigned char *dst, unsigned int format, unsigned int turns)
+{
+    struct frame_transform t;
+
+    memset(&t, 0, sizeof(t));
+    t.rotation = (uint8_t)(turns & 3);
+    t.mirror = (uint8_t)(turns >> 2);
+    t.width = (uint16_t)((turns & 1) ? h / scale : w / scale);
+    t.height = (uint16_t)((turns & 1) ? w / scale : h / scale);
+    if (0 == transform_normalise(&t, w, h))
+        yuyv_transform(p, w, h, &t, format, dst);
+}
+
+static void run_xform(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                      unsigned char *dst)
+{
+    run_transform(p, w, h, scale, dst, FRAME_FMT_RGB24, 0);
+}
+
+static void run_xform_gray(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                           unsigned char *dst)
+{
+    run_transform(p, w, h, scale, dst, FRAME_FMT_GRAY, 0);
+}
+
+static void run_xform_i420(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                           unsigned char *dst)
+{
+    run_transform(p, w, h, scale, dst, FRAME_FMT_I420, 0);
+}
+
+static void run_rot90(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                      unsigned char *dst)
+{
+    run_transform(p, w, h, scale, dst, FRAME_FMT_RGB24, 1);
+}
+
+static void run_rot180(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                       unsigned char *dst)
+{
+    run_transform(p, w, h, scale, dst, FRAME_FMT_RGB24, 2);
+}
+
+static void run_mirror(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                       unsigned char *dst)
+{
+    run_transform(p, w, h, scale, dst, FRAME_FMT_RGB24, 4);
+}
+
+static void run_rot270m(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                        unsigned char *dst)
+{
+    run_transform(p, w, h, scale, dst, FRAME_FMT_RGB24, 7);
+}
+
+static void run_pyramid(const unsigned char *p, unsigned int w, unsigned int h, unsigned int scale,
+                        unsigned char *dst)
+{
+    unsigned char *half = dst + (size_t)w * h * 3;
+
+    (void)scale;
+    yuyv_to_rgb_pyramid(p, w, h, dst, half, half + (size_t)(w / 2) * (h / 2) * 3);
+}
+
+static const struct kernel kernels[] =
+{
+    { "scalar", 1, run_scalar, FRAME_FMT_RGB24, 0, 1 },
+    { "lut", 1, run_lut, FRAME_FMT_RGB24, 0, 1 },
+#ifdef __SSE2__
+    { "sse2", 1, run_sse2, FRAME_FMT_RGB24, 0, 1 },
+#endif
+    { "parallel", 1, run_parallel, FRAME_FMT_RGB24, 0, 1 },
+    { "unfused/2", 2, run_unfused, FRAME_FMT_RGB24, 0, 1 },
+    { "fused/2", 2, run_fused, FRAME_FMT_RGB24, 0, 1 },
+    { "unfused/4", 4, run_unfused, FRAME_FMT_RGB24, 0, 1 },
+    { "fused/4", 4, run_fused, FRAME_FMT_RGB24, 0, 1 },
+    { "gray", 1, run_gray, FRAME_FMT_GRAY, 0, 1 },
+    { "gray/2", 2, run_gray, FRAME_FMT_GRAY, 0, 1 },
+    { "nv12", 1, run_nv12, FRAME_FMT_NV12, 0, 1 },
+    { "i420", 1, run_i420, FRAME_FMT_I420, 0, 1 },
+    { "i420/2", 2, run_i420, FRAME_FMT_I420, 0, 1 },
+    { "rgb565", 1, run_rgb565, FRAME_FMT_RGB565, 0, 1 },
+    { "rgb565/2", 2, run_rgb565, FRAME_FMT_RGB565, 0, 1 },
+    { "xform", 1, run_xform, FRAME_FMT_RGB24, 0, 1 },
+    { "xform-y/2", 2, run_xform_gray, FRAME_FMT_GRAY, 0, 1 },
+    { "xform-i420", 1, run_xform_i420, FRAME_FMT_I420, 0, 1 },
+    { "rot90", 1, run_rot90, FRAME_FMT_RGB24, 1, 1 },
+    { "rot180", 1, run_rot180, FRAME_FMT_RGB24, 2, 1 },
+    { "mirror", 1, run_mirror, FRAME_FMT_RGB24, 4, 1 },
+    { "rot270m", 1, run_rot270m, FRAME_FMT_RGB24, 7, 1 },
+    { "pyramid", 1, run_pyramid, FRAME_FMT_RGB24, 0, FRAME_PYRAMID_LEVELS },
+};
+
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+static struct perf_counters counters;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Rounded mean of one channel of a YUV 4:4:4 image over a block */
+static unsigned char block_mean(const unsigned char *plane, unsigned int width, unsigned int x0,
+                                unsigned int y0, unsigned int x1, unsigned int y1)
+{
+    unsigned int sum = 0, count = (x1 - x0) * (y1 - y0);
+
+    for (unsigned int y = y0; y < y1; y++)
+        for (unsigned int x = x0; x < x1; x++)
+            sum += plane[(size_t)y * width + x];
+    return (unsigned char)((sum + count / 2) / count);
+}
+
+/* The compact formats, from every pixel's own Y, U and V */
+static void reference_compact(const struct kernel *k, const struct input *in, unsigned char *dst)
+{
+    unsigned int w = in->width, h = in->height, s = k->scale, ow = w / s, oh = h / s;
+    unsigned int cw = (ow + 1) / 2, ch = (oh + 1) / 2;
+    size_t pixels = (size_t)w * h;
+    unsigned char *yuv = malloc(pixels * 3);
+
+    if (!yuv)
+        exit(EXIT_FAILURE);
+    for (size_t i = 0; i < pixels; i++)
+    {
+        yuv[i] = in->yuyv[2 * i];
+        yuv[pixels + i] = in->yuyv[(i & ~(size_t)1) * 2 + 1];
+        yuv[2 * pixels + i] = in->yuyv[(i & ~(size_t)1) * 2 + 3];
+    }
+
+    if (FRAME_FMT_RGB565 == k->format)
+    {
+        unsigned char *rgb = malloc((size_t)ow * oh * 3);
+        if (!rgb)
+            exit(EXIT_FAILURE);
+        run_unfused(in->yuyv, w, h, s, rgb);
+        for (size_t i = 0; i < (size_t)ow * oh; i++)
+        {
+            unsigned int v = ((rgb[3 * i] & 0xf8u) << 8) | ((rgb[3 * i + 1] & 0xfcu) << 3) | (rgb[3 * i + 2] >> 3);
+            dst[2 * i] = (unsigned char)(v & 0xff);
+            dst[2 * i + 1] = (unsigned char)(v >> 8);
+        }
+        free(rgb);
+        free(yuv);
+        return;
+    }
+
+    for (unsigned int y = 0; y < oh; y++)
+        for (unsigned int x = 0; x < ow; x++)
+            dst[(size_t)y * ow + x] = block_mean(yuv, w, x * s, y * s, (x + 1) * s, (y + 1) * s);
+    if (FRAME_FMT_GRAY != k->format)
+    {
+        unsigned char *chroma = dst + (size_t)ow * oh;
+        for (unsigned int y = 0; y < ch; y++)
+        {
+            for (unsigned int x = 0; x < cw; x++)
+            {
+                unsigned int x1 = (2 * x + 2) * s < ow * s ? (2 * x + 2) * s : ow * s;
+                unsigned int y1 = (2 * y + 2) * s < oh * s ? (2 * y + 2) * s : oh * s;
+                unsigned char u = block_mean(yuv + pixels, w, 2 * x * s, 2 * y * s, x1, y1);
+                unsigned char v = block_mean(yuv + 2 * pixels, w, 2 * x * s, 2 * y * s, x1, y1);
+                size_t c = (size_t)y * cw + x;
+
+                if (FRAME_FMT_NV12 == k->format)
+                {
+                    chroma[2 * c] = u;
+                    chroma[2 * c + 1] = v;
+                }
+                else
+                {
+                    chroma[c] = u;
+                    chroma[(size_t)cw * ch + c] = v;
+                }
+            }
+        }
+    }
+    free(yuv);
+}
+
+/* The scalar RGB24 image, mirrored and then turned clockwise */
+static void reference_turned(const struct kernel *k, const struct input *in, unsigned char *dst)
+{
+    unsigned int w = in->width, h = in->height;
+    unsigned char *rgb = malloc((size_t)w * h * 3);
+
+    if (!rgb)
+        exit(EXIT_FAILURE);
+    run_scalar(in->yuyv, w, h, 1, rgb);
+    for (unsigned int y = 0; y < h; y++)
+    {
+        for (unsigned int x = 0; x < w; x++)
+        {
+            unsigned int mx = (k->turns & 4) ? w - 1 - x : x;
+            size_t out;
+
+            switch (k->turns & 3)
+            {
+            case 1:
+                out = (size_t)mx * h + (h - 1 - y);
+                break;
+            case 2:
+                out = (size_t)(h - 1 - y) * w + (w - 1 - mx);
+                break;
+            case 3:
+                out = (size_t)(w - 1 - mx) * h + y;
+                break;
+            default:
+                out = (size_t)y * w + mx;
+                break;
+            }
+            memcpy(dst + out * 3, rgb + ((size_t)y * w + x) * 3, 3);
+        }
+    }
+    free(rgb);
+}
+
+/* Computes what a kernel must produce for an input */
+static void reference(const struct kernel *k, const struct input *in, unsigned char *dst)
+{
+    unsigned char *level = dst;
+
+    if (k->turns)
+        reference_turned(k, in, dst);
+    else if (FRAME_FMT_RGB24 != k->format)
+        reference_compact(k, in, dst);
+    else if (1 == k->scale)
+        run_scalar(in->yuyv, in->width, in->height, 1, dst);
+    else
+        run_unfused(in->yuyv, in->width, in->height, k->scale, dst);
+
+    /* Every further level is the first one box-filtered */
+    for (unsigned int l = 1, w = in->width / k->scale, h = in->height / k->scale; l < k->levels; l++)
+    {
+        level += frame_format_bytes(k->format, w >> (l - 1), h >> (l - 1));
+        rgb_downscale(dst, w, h, 1u << l, level);
+    }
+}
+
+static size_t output_size(const struct kernel *k, const struct input *in)
+{
+    size_t len = 0;
+
+    for (unsigned int l = 0; l < k->levels; l++)
+        len += frame_format_bytes(k->format, (in->width / k->scale) >> l, (in->height / k->scale) >> l);
+    return len;
+}
+
+/* Runs a kernel once on an input and compares it with the reference */
+static int verify(const struct kernel *k, const struct input *in, unsigned char *out, unsigned char *ref)
+{
+    size_t len = output_size(k, in);
+
+    reference(k, in, ref);
+    memset(out, 0xA5, len);
+    k->convert(in->yuyv, in->width, in->height, k->scale, out);
+    for (size_t i = 0; i < len; i++)
+    {
+        if (out[i] != ref[i])
+        {
+            printf("  %s differs from the reference on %s at byte %zu: %u != %u\n", k->name, in->name, i,
+                   out[i], ref[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Bayer colour of a sample: 0 red, 1 green, 2 blue */
+static unsigned int bayer_colour(const struct input_layout *l, unsigned int x, unsigned int y)
+{
+    unsigned int red_x = INPUT_BAYER_GRBG == l->format || INPUT_BAYER_BGGR == l->format;
+    unsigned int red_y = INPUT_BAYER_GBRG == l->format || INPUT_BAYER_BGGR == l->format;
+
+    if ((x & 1) == red_x && (y & 1) == red_y)
+        return 0;
+    if ((x & 1) != red_x && (y & 1) != red_y)
+        return 2;
+    return 1;
+}
+
+/*
+ * Bilinear RGB of one Bayer pixel: each missing colour is the rounded mean
+ * of the neighbours holding it, the edges mirrored by one sample
+ */
+static void bayer_pixel(const struct input_layout *l, const unsigned char *src, unsigned int x, unsigned int y,
+                        int rgb[3])
+{
+    unsigned int sum[3] = { 0, 0, 0 }, count[3] = { 0, 0, 0 };
+
+    for (int dy = -1; dy <= 1; dy++)
+    {
+        for (int dx = -1; dx <= 1; dx++)
+        {
+            int nx = (int)x + dx, ny = (int)y + dy;
+            unsigned int c;
+
+            nx = nx < 0 ? 1 : nx >= (int)l->width ? (int)l->width - 2 : nx;
+            ny = ny < 0 ? 1 : ny >= (int)l->height ? (int)l->height - 2 : ny;
+            c = bayer_colour(l, (unsigned int)nx, (unsigned int)ny);
+            if ((dx || dy) && c != bayer_colour(l, x, y))
+            {
+                sum[c] += src[(size_t)ny * l->stride + (size_t)nx];
+                count[c]++;
+            }
+        }
+    }
+    for (unsigned int c = 0; c < 3; c++)
+        rgb[c] = c == bayer_colour(l, x, y) ? src[(size_t)y * l->stride + x]
+                                             : (int)((sum[c] + count[c] / 2) / count[c]);
+}
+
+/* What input_to_yuyv() must produce, one pixel at a time */
+static void reference_input(const struct input_layout *l, const unsigned char *src, unsigned char *dst)
+{
+    size_t luma = l->stride * l->height, cstride = l->stride / 2;
+
+    for (unsigned int y = 0; y < l->height; y++)
+    {
+        const unsigned char *row = src + (size_t)y * l->stride;
+        unsigned char *d = dst + (size_t)y * l->width * 2;
+
+        for (unsigned int x = 0; x < l->width; x++)
+        {
+            /* Even pixels carry U, odd ones V, of their pair */
+            unsigned int pair = x / 2, v = x & 1;
+            int a[3], b[3], r, g, bl;
+
+            switch (l->format)
+            {
+            case INPUT_YUYV:
+                d[2 * x] = row[2 * x];
+                d[2 * x + 1] = row[4 * pair + 1 + 2 * v];
+                break;
+            case INPUT_UYVY:
+                d[2 * x] = row[2 * x + 1];
+                d[2 * x + 1] = row[4 * pair + 2 * v];
+                break;
+            case INPUT_NV12:
+                d[2 * x] = row[x];
+                d[2 * x + 1] = src[luma + (y / 2) * l->stride + 2 * pair + v];
+                break;
+            case INPUT_YU12:
+                d[2 * x] = row[x];
+                d[2 * x + 1] = src[luma + (v ? cstride * ((l->height + 1) / 2) : 0) + (y / 2) * cstride + pair];
+                break;
+            case INPUT_GREY:
+                d[2 * x] = row[x];
+                d[2 * x + 1] = 128;
+                break;
+            default:
+                /* BT.601 limited range, chroma from the pair's summed RGB */
+                bayer_pixel(l, src, x, y, a);
+                bayer_pixel(l, src, x ^ 1, y, b);
+                r = a[0] + b[0];
+                g = a[1] + b[1];
+                bl = a[2] + b[2];
+                d[2 * x] = (unsigned char)(((66 * a[0] + 129 * a[1] + 25 * a[2] + 128) >> 8) + 16);
+                d[2 * x + 1] = (unsigned char)((v ? (112 * r - 94 * g - 18 * bl + 256) >> 9
+                                                  : (-38 * r - 74 * g + 112 * bl + 256) >> 9) + 128);
+                break;
+            }
+        }
+    }
+}
+
+/* Fills a camera frame, padding included, and checks its unpacking */
+static int verify_input(const struct input_layout *l, unsigned char *src, unsigned char *out, unsigned char *ref)
+{
+    size_t size = input_format_size(l), len = (size_t)l->width * l->height * 2;
+    uint32_t state = 0x9e3779b9u ^ (uint32_t)(l->format * 131 + l->width * 7 + l->stride);
+
+    for (size_t i = 0; i < size; i++)
+    {
+        state = state * 1664525u + 1013904223u;
+        src[i] = (unsigned char)(state >> 24);
+    }
+    reference_input(l, src, ref);
+    memset(out, 0xA5, len);
+    input_to_yuyv(l, src, out);
+    for (size_t i = 0; i < len; i++)
+    {
+        if (out[i] != ref[i])
+        {
+            printf("  %s %ux%u stride %zu differs from the reference at byte %zu: %u != %u\n",
+                   input_format_name(l->format), l->width, l->height, l->stride, i, out[i], ref[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Bytes per row of the first plane of an unpadded frame */
+static size_t input_row_bytes(enum input_format format, unsigned int width)
+{
+    return (INPUT_YUYV == format || INPUT_UYVY == format) ? (size_t)width * 2 : width;
+}
+
+/* Checks every input kernel over awkward sizes and then times it */
+static int bench_inputs(int runs, unsigned char *out, unsigned char *ref)
+{
+    static const unsigned int sizes[][2] = { { 2, 2 }, { 18, 6 }, { 34, 10 }, { 70, 4 }, { 640, 480 } };
+    static const size_t padding[] = { 0, 2, 22, 64 };
+    struct input_layout l;
+    unsigned char *src = malloc(1280 * 2 + 64 + (size_t)(1280 * 2 + 64) * 720);
+    int failures = 0;
+
+    if (!src)
+        exit(EXIT_FAILURE);
+    printf("\nInput unpacking against per-pixel references:\n");
+    for (int f = 0; f < INPUT_FORMAT_COUNT; f++)
+    {
+        int status = 0;
+
+        l.format = (enum input_format)f;
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        {
+            for (size_t p = 0; p < sizeof(padding) / sizeof(padding[0]); p++)
+            {
+                l.width = sizes[i][0];
+                l.height = sizes[i][1];
+                l.stride = input_row_bytes(l.format, l.width) + padding[p];
+                status |= verify_input(&l, src, out, ref);
+            }
+        }
+        printf("  %-10s %s\n", input_format_name(l.format), status ? "MISMATCH" : "ok");
+        failures += status ? 1 : 0;
+    }
+
+    printf("\n%-10s %9s %6s %9s %9s  %s\n", "input", "size", "stride", "Mpixel/s", "cyc/pixel", "check");
+    for (int f = 0; f < INPUT_FORMAT_COUNT; f++)
+    {
+        uint64_t *ns = malloc(sizeof(uint64_t) * (size_t)runs);
+        uint64_t *cyc = malloc(sizeof(uint64_t) * (size_t)runs);
+        double pixels = 1280.0 * 720;
+        char cycles_text[16];
+        int status;
+
+        if (!ns || !cyc)
+            exit(EXIT_FAILURE);
+        l.format = (enum input_format)f;
+        l.width = 1280;
+        l.height = 720;
+        l.stride = input_row_bytes(l.format, l.width) + 64;
+        status = verify_input(&l, src, out, ref);
+        for (int i = 0; i < WARMUP_RUNS; i++)
+            input_to_yuyv(&l, src, out);
+        for (int i = 0; i < runs; i++)
+        {
+            uint64_t t0 = now_ns(), c0 = cycles();
+            input_to_yuyv(&l, src, out);
+            cyc[i] = cycles() - c0;
+            ns[i] = now_ns() - t0;
+        }
+        qsort(ns, (size_t)runs, sizeof(*ns), compare_u64);
+        qsort(cyc, (size_t)runs, sizeof(*cyc), compare_u64);
+#ifdef HAVE_TSC
+        snprintf(cycles_text, sizeof(cycles_text), "%.2f", (double)cyc[runs / 2] / pixels);
+#else
+        strcpy(cycles_text, "-");
+#endif
+        printf("%-10s %4ux%-4u %6zu %9.1f %9s  %s\n", input_format_name(l.format), l.width, l.height, l.stride,
+               pixels / ((double)ns[runs / 2] / 1e3), cycles_text, status ? "MISMATCH" : "ok");
+        failures += status ? 1 : 0;
+        free(ns);
+        free(cyc);
+    }
+    free(src);
+    return failures;
+}
+
+/* Formats event / divisor event * factor, or "-" if either was not counted */
+static void format_ratio(char text[16], const struct perf_sample *s, int event, int divisor, double factor)
+{
+    double value;
+
+    if (!(s->valid & (1u << event)) || (divisor >= 0 && (!(s->valid & (1u << divisor)) || !s->value[divisor])))
+    {
+        strcpy(text, "-");
+        return;
+    }
+    value = (double)s->value[event] * factor;
+    if (divisor >= 0)
+        value /= (double)s->value[divisor];
+    snprintf(text, 16, "%.2f", value);
+}
+
+static int bench(const struct kernel *k, const struct input *in, int runs, unsigned char *out,
+                 unsigned char *ref)
+{
+    uint64_t *ns = malloc(sizeof(uint64_t) * (size_t)runs);
+    uint64_t *cyc = malloc(sizeof(uint64_t) * (size_t)runs);
+    double pixels = (double)in->width * in->height;
+    double mean = 0, var = 0;
+    char cycles_text[16], ipc_text[16], cache_text[16], branch_text[16];
+    struct perf_sample before, after, delta;
+    int status;
+
+    if (!ns || !cyc)
+        exit(EXIT_FAILURE);
+    for (int i = 0; i < WARMUP_RUNS; i++)
+        k->convert(in->yuyv, in->width, in->height, k->scale, out);
+    perf_counters_read(&counters, &before);
+    for (int i = 0; i < runs; i++)
+    {
+        uint64_t t0 = now_ns(), c0 = cycles();
+        k->convert(in->yuyv, in->width, in->height, k->scale, out);
+        cyc[i] = cycles() - c0;
+        ns[i] = now_ns() - t0;
+        mean += (double)ns[i];
+    }
+    perf_counters_read(&counters, &after);
+    perf_counters_delta(&before, &after, &delta);
+    if (run_parallel == k->convert)
+        delta.valid = 0;
+    mean /= runs;
+    for (int i = 0; i < runs; i++)
+        var += ((double)ns[i] - mean) * ((double)ns[i] - mean);
+    var /= runs;
+    qsort(ns, (size_t)runs, sizeof(*ns), compare_u64);
+    qsort(cyc, (size_t)runs, sizeof(*cyc), compare_u64);
+
+    status = verify(k, in, out, ref);
+#ifdef HAVE_TSC
+    snprintf(cycles_text, sizeof(cycles_text), "%.2f", (double)cyc[runs / 2] / pixels);
+#else
+    strcpy(cycles_text, "-");
+#endif
+    format_ratio(ipc_text, &delta, PERF_INSTRUCTIONS, PERF_CYCLES, 1);
+    format_ratio(cache_text, &delta, PERF_CACHE_MISSES, -1, 1000 / (pixels * runs));
+    format_ratio(branch_text, &delta, PERF_BRANCH_MISSES, -1, 1000 / (pixels * runs));
+    printf("%-10s %4ux%-4u %-9s %9.1f %9s %7.1f%% %6s %9s %9s  %s\n", k->name, in->width, in->height,
+           in->name, pixels / ((double)ns[runs / 2] / 1e3), cycles_text, 100.0 * sqrt(var) / mean, ipc_text,
+           cache_text, branch_text, status ? "MISMATCH" : "ok");
+    free(ns);
+    free(cyc);
+    return status;
+}
+
+static void fill_gradient(struct input *in)
+{
+    for (unsigned int y = 0; y < in->height; y++)
+    {
+        unsigned char *row = in->yuyv + (size_t)y * in->width * 2;
+        for (unsigned int x = 0; x < in->width; x += 2)
+        {
+            row[2 * x] = (unsigned char)(16 + (x * 219) / in->width);
+            row[2 * x + 1] = (unsigned char)(16 + (y * 224) / in->height);
+            row[2 * x + 2] = (unsigned char)(16 + ((x + 1) * 219) / in->width);
+            row[2 * x + 3] = (unsigned char)(240 - (x * 224) / in->width);
+        }
+    }
+}
+
+static void fill_noise(struct input *in)
+{
+    uint32_t state = 0x12345678u;
+    size_t len = (size_t)in->width * in->height * 2;
+
+    /* Full 0..255 range, so the clipping paths are exercised too */
+    for (size_t i = 0; i < len; i++)
+    {
+        state = state * 1664525u + 1013904223u;
+        in->yuyv[i] = (unsigned char)(state >> 24);
+    }
+}
+
+static struct input make_input(const char *name, unsigned int width, unsigned int height)
+{
+    struct input in = { name, width, height, malloc((size_t)width * height * 2) };
+
+    if (!in.yuyv)
+        exit(EXIT_FAILURE);
+    return in;
+}
+
+/*
+ * One pixel pair for every U and V with each Y value, laid out as a square
+ * image so that it also fits the 16-bit sizes of a frame transform
+ */
+static struct input make_exhaustive(void)
+{
+    struct input in = make_input("all-yuv", 4096, 4096);
+    unsigned char *p = in.yuyv;
+
+    for (unsigned int u = 0; u < 256; u++)
+        for (unsigned int v = 0; v < 256; v++)
+            for (unsigned int y = 0; y < 128; y++, p += 4)
+            {
+                p[0] = (unsigned char)y;
+                p[1] = (unsigned char)u;
+                p[2] = (unsigned char)(255 - y);
+                p[3] = (unsigned char)v;
+            }
+    return in;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-r repetitions] [-t threads] [-f frames.yuyv -s WxH]\n"
+                    "  -r runs      timed runs per kernel and input (default %d)\n"
+                    "  -t threads   threads of the parallel kernel (default: online CPUs, at least 2)\n"
+                    "  -f file      also benchmark raw YUYV frames from this file\n"
+                    "  -s WxH       frame size of that file (default 640x480)\n",
+            prog, DEFAULT_RUNS);
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned int sizes[][2] = { { 320, 240 }, { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+    struct input inputs[64];
+    int input_count = 0;
+    int runs = DEFAULT_RUNS;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *file = NULL;
+    unsigned int file_w = 640, file_h = 480;
+    size_t max_pixels = 0;
+    unsigned char *out, *ref;
+    int failures = 0;
+    int opt;
+
+    while (-1 != (opt = getopt(argc, argv, "r:t:f:s:")))
+    {
+        switch (opt)
+        {
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        case 's':
+            if (2 != sscanf(optarg, "%ux%u", &file_w, &file_h))
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (runs < 1 || file_w % 4 || !file_h)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (threads < 2)
+        threads = 2;
+    if (-1 == convert_threads_start(threads))
+        return EXIT_FAILURE;
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        inputs[input_count] = make_input("gradient", sizes[i][0], sizes[i][1]);
+        fill_gradient(&inputs[input_count++]);
+        inputs[input_count] = make_input("noise", sizes[i][0], sizes[i][1]);
+        fill_noise(&inputs[input_count++]);
+    }
+    if (file)
+    {
+        FILE *f = fopen(file, "rb");
+        size_t frame = (size_t)file_w * file_h * 2;
+
+        if (!f)
+        {
+            perror(file);
+            return EXIT_FAILURE;
+        }
+        while (input_count < (int)(sizeof(inputs) / sizeof(inputs[0])))
+        {
+            struct input in = make_input("recorded", file_w, file_h);
+            if (frame != fread(in.yuyv, 1, frame, f))
+            {
+                free(in.yuyv);
+                break;
+            }
+            inputs[input_count++] = in;
+        }
+        fclose(f);
+    }
+    inputs[input_count] = make_exhaustive();
+
+    for (int i = 0; i <= input_count; i++)
+    {
+        size_t pixels = (size_t)inputs[i].width * inputs[i].height;
+        if (pixels > max_pixels)
+            max_pixels = pixels;
+    }
+    out = malloc(max_pixels * 4);
+    ref = malloc(max_pixels * 4);
+    unfused_tmp = malloc(max_pixels * 3);
+    if (!out || !ref || !unfused_tmp)
+        return EXIT_FAILURE;
+
+    for (unsigned int m = 0; m < COLOR_MATRIX_COUNT * COLOR_RANGE_COUNT; m++)
+    {
+        color_convert_select(m / COLOR_RANGE_COUNT, m % COLOR_RANGE_COUNT);
+        printf("Bit-exactness over every Y, U and V value, %s:\n", color_convert_name());
+        for (size_t k = 0; k < KERNEL_COUNT; k++)
+        {
+            int status = verify(&kernels[k], &inputs[input_count], out, ref);
+            printf("  %-10s %s\n", kernels[k].name, status ? "MISMATCH" : "ok");
+            failures += status ? 1 : 0;
+        }
+    }
+    color_convert_select(COLOR_BT601, COLOR_LIMITED);
+
+    printf("\n%d runs each, parallel kernel on %d threads\n", runs, threads);
+    perf_counters_open(&counters, "the benchmark");
+    printf("%-10s %9s %-9s %9s %9s %8s %6s %9s %9s  %s\n", "kernel", "size", "input", "Mpixel/s", "cyc/pixel",
+           "cv", "IPC", "LLCm/kpx", "brm/kpx", "check");
+    for (int i = 0; i < input_count; i++)
+    {
+        for (size_t k = 0; k < KERNEL_COUNT; k++)
+            failures += bench(&kernels[k], &inputs[i], runs, out, ref) ? 1 : 0;
+    }
+
+    perf_counters_close(&counters);
+    failures += bench_inputs(runs, out, ref);
+    convert_threads_stop();
+    for (int i = 0; i <= input_count; i++)
+        free(inputs[i].yuyv);
+    free(out);
+    free(ref);
+    free(unfused_tmp);
+    if (failures)
+        printf("\n%d kernel runs did not match the scalar reference\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,167 @@
+/**
+ * @file history.c
+ * @brief Bounded in-memory ring of recently captured frames.
+ *
+ * Frames are kept in the camera's raw YUYV format, which is two thirds of
+ * the size of the RGB24 the server streams and loses nothing, and are only
+ * converted when they are replayed. They are stored back to back in a
+ * single arena of exactly the configured byte budget; appending a frame
+ * evicts the oldest frames it would overlap, so the number of frames held
+ * follows from the budget rather than being configured. Frames are
+ * indexed by a ring of descriptors in capture order, which keeps lookups
+ * by sequence number or timestamp a binary search.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "history.h"
+
+/* Smallest frame the descriptor ring is sized for */
+#define HISTORY_MIN_FRAME 4096
+
+struct history_slot
+{
+    uint32_t sequence;
+    uint64_t timestamp_us;
+    size_t offset;              /* position of the frame in the arena */
+    size_t len;
+};
+
+static unsigned char *arena;
+static size_t arena_size;
+static size_t write_pos;        /* where the next frame goes */
+static struct history_slot *slots;
+static size_t slot_cap, slot_head, slot_count;
+
+/**
+ * @brief   Allocate the history arena.
+ *
+ * @param   budget_bytes    Memory the stored frames may use.
+ *
+ * @return  0 on success, -1 if the memory could not be allocated.
+ */
+int history_init(size_t budget_bytes)
+{
+    slot_cap = budget_bytes / HISTORY_MIN_FRAME + 1;
+    arena = malloc(budget_bytes);
+    slots = calloc(slot_cap, sizeof(*slots));
+    if (!arena || !slots)
+    {
+        syslog(LOG_ERR, "Out of memory for a %zu byte history", budget_bytes);
+        free(arena);
+        free(slots);
+        arena = NULL;
+        slots = NULL;
+        return -1;
+    }
+    /* Touch the arena now rather than page faulting during capture */
+    memset(arena, 0, budget_bytes);
+    arena_size = budget_bytes;
+    syslog(LOG_INFO, "Keeping %zu bytes of frame history", budget_bytes);
+    return 0;
+}
+
+/**
+ * @brief   Tells whether a history ring has been configured.
+ *
+ * @return  Non-zero if frames are being kept.
+ */
+int history_enabled(void)
+{
+    return NULL != arena;
+}
+
+static struct history_slot *slot_at(size_t i)
+{
+    return &slots[(slot_head + i) % slot_cap];
+}
+
+static void evict_oldest(void)
+{
+    slot_head = (slot_head + 1) % slot_cap;
+    slot_count--;
+}
+
+/**
+ * @brief   Store a captured frame, evicting the oldest frames as needed.
+ *
+ * @param   sequence        Capture sequence number.
+ * @param   timestamp_us    Capture time, as sent in frame headers.
+ * @param   data            Raw frame data.
+ * @param   len             Raw frame size in bytes.
+ *
+ * @return  This function does not return a value.
+ */
+void history_append(uint32_t sequence, uint64_t timestamp_us, const unsigned char *data, size_t len)
+{
+    struct history_slot *s;
+
+    if (!arena || len > arena_size)
+        return;
+
+    /* Frames never straddle the end of the arena */
+    if (write_pos + len > arena_size)
+        write_pos = 0;
+
+    /*
+     * The oldest frame always starts at or after write_pos (circularly), so
+     * evicting from the front until it no longer overlaps frees the space.
+     */
+    while (slot_count)
+    {
+        struct history_slot *old = slot_at(0);
+        if (slot_count < slot_cap &&
+            (old->offset >= write_pos + len || old->offset + old->len <= write_pos))
+            break;
+        evict_oldest();
+    }
+
+    memcpy(arena + write_pos, data, len);
+    s = slot_at(slot_count++);
+    s->sequence = sequence;
+    s->timestamp_us = timestamp_us;
+    s->offset = write_pos;
+    s->len = len;
+    write_pos += len;
+}
+
+/**
+ * @brief   Find the oldest stored frame at or after a sequence and time.
+ *
+ * @param   min_sequence        Smallest acceptable sequence number.
+ * @param   min_timestamp_us    Earliest acceptable capture time.
+ * @param   frame               Receives the frame. Its data stays valid
+ *                              until the next history_append().
+ *
+ * @return  0 if a frame was found, -1 otherwise.
+ */
+int history_find(uint32_t min_sequence, uint64_t min_timestamp_us, struct history_frame *frame)
+{
+    size_t lo = 0, hi = slot_count;
+    struct history_slot *s;
+
+    /* Sequence and timestamp both grow along the ring */
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        s = slot_at(mid);
+        if (s->sequence < min_sequence || s->timestamp_us < min_timestamp_us)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == slot_count)
+        return -1;
+
+    s = slot_at(lo);
+    frame->sequence = s->sequence;
+    frame->timestamp_us = s->timestamp_us;
+    frame->data = arena + s->offset;
+    frame->len = s->len;
+    return 0;
+}
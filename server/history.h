@@ -0,0 +1,28 @@
+/**
+ * @file history.h
+ * @brief Bounded in-memory ring of recently captured frames.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct history_frame
+{
+    uint32_t sequence;
+    uint64_t timestamp_us;
+    const unsigned char *data;  /* raw YUYV, valid until the next append */
+    size_t len;
+};
+
+int history_init(size_t budget_bytes);
+int history_enabled(void);
+void history_append(uint32_t sequence, uint64_t timestamp_us, const unsigned char *data, size_t len);
+int history_find(uint32_t min_sequence, uint64_t min_timestamp_us, struct history_frame *frame);
+
+#endif /* __HISTORY_H__ */
@@ -0,0 +1,342 @@
+/**
+ * @file input_format.c
+ * @brief Unpacking of the pixel formats cameras deliver into the packed
+ *        YUYV frames the rest of the server works on.
+ *
+ * Every camera format is turned into packed YUYV while it is copied out
+ * of the driver's buffer, so the unpacking replaces the copy the capture
+ * thread made anyway and every output kernel downstream stays as it is.
+ * Rows are read at the driver's bytesperline, which may include padding.
+ *
+ * There is one kernel per input format, picked once per frame; the row
+ * loops inside it carry no per-pixel format decisions. YUV inputs only
+ * move bytes: the 4:2:0 formats repeat each chroma row for the two rows
+ * it covers and grey gets neutral chroma, 16 pixels at a time with SSE2.
+ * Bayer data is demosaiced bilinearly, mirroring at the edges, which
+ * keeps the colour pattern intact, and converted with the BT.601 limited
+ * range matrix. The conversions back to RGB are set to the same matrix
+ * for Bayer cameras. The four Bayer orders share one inline kernel that
+ * is instantiated with the position of the red sample as a constant.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <sys/time.h>
+#include <linux/videodev2.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "input_format.h"
+
+static const struct
+{
+    uint32_t fourcc;
+    const char *name;
+} formats[INPUT_FORMAT_COUNT] =
+{
+    [INPUT_YUYV] = { V4L2_PIX_FMT_YUYV, "YUYV" },
+    [INPUT_UYVY] = { V4L2_PIX_FMT_UYVY, "UYVY" },
+    [INPUT_NV12] = { V4L2_PIX_FMT_NV12, "NV12" },
+    [INPUT_YU12] = { V4L2_PIX_FMT_YUV420, "YU12" },
+    [INPUT_GREY] = { V4L2_PIX_FMT_GREY, "GREY" },
+    [INPUT_BAYER_BGGR] = { V4L2_PIX_FMT_SBGGR8, "BA81" },
+    [INPUT_BAYER_GBRG] = { V4L2_PIX_FMT_SGBRG8, "GBRG" },
+    [INPUT_BAYER_GRBG] = { V4L2_PIX_FMT_SGRBG8, "GRBG" },
+    [INPUT_BAYER_RGGB] = { V4L2_PIX_FMT_SRGGB8, "RGGB" },
+};
+
+/**
+ * @brief   Maps a V4L2 pixel format to the input format it is unpacked as.
+ *
+ * @param   fourcc  V4L2_PIX_FMT_* code.
+ *
+ * @return  enum input_format, or -1 if the format is not supported.
+ */
+int input_format_from_fourcc(uint32_t fourcc)
+{
+    for (int i = 0; i < INPUT_FORMAT_COUNT; i++)
+        if (formats[i].fourcc == fourcc)
+            return i;
+    return -1;
+}
+
+/**
+ * @brief   Returns the V4L2 pixel format of an input format.
+ */
+uint32_t input_format_fourcc(enum input_format format)
+{
+    return formats[format].fourcc;
+}
+
+/**
+ * @brief   Returns the V4L2 fourcc of an input format as text, for logs.
+ */
+const char *input_format_name(enum input_format format)
+{
+    return formats[format].name;
+}
+
+/**
+ * @brief   Bytes a complete frame occupies in the driver's buffer.
+ *
+ * @param   l   Layout of the frame.
+ *
+ * @return  Size in bytes, padding included.
+ */
+size_t input_format_size(const struct input_layout *l)
+{
+    size_t luma = l->stride * l->height;
+
+    switch (l->format)
+    {
+    case INPUT_NV12:
+        return luma + l->stride * ((l->height + 1) / 2);
+    case INPUT_YU12:
+        return luma + 2 * (l->stride / 2) * ((l->height + 1) / 2);
+    default:
+        return luma;
+    }
+}
+
+/* Y0 U Y1 V from a row of Y samples and a row of U/V pairs */
+static inline void interleave_row(const unsigned char *y, const unsigned char *uv, unsigned int width,
+                                  unsigned char *dst)
+{
+    unsigned int x = 0;
+
+#ifdef __SSE2__
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i luma = _mm_loadu_si128((const __m128i *)(y + x));
+        __m128i chroma = _mm_loadu_si128((const __m128i *)(uv + x));
+
+        _mm_storeu_si128((__m128i *)(dst + 2 * x), _mm_unpacklo_epi8(luma, chroma));
+        _mm_storeu_si128((__m128i *)(dst + 2 * x + 16), _mm_unpackhi_epi8(luma, chroma));
+    }
+#endif
+    for (; x < width; x++)
+    {
+        dst[2 * x] = y[x];
+        dst[2 * x + 1] = uv[x];
+    }
+}
+
+static void unpack_yuyv(const struct input_layout *l, const unsigned char *src, unsigned char *dst)
+{
+    size_t row = (size_t)l->width * 2;
+
+    for (unsigned int y = 0; y < l->height; y++)
+        memcpy(dst + y * row, src + y * l->stride, row);
+}
+
+static void unpack_uyvy(const struct input_layout *l, const unsigned char *src, unsigned char *dst)
+{
+    size_t row = (size_t)l->width * 2;
+
+    for (unsigned int y = 0; y < l->height; y++)
+    {
+        const unsigned char *s = src + y * l->stride;
+        unsigned char *d = dst + y * row;
+        size_t x = 0;
+
+#ifdef __SSE2__
+        /* Swapping the bytes of every 16-bit word turns U Y V Y into Y U Y V */
+        for (; x + 16 <= row; x += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + x));
+            _mm_storeu_si128((__m128i *)(d + x), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+        }
+#endif
+        for (; x < row; x += 2)
+        {
+            d[x] = s[x + 1];
+            d[x + 1] = s[x];
+        }
+    }
+}
+
+static void unpack_nv12(const struct input_layout *l, const unsigned char *src, unsigned char *dst)
+{
+    const unsigned char *chroma = src + l->stride * l->height;
+
+    for (unsigned int y = 0; y < l->height; y++)
+        interleave_row(src + y * l->stride, chroma + (y / 2) * l->stride, l->width,
+                       dst + (size_t)y * l->width * 2);
+}
+
+static void unpack_yu12(const struct input_layout *l, const unsigned char *src, unsigned char *dst)
+{
+    size_t cstride = l->stride / 2;
+    const unsigned char *cb = src + l->stride * l->height;
+    const unsigned char *cr = cb + cstride * ((l->height + 1) / 2);
+    unsigned char uv[2 * ((l->width + 1) / 2)];
+
+    for (unsigned int y = 0; y < l->height; y++)
+    {
+        /* A chroma row serves two luma rows, interleave it once */
+        if (!(y & 1))
+        {
+            const unsigned char *u = cb + (y / 2) * cstride;
+            const unsigned char *v = cr + (y / 2) * cstride;
+            unsigned int x = 0, half = (l->width + 1) / 2;
+
+#ifdef __SSE2__
+            for (; x + 16 <= half; x += 16)
+            {
+                __m128i cu = _mm_loadu_si128((const __m128i *)(u + x));
+                __m128i cv = _mm_loadu_si128((const __m128i *)(v + x));
+
+                _mm_storeu_si128((__m128i *)(uv + 2 * x), _mm_unpacklo_epi8(cu, cv));
+                _mm_storeu_si128((__m128i *)(uv + 2 * x + 16), _mm_unpackhi_epi8(cu, cv));
+            }
+#endif
+            for (; x < half; x++)
+            {
+                uv[2 * x] = u[x];
+                uv[2 * x + 1] = v[x];
+            }
+        }
+        interleave_row(src + y * l->stride, uv, l->width, dst + (size_t)y * l->width * 2);
+    }
+}
+
+static void unpack_grey(const struct input_layout *l, const unsigned char *src, unsigned char *dst)
+{
+    unsigned char neutral[l->width];
+
+    memset(neutral, 128, sizeof(neutral));
+    for (unsigned int y = 0; y < l->height; y++)
+        interleave_row(src + y * l->stride, neutral, l->width, dst + (size_t)y * l->width * 2);
+}
+
+/* Which colour a Bayer sample holds, and for green which row it sits on */
+enum bayer_site
+{
+    SITE_RED,
+    SITE_GREEN_RED_ROW,
+    SITE_GREEN_BLUE_ROW,
+    SITE_BLUE,
+};
+
+/* Bilinear RGB at column x of mid, l and r being its neighbour columns */
+static inline void bayer_rgb(const unsigned char *up, const unsigned char *mid, const unsigned char *down,
+                             unsigned int l, unsigned int x, unsigned int r, enum bayer_site site, int rgb[3])
+{
+    int cross = (mid[l] + mid[r] + up[x] + down[x] + 2) >> 2;
+    int diagonal = (up[l] + up[r] + down[l] + down[r] + 2) >> 2;
+    int across = (mid[l] + mid[r] + 1) >> 1;
+    int vertical = (up[x] + down[x] + 1) >> 1;
+
+    switch (site)
+    {
+    case SITE_RED:
+        rgb[0] = mid[x], rgb[1] = cross, rgb[2] = diagonal;
+        break;
+    case SITE_GREEN_RED_ROW:
+        rgb[0] = across, rgb[1] = mid[x], rgb[2] = vertical;
+        break;
+    case SITE_GREEN_BLUE_ROW:
+        rgb[0] = vertical, rgb[1] = mid[x], rgb[2] = across;
+        break;
+    case SITE_BLUE:
+        rgb[0] = diagonal, rgb[1] = cross, rgb[2] = mid[x];
+        break;
+    }
+}
+
+static inline unsigned char rgb_luma(const int rgb[3])
+{
+    return (unsigned char)(((66 * rgb[0] + 129 * rgb[1] + 25 * rgb[2] + 128) >> 8) + 16);
+}
+
+/* One row of YUYV, with the sites of even and odd columns fixed */
+static inline void bayer_row(const unsigned char *up, const unsigned char *mid, const unsigned char *down,
+                             unsigned int width, enum bayer_site even, enum bayer_site odd, unsigned char *dst)
+{
+    for (unsigned int x = 0; x + 1 < width; x += 2)
+    {
+        int a[3], b[3], r, g, bl;
+
+        /* Mirroring by one column keeps the colour pattern */
+        bayer_rgb(up, mid, down, x ? x - 1 : 1, x, x + 1, even, a);
+        bayer_rgb(up, mid, down, x, x + 1, x + 2 < width ? x + 2 : x, odd, b);
+        r = a[0] + b[0];
+        g = a[1] + b[1];
+        bl = a[2] + b[2];
+        dst[2 * x] = rgb_luma(a);
+        dst[2 * x + 1] = (unsigned char)(((-38 * r - 74 * g + 112 * bl + 256) >> 9) + 128);
+        dst[2 * x + 2] = rgb_luma(b);
+        dst[2 * x + 3] = (unsigned char)(((112 * r - 94 * g - 18 * bl + 256) >> 9) + 128);
+    }
+}
+
+/* red_x and red_y locate the red sample in the top left 2x2 block */
+static inline void unpack_bayer(const struct input_layout *l, const unsigned char *src, unsigned char *dst,
+                                const unsigned int red_x, const unsigned int red_y)
+{
+    for (unsigned int y = 0; y < l->height; y++)
+    {
+        const unsigned char *mid = src + y * l->stride;
+        const unsigned char *up = src + (y ? y - 1 : 1) * l->stride;
+        const unsigned char *down = src + (y + 1 < l->height ? y + 1 : y - 1) * l->stride;
+        unsigned char *d = dst + (size_t)y * l->width * 2;
+
+        if ((y & 1) == red_y)
+            bayer_row(up, mid, down, l->width, red_x ? SITE_GREEN_RED_ROW : SITE_RED,
+                      red_x ? SITE_RED : SITE_GREEN_RED_ROW, d);
+        else
+            bayer_row(up, mid, down, l->width, red_x ? SITE_BLUE : SITE_GREEN_BLUE_ROW,
+                      red_x ? SITE_GREEN_BLUE_ROW : SITE_BLUE, d);
+    }
+}
+
+static void unpack_bggr(const struct input_layout *l, const unsigned char *src, unsigned char *dst)
+{
+    unpack_bayer(l, src, dst, 1, 1);
+}
+
+static void unpack_gbrg(const struct input_layout *l, const unsigned char *src, unsigned char *dst)
+{
+    unpack_bayer(l, src, dst, 0, 1);
+}
+
+static void unpack_grbg(const struct input_layout *l, const unsigned char *src, unsigned char *dst)
+{
+    unpack_bayer(l, src, dst, 1, 0);
+}
+
+static void unpack_rggb(const struct input_layout *l, const unsigned char *src, unsigned char *dst)
+{
+    unpack_bayer(l, src, dst, 0, 0);
+}
+
+static void (*const unpack[INPUT_FORMAT_COUNT])(const struct input_layout *, const unsigned char *,
+                                                unsigned char *) =
+{
+    [INPUT_YUYV] = unpack_yuyv,
+    [INPUT_UYVY] = unpack_uyvy,
+    [INPUT_NV12] = unpack_nv12,
+    [INPUT_YU12] = unpack_yu12,
+    [INPUT_GREY] = unpack_grey,
+    [INPUT_BAYER_BGGR] = unpack_bggr,
+    [INPUT_BAYER_GBRG] = unpack_gbrg,
+    [INPUT_BAYER_GRBG] = unpack_grbg,
+    [INPUT_BAYER_RGGB] = unpack_rggb,
+};
+
+/**
+ * @brief   Unpack one camera frame into packed YUYV.
+ *
+ * @param   l       Layout of the frame; width and height must be even.
+ * @param   src     The frame, at least input_format_size() bytes.
+ * @param   dst     Receives width * height * 2 bytes of YUYV.
+ *
+ * @return  This function does not return a value.
+ */
+void input_to_yuyv(const struct input_layout *l, const unsigned char *src, unsigned char *dst)
+{
+    unpack[l->format](l, src, dst);
+}
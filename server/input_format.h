@@ -0,0 +1,45 @@
+/**
+ * @file input_format.h
+ * @brief Unpacking of the pixel formats cameras deliver into the packed
+ *        YUYV frames the rest of the server works on.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __INPUT_FORMAT_H__
+#define __INPUT_FORMAT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* In order of preference when negotiating with the camera */
+enum input_format
+{
+    INPUT_YUYV,         /* packed 4:2:2, what the server works on */
+    INPUT_UYVY,         /* packed 4:2:2, chroma first */
+    INPUT_NV12,         /* Y plane, then interleaved U/V at half resolution */
+    INPUT_YU12,         /* Y plane, then U and V planes at half resolution */
+    INPUT_GREY,         /* Y plane only */
+    INPUT_BAYER_BGGR,   /* 8-bit raw sensor data, named by the top left 2x2 block */
+    INPUT_BAYER_GBRG,
+    INPUT_BAYER_GRBG,
+    INPUT_BAYER_RGGB,
+    INPUT_FORMAT_COUNT
+};
+
+/* A frame as the driver lays it out */
+struct input_layout
+{
+    enum input_format format;
+    unsigned int width, height;
+    size_t stride;      /* bytes per row of the first plane, padding included */
+};
+
+int input_format_from_fourcc(uint32_t fourcc);
+uint32_t input_format_fourcc(enum input_format format);
+const char *input_format_name(enum input_format format);
+size_t input_format_size(const struct input_layout *l);
+void input_to_yuyv(const struct input_layout *l, const unsigned char *src, unsigned char *dst);
+
+#endif /* __INPUT_FORMAT_H__ */
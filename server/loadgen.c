@@ -0,0 +1,446 @@
+/**
+ * @file loadgen.c
+ * @brief Loopback load generator for server_sock.
+ *
+ * Usage: loadgen [-d seconds] [-r fps] [-s server] [-f min_fraction] pattern=count[:arg] ...
+ *
+ * Starts server_sock with its synthetic camera and runs simulated clients
+ * against it on loopback, one thread each. Patterns:
+ *
+ *   fast=N          read every frame as fast as possible
+ *   slow=N:bytes    read at most this many bytes per second
+ *   stall=N:secs    read for a second, then stop reading for secs, repeatedly
+ *   churn=N:frames  read this many frames, disconnect and reconnect
+ *   garbage=N       send a malformed command, expect to be dropped, reconnect
+ *
+ * At the end it prints per-client frame rates and latency percentiles (from
+ * the capture timestamp in the frame header to the last payload byte), the
+ * aggregate throughput and the CPU time the server used. It exits non-zero
+ * if the server died, did not shut down cleanly, or a fast client received
+ * fewer than min_fraction of the frames produced.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "../common/frame_protocol.h"
+#include "../common/clock_utils.h"
+
+#define MAX_SIM_CLIENTS 64
+#define DEFAULT_SECONDS 10
+#define DEFAULT_FPS 30
+#define DEFAULT_MIN_FRACTION 0.9
+#define RECV_TIMEOUT_MS 200
+#define CHUNK 65536
+
+enum pattern
+{
+    PATTERN_FAST,
+    PATTERN_SLOW,
+    PATTERN_STALL,
+    PATTERN_CHURN,
+    PATTERN_GARBAGE,
+};
+
+static const char *const pattern_names[] = { "fast", "slow", "stall", "churn", "garbage" };
+
+struct sim_client
+{
+    pthread_t thread;
+    int id;
+    enum pattern pattern;
+    double arg;
+
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t connects;
+    uint64_t rejected;          /* connections closed before any frame */
+    uint64_t *latency_us;
+    size_t latency_count, latency_cap;
+};
+
+static struct sim_client clients[MAX_SIM_CLIENTS];
+static int client_count;
+static atomic_int stopping;
+
+static int connect_server(void)
+{
+    struct sockaddr_in addr;
+    struct timeval tv = { 0, RECV_TIMEOUT_MS * 1000 };
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(FRAME_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || -1 == connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    /* Lets blocked receives notice the end of the run */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+/*
+ * Receives exactly len bytes, or up to len if buf is NULL and the data is
+ * to be thrown away. Returns 0, or -1 on error, end of stream or stop.
+ * A positive rate paces the reads to that many bytes per second.
+ */
+static int receive(struct sim_client *c, int fd, unsigned char *buf, size_t len, double rate)
+{
+    static _Thread_local unsigned char sink[CHUNK];
+    size_t done = 0;
+
+    while (done < len)
+    {
+        size_t want = len - done;
+        ssize_t n;
+
+        if (!buf && want > CHUNK)
+            want = CHUNK;
+        if (rate > 0 && want > CHUNK / 4)
+            want = CHUNK / 4;
+        if (atomic_load(&stopping))
+            return -1;
+        n = recv(fd, buf ? buf + done : sink, want, 0);
+        if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno))
+            continue;
+        if (n <= 0)
+            return -1;
+        done += (size_t)n;
+        c->bytes += (uint64_t)n;
+        if (rate > 0)
+        {
+            struct timespec pause = { 0, (long)((double)n / rate * 1e9) };
+            while (pause.tv_nsec >= 1000000000L)
+            {
+                pause.tv_sec++;
+                pause.tv_nsec -= 1000000000L;
+            }
+            nanosleep(&pause, NULL);
+        }
+    }
+    return 0;
+}
+
+static void record_latency(struct sim_client *c, uint64_t latency)
+{
+    if (c->latency_count == c->latency_cap)
+    {
+        size_t cap = c->latency_cap ? c->latency_cap * 2 : 1024;
+        uint64_t *grown = realloc(c->latency_us, cap * sizeof(*grown));
+        if (!grown)
+            return;
+        c->latency_us = grown;
+        c->latency_cap = cap;
+    }
+    c->latency_us[c->latency_count++] = latency;
+}
+
+/* Receives one whole frame; returns 0, or -1 when the connection is over */
+static int receive_frame(struct sim_client *c, int fd, double rate)
+{
+    unsigned char header_bytes[FRAME_HEADER_SIZE];
+    struct frame_header h;
+
+    if (-1 == receive(c, fd, header_bytes, sizeof(header_bytes), rate) ||
+        -1 == frame_header_unpack(header_bytes, &h) ||
+        -1 == receive(c, fd, NULL, h.payload_size, rate))
+        return -1;
+    c->frames++;
+    if (!(h.flags & (FRAME_FLAG_HISTORY | FRAME_FLAG_HISTORY_END)))
+        record_latency(c, monotonic_us() - h.timestamp_us);
+    return 0;
+}
+
+static void *client_thread(void *arg)
+{
+    struct sim_client *c = arg;
+
+    while (!atomic_load(&stopping))
+    {
+        uint64_t frames_before = c->frames;
+        int fd = connect_server();
+
+        if (fd < 0)
+        {
+            usleep(100000);
+            continue;
+        }
+        c->connects++;
+
+        switch (c->pattern)
+        {
+        case PATTERN_FAST:
+            while (0 == receive_frame(c, fd, 0))
+                ;
+            break;
+        case PATTERN_SLOW:
+            while (0 == receive_frame(c, fd, c->arg))
+                ;
+            break;
+        case PATTERN_STALL:
+            for (;;)
+            {
+                uint64_t until = monotonic_us() + 1000000;
+                int failed = 0;
+                while (!failed && monotonic_us() < until)
+                    failed = receive_frame(c, fd, 0);
+                if (failed)
+                    break;
+                for (uint64_t end = monotonic_us() + (uint64_t)(c->arg * 1e6);
+                     monotonic_us() < end && !atomic_load(&stopping);)
+                    usleep(10000);
+            }
+            break;
+        case PATTERN_CHURN:
+            for (int i = 0; i < (int)c->arg && 0 == receive_frame(c, fd, 0); i++)
+                ;
+            break;
+        case PATTERN_GARBAGE:
+        {
+            unsigned char junk[COMMAND_SIZE];
+            memset(junk, 0x5a, sizeof(junk));
+            if (sizeof(junk) == send(fd, junk, sizeof(junk), MSG_NOSIGNAL))
+                while (0 == receive_frame(c, fd, 0))
+                    ;
+            usleep(100000);
+            break;
+        }
+        }
+        if (c->frames == frames_before && !atomic_load(&stopping))
+            c->rejected++;
+        close(fd);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Percentile of a sorted array, in milliseconds */
+static double percentile_ms(const uint64_t *sorted, size_t n, double p)
+{
+    if (!n)
+        return 0;
+    return (double)sorted[(size_t)(p * (double)(n - 1))] / 1000.0;
+}
+
+static int add_clients(const char *spec)
+{
+    char name[16];
+    int count = 0;
+    double arg = 0;
+    int p;
+
+    if (sscanf(spec, "%15[a-z]=%d:%lf", name, &count, &arg) < 2 || count < 1)
+        return -1;
+    for (p = 0; p < (int)(sizeof(pattern_names) / sizeof(pattern_names[0])); p++)
+        if (0 == strcmp(name, pattern_names[p]))
+            break;
+    if (p == (int)(sizeof(pattern_names) / sizeof(pattern_names[0])))
+        return -1;
+    if (0 == arg)
+        arg = PATTERN_SLOW == p ? 2e6 : PATTERN_STALL == p ? 2 : PATTERN_CHURN == p ? 10 : 0;
+
+    for (int i = 0; i < count && client_count < MAX_SIM_CLIENTS; i++)
+    {
+        clients[client_count].id = client_count;
+        clients[client_count].pattern = (enum pattern)p;
+        clients[client_count].arg = arg;
+        client_count++;
+    }
+    return 0;
+}
+
+/* utime + stime of a process, in clock ticks */
+static unsigned long long process_ticks(pid_t pid)
+{
+    char path[64], buf[1024];
+    unsigned long long utime = 0, stime = 0;
+    char *p;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    if (!fgets(buf, sizeof(buf), f))
+        buf[0] = '\0';
+    fclose(f);
+    /* Fields after the command name, which may contain spaces */
+    p = strrchr(buf, ')');
+    if (p)
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime);
+    return utime + stime;
+}
+
+static pid_t start_server(const char *path, int fps)
+{
+    char fps_arg[16];
+    pid_t pid;
+
+    snprintf(fps_arg, sizeof(fps_arg), "%d", fps);
+    pid = fork();
+    if (0 == pid)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execl(path, path, "-T", fps_arg, "-m", "0", (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d seconds] [-r fps] [-s server] [-f min_fraction] pattern=count[:arg] ...\n"
+                    "  patterns: fast=N slow=N:bytes_per_s stall=N:seconds churn=N:frames garbage=N\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *server = "./server_sock";
+    int seconds = DEFAULT_SECONDS, fps = DEFAULT_FPS;
+    double min_fraction = DEFAULT_MIN_FRACTION;
+    unsigned long long ticks_start, ticks_end;
+    uint64_t start_us, elapsed_us, total_bytes = 0, total_frames = 0;
+    int status, failed = 0, opt, probe = -1;
+    pid_t pid;
+
+    while (-1 != (opt = getopt(argc, argv, "d:r:s:f:")))
+    {
+        switch (opt)
+        {
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'r':
+            fps = atoi(optarg);
+            break;
+        case 's':
+            server = optarg;
+            break;
+        case 'f':
+            min_fraction = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = optind; i < argc; i++)
+    {
+        if (-1 == add_clients(argv[i]))
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!client_count)
+        add_clients("fast=4");
+    if (seconds < 1 || fps < 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    pid = start_server(server, fps);
+    if (pid < 0)
+        return EXIT_FAILURE;
+    for (int i = 0; i < 50 && probe < 0; i++)
+    {
+        usleep(100000);
+        probe = connect_server();
+    }
+    if (probe < 0)
+    {
+        fprintf(stderr, "%s did not start listening\n", server);
+        kill(pid, SIGKILL);
+        return EXIT_FAILURE;
+    }
+    close(probe);
+    usleep(200000);
+
+    printf("%d clients for %d s against %s at %d fps\n", client_count, seconds, server, fps);
+    ticks_start = process_ticks(pid);
+    start_us = monotonic_us();
+    for (int i = 0; i < client_count; i++)
+        pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+    sleep((unsigned int)seconds);
+    atomic_store(&stopping, 1);
+    for (int i = 0; i < client_count; i++)
+        pthread_join(clients[i].thread, NULL);
+    elapsed_us = monotonic_us() - start_us;
+    ticks_end = process_ticks(pid);
+
+    if (0 != waitpid(pid, &status, WNOHANG))
+    {
+        printf("FAIL: server exited during the run\n");
+        failed = 1;
+    }
+    else
+    {
+        kill(pid, SIGINT);
+        if (-1 == waitpid(pid, &status, 0) || !WIFEXITED(status) || 0 != WEXITSTATUS(status))
+        {
+            printf("FAIL: server did not shut down cleanly\n");
+            failed = 1;
+        }
+    }
+
+    printf("\n%-3s %-8s %8s %9s %8s %8s %8s %8s %8s %8s\n", "id", "pattern", "fps", "MB/s", "p50 ms",
+           "p90 ms", "p99 ms", "max ms", "connects", "refused");
+    for (int i = 0; i < client_count; i++)
+    {
+        struct sim_client *c = &clients[i];
+        double client_fps = (double)c->frames * 1e6 / (double)elapsed_us;
+
+        qsort(c->latency_us, c->latency_count, sizeof(uint64_t), compare_u64);
+        printf("%-3d %-8s %8.1f %9.2f %8.1f %8.1f %8.1f %8.1f %8llu %8llu\n", c->id, pattern_names[c->pattern],
+               client_fps, (double)c->bytes / (double)elapsed_us,
+               percentile_ms(c->latency_us, c->latency_count, 0.50),
+               percentile_ms(c->latency_us, c->latency_count, 0.90),
+               percentile_ms(c->latency_us, c->latency_count, 0.99),
+               percentile_ms(c->latency_us, c->latency_count, 1.0),
+               (unsigned long long)c->connects, (unsigned long long)c->rejected);
+        total_bytes += c->bytes;
+        total_frames += c->frames;
+        if (PATTERN_FAST == c->pattern && client_fps < min_fraction * fps)
+        {
+            printf("FAIL: fast client %d got %.1f fps, below %.0f%% of %d\n", c->id, client_fps,
+                   min_fraction * 100, fps);
+            failed = 1;
+        }
+        free(c->latency_us);
+    }
+    printf("\naggregate %.2f MB/s, %.1f frames/s; server CPU %.1f%%\n",
+           (double)total_bytes / (double)elapsed_us, (double)total_frames * 1e6 / (double)elapsed_us,
+           100.0 * (double)(ticks_end - ticks_start) / (double)sysconf(_SC_CLK_TCK) / ((double)elapsed_us / 1e6));
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,494 @@
+/**
+ * @file metrics.c
+ * @brief Lock-free pipeline counters exported in Prometheus text format.
+ *
+ * Every thread that records a metric gets its own block of counters and
+ * histogram buckets on first use. Only the owning thread ever writes to a
+ * block, so recording is a relaxed load and store with no locked
+ * instruction and no shared cache line. A small HTTP server thread bound to
+ * the loopback interface walks the list of blocks and sums them whenever it
+ * is scraped. Blocks are never freed; the server only has a handful of long
+ * lived threads.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+#include "client_session.h"
+
+#define HIST_BUCKETS 12
+
+struct metrics_block
+{
+    _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+    _Atomic uint64_t buckets[METRIC_HISTOGRAM_COUNT][HIST_BUCKETS];
+    _Atomic uint64_t sum_us[METRIC_HISTOGRAM_COUNT];
+    _Atomic uint64_t hw_events[METRIC_STAGE_COUNT][PERF_EVENT_COUNT];
+    _Atomic uint64_t hw_frames[METRIC_STAGE_COUNT];
+    struct metrics_block *next;
+};
+
+struct metrics_client
+{
+    _Atomic int active;
+    char name[48];
+    _Atomic uint64_t queue_bytes;
+    _Atomic unsigned int level;
+};
+
+struct text_buffer
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/* Upper bounds of the histogram buckets, the last bucket is +Inf */
+static const uint64_t bucket_bounds_us[HIST_BUCKETS - 1] =
+{
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000
+};
+
+static const struct
+{
+    const char *name;
+    const char *help;
+} counter_info[METRIC_COUNTER_COUNT] =
+{
+    [METRIC_FRAMES_CAPTURED]  = { "camera_frames_captured_total", "Frames dequeued from the capture device." },
+    [METRIC_FRAMES_SENT]      = { "camera_frames_sent_total", "Frames fully handed to client sockets." },
+    [METRIC_FRAMES_DROPPED]   = { "camera_frames_dropped_total", "Frames not sent because the previous one was still in flight." },
+    [METRIC_FRAMES_SKIPPED]   = { "camera_frames_skipped_total", "Frames skipped by the frame rate step of the quality ladder." },
+    [METRIC_BYTES_SENT]       = { "camera_bytes_sent_total", "Bytes handed to client sockets." },
+    [METRIC_V4L2_ERRORS]      = { "camera_v4l2_errors_total", "Recoverable V4L2 capture errors." },
+    [METRIC_CLIENTS_ACCEPTED] = { "camera_clients_accepted_total", "Client connections accepted." },
+    [METRIC_CLIENTS_REJECTED] = { "camera_clients_rejected_total", "Client connections rejected because the server was full." },
+    [METRIC_RECORD_FRAMES]    = { "camera_record_frames_total", "Frames written to the recording." },
+    [METRIC_RECORD_BYTES]     = { "camera_record_bytes_total", "Bytes written to the recording." },
+    [METRIC_RECORD_DROPPED]   = { "camera_record_dropped_total", "Frames not recorded because the disk could not keep up." },
+    [METRIC_PIPELINE_OVERRUNS] = { "camera_pipeline_overruns_total", "Frames discarded because a later pipeline stage was behind." },
+    [METRIC_ROI_SHARED]       = { "camera_roi_shared_total", "Regions of interest copied from another client's conversion of the same frame." },
+    [METRIC_KEYFRAMES]        = { "camera_keyframes_total", "Whole images sent to clients that receive delta frames." },
+    [METRIC_DELTA_FRAMES]     = { "camera_delta_frames_total", "Images sent as only the tiles that changed." },
+    [METRIC_DELTA_BYTES_SAVED] = { "camera_delta_bytes_saved_total", "Payload bytes left out of images by sending only changed tiles." },
+    [METRIC_MOTION_EVENTS]    = { "camera_motion_events_total", "Times motion opened the gate after a still period." },
+    [METRIC_FRAMES_STILL]     = { "camera_frames_still_total", "Frames neither sent nor recorded because nothing moved." },
+    [METRIC_BAND_SPILLS]      = { "camera_band_spills_total", "Frames streamed in bands that were finished in a whole frame buffer because the client's socket filled up." },
+    [METRIC_IO_SYSCALLS]      = { "camera_io_syscalls_total", "System calls the send loop made to wait for, send to and read from clients: poll, send, recv, ioctl and io_uring_enter." },
+};
+
+static const struct
+{
+    const char *name;
+    const char *help;
+} histogram_info[METRIC_HISTOGRAM_COUNT] =
+{
+    [METRIC_CONVERT_US] = { "camera_convert_seconds", "Time to convert one captured frame." },
+    [METRIC_SEND_US]    = { "camera_send_seconds", "Time spent in send() per socket flush." },
+    [METRIC_DISK_WRITE_US] = { "camera_disk_write_seconds", "Time to write one recording buffer." },
+    [METRIC_CAPTURE_WAKEUP_US] = { "camera_capture_wakeup_seconds", "Delay from the driver's capture timestamp to the dequeue." },
+    [METRIC_FRAME_JITTER_US] = { "camera_frame_jitter_seconds", "Deviation of each frame interval from the average interval." },
+    [METRIC_MOTION_US] = { "camera_motion_seconds", "Time to look for motion in one captured frame." },
+    [METRIC_CRC_US]    = { "camera_crc_seconds", "Time to checksum one image sent to a client." },
+    [METRIC_FIRST_BYTE_US] = { "camera_first_byte_seconds", "Delay from a frame's capture to its first byte reaching a client socket." },
+};
+
+static const char *const stage_names[METRIC_STAGE_COUNT] = { "convert", "send" };
+static const char *const hw_event_names[PERF_EVENT_COUNT] = {
+    [PERF_CYCLES] = "cycles",
+    [PERF_INSTRUCTIONS] = "instructions",
+    [PERF_CACHE_MISSES] = "cache_misses",
+    [PERF_BRANCH_MISSES] = "branch_misses",
+};
+
+static _Atomic(struct metrics_block *) blocks;
+static _Thread_local struct metrics_block *local_block;
+static struct metrics_client clients[MAX_CLIENTS];
+static _Atomic uint64_t fps_milli;
+static _Atomic uint64_t hw_last[METRIC_STAGE_COUNT][PERF_EVENT_COUNT];
+static int metrics_fd = -1;
+
+/**
+ * @brief   Returns the calling thread's counter block, creating it on first use.
+ */
+static struct metrics_block *thread_block(void)
+{
+    struct metrics_block *b = local_block;
+
+    if (b)
+        return b;
+
+    b = calloc(1, sizeof(*b));
+    if (!b)
+        return NULL;
+
+    b->next = atomic_load_explicit(&blocks, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&blocks, &b->next, b,
+                                                  memory_order_release, memory_order_relaxed))
+    {
+    }
+    local_block = b;
+    return b;
+}
+
+/**
+ * @brief   Adds to a counter owned by the calling thread.
+ *
+ * Single writer, so a plain relaxed read-modify-write is enough; readers
+ * only ever see whole values.
+ */
+static inline void bump(_Atomic uint64_t *c, uint64_t value)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+/**
+ * @brief   Increase a counter by the given amount.
+ *
+ * @param   counter Counter to increase.
+ * @param   value   Amount to add.
+ *
+ * @return  This function does not return a value.
+ */
+void metrics_add(enum metric_counter counter, uint64_t value)
+{
+    struct metrics_block *b = thread_block();
+    if (b)
+        bump(&b->counters[counter], value);
+}
+
+/**
+ * @brief   Record one sample in a latency histogram.
+ *
+ * @param   histogram   Histogram to record into.
+ * @param   value_us    Sample in microseconds.
+ *
+ * @return  This function does not return a value.
+ */
+void metrics_observe(enum metric_histogram histogram, uint64_t value_us)
+{
+    struct metrics_block *b = thread_block();
+    unsigned int i = 0;
+
+    if (!b)
+        return;
+    while (i < HIST_BUCKETS - 1 && value_us > bucket_bounds_us[i])
+        i++;
+    bump(&b->buckets[histogram][i], 1);
+    bump(&b->sum_us[histogram], value_us);
+}
+
+/**
+ * @brief   Publish the current capture rate.
+ *
+ * @param   fps Frames per second.
+ *
+ * @return  This function does not return a value.
+ */
+void metrics_set_fps(double fps)
+{
+    atomic_store_explicit(&fps_milli, (uint64_t)(fps * 1000.0), memory_order_relaxed);
+}
+
+/**
+ * @brief   Record the hardware counters of one frame's pass through a stage.
+ *
+ * Adds to the stage's totals and replaces its last-frame values. Events
+ * that were not counted are left alone, so a stage without counters only
+ * ever exports zeros.
+ *
+ * @param   stage   Stage that was measured.
+ * @param   delta   Events counted while the stage ran.
+ *
+ * @return  This function does not return a value.
+ */
+void metrics_stage_counters(enum metric_stage stage, const struct perf_sample *delta)
+{
+    struct metrics_block *b;
+
+    if (!delta->valid || !(b = thread_block()))
+        return;
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
+    {
+        if (!(delta->valid & (1u << e)))
+            continue;
+        bump(&b->hw_events[stage][e], delta->value[e]);
+        atomic_store_explicit(&hw_last[stage][e], delta->value[e], memory_order_relaxed);
+    }
+    bump(&b->hw_frames[stage], 1);
+}
+
+/**
+ * @brief   Start exporting gauges for a client slot.
+ *
+ * @param   slot    Session slot of the client.
+ * @param   name    Label identifying the client, e.g. "10.0.0.2:51234".
+ *
+ * @return  This function does not return a value.
+ */
+void metrics_client_open(int slot, const char *name)
+{
+    atomic_store_explicit(&clients[slot].active, 0, memory_order_relaxed);
+    snprintf(clients[slot].name, sizeof(clients[slot].name), "%s", name);
+    atomic_store_explicit(&clients[slot].queue_bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&clients[slot].level, 0, memory_order_relaxed);
+    atomic_store_explicit(&clients[slot].active, 1, memory_order_release);
+}
+
+/**
+ * @brief   Update the gauges of a client slot.
+ *
+ * @param   slot        Session slot of the client.
+ * @param   queue_bytes Bytes queued in the socket and not yet sent.
+ * @param   level       Current quality ladder step.
+ *
+ * @return  This function does not return a value.
+ */
+void metrics_client_update(int slot, uint64_t queue_bytes, unsigned int level)
+{
+    atomic_store_explicit(&clients[slot].queue_bytes, queue_bytes, memory_order_relaxed);
+    atomic_store_explicit(&clients[slot].level, level, memory_order_relaxed);
+}
+
+/**
+ * @brief   Stop exporting gauges for a client slot.
+ *
+ * @param   slot    Session slot of the client.
+ *
+ * @return  This function does not return a value.
+ */
+void metrics_client_close(int slot)
+{
+    atomic_store_explicit(&clients[slot].active, 0, memory_order_release);
+}
+
+/**
+ * @brief   printf-style append to a growable text buffer.
+ */
+static void text_append(struct text_buffer *t, const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;)
+    {
+        va_start(ap, format);
+        n = vsnprintf(t->data + t->len, t->cap - t->len, format, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t)n < t->cap - t->len)
+            break;
+
+        size_t cap = (t->cap + (size_t)n + 1) * 2;
+        char *data = realloc(t->data, cap);
+        if (!data)
+            return;
+        t->data = data;
+        t->cap = cap;
+    }
+    t->len += (size_t)n;
+}
+
+/**
+ * @brief   Sum all thread blocks and render them in Prometheus text format.
+ */
+static void render_metrics(struct text_buffer *t)
+{
+    uint64_t counters[METRIC_COUNTER_COUNT] = { 0 };
+    uint64_t buckets[METRIC_HISTOGRAM_COUNT][HIST_BUCKETS] = { { 0 } };
+    uint64_t sum_us[METRIC_HISTOGRAM_COUNT] = { 0 };
+    uint64_t hw_events[METRIC_STAGE_COUNT][PERF_EVENT_COUNT] = { { 0 } };
+    uint64_t hw_frames[METRIC_STAGE_COUNT] = { 0 };
+
+    for (struct metrics_block *b = atomic_load_explicit(&blocks, memory_order_acquire); b; b = b->next)
+    {
+        for (int c = 0; c < METRIC_COUNTER_COUNT; c++)
+            counters[c] += atomic_load_explicit(&b->counters[c], memory_order_relaxed);
+        for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++)
+        {
+            for (int i = 0; i < HIST_BUCKETS; i++)
+                buckets[h][i] += atomic_load_explicit(&b->buckets[h][i], memory_order_relaxed);
+            sum_us[h] += atomic_load_explicit(&b->sum_us[h], memory_order_relaxed);
+        }
+        for (int s = 0; s < METRIC_STAGE_COUNT; s++)
+        {
+            for (int e = 0; e < PERF_EVENT_COUNT; e++)
+                hw_events[s][e] += atomic_load_explicit(&b->hw_events[s][e], memory_order_relaxed);
+            hw_frames[s] += atomic_load_explicit(&b->hw_frames[s], memory_order_relaxed);
+        }
+    }
+
+    for (int c = 0; c < METRIC_COUNTER_COUNT; c++)
+    {
+        text_append(t, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                    counter_info[c].name, counter_info[c].help, counter_info[c].name,
+                    counter_info[c].name, (unsigned long long)counters[c]);
+    }
+
+    text_append(t, "# HELP camera_capture_fps Smoothed capture rate.\n"
+                   "# TYPE camera_capture_fps gauge\ncamera_capture_fps %.3f\n",
+                atomic_load_explicit(&fps_milli, memory_order_relaxed) / 1000.0);
+
+    for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++)
+    {
+        const char *name = histogram_info[h].name;
+        uint64_t cumulative = 0;
+
+        text_append(t, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[h].help, name);
+        for (int i = 0; i < HIST_BUCKETS; i++)
+        {
+            cumulative += buckets[h][i];
+            if (i < HIST_BUCKETS - 1)
+                text_append(t, "%s_bucket{le=\"%g\"} %llu\n", name,
+                            bucket_bounds_us[i] / 1e6, (unsigned long long)cumulative);
+            else
+                text_append(t, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+        }
+        text_append(t, "%s_sum %.6f\n%s_count %llu\n", name, sum_us[h] / 1e6,
+                    name, (unsigned long long)cumulative);
+    }
+
+    text_append(t, "# HELP camera_stage_hw_frames_total Frames measured with hardware counters.\n"
+                   "# TYPE camera_stage_hw_frames_total counter\n");
+    for (int s = 0; s < METRIC_STAGE_COUNT; s++)
+        text_append(t, "camera_stage_hw_frames_total{stage=\"%s\"} %llu\n", stage_names[s],
+                    (unsigned long long)hw_frames[s]);
+    text_append(t, "# HELP camera_stage_hw_events_total Hardware events counted while a stage ran.\n"
+                   "# TYPE camera_stage_hw_events_total counter\n");
+    for (int s = 0; s < METRIC_STAGE_COUNT; s++)
+        for (int e = 0; e < PERF_EVENT_COUNT; e++)
+            text_append(t, "camera_stage_hw_events_total{stage=\"%s\",event=\"%s\"} %llu\n", stage_names[s],
+                        hw_event_names[e], (unsigned long long)hw_events[s][e]);
+    text_append(t, "# HELP camera_stage_hw_frame_events Hardware events of the most recent frame.\n"
+                   "# TYPE camera_stage_hw_frame_events gauge\n");
+    for (int s = 0; s < METRIC_STAGE_COUNT; s++)
+        for (int e = 0; e < PERF_EVENT_COUNT; e++)
+            text_append(t, "camera_stage_hw_frame_events{stage=\"%s\",event=\"%s\"} %llu\n", stage_names[s],
+                        hw_event_names[e],
+                        (unsigned long long)atomic_load_explicit(&hw_last[s][e], memory_order_relaxed));
+
+    text_append(t, "# HELP camera_client_queue_bytes Bytes queued in the client socket.\n"
+                   "# TYPE camera_client_queue_bytes gauge\n");
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (atomic_load_explicit(&clients[i].active, memory_order_acquire))
+            text_append(t, "camera_client_queue_bytes{client=\"%s\"} %llu\n", clients[i].name,
+                        (unsigned long long)atomic_load_explicit(&clients[i].queue_bytes, memory_order_relaxed));
+    }
+    text_append(t, "# HELP camera_client_quality_level Quality ladder step of the client, 0 is best.\n"
+                   "# TYPE camera_client_quality_level gauge\n");
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (atomic_load_explicit(&clients[i].active, memory_order_acquire))
+            text_append(t, "camera_client_quality_level{client=\"%s\"} %u\n", clients[i].name,
+                        atomic_load_explicit(&clients[i].level, memory_order_relaxed));
+    }
+}
+
+/**
+ * @brief   Serve one scrape request on an accepted connection.
+ */
+static void serve_scrape(int fd)
+{
+    char request[1024];
+    char header[128];
+    struct text_buffer body = { NULL, 0, 0 };
+    struct timeval tv = { 1, 0 };
+    size_t off = 0;
+    int header_len;
+
+    /* The request itself is ignored, every path returns the metrics */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (recv(fd, request, sizeof(request), 0) <= 0)
+        return;
+
+    render_metrics(&body);
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\n\r\n", body.len);
+    send(fd, header, (size_t)header_len, MSG_NOSIGNAL);
+    while (off < body.len)
+    {
+        ssize_t n = send(fd, body.data + off, body.len - off, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        off += (size_t)n;
+    }
+    free(body.data);
+}
+
+/**
+ * @brief   Accept loop of the metrics thread.
+ */
+static void *metrics_thread(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        int fd = accept(metrics_fd, NULL, NULL);
+        if (-1 == fd)
+        {
+            if (EINTR == errno || ECONNABORTED == errno)
+                continue;
+            syslog(LOG_ERR, "Metrics accept failed: %s", strerror(errno));
+            return NULL;
+        }
+        serve_scrape(fd);
+        close(fd);
+    }
+}
+
+/**
+ * @brief   Start the metrics endpoint on the loopback interface.
+ *
+ * @param   port    TCP port to listen on.
+ *
+ * @return  0 on success, -1 if the endpoint could not be started. The
+ *          server keeps running without metrics in that case.
+ */
+int metrics_start(int port)
+{
+    struct sockaddr_in addr;
+    pthread_t tid;
+    int num = 1;
+
+    metrics_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (-1 == metrics_fd)
+        return -1;
+
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &num, sizeof(num));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (-1 == bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        -1 == listen(metrics_fd, 4) ||
+        0 != pthread_create(&tid, NULL, metrics_thread, NULL))
+    {
+        syslog(LOG_ERR, "Failed to start metrics endpoint on port %d: %s", port, strerror(errno));
+        close(metrics_fd);
+        metrics_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    syslog(LOG_INFO, "Metrics available on http://127.0.0.1:%d/metrics", port);
+    return 0;
+}
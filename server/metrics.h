@@ -0,0 +1,71 @@
+/**
+ * @file metrics.h
+ * @brief Lock-free pipeline counters exported in Prometheus text format.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include "perf_counters.h"
+
+#define METRICS_DEFAULT_PORT 9100
+
+enum metric_counter
+{
+    METRIC_FRAMES_CAPTURED,
+    METRIC_FRAMES_SENT,
+    METRIC_FRAMES_DROPPED,    /* previous frame still in flight */
+    METRIC_FRAMES_SKIPPED,    /* frame rate step of the quality ladder */
+    METRIC_BYTES_SENT,
+    METRIC_V4L2_ERRORS,
+    METRIC_CLIENTS_ACCEPTED,
+    METRIC_CLIENTS_REJECTED,
+    METRIC_RECORD_FRAMES,
+    METRIC_RECORD_BYTES,
+    METRIC_RECORD_DROPPED,    /* all recording buffers waiting for the disk */
+    METRIC_PIPELINE_OVERRUNS, /* frames discarded because a later stage was behind */
+    METRIC_ROI_SHARED,        /* regions copied from another client's conversion */
+    METRIC_KEYFRAMES,         /* whole images sent to clients that take deltas */
+    METRIC_DELTA_FRAMES,      /* images sent as their changed tiles only */
+    METRIC_DELTA_BYTES_SAVED, /* payload bytes the delta images left out */
+    METRIC_MOTION_EVENTS,     /* times the motion gate opened */
+    METRIC_FRAMES_STILL,      /* frames held back by the closed motion gate */
+    METRIC_BAND_SPILLS,       /* streamed frames finished whole because the socket filled up */
+    METRIC_IO_SYSCALLS,       /* poll, send, recv, ioctl and io_uring_enter calls of the send loop */
+    METRIC_COUNTER_COUNT
+};
+
+enum metric_histogram
+{
+    METRIC_CONVERT_US,        /* YUYV to RGB conversion time per frame */
+    METRIC_SEND_US,           /* time spent in send() per flush */
+    METRIC_DISK_WRITE_US,     /* recording write time per staging buffer */
+    METRIC_CAPTURE_WAKEUP_US, /* driver capture timestamp to dequeue */
+    METRIC_FRAME_JITTER_US,   /* deviation of the frame interval from its average */
+    METRIC_MOTION_US,         /* motion analysis time per frame */
+    METRIC_CRC_US,            /* CRC32C time per image sent */
+    METRIC_FIRST_BYTE_US,     /* capture to the first byte of a live frame handed to a socket */
+    METRIC_HISTOGRAM_COUNT
+};
+
+enum metric_stage
+{
+    METRIC_STAGE_CONVERT,     /* YUYV to RGB conversion of one frame */
+    METRIC_STAGE_SEND,        /* everything sent to clients between two frames */
+    METRIC_STAGE_COUNT
+};
+
+void metrics_add(enum metric_counter counter, uint64_t value);
+void metrics_observe(enum metric_histogram histogram, uint64_t value_us);
+void metrics_set_fps(double fps);
+void metrics_stage_counters(enum metric_stage stage, const struct perf_sample *delta);
+void metrics_client_open(int slot, const char *name);
+void metrics_client_update(int slot, uint64_t queue_bytes, unsigned int level);
+void metrics_client_close(int slot);
+int metrics_start(int port);
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,230 @@
+/**
+ * @file motion.c
+ * @brief Motion detection on downsampled luma, gating what is sent and
+ *        recorded.
+ *
+ * The conversion thread reduces every captured frame to the mean luma of
+ * MOTION_CELL square cells, estimated from every fourth row of the cell,
+ * so only a quarter of the frame is read and the Y samples are summed 16
+ * at a time with SSE2. Each cell is compared with a slowly adapting
+ * background, so lighting drifts and objects that stop moving fade into it
+ * within a second or so. Cells inside a masked zone never count.
+ *
+ * The send loop turns the per-frame result into a gate: it opens on the
+ * first frame with at least min_cells changed cells and closes once
+ * post_frames frames in a row were still. While it is closed frames are
+ * neither sent nor recorded; when it opens the last pre_frames of them are
+ * replayed from the history ring to clients and written out of the
+ * recorder's pre-roll. The shared-memory transport is not gated: local
+ * consumers see every frame and can look at motion themselves.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "motion.h"
+#include "camera_drivers.h"
+#include "metrics.h"
+
+#define GRID_COLS (HRES / MOTION_CELL)
+#define GRID_ROWS (VRES / MOTION_CELL)
+#define ROW_STEP 4                  /* rows of a cell that are sampled */
+#define SAMPLES (MOTION_CELL * MOTION_CELL / ROW_STEP)
+#define BACKGROUND_SHIFT 5          /* the background moves 1/32 of the way per frame */
+
+static struct motion_config cfg;
+static int enabled;
+
+/* Conversion thread state */
+static int32_t background[GRID_ROWS * GRID_COLS];   /* mean luma, 4 fractional bits */
+static unsigned char masked[GRID_ROWS * GRID_COLS];
+static int primed;
+
+/* Send loop state */
+static int open_gate;
+static unsigned int still_run;          /* still frames since the last motion */
+static uint64_t *recent_us;             /* timestamps of the last pre_frames frames */
+static unsigned int recent_next, recent_count;
+
+/**
+ * @brief   Enable motion detection.
+ *
+ * @param   config  Sensitivity, padding and masked zones.
+ *
+ * @return  0 on success, -1 if out of memory.
+ */
+int motion_start(const struct motion_config *config)
+{
+    cfg = *config;
+    if (cfg.pre_frames && !(recent_us = calloc(cfg.pre_frames, sizeof(*recent_us))))
+    {
+        syslog(LOG_ERR, "Out of memory for motion pre-roll");
+        return -1;
+    }
+
+    /* A cell is masked if its centre lies in a zone */
+    for (unsigned int i = 0; i < GRID_ROWS * GRID_COLS; i++)
+    {
+        unsigned int cx = (i % GRID_COLS) * MOTION_CELL + MOTION_CELL / 2;
+        unsigned int cy = (i / GRID_COLS) * MOTION_CELL + MOTION_CELL / 2;
+
+        for (unsigned int z = 0; z < cfg.zones; z++)
+        {
+            const struct motion_zone *zone = &cfg.zone[z];
+            if (cx >= zone->x && cx < zone->x + zone->width && cy >= zone->y && cy < zone->y + zone->height)
+                masked[i] = 1;
+        }
+    }
+    enabled = 1;
+    syslog(LOG_INFO, "Motion gate: threshold %u, %u cells, %u frames before and %u after, %u masked zones",
+           cfg.threshold, cfg.min_cells, cfg.pre_frames, cfg.post_frames, cfg.zones);
+    return 0;
+}
+
+/**
+ * @brief   Tells whether motion detection is on.
+ *
+ * @return  Non-zero if motion_start() succeeded.
+ */
+int motion_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * @brief   Frames kept from before motion starts.
+ *
+ * @return  The configured pre-roll, 0 while motion detection is off.
+ */
+unsigned int motion_pre_frames(void)
+{
+    return enabled ? cfg.pre_frames : 0;
+}
+
+/* Sum of the 16 Y samples of 16 YUYV pixels */
+static unsigned int luma_sum16(const unsigned char *p)
+{
+#ifdef __SSE2__
+    __m128i mask = _mm_set1_epi16(0x00ff);
+    __m128i y = _mm_packus_epi16(_mm_and_si128(_mm_loadu_si128((const __m128i *)p), mask),
+                                 _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 16)), mask));
+    __m128i sum = _mm_sad_epu8(y, _mm_setzero_si128());
+
+    return (unsigned int)_mm_cvtsi128_si32(sum) + (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+#else
+    unsigned int sum = 0;
+
+    for (int i = 0; i < 32; i += 2)
+        sum += p[i];
+    return sum;
+#endif
+}
+
+/**
+ * @brief   Compare a frame with the background and update it.
+ *
+ * Called by the conversion thread only.
+ *
+ * @param   yuyv    A HRES x VRES YUYV frame.
+ *
+ * @return  Number of unmasked cells whose luma moved away from the
+ *          background by more than the threshold.
+ */
+unsigned int motion_analyse(const unsigned char *yuyv)
+{
+    unsigned int changed = 0;
+
+    for (unsigned int cy = 0; cy < GRID_ROWS; cy++)
+    {
+        unsigned int sums[GRID_COLS] = { 0 };
+
+        for (unsigned int r = 0; r < MOTION_CELL; r += ROW_STEP)
+        {
+            const unsigned char *row = yuyv + (size_t)(cy * MOTION_CELL + r) * HRES * 2;
+            for (unsigned int cx = 0; cx < GRID_COLS; cx++)
+                sums[cx] += luma_sum16(row + cx * MOTION_CELL * 2);
+        }
+
+        for (unsigned int cx = 0; cx < GRID_COLS; cx++)
+        {
+            unsigned int i = cy * GRID_COLS + cx;
+            int32_t mean = (int32_t)(sums[cx] * 16 / SAMPLES);
+            int32_t diff = mean - background[i];
+
+            if (!primed)
+            {
+                background[i] = mean;
+                continue;
+            }
+            if (!masked[i] && (uint32_t)abs(diff) > cfg.threshold * 16)
+                changed++;
+            background[i] += diff / (1 << BACKGROUND_SHIFT);
+        }
+    }
+    primed = 1;
+    return changed;
+}
+
+/**
+ * @brief   Decide whether a frame is sent and recorded.
+ *
+ * Called by the send loop once per captured frame, in capture order.
+ *
+ * @param   cells           What motion_analyse() returned for the frame,
+ *                          or MOTION_NOT_ANALYSED.
+ * @param   timestamp_us    Capture time of the frame.
+ * @param   preroll_from_us Set to the capture time of the oldest pre-roll
+ *                          frame when the gate opens with this frame,
+ *                          otherwise to 0.
+ *
+ * @return  1 if the frame goes out, 0 if the gate holds it back. Always 1
+ *          while motion detection is off.
+ */
+int motion_gate(unsigned int cells, uint64_t timestamp_us, uint64_t *preroll_from_us)
+{
+    int moving = cells >= cfg.min_cells;
+
+    *preroll_from_us = 0;
+    if (!enabled)
+        return 1;
+
+    if (moving)
+    {
+        still_run = 0;
+        if (!open_gate)
+        {
+            open_gate = 1;
+            *preroll_from_us = recent_count ? recent_us[(recent_next + cfg.pre_frames - recent_count) % cfg.pre_frames]
+                                            : timestamp_us;
+            recent_count = 0;
+            metrics_add(METRIC_MOTION_EVENTS, 1);
+            syslog(LOG_INFO, "Motion started (%u cells)", cells);
+        }
+    }
+    else if (open_gate && ++still_run > cfg.post_frames)
+    {
+        open_gate = 0;
+        syslog(LOG_INFO, "Motion stopped");
+    }
+
+    if (!open_gate)
+    {
+        if (cfg.pre_frames)
+        {
+            recent_us[recent_next] = timestamp_us;
+            recent_next = (recent_next + 1) % cfg.pre_frames;
+            if (recent_count < cfg.pre_frames)
+                recent_count++;
+        }
+        metrics_add(METRIC_FRAMES_STILL, 1);
+    }
+    return open_gate;
+}
@@ -0,0 +1,46 @@
+/**
+ * @file motion.h
+ * @brief Motion detection on downsampled luma, gating what is sent and
+ *        recorded.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __MOTION_H__
+#define __MOTION_H__
+
+#include <stdint.h>
+#include <limits.h>
+
+#define MOTION_CELL 16              /* cells of this many pixels square are compared */
+#define MOTION_MAX_ZONES 8
+#define MOTION_NOT_ANALYSED UINT_MAX    /* frame counts as moving */
+#define MOTION_DEFAULT_THRESHOLD 12
+#define MOTION_DEFAULT_CELLS 4
+#define MOTION_DEFAULT_PRE_FRAMES 30
+#define MOTION_DEFAULT_POST_FRAMES 90
+
+/* A rectangle of the frame, in pixels, where motion is ignored */
+struct motion_zone
+{
+    unsigned int x, y, width, height;
+};
+
+struct motion_config
+{
+    unsigned int threshold;     /* mean luma change of a cell that counts as motion */
+    unsigned int min_cells;     /* changed cells that make a frame moving */
+    unsigned int pre_frames;    /* frames before motion that are sent and recorded too */
+    unsigned int post_frames;   /* frames after motion stopped that still are */
+    unsigned int zones;
+    struct motion_zone zone[MOTION_MAX_ZONES];
+};
+
+int motion_start(const struct motion_config *config);
+int motion_enabled(void);
+unsigned int motion_analyse(const unsigned char *yuyv);
+int motion_gate(unsigned int cells, uint64_t timestamp_us, uint64_t *preroll_from_us);
+unsigned int motion_pre_frames(void);
+
+#endif /* __MOTION_H__ */
@@ -0,0 +1,176 @@
+/**
+ * @file perf_counters.c
+ * @brief Hardware performance counters around a stage of the calling thread.
+ *
+ * The counters are opened with perf_event_open() as one group on the
+ * calling thread, so a single read() returns all of them with the same
+ * enabled and running times. They count continuously; a stage is measured
+ * by reading the group before and after it. When the PMU multiplexes the
+ * group the deltas are scaled by the share of time it was scheduled.
+ *
+ * Events the CPU does not have are left out of the group. Kernel time is
+ * counted when perf_event_paranoid allows it, which matters for send().
+ * Where no counter can be opened at all (containers, virtual machines
+ * without a virtual PMU) every read reports no valid events and callers
+ * simply record nothing.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perf_counters.h"
+
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} events[PERF_EVENT_COUNT] = {
+    [PERF_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+    [PERF_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+    [PERF_CACHE_MISSES]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses" },
+    [PERF_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses" },
+};
+
+static int open_event(int event, int group_fd, int with_kernel)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[event].type;
+    attr.config = events[event].config;
+    attr.exclude_kernel = with_kernel ? 0 : 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * @brief   Open the counters for the calling thread.
+ *
+ * @param   pc      Counter set to initialise.
+ * @param   stage   Name of the measured stage, for the log.
+ *
+ * @return  Number of events being counted, 0 if none are available.
+ */
+int perf_counters_open(struct perf_counters *pc, const char *stage)
+{
+    int leader = -1;
+    int first_error = 0;
+    char names[64] = "";
+
+    memset(pc, 0, sizeof(*pc));
+    pc->with_kernel = 1;
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
+    {
+        int fd = open_event(e, leader, pc->with_kernel);
+
+        /* perf_event_paranoid >= 2 only allows user space counting */
+        if (fd < 0 && -1 == leader && pc->with_kernel && (EACCES == errno || EPERM == errno))
+        {
+            pc->with_kernel = 0;
+            fd = open_event(e, leader, 0);
+        }
+        pc->fds[e] = fd;
+        if (fd < 0)
+        {
+            if (!first_error)
+                first_error = errno;
+            continue;
+        }
+        if (-1 == leader)
+            leader = fd;
+        pc->order[pc->members++] = e;
+        snprintf(names + strlen(names), sizeof(names) - strlen(names), "%s%s", pc->members > 1 ? " " : "",
+                 events[e].name);
+    }
+
+    if (pc->members)
+        syslog(LOG_INFO, "Counting %s for %s%s", names, stage, pc->with_kernel ? "" : " (user space only)");
+    else
+        syslog(LOG_INFO, "No hardware counters for %s: %s", stage, strerror(first_error));
+    return pc->members;
+}
+
+/**
+ * @brief   Read the current values of every counter in the group.
+ *
+ * @param   pc      Counters opened by the calling thread.
+ * @param   sample  Receives the values; valid is 0 if nothing was read.
+ *
+ * @return  This function does not return a value.
+ */
+void perf_counters_read(const struct perf_counters *pc, struct perf_sample *sample)
+{
+    uint64_t buf[3 + PERF_EVENT_COUNT];
+    ssize_t len;
+
+    sample->valid = 0;
+    if (!pc->members)
+        return;
+    len = read(pc->fds[pc->order[0]], buf, sizeof(buf));
+    if (len < (ssize_t)(3 * sizeof(uint64_t)) || buf[0] != (uint64_t)pc->members)
+        return;
+    sample->time_enabled = buf[1];
+    sample->time_running = buf[2];
+    for (int i = 0; i < pc->members; i++)
+    {
+        sample->value[pc->order[i]] = buf[3 + i];
+        sample->valid |= 1u << pc->order[i];
+    }
+}
+
+/**
+ * @brief   Compute what was counted between two reads.
+ *
+ * @param   before  Read taken before the stage.
+ * @param   after   Read taken after the stage.
+ * @param   delta   Receives the difference, scaled up if the group was
+ *                  only scheduled part of the time.
+ *
+ * @return  This function does not return a value.
+ */
+void perf_counters_delta(const struct perf_sample *before, const struct perf_sample *after,
+                         struct perf_sample *delta)
+{
+    double scale = 1.0;
+
+    delta->valid = before->valid & after->valid;
+    delta->time_enabled = after->time_enabled - before->time_enabled;
+    delta->time_running = after->time_running - before->time_running;
+    if (!delta->time_running)
+        delta->valid = 0;
+    else if (delta->time_running < delta->time_enabled)
+        scale = (double)delta->time_enabled / (double)delta->time_running;
+
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
+    {
+        delta->value[e] = 0;
+        if (delta->valid & (1u << e))
+            delta->value[e] = (uint64_t)((double)(after->value[e] - before->value[e]) * scale);
+    }
+}
+
+/**
+ * @brief   Close the counters.
+ *
+ * @param   pc  Counters to close.
+ *
+ * @return  This function does not return a value.
+ */
+void perf_counters_close(struct perf_counters *pc)
+{
+    for (int i = 0; i < pc->members; i++)
+        close(pc->fds[pc->order[i]]);
+    pc->members = 0;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file perf_counters.h
+ * @brief Hardware performance counters around a stage of the calling thread.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __PERF_COUNTERS_H__
+#define __PERF_COUNTERS_H__
+
+#include <stdint.h>
+
+enum perf_event_index
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,        /* last level cache misses as the PMU defines them */
+    PERF_BRANCH_MISSES,
+    PERF_EVENT_COUNT
+};
+
+struct perf_counters
+{
+    int fds[PERF_EVENT_COUNT];      /* -1 for events the CPU or kernel refused */
+    int order[PERF_EVENT_COUNT];    /* event of each group member, in read order */
+    int members;
+    int with_kernel;                /* kernel time is counted too */
+};
+
+struct perf_sample
+{
+    uint64_t value[PERF_EVENT_COUNT];
+    uint64_t time_enabled;
+    uint64_t time_running;
+    unsigned int valid;             /* bit per event that was counted */
+};
+
+int perf_counters_open(struct perf_counters *pc, const char *stage);
+void perf_counters_read(const struct perf_counters *pc, struct perf_sample *sample);
+void perf_counters_delta(const struct perf_sample *before, const struct perf_sample *after,
+                         struct perf_sample *delta);
+void perf_counters_close(struct perf_counters *pc);
+
+#endif /* __PERF_COUNTERS_H__ */
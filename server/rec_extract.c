@@ -0,0 +1,80 @@
+/**
+ * @file rec_extract.c
+ * @brief Pulls the frame recorded at a given time out of a server recording.
+ *
+ * Usage: rec_extract <recording_dir> <unix_time_seconds> <out.ppm>
+ *
+ * The frame captured at or just before the requested time is located with
+ * recorder_seek() and written out as a PPM image.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "recorder.h"
+#include "../common/frame_protocol.h"
+
+int main(int argc, char *argv[])
+{
+    struct rec_index_entry entry;
+    struct frame_header hdr;
+    unsigned char header_bytes[FRAME_HEADER_SIZE];
+    unsigned char *payload;
+    char path[512];
+    uint64_t timestamp_us;
+    FILE *out;
+    int fd;
+
+    if (argc != 4)
+    {
+        fprintf(stderr, "Usage: %s <recording_dir> <unix_time_seconds> <out.ppm>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    timestamp_us = (uint64_t)(strtod(argv[2], NULL) * 1e6);
+    if (-1 == recorder_seek(argv[1], timestamp_us, path, sizeof(path), &entry))
+    {
+        fprintf(stderr, "No recorded frame found for %s\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 ||
+        FRAME_HEADER_SIZE != pread(fd, header_bytes, FRAME_HEADER_SIZE, (off_t)entry.offset) ||
+        -1 == frame_header_unpack(header_bytes, &hdr) ||
+        hdr.payload_size > FRAME_MAX_PAYLOAD)
+    {
+        fprintf(stderr, "Corrupt frame at %s:%llu\n", path, (unsigned long long)entry.offset);
+        return EXIT_FAILURE;
+    }
+
+    payload = malloc(hdr.payload_size);
+    if (!payload ||
+        (ssize_t)hdr.payload_size != pread(fd, payload, hdr.payload_size,
+                                           (off_t)entry.offset + FRAME_HEADER_SIZE))
+    {
+        fprintf(stderr, "Short frame at %s:%llu\n", path, (unsigned long long)entry.offset);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    out = fopen(argv[3], "wb");
+    if (!out)
+    {
+        perror(argv[3]);
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "P6\n#Frame %u\n%u %u\n255\n", hdr.sequence, hdr.width, hdr.height);
+    fwrite(payload, 1, hdr.payload_size, out);
+    fclose(out);
+
+    printf("Frame %u captured at %.6f from %s\n", entry.sequence, entry.timestamp_us / 1e6, path);
+    free(payload);
+    return EXIT_SUCCESS;
+}
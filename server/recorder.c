@@ -0,0 +1,641 @@
+/**
+ * @file recorder.c
+ * @brief Continuous recording of captured frames to rolling, indexed
+ *        segment files through a dedicated writer thread.
+ *
+ * The capture loop copies each frame (wire header followed by the RGB
+ * payload, exactly as it would be streamed) into one of a small pool of
+ * large page aligned staging buffers and hands full buffers to a writer
+ * thread. The capture side never waits for the disk: when every buffer is
+ * still queued for writing the frame is simply not recorded and counted as
+ * dropped.
+ *
+ * A recording is a directory of segments. Segment "seg-<start>.rec" holds
+ * the frames back to back and "seg-<start>.idx" is an append-only array of
+ * fixed size struct rec_index_entry records, one per frame, where <start>
+ * is the zero padded wall clock time of the first frame in microseconds.
+ * Because segment names sort by time and index records are fixed size and
+ * in capture order, finding the frame for a timestamp is two binary
+ * searches. Once max_segments exist the oldest segment is deleted.
+ *
+ * Frames the motion gate marks still are not recorded. The last
+ * preroll_frames of them are kept in a ring instead and recorded, oldest
+ * first, in front of the first frame with motion; enough extra staging
+ * buffers are allocated to take the whole ring at once.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "recorder.h"
+#include "camera_drivers.h"
+#include "metrics.h"
+#include "../common/frame_protocol.h"
+#include "../common/clock_utils.h"
+
+#define REC_BUFFER_SIZE (4 * 1024 * 1024)
+#define REC_BUFFERS 6
+#define REC_MAX_BUFFERS 32
+#define REC_MAX_ENTRIES 128
+#define REC_ALIGN 4096
+#define REC_FLUSH_AGE_US 500000
+#define SEGMENT_PREFIX "seg-"
+
+struct rec_buffer
+{
+    unsigned char *data;
+    size_t len;
+    uint64_t first_us;            /* monotonic time the first frame was added */
+    uint64_t segment_id;          /* segment the buffer's frames belong to */
+    unsigned int count;
+    struct rec_index_entry entries[REC_MAX_ENTRIES];
+};
+
+struct preroll_frame
+{
+    unsigned char *rgb;
+    uint32_t sequence;
+    uint64_t timestamp_us;
+};
+
+static struct recorder_config cfg;
+static struct rec_buffer buffers[REC_MAX_BUFFERS];
+static struct rec_buffer *free_list[REC_MAX_BUFFERS];
+static struct rec_buffer *write_queue[REC_MAX_BUFFERS];
+static unsigned int nbuffers, nfree, queue_head, queue_count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_tid;
+static int running, stopping;
+
+/* Capture side state, only touched by the thread calling recorder_submit() */
+static struct rec_buffer *current;
+static uint64_t segment_id;
+static int64_t realtime_offset_us;
+static struct preroll_frame *preroll;   /* still frames, oldest at preroll_next once full */
+static unsigned int preroll_next, preroll_count;
+
+/* Writer side state */
+static int rec_fd = -1, idx_fd = -1;
+static uint64_t open_segment;
+static off_t rec_size, idx_size;  /* bytes known to be in the open segment's files */
+static uint64_t *segments;
+static unsigned int nsegments;
+
+/**
+ * @brief   Builds the path of a segment's data or index file.
+ */
+static void segment_path(char *out, size_t len, const char *dir, uint64_t id, const char *ext)
+{
+    snprintf(out, len, "%s/" SEGMENT_PREFIX "%016llu.%s", dir, (unsigned long long)id, ext);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief   Lists the segments present in a recording directory, oldest first.
+ *
+ * @return  Number of segments found, -1 if the directory cannot be read.
+ *          The caller frees *ids.
+ */
+static int list_segments(const char *dir, uint64_t **ids)
+{
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    uint64_t *list = NULL;
+    int n = 0, cap = 0;
+
+    *ids = NULL;
+    if (!d)
+        return -1;
+
+    while ((de = readdir(d)))
+    {
+        unsigned long long id;
+        char ext[8];
+
+        if (2 != sscanf(de->d_name, SEGMENT_PREFIX "%16llu.%7s", &id, ext) || strcmp(ext, "idx"))
+            continue;
+        if (n == cap)
+        {
+            uint64_t *grown = realloc(list, (size_t)(cap ? cap * 2 : 64) * sizeof(*list));
+            if (!grown)
+                break;
+            list = grown;
+            cap = cap ? cap * 2 : 64;
+        }
+        list[n++] = id;
+    }
+    closedir(d);
+
+    qsort(list, (size_t)n, sizeof(*list), compare_u64);
+    *ids = list;
+    return n;
+}
+
+static int pwrite_all(int fd, const void *data, size_t len, off_t offset)
+{
+    const unsigned char *p = data;
+
+    while (len)
+    {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief   Closes the open segment's files, leaving them as they are.
+ */
+static void close_segment_files(void)
+{
+    if (rec_fd >= 0)
+    {
+        posix_fadvise(rec_fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(rec_fd);
+        close(idx_fd);
+        rec_fd = idx_fd = -1;
+    }
+}
+
+/**
+ * @brief   Deletes the oldest segments until there is room for one more.
+ */
+static void enforce_retention(void)
+{
+    char path[512];
+
+    while (cfg.max_segments && nsegments >= cfg.max_segments)
+    {
+        segment_path(path, sizeof(path), cfg.directory, segments[0], "rec");
+        unlink(path);
+        segment_path(path, sizeof(path), cfg.directory, segments[0], "idx");
+        unlink(path);
+        memmove(segments, segments + 1, (nsegments - 1) * sizeof(*segments));
+        nsegments--;
+    }
+}
+
+/**
+ * @brief   Closes the current segment and opens the one with the given id.
+ */
+static void open_segment_files(uint64_t id)
+{
+    char path[512];
+
+    close_segment_files();
+    enforce_retention();
+
+    segment_path(path, sizeof(path), cfg.directory, id, "rec");
+    rec_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    segment_path(path, sizeof(path), cfg.directory, id, "idx");
+    idx_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (rec_fd < 0 || idx_fd < 0)
+    {
+        syslog(LOG_ERR, "Cannot create recording segment %s: %s", path, strerror(errno));
+        if (rec_fd >= 0)
+            close(rec_fd);
+        if (idx_fd >= 0)
+            close(idx_fd);
+        rec_fd = idx_fd = -1;
+    }
+    else
+    {
+        uint64_t *grown = realloc(segments, (nsegments + 1) * sizeof(*segments));
+        if (grown)
+        {
+            segments = grown;
+            segments[nsegments++] = id;
+        }
+    }
+    open_segment = id;
+    rec_size = idx_size = 0;
+}
+
+/**
+ * @brief   Writes one staging buffer and its index records to disk.
+ *
+ * Index offsets are filled in here from what the segment really holds, so
+ * a buffer that was dropped does not shift the frames after it. A write
+ * that fails part way is cut back off both files; if even that fails the
+ * segment is closed and the rest of its frames are dropped, rather than
+ * indexed at offsets that no longer match the data.
+ */
+static void write_buffer(struct rec_buffer *b)
+{
+    uint64_t start = monotonic_us();
+    size_t idx_len = b->count * sizeof(b->entries[0]);
+    off_t data_off;
+
+    if (b->segment_id != open_segment)
+        open_segment_files(b->segment_id);
+    if (rec_fd < 0)
+    {
+        metrics_add(METRIC_RECORD_DROPPED, b->count);
+        return;
+    }
+
+    /* Entries hold offsets within the buffer until the buffer is placed */
+    data_off = rec_size;
+    for (unsigned int i = 0; i < b->count; i++)
+        b->entries[i].offset += (uint64_t)data_off;
+
+    /* Data first, so an index record never points past the end of the file */
+    if (-1 == pwrite_all(rec_fd, b->data, b->len, data_off) ||
+        -1 == pwrite_all(idx_fd, b->entries, idx_len, idx_size))
+    {
+        syslog(LOG_ERR, "Recording write failed: %s", strerror(errno));
+        metrics_add(METRIC_RECORD_DROPPED, b->count);
+        if (-1 == ftruncate(rec_fd, rec_size) || -1 == ftruncate(idx_fd, idx_size))
+        {
+            syslog(LOG_ERR, "Recording segment %016llu ends here: %s",
+                   (unsigned long long)open_segment, strerror(errno));
+            close_segment_files();
+        }
+        return;
+    }
+    rec_size += (off_t)b->len;
+    idx_size += (off_t)idx_len;
+
+    /* Start write-back now and keep recorded data out of the page cache */
+    sync_file_range(rec_fd, data_off, (off_t)b->len, SYNC_FILE_RANGE_WRITE);
+    if (data_off >= REC_BUFFER_SIZE)
+        posix_fadvise(rec_fd, 0, data_off - REC_BUFFER_SIZE, POSIX_FADV_DONTNEED);
+
+    metrics_add(METRIC_RECORD_FRAMES, b->count);
+    metrics_add(METRIC_RECORD_BYTES, b->len);
+    metrics_observe(METRIC_DISK_WRITE_US, monotonic_us() - start);
+}
+
+/**
+ * @brief   Writer thread: drains the queue of full staging buffers.
+ */
+static void *writer_thread(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        struct rec_buffer *b;
+
+        pthread_mutex_lock(&lock);
+        while (!queue_count && !stopping)
+            pthread_cond_wait(&work, &lock);
+        if (!queue_count)
+        {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        b = write_queue[queue_head];
+        queue_head = (queue_head + 1) % nbuffers;
+        queue_count--;
+        pthread_mutex_unlock(&lock);
+
+        write_buffer(b);
+
+        pthread_mutex_lock(&lock);
+        free_list[nfree++] = b;
+        pthread_mutex_unlock(&lock);
+    }
+
+    if (rec_fd >= 0)
+    {
+        fdatasync(rec_fd);
+        fdatasync(idx_fd);
+        close(rec_fd);
+        close(idx_fd);
+        rec_fd = idx_fd = -1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief   Queues the current staging buffer for the writer thread.
+ */
+static void hand_off(void)
+{
+    pthread_mutex_lock(&lock);
+    write_queue[(queue_head + queue_count) % nbuffers] = current;
+    queue_count++;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+    current = NULL;
+}
+
+/**
+ * @brief   Takes a free staging buffer, or NULL if all are waiting for the disk.
+ */
+static struct rec_buffer *take_free(void)
+{
+    struct rec_buffer *b = NULL;
+
+    pthread_mutex_lock(&lock);
+    if (nfree)
+        b = free_list[--nfree];
+    pthread_mutex_unlock(&lock);
+    return b;
+}
+
+/**
+ * @brief   Start recording into a directory.
+ *
+ * Allocates and prefaults the staging buffers and the pre-roll ring and
+ * starts the writer thread. Segments already present in the directory count
+ * towards max_segments.
+ *
+ * @param   config  Recording directory, segment length, retention and
+ *                  motion pre-roll.
+ *
+ * @return  0 on success, -1 if recording could not be started.
+ */
+int recorder_start(const struct recorder_config *config)
+{
+    struct timespec rt;
+    int n;
+
+    cfg = *config;
+    if (!cfg.segment_seconds)
+        cfg.segment_seconds = RECORDER_DEFAULT_SEGMENT_SECONDS;
+
+    if (-1 == mkdir(cfg.directory, 0755) && EEXIST != errno)
+    {
+        syslog(LOG_ERR, "Cannot create recording directory %s: %s", cfg.directory, strerror(errno));
+        return -1;
+    }
+
+    n = list_segments(cfg.directory, &segments);
+    nsegments = (n > 0) ? (unsigned int)n : 0;
+
+    /* The whole pre-roll is recorded in one go when motion starts */
+    nbuffers = REC_BUFFERS + (cfg.preroll_frames * (FRAME_HEADER_SIZE + RGB_FRAME_SIZE) + REC_BUFFER_SIZE - 1) /
+                             REC_BUFFER_SIZE;
+    if (nbuffers > REC_MAX_BUFFERS)
+        nbuffers = REC_MAX_BUFFERS;
+    for (unsigned int i = 0; i < nbuffers; i++)
+    {
+        if (0 != posix_memalign((void **)&buffers[i].data, REC_ALIGN, REC_BUFFER_SIZE))
+        {
+            syslog(LOG_ERR, "Out of memory for recording buffers");
+            return -1;
+        }
+        memset(buffers[i].data, 0, REC_BUFFER_SIZE);
+        free_list[nfree++] = &buffers[i];
+    }
+
+    if (cfg.preroll_frames && !(preroll = calloc(cfg.preroll_frames, sizeof(*preroll))))
+    {
+        syslog(LOG_ERR, "Out of memory for the recording pre-roll");
+        return -1;
+    }
+    for (unsigned int i = 0; i < cfg.preroll_frames; i++)
+    {
+        if (!(preroll[i].rgb = malloc(RGB_FRAME_SIZE)))
+        {
+            syslog(LOG_ERR, "Out of memory for the recording pre-roll");
+            return -1;
+        }
+        memset(preroll[i].rgb, 0, RGB_FRAME_SIZE);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &rt);
+    realtime_offset_us = (int64_t)((uint64_t)rt.tv_sec * 1000000u + (uint64_t)rt.tv_nsec / 1000u) -
+                         (int64_t)monotonic_us();
+
+    if (0 != pthread_create(&writer_tid, NULL, writer_thread, NULL))
+    {
+        syslog(LOG_ERR, "Failed to start the recording thread");
+        return -1;
+    }
+    running = 1;
+    syslog(LOG_INFO, "Recording to %s in %u s segments", cfg.directory, cfg.segment_seconds);
+    return 0;
+}
+
+/**
+ * @brief   Copies one frame into the current staging buffer.
+ */
+static void record_frame(uint32_t sequence, uint64_t timestamp_us, const unsigned char *rgb)
+{
+    struct frame_header hdr;
+    struct rec_index_entry *e;
+    uint64_t wall = (uint64_t)((int64_t)timestamp_us + realtime_offset_us);
+    size_t size = FRAME_HEADER_SIZE + RGB_FRAME_SIZE;
+    uint64_t now = monotonic_us();
+
+    if (!segment_id || wall - segment_id >= (uint64_t)cfg.segment_seconds * 1000000u)
+    {
+        if (current && current->count)
+            hand_off();
+        segment_id = wall;
+    }
+
+    if (current && (current->len + size > REC_BUFFER_SIZE || REC_MAX_ENTRIES == current->count ||
+                    now - current->first_us > REC_FLUSH_AGE_US))
+        hand_off();
+
+    if (!current)
+    {
+        current = take_free();
+        if (!current)
+        {
+            metrics_add(METRIC_RECORD_DROPPED, 1);
+            return;
+        }
+        current->len = 0;
+        current->count = 0;
+        current->first_us = now;
+        current->segment_id = segment_id;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = FRAME_MAGIC;
+    hdr.sequence = sequence;
+    hdr.timestamp_us = timestamp_us;
+    hdr.width = HRES;
+    hdr.height = VRES;
+    hdr.format = FRAME_FMT_RGB24;
+    hdr.payload_size = RGB_FRAME_SIZE;
+    frame_header_pack(&hdr, current->data + current->len);
+    memcpy(current->data + current->len + FRAME_HEADER_SIZE, rgb, RGB_FRAME_SIZE);
+
+    e = &current->entries[current->count++];
+    e->offset = current->len;
+    e->timestamp_us = wall;
+    e->sequence = sequence;
+    e->size = (uint32_t)size;
+    current->len += size;
+
+    /* Start the write as soon as the next frame would not fit anyway */
+    if (current->len + size > REC_BUFFER_SIZE)
+        hand_off();
+}
+
+/**
+ * @brief   Record one frame.
+ *
+ * Copies the frame into the current staging buffer and never blocks on the
+ * disk. A still frame only goes into the pre-roll ring, which is recorded
+ * ahead of the next frame that is not still. Must always be called from the
+ * same thread.
+ *
+ * @param   frame   The frame just captured.
+ *
+ * @return  This function does not return a value.
+ */
+void recorder_submit(const struct frame_info *frame)
+{
+    if (!running)
+        return;
+
+    if (frame->still)
+    {
+        if (cfg.preroll_frames)
+        {
+            struct preroll_frame *p = &preroll[preroll_next];
+
+            memcpy(p->rgb, frame->rgb, RGB_FRAME_SIZE);
+            p->sequence = frame->sequence;
+            p->timestamp_us = frame->timestamp_us;
+            preroll_next = (preroll_next + 1) % cfg.preroll_frames;
+            if (preroll_count < cfg.preroll_frames)
+                preroll_count++;
+        }
+        return;
+    }
+
+    for (; preroll_count; preroll_count--)
+    {
+        const struct preroll_frame *p =
+            &preroll[(preroll_next + cfg.preroll_frames - preroll_count) % cfg.preroll_frames];
+        record_frame(p->sequence, p->timestamp_us, p->rgb);
+    }
+    record_frame(frame->sequence, frame->timestamp_us, frame->rgb);
+}
+
+/**
+ * @brief   Flush everything recorded so far and stop the writer thread.
+ *
+ * @return  This function does not return a value.
+ */
+void recorder_stop(void)
+{
+    if (!running)
+        return;
+    running = 0;
+    if (current && current->count)
+        hand_off();
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer_tid, NULL);
+    syslog(LOG_INFO, "Recording stopped");
+}
+
+/**
+ * @brief   Find the recorded frame captured at or just before a time.
+ *
+ * Binary searches the segment list and then the segment's index, so the
+ * cost is logarithmic in both the number of segments and frames.
+ *
+ * @param   directory       Recording directory.
+ * @param   timestamp_us    Wall clock time in microseconds.
+ * @param   seg_path        Receives the path of the segment's .rec file.
+ * @param   path_len        Size of seg_path.
+ * @param   entry           Receives the index record of the frame.
+ *
+ * @return  0 if a frame was found, -1 otherwise.
+ */
+int recorder_seek(const char *directory, uint64_t timestamp_us,
+                  char *seg_path, size_t path_len, struct rec_index_entry *entry)
+{
+    uint64_t *ids;
+    int n = list_segments(directory, &ids);
+    int lo = 0, hi = n - 1, seg = 0;
+    char path[512];
+    struct stat st;
+    long count, first = 0, last;
+    int fd, found = -1;
+
+    if (n <= 0)
+    {
+        free(ids);
+        return -1;
+    }
+
+    /* Last segment that started at or before the timestamp */
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (ids[mid] <= timestamp_us)
+        {
+            seg = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    segment_path(path, sizeof(path), directory, ids[seg], "idx");
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && 0 == fstat(fd, &st) && (count = st.st_size / (long)sizeof(*entry)) > 0)
+    {
+        /* Last index record at or before the timestamp, else the first */
+        last = count - 1;
+        found = 0;
+        if (-1 == pread(fd, entry, sizeof(*entry), 0))
+            found = -1;
+        while (0 == found && first <= last)
+        {
+            long mid = first + (last - first) / 2;
+            struct rec_index_entry e;
+
+            if ((ssize_t)sizeof(e) != pread(fd, &e, sizeof(e), (off_t)mid * (off_t)sizeof(e)))
+            {
+                found = -1;
+                break;
+            }
+            if (e.timestamp_us <= timestamp_us)
+            {
+                *entry = e;
+                first = mid + 1;
+            }
+            else
+            {
+                last = mid - 1;
+            }
+        }
+        segment_path(seg_path, path_len, directory, ids[seg], "rec");
+    }
+    if (fd >= 0)
+        close(fd);
+    free(ids);
+    return found;
+}
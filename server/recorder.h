@@ -0,0 +1,42 @@
+/**
+ * @file recorder.h
+ * @brief Continuous recording of captured frames to rolling, indexed
+ *        segment files through a dedicated writer thread.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <stdint.h>
+#include "client_session.h"
+
+#define RECORDER_DEFAULT_SEGMENT_SECONDS 60
+#define RECORDER_DEFAULT_MAX_SEGMENTS 60
+
+/* One record of a segment's .idx file */
+struct rec_index_entry
+{
+    uint64_t offset;        /* byte offset of the frame header in the .rec file */
+    uint64_t timestamp_us;  /* wall clock capture time, CLOCK_REALTIME */
+    uint32_t sequence;      /* capture sequence number */
+    uint32_t size;          /* header plus payload bytes */
+};
+
+struct recorder_config
+{
+    const char *directory;
+    unsigned int segment_seconds;
+    unsigned int max_segments;    /* oldest segments are deleted, 0 keeps all */
+    unsigned int preroll_frames;  /* still frames held back to record ahead of motion */
+};
+
+int recorder_start(const struct recorder_config *config);
+void recorder_submit(const struct frame_info *frame);
+void recorder_stop(void);
+int recorder_seek(const char *directory, uint64_t timestamp_us,
+                  char *seg_path, size_t path_len, struct rec_index_entry *entry);
+
+#endif /* __RECORDER_H__ */
@@ -0,0 +1,135 @@
+/**
+ * @file rt_sched.c
+ * @brief Real-time priority, CPU affinity and memory locking helpers.
+ *
+ * Failures are logged and otherwise ignored: without CAP_SYS_NICE or
+ * CAP_IPC_LOCK the server still runs, just without the latency guarantees.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "rt_sched.h"
+
+/**
+ * @brief   Parse "a" or "a,b" into two integers.
+ *
+ * @param   arg     Text to parse.
+ * @param   first   Receives the first value.
+ * @param   second  Receives the second value, left untouched if absent.
+ *
+ * @return  0 on success, -1 if the text is not one or two integers.
+ */
+int rt_parse_pair(const char *arg, int *first, int *second)
+{
+    char *end;
+
+    *first = (int)strtol(arg, &end, 10);
+    if (end == arg)
+        return -1;
+    if (',' == *end)
+    {
+        const char *rest = end + 1;
+        *second = (int)strtol(rest, &end, 10);
+        if (end == rest)
+            return -1;
+    }
+    return ('\0' == *end) ? 0 : -1;
+}
+
+/**
+ * @brief   Apply a scheduling policy and affinity to the calling thread.
+ *
+ * @param   name    Thread name, used for the thread's comm and logging.
+ * @param   config  Priority and CPU to apply.
+ *
+ * @return  0 if everything requested was applied, -1 otherwise.
+ */
+int rt_apply(const char *name, const struct rt_thread_config *config)
+{
+    int status = 0;
+    int err;
+
+    pthread_setname_np(pthread_self(), name);
+
+    if (config->cpu >= 0)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(config->cpu, &set);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err)
+        {
+            syslog(LOG_ERR, "Cannot pin %s to CPU %d: %s", name, config->cpu, strerror(err));
+            status = -1;
+        }
+    }
+
+    if (config->priority > 0)
+    {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config->priority;
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err)
+        {
+            syslog(LOG_ERR, "Cannot give %s SCHED_FIFO priority %d: %s", name, config->priority,
+                   strerror(err));
+            status = -1;
+        }
+    }
+
+    if (0 == status && (config->cpu >= 0 || config->priority > 0))
+        syslog(LOG_INFO, "%s running with priority %d on CPU %d", name, config->priority, config->cpu);
+    return status;
+}
+
+/**
+ * @brief   Lock all current and future memory of the process into RAM.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int rt_lock_memory(void)
+{
+    if (-1 == mlockall(MCL_CURRENT | MCL_FUTURE))
+    {
+        syslog(LOG_ERR, "mlockall failed: %s", strerror(errno));
+        return -1;
+    }
+    syslog(LOG_INFO, "Process memory locked");
+    return 0;
+}
+
+/**
+ * @brief   Touch every page of a buffer so it is backed before first use.
+ *
+ * Writes one byte per page, which is enough to take the page fault now
+ * instead of on the real-time path.
+ *
+ * @param   p       Buffer to prefault.
+ * @param   len     Length of the buffer in bytes.
+ *
+ * @return  This function does not return a value.
+ */
+void rt_prefault(void *p, size_t len)
+{
+    volatile unsigned char *bytes = p;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    for (size_t off = 0; off < len; off += page)
+        bytes[off] = 0;
+    if (len)
+        bytes[len - 1] = 0;
+}
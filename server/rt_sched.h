@@ -0,0 +1,25 @@
+/**
+ * @file rt_sched.h
+ * @brief Real-time priority, CPU affinity and memory locking helpers.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __RT_SCHED_H__
+#define __RT_SCHED_H__
+
+#include <stddef.h>
+
+struct rt_thread_config
+{
+    int priority;   /* SCHED_FIFO priority, 0 keeps the normal scheduler */
+    int cpu;        /* CPU to pin the thread to, -1 leaves it unpinned */
+};
+
+int rt_parse_pair(const char *arg, int *first, int *second);
+int rt_apply(const char *name, const struct rt_thread_config *config);
+int rt_lock_memory(void);
+void rt_prefault(void *p, size_t len);
+
+#endif /* __RT_SCHED_H__ */
@@ -32,7 +32,22 @@
 #include <getopt.h>
 #include <linux/fs.h>
 #include <pthread.h>
+#include <poll.h>
 #include "camera_drivers.h"
+#include "client_session.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "history.h"
+#include "capture_pipeline.h"
+#include "rt_sched.h"
+#include "shm_transport.h"
+#include "synthetic_camera.h"
+#include "perf_counters.h"
+#include "motion.h"
+#include "../common/frame_protocol.h"
+#include "../common/shm_protocol.h"
+#include "../common/clock_utils.h"
+#include "../common/trace.h"
 
 #define SUCCESS_FLAG 0
 #define SIGINT_FAIL 1
@@ -43,13 +58,17 @@
 #define BIND_API_FAIL 6
 #define LISTEN_API_FAIL 7
 #define ACCEPT_API_FAIL 8
-
+#define POLL_API_FAIL 9
+#define USAGE_FAIL 10
+#define PIPELINE_FAIL 11
+#define TRACE_DEFAULT_PATH "/tmp/server_trace.json"
+#define URING_ENTRIES (2 * MAX_CLIENTS)
 
 int server_sock_fd;
-int client_connection_fd;
 struct addrinfo hints;
 struct addrinfo *server_info;
-struct sockaddr_in client_addr;
+struct client_session sessions[MAX_CLIENTS];
+volatile sig_atomic_t exit_requested;
 
 void camera_init()
 {
@@ -62,6 +81,11 @@ void camera_init()
 
 void camera_off()
 {
+        if(synthetic_camera_active())
+        {
+            synthetic_camera_stop();
+            return;
+        }
         printf("Camera switched off\n");
         stop_capturing();
         uninit_device();
@@ -79,26 +103,328 @@ void signal_handler(int sig)
 	{
 		syslog(LOG_INFO,"Caught SIGTERM, leaving");
 	}
-	
-	/* Close socket and client connection */
+
+	/* The main loop notices this once poll() is interrupted and shuts down */
+	exit_requested = 1;
+}
+
+void server_shutdown(void)
+{
+	/* Close socket and client connections */
 	close(server_sock_fd);
-	close(client_connection_fd);
-	syslog(LOG_ERR,"Closed connection with %s",inet_ntoa(client_addr.sin_addr));
-	printf("Closed connection with %s\n",inet_ntoa(client_addr.sin_addr));
+	for(int i = 0; i < MAX_CLIENTS; i++)
+	{
+		if(sessions[i].fd >= 0)
+		{
+			session_close(&sessions[i]);
+		}
+	}
+	/* Flush whatever is still buffered for the recording */
+	recorder_stop();
+	shm_transport_stop();
+	pipeline_stop();
+	camera_off();
 	/* Exit success */
-	exit(SUCCESS_FLAG); 
+	exit(SUCCESS_FLAG);
+}
+
+void accept_client(void)
+{
+    struct sockaddr_in client_addr;
+    socklen_t size = sizeof(client_addr);
+    int fd, slot;
+
+    fd = accept(server_sock_fd,(struct sockaddr *)&client_addr,&size);
+    if(-1 == fd)
+    {
+        if(EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno || ECONNABORTED == errno)
+        {
+            return;
+        }
+        syslog(LOG_ERR, "Failed to accept the connection");
+        exit(ACCEPT_API_FAIL);
+    }
+
+    for(slot = 0; slot < MAX_CLIENTS; slot++)
+    {
+        if(sessions[slot].fd < 0)
+        {
+            break;
+        }
+    }
+    if(MAX_CLIENTS == slot)
+    {
+        syslog(LOG_ERR,"Rejecting %s, already serving %d clients",inet_ntoa(client_addr.sin_addr),MAX_CLIENTS);
+        metrics_add(METRIC_CLIENTS_REJECTED, 1);
+        close(fd);
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if(-1 == session_open(&sessions[slot], slot, fd, &client_addr))
+    {
+        close(fd);
+        return;
+    }
+    metrics_add(METRIC_CLIENTS_ACCEPTED, 1);
+    syslog(LOG_INFO,"Accepts connection from %s",inet_ntoa(client_addr.sin_addr));
+    printf("Accepts connection from %s\n",inet_ntoa(client_addr.sin_addr));
+}
+
+/* Adds what was counted between two reads to a running total */
+static void add_counters(struct perf_sample *total, const struct perf_sample *before, const struct perf_sample *after)
+{
+    struct perf_sample delta;
+
+    perf_counters_delta(before, after, &delta);
+    if(!delta.valid)
+    {
+        return;
+    }
+    for(int e = 0; e < PERF_EVENT_COUNT; e++)
+    {
+        total->value[e] += delta.value[e];
+    }
+    total->valid |= delta.valid;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-m metrics_port] [-r dir [-g seconds] [-k segments]] [-H MiB]\n"
+                    "          [-P capture_prio[,convert_prio]] [-A capture_cpu[,convert_cpu]] [-L] [-S socket] [-T fps]\n"
+                    "          [-t trace.json] [-M threshold[,cells[,pre[,post]]] [-Z WxH+X+Y]...] [-B KiB] [-U]\n"
+                    "  -m port      serve Prometheus metrics on 127.0.0.1:port (default %d, 0 disables)\n"
+                    "  -r dir       record every frame into rolling segments under dir\n"
+                    "  -g seconds   length of a recording segment (default %d)\n"
+                    "  -k segments  number of segments kept, 0 keeps all (default %d)\n"
+                    "  -H MiB       keep this much recent history in memory for replay\n"
+                    "  -P prio      SCHED_FIFO priority of the capture and conversion threads\n"
+                    "  -A cpu       pin the capture and conversion threads to these CPUs\n"
+                    "  -L           lock all memory and prefault frame buffers\n"
+                    "  -S socket    share frames with local consumers through this Unix socket\n"
+                    "               (- for %s)\n"
+                    "  -T fps       serve a synthetic test pattern instead of the camera\n"
+                    "  -t file      trace every stage from the start and write the trace to file\n"
+                    "               (SIGUSR1 toggles tracing, SIGUSR2 dumps it, default file %s)\n"
+                    "  -M ...       only send and record while something moves: mean luma change of a\n"
+                    "               %dx%d cell that counts (default %d), changed cells that make motion\n"
+                    "               (default %d), frames kept before (default %d, replayed from -H\n"
+                    "               history) and after it (default %d)\n"
+                    "  -Z WxH+X+Y   ignore motion in this rectangle, up to %d times\n"
+                    "  -B KiB       convert and send whole RGB24, RGB565 and grey frames in bands of\n"
+                    "               about this size, so sending starts after one band is converted\n"
+                    "  -U           send through io_uring from registered buffers, all clients in one\n"
+                    "               system call; poll() and send() where it is not available, not with -B\n",
+            prog, METRICS_DEFAULT_PORT, RECORDER_DEFAULT_SEGMENT_SECONDS, RECORDER_DEFAULT_MAX_SEGMENTS, SHM_DEFAULT_PATH,
+            TRACE_DEFAULT_PATH, MOTION_CELL, MOTION_CELL, MOTION_DEFAULT_THRESHOLD, MOTION_DEFAULT_CELLS,
+            MOTION_DEFAULT_PRE_FRAMES, MOTION_DEFAULT_POST_FRAMES, MOTION_MAX_ZONES);
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     int num = 1;
+    int opt;
+    int metrics_port = METRICS_DEFAULT_PORT;
+    struct recorder_config recording = { NULL, RECORDER_DEFAULT_SEGMENT_SECONDS, RECORDER_DEFAULT_MAX_SEGMENTS, 0 };
+    struct motion_config motion = { MOTION_DEFAULT_THRESHOLD, MOTION_DEFAULT_CELLS, MOTION_DEFAULT_PRE_FRAMES,
+                                    MOTION_DEFAULT_POST_FRAMES, 0, { { 0, 0, 0, 0 } } };
+    int motion_gating = 0;
+    uint64_t preroll_from_us;
+    size_t history_mib = 0;
+    struct pipeline_config pipeline = { { 0, -1 }, { 0, -1 }, 0 };
+    int band_kib = 0;
+    int use_uring = 0;
+    int lock_memory = 0;
+    const char *shm_path = NULL;
+    int synthetic_fps = 0;
+    const char *trace_path = NULL;
+    struct pipeline_frame *captured;
     int get_addr, sockopt_status, bind_status, listen_status;
-    socklen_t size = sizeof(struct sockaddr);
+    struct pollfd pfds[4 + MAX_CLIENTS];
+    int session_of[4 + MAX_CLIENTS];
+    struct frame_info frame;
+    uint64_t last_frame_us = 0;
+    double frame_interval_us = 0;
+    struct perf_counters send_counters;
+    struct perf_sample send_before, send_after, send_total;
+
+    for(int i = 0; i < MAX_CLIENTS; i++)
+    {
+        sessions[i].fd = -1;
+    }
+
+    while(-1 != (opt = getopt(argc, argv, "m:r:g:k:H:P:A:LS:T:t:M:Z:B:U")))
+    {
+        switch(opt)
+        {
+            case 'm':
+                metrics_port = atoi(optarg);
+                break;
+            case 'r':
+                recording.directory = optarg;
+                break;
+            case 'g':
+                recording.segment_seconds = (unsigned int)atoi(optarg);
+                break;
+            case 'k':
+                recording.max_segments = (unsigned int)atoi(optarg);
+                break;
+            case 'H':
+                history_mib = (size_t)atoi(optarg);
+                break;
+            case 'P':
+                pipeline.convert.priority = -1;
+                if(-1 == rt_parse_pair(optarg, &pipeline.capture.priority, &pipeline.convert.priority))
+                {
+                    usage(argv[0]);
+                    exit(USAGE_FAIL);
+                }
+                /* A single value gives conversion one level less than capture */
+                if(-1 == pipeline.convert.priority)
+                {
+                    pipeline.convert.priority = pipeline.capture.priority > 1 ? pipeline.capture.priority - 1 : pipeline.capture.priority;
+                }
+                break;
+            case 'A':
+                pipeline.convert.cpu = -2;
+                if(-1 == rt_parse_pair(optarg, &pipeline.capture.cpu, &pipeline.convert.cpu))
+                {
+                    usage(argv[0]);
+                    exit(USAGE_FAIL);
+                }
+                if(-2 == pipeline.convert.cpu)
+                {
+                    pipeline.convert.cpu = pipeline.capture.cpu;
+                }
+                break;
+            case 'L':
+                lock_memory = 1;
+                break;
+            case 'S':
+                shm_path = strcmp(optarg, "-") ? optarg : SHM_DEFAULT_PATH;
+                break;
+            case 'T':
+                synthetic_fps = atoi(optarg);
+                if(synthetic_fps <= 0)
+                {
+                    usage(argv[0]);
+                    exit(USAGE_FAIL);
+                }
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'M':
+                motion_gating = 1;
+                if(sscanf(optarg, "%u,%u,%u,%u", &motion.threshold, &motion.min_cells, &motion.pre_frames,
+                          &motion.post_frames) < 1 || !motion.min_cells)
+                {
+                    usage(argv[0]);
+                    exit(USAGE_FAIL);
+                }
+                break;
+            case 'Z':
+            {
+                struct motion_zone *zone = &motion.zone[motion.zones];
+
+                if(MOTION_MAX_ZONES == motion.zones ||
+                   4 != sscanf(optarg, "%ux%u+%u+%u", &zone->width, &zone->height, &zone->x, &zone->y))
+                {
+                    usage(argv[0]);
+                    exit(USAGE_FAIL);
+                }
+                motion.zones++;
+                break;
+            }
+            case 'B':
+                band_kib = atoi(optarg);
+                if(band_kib <= 0)
+                {
+                    usage(argv[0]);
+                    exit(USAGE_FAIL);
+                }
+                break;
+            case 'U':
+                use_uring = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(USAGE_FAIL);
+        }
+    }
 
     /* setup the logging */
     openlog(NULL,LOG_PID, LOG_USER);
-    /* initialise the camera */
-    camera_init();
+    if(-1 == trace_setup(trace_path ? trace_path : TRACE_DEFAULT_PATH, NULL != trace_path))
+    {
+        syslog(LOG_ERR, "Tracing signals could not be installed: %s", strerror(errno));
+    }
+    if(metrics_port > 0)
+    {
+        metrics_start(metrics_port);
+    }
+    /* lock memory before anything large is allocated so it is locked too */
+    if(lock_memory)
+    {
+        rt_lock_memory();
+    }
+    /* initialise the camera, or the test pattern standing in for it */
+    if(synthetic_fps)
+    {
+        if(-1 == synthetic_camera_start(synthetic_fps))
+        {
+            exit(PIPELINE_FAIL);
+        }
+    }
+    else
+    {
+        camera_init();
+    }
+    if(motion_gating)
+    {
+        if(-1 == motion_start(&motion))
+        {
+            fprintf(stderr, "Motion detection could not be started\n");
+        }
+        recording.preroll_frames = motion_pre_frames();
+    }
+    if(recording.directory && -1 == recorder_start(&recording))
+    {
+        fprintf(stderr, "Recording to %s could not be started\n", recording.directory);
+    }
+    if(history_mib && -1 == history_init(history_mib * 1024 * 1024))
+    {
+        fprintf(stderr, "History of %zu MiB could not be allocated\n", history_mib);
+    }
+    if(shm_path && -1 == shm_transport_start(shm_path, SHM_SLOTS))
+    {
+        fprintf(stderr, "Shared-memory transport on %s could not be started\n", shm_path);
+    }
+    if(use_uring)
+    {
+        if(-1 == session_use_uring(URING_ENTRIES))
+        {
+            fprintf(stderr, "io_uring is not available, sending with send()\n");
+            use_uring = 0;
+        }
+        else if(band_kib)
+        {
+            fprintf(stderr, "Band streaming is not used with io_uring\n");
+            band_kib = 0;
+        }
+    }
+    if(band_kib)
+    {
+        session_set_band_size((size_t)band_kib * 1024);
+        /* The recorder and local consumers still take whole RGB frames */
+        pipeline.raw_only = !recording.directory && !shm_path;
+        syslog(LOG_INFO, "Streaming frames in %d KiB bands%s", band_kib,
+               pipeline.raw_only ? ", no RGB frames kept" : "");
+    }
+    if(-1 == pipeline_start(&pipeline))
+    {
+        exit(PIPELINE_FAIL);
+    }
 
     /* initialise the signal handler */
 	if(SIG_ERR == signal(SIGINT,signal_handler))
@@ -111,6 +437,11 @@ int main()
 		syslog(LOG_ERR,"SIGTERM failed");
 		exit(SIGTERM_FAIL);
 	}
+    /* Writes to a socket have no MSG_NOSIGNAL, a client hanging up must not end the server */
+    if(use_uring)
+    {
+        signal(SIGPIPE, SIG_IGN);
+    }
 
     /* start server socket code */
     server_sock_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -145,38 +476,169 @@ int main()
 
     freeaddrinfo(server_info); 
 
-    listen_status=listen(server_sock_fd,1); 
+    listen_status=listen(server_sock_fd,MAX_CLIENTS);
 	if(-1 == listen_status)
 	{
 		syslog(LOG_ERR, "Failed the listen function call");
 		exit(LISTEN_API_FAIL);
 	}
-accept:
+    fcntl(server_sock_fd, F_SETFL, fcntl(server_sock_fd, F_GETFL) | O_NONBLOCK);
 	printf("About to accept\n");
-    client_connection_fd = accept(server_sock_fd,(struct sockaddr *)&client_addr,&size);
-	printf("accept ran\n");
-	if(-1 == client_connection_fd)
-	{
-		syslog(LOG_ERR, "Failed to accept the connection");
-		exit(ACCEPT_API_FAIL);
-	}
-    else
-	{
-		syslog(LOG_INFO,"Accepts connection from %s",inet_ntoa(client_addr.sin_addr));
-		printf("Accepts connection from %s\n",inet_ntoa(client_addr.sin_addr));
-	}
 
-    while(1)
+    memset(&frame, 0, sizeof(frame));
+    /* Everything sent between two frames is charged to the later frame */
+    perf_counters_open(&send_counters, "sending");
+    memset(&send_total, 0, sizeof(send_total));
+
+    while(!exit_requested)
     {
-		int bytes_sent;
-        unsigned char *temp_frame;
-		temp_frame = return_pic_buffer();
-		bytes_sent = send(client_connection_fd,temp_frame,((614400*6)/4),0);
-		if(-1 == bytes_sent)
-		{
-			printf("Goto accepting a new connection \n");
-			goto accept;
-		}
+        int nfds = 0;
+        int ready;
+        int completions_wanted = 0;
+
+        pfds[nfds].fd = pipeline_event_fd();
+        pfds[nfds].events = POLLIN;
+        session_of[nfds++] = -1;
+        pfds[nfds].fd = server_sock_fd;
+        pfds[nfds].events = POLLIN;
+        session_of[nfds++] = -1;
+        /* Negative when the shared-memory transport is off, poll skips it */
+        pfds[nfds].fd = shm_transport_listen_fd();
+        pfds[nfds].events = POLLIN;
+        session_of[nfds++] = -1;
+        /* Set below if a send completion must wake the loop, skipped while negative */
+        pfds[nfds].fd = -1;
+        pfds[nfds].events = POLLIN;
+        session_of[nfds++] = -1;
+        for(int i = 0; i < MAX_CLIENTS; i++)
+        {
+            if(sessions[i].fd >= 0)
+            {
+                pfds[nfds].fd = sessions[i].fd;
+                pfds[nfds].events = POLLIN | (session_wants_write(&sessions[i]) ? POLLOUT : 0);
+                session_of[nfds++] = i;
+                completions_wanted |= session_wants_completion(&sessions[i]);
+            }
+        }
+        if(completions_wanted)
+        {
+            pfds[3].fd = session_uring_fd();
+        }
+
+        /* The capture thread owns the device timeout */
+        ready = poll(pfds, nfds, -1);
+        metrics_add(METRIC_IO_SYSCALLS, 1);
+        if(-1 == ready)
+        {
+            if(EINTR == errno)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed the poll function call");
+            exit(POLL_API_FAIL);
+        }
+        trace_service();
+
+        /* Service client sockets before the new frame so freed space is used */
+        perf_counters_read(&send_counters, &send_before);
+        session_uring_complete(sessions);
+        for(int p = 4; p < nfds; p++)
+        {
+            struct client_session *s = &sessions[session_of[p]];
+            int failed = 0;
+
+            if(pfds[p].revents & (POLLERR | POLLHUP | POLLNVAL))
+            {
+                failed = 1;
+            }
+            /* A completion may have closed it since poll() returned */
+            if(s->fd < 0)
+            {
+                continue;
+            }
+            if(!failed && (pfds[p].revents & POLLIN))
+            {
+                failed = session_read(s);
+            }
+            if(!failed && (pfds[p].revents & POLLOUT))
+            {
+                uint64_t span = trace_begin();
+                failed = session_flush(s);
+                trace_end("flush", span, frame.sequence);
+            }
+            if(failed)
+            {
+                session_close(s);
+            }
+        }
+        perf_counters_read(&send_counters, &send_after);
+        add_counters(&send_total, &send_before, &send_after);
+
+        if((pfds[0].revents & POLLIN) && (captured = pipeline_acquire()))
+        {
+            uint64_t dispatch_span = trace_begin();
+
+            if(last_frame_us && captured->timestamp_us > last_frame_us)
+            {
+                double interval = (double)(captured->timestamp_us - last_frame_us);
+                frame_interval_us = frame_interval_us ? (0.9 * frame_interval_us + 0.1 * interval) : interval;
+            }
+            last_frame_us = captured->timestamp_us;
+            frame.rgb = captured->rgb;
+            frame.rgb_level[0] = captured->rgb;
+            frame.rgb_level[1] = captured->pyramid ? captured->half : NULL;
+            frame.rgb_level[2] = captured->pyramid ? captured->quarter : NULL;
+            frame.raw = captured->raw;
+            frame.raw_len = captured->raw_len;
+            frame.sequence = captured->sequence;
+            frame.timestamp_us = captured->timestamp_us;
+            frame.fps = frame_interval_us ? (1e6 / frame_interval_us) : 0;
+            frame.still = !motion_gate(captured->motion_cells, frame.timestamp_us, &preroll_from_us);
+            frame.preroll_from_us = preroll_from_us;
+            metrics_set_fps(frame.fps);
+            recorder_submit(&frame);
+            shm_transport_publish(&frame);
+            if(history_enabled() && YUYV_FRAME_SIZE == frame.raw_len)
+            {
+                history_append(frame.sequence, frame.timestamp_us, frame.raw, frame.raw_len);
+            }
+
+            perf_counters_read(&send_counters, &send_before);
+            for(int i = 0; i < MAX_CLIENTS; i++)
+            {
+                uint64_t span;
+
+                if(sessions[i].fd < 0)
+                {
+                    continue;
+                }
+                span = trace_begin();
+                if(-1 == session_offer_frame(&sessions[i], &frame))
+                {
+                    session_close(&sessions[i]);
+                }
+                trace_end("send", span, frame.sequence);
+            }
+            perf_counters_read(&send_counters, &send_after);
+            add_counters(&send_total, &send_before, &send_after);
+            metrics_stage_counters(METRIC_STAGE_SEND, &send_total);
+            memset(&send_total, 0, sizeof(send_total));
+            pipeline_release(captured);
+            trace_end("dispatch", dispatch_span, frame.sequence);
+        }
+
+        /* Everything queued for every client in this pass, in one system call */
+        session_uring_submit();
+
+        if(pfds[1].revents & POLLIN)
+        {
+            accept_client();
+        }
+        if(pfds[2].revents & POLLIN)
+        {
+            shm_transport_accept();
+        }
     }
 
-}
\ No newline at end of file
+    server_shutdown();
+}
@@ -0,0 +1,267 @@
+/**
+ * @file shm_transport.c
+ * @brief Publishes converted frames to local consumers through a
+ *        shared-memory ring.
+ *
+ * The ring lives in a sealed memfd that is written once per frame,
+ * however many consumers there are. Consumers connect to a Unix domain
+ * socket and are handed the memfd and an eventfd of their own; each
+ * published frame bumps every consumer's eventfd. Consumers read frames in
+ * place, so beyond the single copy into the ring nothing is copied and no
+ * socket buffers are involved. See common/shm_protocol.h for the layout.
+ *
+ * A consumer that falls behind by more than the ring size simply sees the
+ * older frames overwritten; the server never waits for it.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "shm_transport.h"
+#include "camera_drivers.h"
+#include "../common/frame_protocol.h"
+#include "../common/shm_protocol.h"
+
+struct consumer
+{
+    int conn_fd;                /* Unix socket, only watched for hangup */
+    int event_fd;
+};
+
+static int listen_fd = -1;
+static int memfd = -1;
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static unsigned char *ring;
+static size_t ring_size;
+static struct shm_ring_header *ring_header;
+static uint32_t slot_count, slot_size;
+static uint64_t published;
+static struct consumer consumers[SHM_MAX_CONSUMERS];
+static int consumer_count;
+
+static struct shm_slot_header *slot_at(uint64_t sequence)
+{
+    return (struct shm_slot_header *)(ring + SHM_HEADER_SIZE + (sequence % slot_count) * slot_size);
+}
+
+/**
+ * @brief   Create the frame ring and start listening for consumers.
+ *
+ * @param   path    Unix socket path consumers connect to.
+ * @param   slots   Number of frames the ring holds.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int shm_transport_start(const char *path, int slots)
+{
+    struct sockaddr_un addr;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    slot_count = (uint32_t)slots;
+    slot_size = (uint32_t)(((SHM_PAYLOAD_OFFSET + RGB_FRAME_SIZE) + page - 1) / page * page);
+    ring_size = SHM_HEADER_SIZE + (size_t)slot_count * slot_size;
+
+    memfd = memfd_create("camera-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0 || -1 == ftruncate(memfd, (off_t)ring_size))
+    {
+        syslog(LOG_ERR, "Cannot create the frame ring: %s", strerror(errno));
+        return -1;
+    }
+    ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, memfd, 0);
+    if (MAP_FAILED == ring)
+    {
+        syslog(LOG_ERR, "Cannot map the frame ring: %s", strerror(errno));
+        ring = NULL;
+        return -1;
+    }
+
+    /* Consumers get the same fd; stop them resizing it or mapping it writable */
+    {
+        int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+        seals |= F_SEAL_FUTURE_WRITE;
+#endif
+        if (-1 == fcntl(memfd, F_ADD_SEALS, seals))
+            syslog(LOG_WARNING, "Cannot seal the frame ring: %s", strerror(errno));
+    }
+
+    ring_header = (struct shm_ring_header *)ring;
+    ring_header->magic = SHM_MAGIC;
+    ring_header->version = SHM_VERSION;
+    ring_header->slot_count = slot_count;
+    ring_header->slot_size = slot_size;
+    atomic_store(&ring_header->latest, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        syslog(LOG_ERR, "Socket path %s is too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(socket_path, path);
+    unlink(path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || -1 == bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        -1 == listen(listen_fd, SHM_MAX_CONSUMERS))
+    {
+        syslog(LOG_ERR, "Cannot listen on %s: %s", path, strerror(errno));
+        return -1;
+    }
+    syslog(LOG_INFO, "Shared-memory frames on %s, %u slots of %u bytes", path, slot_count, slot_size);
+    return 0;
+}
+
+/**
+ * @brief   Returns the socket to poll for new consumers.
+ *
+ * @return  The listening socket, or -1 if the transport is not running.
+ */
+int shm_transport_listen_fd(void)
+{
+    return listen_fd;
+}
+
+static void drop_consumer(int i)
+{
+    close(consumers[i].conn_fd);
+    close(consumers[i].event_fd);
+    consumers[i] = consumers[--consumer_count];
+    syslog(LOG_INFO, "Shared-memory consumer left, %d remaining", consumer_count);
+}
+
+/**
+ * @brief   Accept a pending consumer and send it the ring and its eventfd.
+ *
+ * @return  This function does not return a value.
+ */
+void shm_transport_accept(void)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union
+    {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    uint32_t magic = SHM_MAGIC;
+    int fds[2];
+    int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (conn < 0)
+        return;
+    if (consumer_count == SHM_MAX_CONSUMERS)
+    {
+        syslog(LOG_WARNING, "Too many shared-memory consumers, rejecting one");
+        close(conn);
+        return;
+    }
+
+    fds[0] = memfd;
+    fds[1] = eventfd(0, EFD_CLOEXEC);
+    if (fds[1] < 0)
+    {
+        close(conn);
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &magic;
+    iov.iov_len = sizeof(magic);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if ((ssize_t)sizeof(magic) != sendmsg(conn, &msg, MSG_NOSIGNAL))
+    {
+        syslog(LOG_ERR, "Failed to hand the frame ring to a consumer: %s", strerror(errno));
+        close(fds[1]);
+        close(conn);
+        return;
+    }
+    consumers[consumer_count].conn_fd = conn;
+    consumers[consumer_count].event_fd = fds[1];
+    consumer_count++;
+    syslog(LOG_INFO, "Shared-memory consumer joined, %d connected", consumer_count);
+}
+
+/**
+ * @brief   Copy a converted frame into the ring and notify consumers.
+ *
+ * @param   frame   Frame to publish.
+ *
+ * @return  This function does not return a value.
+ */
+void shm_transport_publish(const struct frame_info *frame)
+{
+    struct shm_slot_header *slot;
+    uint64_t one = 1;
+    char probe;
+
+    if (!ring || !consumer_count)
+        return;
+
+    slot = slot_at(++published);
+    atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->timestamp_us = frame->timestamp_us;
+    slot->width = HRES;
+    slot->height = VRES;
+    slot->format = FRAME_FMT_RGB24;
+    slot->payload_size = RGB_FRAME_SIZE;
+    memcpy((unsigned char *)slot + SHM_PAYLOAD_OFFSET, frame->rgb, RGB_FRAME_SIZE);
+    atomic_store_explicit(&slot->sequence, published, memory_order_release);
+    atomic_store_explicit(&ring_header->latest, published, memory_order_release);
+
+    for (int i = consumer_count - 1; i >= 0; i--)
+    {
+        /* A consumer never sends anything, so readable means it hung up */
+        if (recv(consumers[i].conn_fd, &probe, 1, MSG_DONTWAIT | MSG_PEEK) >= 0 ||
+            (EAGAIN != errno && EWOULDBLOCK != errno))
+        {
+            drop_consumer(i);
+            continue;
+        }
+        if ((ssize_t)sizeof(one) != write(consumers[i].event_fd, &one, sizeof(one)))
+            syslog(LOG_ERR, "Failed to notify a shared-memory consumer");
+    }
+}
+
+/**
+ * @brief   Disconnect consumers and remove the socket.
+ *
+ * @return  This function does not return a value.
+ */
+void shm_transport_stop(void)
+{
+    while (consumer_count)
+        drop_consumer(consumer_count - 1);
+    if (listen_fd >= 0)
+    {
+        close(listen_fd);
+        unlink(socket_path);
+        listen_fd = -1;
+    }
+}
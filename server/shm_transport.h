@@ -0,0 +1,24 @@
+/**
+ * @file shm_transport.h
+ * @brief Publishes converted frames to local consumers through a
+ *        shared-memory ring.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __SHM_TRANSPORT_H__
+#define __SHM_TRANSPORT_H__
+
+#include "client_session.h"
+
+#define SHM_SLOTS 8
+#define SHM_MAX_CONSUMERS 16
+
+int shm_transport_start(const char *path, int slots);
+int shm_transport_listen_fd(void);
+void shm_transport_accept(void);
+void shm_transport_publish(const struct frame_info *frame);
+void shm_transport_stop(void);
+
+#endif /* __SHM_TRANSPORT_H__ */
@@ -0,0 +1,162 @@
+/**
+ * @file synthetic_camera.c
+ * @brief Timer driven test pattern standing in for the V4L2 camera.
+ *
+ * Lets the whole server run without a capture device, for load testing
+ * and development. A timerfd ticks at the requested frame rate and plays
+ * the role of the device descriptor; every tick yields a YUYV frame of
+ * colour bars with a box that moves across the image, so frames differ
+ * from one another the way real ones do. The frames are rendered once at
+ * start-up, so producing one costs a single copy.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "synthetic_camera.h"
+#include "camera_drivers.h"
+#include "metrics.h"
+#include "../common/clock_utils.h"
+
+#define PATTERN_FRAMES 16
+#define BOX_SIZE 64
+
+static int timer_fd = -1;
+static unsigned char *patterns;
+static unsigned int pattern_index;
+
+/* YUV of the bars: white, yellow, cyan, green, magenta, red, blue, black */
+static const unsigned char bars[8][3] =
+{
+    { 235, 128, 128 }, { 210, 16, 146 }, { 170, 166, 16 }, { 145, 54, 34 },
+    { 106, 202, 222 }, { 81, 90, 240 }, { 41, 240, 110 }, { 16, 128, 128 },
+};
+
+static void render(unsigned char *frame, unsigned int n)
+{
+    unsigned int box_x = (n * (HRES - BOX_SIZE)) / PATTERN_FRAMES;
+    unsigned int box_y = (VRES - BOX_SIZE) / 2;
+
+    for (unsigned int y = 0; y < VRES; y++)
+    {
+        unsigned char *row = frame + (size_t)y * HRES * 2;
+        for (unsigned int x = 0; x < HRES; x += 2)
+        {
+            const unsigned char *c = bars[(x * 8) / HRES];
+            int in_box = y >= box_y && y < box_y + BOX_SIZE && x >= box_x && x < box_x + BOX_SIZE;
+
+            row[2 * x] = in_box ? 235 : c[0];
+            row[2 * x + 1] = in_box ? 128 : c[1];
+            row[2 * x + 2] = in_box ? 235 : c[0];
+            row[2 * x + 3] = in_box ? 128 : c[2];
+        }
+    }
+}
+
+/**
+ * @brief   Render the test pattern and start the frame timer.
+ *
+ * @param   fps     Frames per second to produce.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int synthetic_camera_start(int fps)
+{
+    struct itimerspec period;
+    long interval_ns = 1000000000L / (fps > 0 ? fps : 30);
+
+    patterns = malloc((size_t)PATTERN_FRAMES * YUYV_FRAME_SIZE);
+    if (!patterns)
+        return -1;
+    for (unsigned int i = 0; i < PATTERN_FRAMES; i++)
+        render(patterns + (size_t)i * YUYV_FRAME_SIZE, i);
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0)
+    {
+        syslog(LOG_ERR, "Cannot create the frame timer: %s", strerror(errno));
+        return -1;
+    }
+    memset(&period, 0, sizeof(period));
+    period.it_interval.tv_sec = interval_ns / 1000000000L;
+    period.it_interval.tv_nsec = interval_ns % 1000000000L;
+    period.it_value = period.it_interval;
+    if (-1 == timerfd_settime(timer_fd, 0, &period, NULL))
+        return -1;
+    syslog(LOG_INFO, "Synthetic camera at %d fps", fps);
+    return 0;
+}
+
+/**
+ * @brief   Tells whether the synthetic camera replaces the device.
+ *
+ * @return  Non-zero if it does.
+ */
+int synthetic_camera_active(void)
+{
+    return timer_fd >= 0;
+}
+
+/**
+ * @brief   Returns the descriptor that becomes readable once per frame.
+ *
+ * @return  The frame timer.
+ */
+int synthetic_camera_fd(void)
+{
+    return timer_fd;
+}
+
+/**
+ * @brief   Produce the next frame, like camera_capture_raw().
+ *
+ * @param   dst             Destination for the YUYV frame, or NULL to
+ *                          drop it.
+ * @param   cap             Size of dst.
+ * @param   len             Receives the number of bytes stored.
+ * @param   timestamp_us    If not NULL, receives the CLOCK_MONOTONIC time
+ *                          the frame was due.
+ *
+ * @return  1 if a frame was produced, 0 if none was due yet.
+ */
+int synthetic_camera_capture(unsigned char *dst, size_t cap, size_t *len, uint64_t *timestamp_us)
+{
+    uint64_t expirations;
+
+    if ((ssize_t)sizeof(expirations) != read(timer_fd, &expirations, sizeof(expirations)))
+        return 0;
+
+    metrics_add(METRIC_FRAMES_CAPTURED, 1);
+    *len = 0;
+    if (dst)
+    {
+        *len = cap < YUYV_FRAME_SIZE ? cap : YUYV_FRAME_SIZE;
+        memcpy(dst, patterns + (size_t)pattern_index * YUYV_FRAME_SIZE, *len);
+    }
+    pattern_index = (pattern_index + 1) % PATTERN_FRAMES;
+    if (timestamp_us)
+        *timestamp_us = monotonic_us();
+    return 1;
+}
+
+/**
+ * @brief   Stop the frame timer.
+ *
+ * @return  This function does not return a value.
+ */
+void synthetic_camera_stop(void)
+{
+    if (timer_fd >= 0)
+        close(timer_fd);
+    timer_fd = -1;
+    free(patterns);
+    patterns = NULL;
+}
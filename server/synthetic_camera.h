@@ -0,0 +1,21 @@
+/**
+ * @file synthetic_camera.h
+ * @brief Timer driven test pattern standing in for the V4L2 camera.
+ *
+ * @author Rishikesh Goud Sundaragiri
+ * @date 5th Dec 2023
+ */
+
+#ifndef __SYNTHETIC_CAMERA_H__
+#define __SYNTHETIC_CAMERA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+int synthetic_camera_start(int fps);
+int synthetic_camera_active(void);
+int synthetic_camera_fd(void);
+int synthetic_camera_capture(unsigned char *dst, size_t cap, size_t *len, uint64_t *timestamp_us);
+void synthetic_camera_stop(void);
+
+#endif /* __SYNTHETIC_CAMERA_H__ */